@@ -0,0 +1,547 @@
+/*
+ * Block device backends built into the library
+ *
+ * The null backend completes requests without moving any data; the RAM one
+ * keeps the data in a memfd, optionally backed by huge pages, and punches
+ * holes in it for discards and write-zeroes.  Both run in the request queue
+ * thread and delay the completions on the request queue timers if asked to
+ * simulate latency.
+ *
+ * For zoned devices the RAM backend emulates sequential zones: writes are
+ * checked against the write pointers, and the zone states and the open and
+ * active zone limits are tracked under a lock, as the vrings may be served by
+ * different request queues.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "vhost/blockdev.h"
+
+#include "bdev_builtin.h"
+#include "bio.h"
+#include "event.h"
+#include "logging.h"
+#include "platform.h"
+#include "server_internal.h"
+#include "vdev.h"
+
+struct builtin_zone {
+    uint64_t start;
+    uint64_t len;
+    uint64_t wp;
+    enum vhd_zone_state state;
+};
+
+struct vhd_bdev_builtin {
+    enum vhd_bdev_backend_type type;
+    uint32_t flags;
+    uint64_t latency_ns;
+
+    /* RAM backend storage */
+    int memfd;
+    char *data;
+    uint64_t size;
+    uint64_t page_size;
+
+    /* RAM backend zones, if the device is zoned */
+    struct builtin_zone *zones;
+    uint64_t nr_zones;
+    uint32_t zone_shift;
+    uint32_t max_open_zones;
+    uint32_t max_active_zones;
+    uint32_t nr_open;
+    uint32_t nr_active;
+    bool zones_host_aware;
+    pthread_mutex_t zone_lock;
+};
+
+/* request waiting for the synthetic latency to pass */
+struct builtin_delayed_io {
+    struct vhd_timer timer;
+    struct vhd_io *io;
+    enum vhd_bdev_io_result status;
+};
+
+static void zero_sglist(struct vhd_sglist *sglist)
+{
+    uint32_t i;
+
+    for (i = 0; i < sglist->nbuffers; i++) {
+        memset(sglist->buffers[i].base, 0, sglist->buffers[i].len);
+    }
+}
+
+static enum vhd_bdev_io_result null_handle_io(struct vhd_bdev_builtin *bb,
+                                              struct vhd_bdev_io *bio)
+{
+    if (bio->type == VHD_BDEV_READ &&
+        (bb->flags & VHD_BDEV_BACKEND_F_ZERO_FILL)) {
+        zero_sglist(&bio->sglist);
+    }
+    return VHD_BDEV_SUCCESS;
+}
+
+static void ram_copy(struct vhd_bdev_builtin *bb, struct vhd_sglist *sglist,
+                     uint64_t offset, bool write)
+{
+    uint32_t i;
+
+    for (i = 0; i < sglist->nbuffers; i++) {
+        struct vhd_buffer *buf = &sglist->buffers[i];
+
+        if (write) {
+            memcpy(bb->data + offset, buf->base, buf->len);
+        } else {
+            memcpy(buf->base, bb->data + offset, buf->len);
+        }
+        offset += buf->len;
+    }
+}
+
+/*
+ * Give the whole pages in the range back to the system and clear the partial
+ * ones at the edges; either way the range reads back as zeroes.
+ */
+static int ram_zero_range(struct vhd_bdev_builtin *bb, uint64_t offset,
+                          uint64_t len)
+{
+    uint64_t start = VHD_ALIGN_UP(offset, bb->page_size);
+    uint64_t end = VHD_ALIGN_DOWN(offset + len, bb->page_size);
+
+    if (start >= end) {
+        memset(bb->data + offset, 0, len);
+        return 0;
+    }
+
+    if (fallocate(bb->memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  start, end - start) < 0) {
+        return -errno;
+    }
+
+    memset(bb->data + offset, 0, start - offset);
+    memset(bb->data + end, 0, offset + len - end);
+    return 0;
+}
+
+static enum vhd_bdev_io_result ram_data_io(struct vhd_bdev_builtin *bb,
+                                           struct vhd_bdev_io *bio)
+{
+    uint64_t offset = bio->first_sector << VHD_SECTOR_SHIFT;
+    uint64_t len = bio->total_sectors << VHD_SECTOR_SHIFT;
+    int ret;
+
+    switch (bio->type) {
+    case VHD_BDEV_READ:
+        ram_copy(bb, &bio->sglist, offset, false);
+        break;
+    case VHD_BDEV_WRITE:
+        ram_copy(bb, &bio->sglist, offset, true);
+        break;
+    case VHD_BDEV_DISCARD:
+    case VHD_BDEV_WRITE_ZEROES:
+        ret = ram_zero_range(bb, offset, len);
+        if (ret < 0) {
+            VHD_LOG_ERROR("failed to zero RAM disk range (%" PRIu64 ", +%"
+                          PRIu64 "): %s", offset, len, strerror(-ret));
+            return VHD_BDEV_IOERR;
+        }
+        break;
+    default:
+        return VHD_BDEV_IOERR;
+    }
+
+    return VHD_BDEV_SUCCESS;
+}
+
+/*
+ * Zone emulation
+ */
+static bool zone_is_open(struct builtin_zone *zone)
+{
+    return zone->state == VHD_ZONE_STATE_IMPLICIT_OPEN ||
+           zone->state == VHD_ZONE_STATE_EXPLICIT_OPEN;
+}
+
+static bool zone_is_active(struct builtin_zone *zone)
+{
+    return zone_is_open(zone) || zone->state == VHD_ZONE_STATE_CLOSED;
+}
+
+/* Move @zone to @state keeping the open and active counts */
+static void zone_set_state(struct vhd_bdev_builtin *bb,
+                           struct builtin_zone *zone, enum vhd_zone_state state)
+{
+    bb->nr_open -= zone_is_open(zone);
+    bb->nr_active -= zone_is_active(zone);
+    zone->state = state;
+    bb->nr_open += zone_is_open(zone);
+    bb->nr_active += zone_is_active(zone);
+}
+
+static void zone_close(struct vhd_bdev_builtin *bb, struct builtin_zone *zone)
+{
+    zone_set_state(bb, zone, zone->wp == zone->start ?
+                   VHD_ZONE_STATE_EMPTY : VHD_ZONE_STATE_CLOSED);
+}
+
+/* Make room for another open zone by closing an implicitly open one */
+static bool zone_close_implicit(struct vhd_bdev_builtin *bb)
+{
+    uint64_t i;
+
+    for (i = 0; i < bb->nr_zones; i++) {
+        if (bb->zones[i].state == VHD_ZONE_STATE_IMPLICIT_OPEN) {
+            zone_close(bb, &bb->zones[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+static enum vhd_bdev_io_result zone_open(struct vhd_bdev_builtin *bb,
+                                         struct builtin_zone *zone,
+                                         bool explicit)
+{
+    enum vhd_zone_state state = explicit ? VHD_ZONE_STATE_EXPLICIT_OPEN :
+                                           VHD_ZONE_STATE_IMPLICIT_OPEN;
+
+    switch (zone->state) {
+    case VHD_ZONE_STATE_EXPLICIT_OPEN:
+        return VHD_BDEV_SUCCESS;
+    case VHD_ZONE_STATE_IMPLICIT_OPEN:
+        zone_set_state(bb, zone, state);
+        return VHD_BDEV_SUCCESS;
+    case VHD_ZONE_STATE_EMPTY:
+        if (bb->max_active_zones && bb->nr_active >= bb->max_active_zones) {
+            return VHD_BDEV_ZONE_ACTIVE_RESOURCE;
+        }
+        break;
+    case VHD_ZONE_STATE_CLOSED:
+        break;
+    default:
+        return VHD_BDEV_ZONE_INVALID_CMD;
+    }
+
+    if (bb->max_open_zones && bb->nr_open >= bb->max_open_zones &&
+        !zone_close_implicit(bb)) {
+        return VHD_BDEV_ZONE_OPEN_RESOURCE;
+    }
+
+    zone_set_state(bb, zone, state);
+    return VHD_BDEV_SUCCESS;
+}
+
+static int zone_reset(struct vhd_bdev_builtin *bb, struct builtin_zone *zone)
+{
+    int ret = 0;
+
+    if (zone->wp != zone->start) {
+        ret = ram_zero_range(bb, zone->start << VHD_SECTOR_SHIFT,
+                             (zone->wp - zone->start) << VHD_SECTOR_SHIFT);
+    }
+    zone->wp = zone->start;
+    zone_set_state(bb, zone, VHD_ZONE_STATE_EMPTY);
+    return ret;
+}
+
+/*
+ * Check a write of @nsectors at @sector to @zone and advance the write
+ * pointer past it.
+ */
+static enum vhd_bdev_io_result zone_write(struct vhd_bdev_builtin *bb,
+                                          struct builtin_zone *zone,
+                                          uint64_t sector, uint64_t nsectors)
+{
+    enum vhd_bdev_io_result res;
+
+    if (sector + nsectors > zone->start + zone->len) {
+        VHD_LOG_ERROR("write (%" PRIu64 "s, +%" PRIu64 "s) crosses the end of"
+                      " zone %" PRIu64, sector, nsectors, zone->start);
+        return VHD_BDEV_IOERR;
+    }
+
+    if (zone->state == VHD_ZONE_STATE_FULL) {
+        return VHD_BDEV_ZONE_INVALID_CMD;
+    }
+
+    if (sector != zone->wp && !bb->zones_host_aware) {
+        return VHD_BDEV_ZONE_UNALIGNED_WP;
+    }
+
+    res = zone_open(bb, zone, false);
+    if (res != VHD_BDEV_SUCCESS) {
+        return res;
+    }
+
+    zone->wp = MAX(zone->wp, sector + nsectors);
+    if (zone->wp == zone->start + zone->len) {
+        zone_set_state(bb, zone, VHD_ZONE_STATE_FULL);
+    }
+    return VHD_BDEV_SUCCESS;
+}
+
+static void zone_report(struct vhd_bdev_builtin *bb, struct vhd_bdev_io *bio)
+{
+    uint64_t first = bio->first_sector >> bb->zone_shift;
+    uint32_t i;
+
+    bio->nr_zones = MIN(bio->nr_zones, bb->nr_zones - first);
+    for (i = 0; i < bio->nr_zones; i++) {
+        struct builtin_zone *zone = &bb->zones[first + i];
+
+        bio->zones[i] = (struct vhd_zone_descriptor) {
+            .start = zone->start,
+            .capacity = zone->len,
+            .write_pointer = zone->wp,
+            .type = bb->zones_host_aware ? VHD_ZONE_TYPE_SEQWRITE_PREFERRED :
+                                           VHD_ZONE_TYPE_SEQWRITE_REQUIRED,
+            .state = zone->state,
+        };
+    }
+}
+
+static enum vhd_bdev_io_result zone_handle_io(struct vhd_bdev_builtin *bb,
+                                              struct vhd_bdev_io *bio)
+{
+    uint64_t idx = bio->first_sector >> bb->zone_shift;
+    struct builtin_zone *zone = &bb->zones[MIN(idx, bb->nr_zones - 1)];
+    enum vhd_bdev_io_result res = VHD_BDEV_SUCCESS;
+    uint64_t i;
+
+    switch (bio->type) {
+    case VHD_BDEV_WRITE:
+        res = zone_write(bb, zone, bio->first_sector, bio->total_sectors);
+        if (res == VHD_BDEV_SUCCESS) {
+            res = ram_data_io(bb, bio);
+        }
+        break;
+    case VHD_BDEV_ZONE_APPEND:
+        bio->append_sector = zone->wp;
+        res = zone_write(bb, zone, zone->wp, bio->total_sectors);
+        if (res == VHD_BDEV_SUCCESS) {
+            ram_copy(bb, &bio->sglist, bio->append_sector << VHD_SECTOR_SHIFT,
+                     true);
+        }
+        break;
+    case VHD_BDEV_ZONE_REPORT:
+        zone_report(bb, bio);
+        break;
+    case VHD_BDEV_ZONE_OPEN:
+        res = zone_open(bb, zone, true);
+        break;
+    case VHD_BDEV_ZONE_CLOSE:
+        if (zone_is_open(zone)) {
+            zone_close(bb, zone);
+        }
+        break;
+    case VHD_BDEV_ZONE_FINISH:
+        zone->wp = zone->start + zone->len;
+        zone_set_state(bb, zone, VHD_ZONE_STATE_FULL);
+        break;
+    case VHD_BDEV_ZONE_RESET:
+        if (zone_reset(bb, zone) < 0) {
+            res = VHD_BDEV_IOERR;
+        }
+        break;
+    case VHD_BDEV_ZONE_RESET_ALL:
+        for (i = 0; i < bb->nr_zones; i++) {
+            if (zone_reset(bb, &bb->zones[i]) < 0) {
+                res = VHD_BDEV_IOERR;
+            }
+        }
+        break;
+    default:
+        /* discards and write-zeroes keep the write pointers */
+        res = ram_data_io(bb, bio);
+        break;
+    }
+
+    return res;
+}
+
+static enum vhd_bdev_io_result ram_handle_io(struct vhd_bdev_builtin *bb,
+                                             struct vhd_bdev_io *bio)
+{
+    uint64_t offset = bio->first_sector << VHD_SECTOR_SHIFT;
+    uint64_t len = bio->total_sectors << VHD_SECTOR_SHIFT;
+    enum vhd_bdev_io_result res;
+
+    /* the device may have been resized beyond the storage */
+    if (offset > bb->size || len > bb->size - offset) {
+        VHD_LOG_ERROR("request (%" PRIu64 "s, +%" PRIu64 "s) is beyond"
+                      " the RAM disk size %" PRIu64, bio->first_sector,
+                      bio->total_sectors, bb->size);
+        return VHD_BDEV_IOERR;
+    }
+
+    /* reads may go anywhere, regardless of the write pointers */
+    if (!bb->zones || bio->type == VHD_BDEV_READ) {
+        return ram_data_io(bb, bio);
+    }
+
+    pthread_mutex_lock(&bb->zone_lock);
+    res = zone_handle_io(bb, bio);
+    pthread_mutex_unlock(&bb->zone_lock);
+    return res;
+}
+
+static void delayed_io_complete(void *opaque)
+{
+    struct builtin_delayed_io *dio = opaque;
+
+    vhd_complete_bio(dio->io, dio->status);
+    vhd_free(dio);
+}
+
+void vhd_bdev_builtin_submit(struct vhd_bdev_builtin *bb, struct vhd_io *io)
+{
+    struct vhd_request_queue *rq = vhd_get_rq_for_vring(io->vring);
+    struct vhd_bdev_io *bio = vhd_get_bdev_io(io);
+    enum vhd_bdev_io_result status;
+    struct builtin_delayed_io *dio;
+
+    vhd_start_request(rq, io);
+
+    if (bb->type == VHD_BDEV_BACKEND_RAM) {
+        status = ram_handle_io(bb, bio);
+    } else {
+        status = null_handle_io(bb, bio);
+    }
+
+    if (!bb->latency_ns) {
+        vhd_complete_bio(io, status);
+        return;
+    }
+
+    dio = vhd_alloc(sizeof(*dio));
+    dio->io = io;
+    dio->status = status;
+    vhd_rq_timer_init(rq, &dio->timer, delayed_io_complete, dio);
+    vhd_timer_mod(&dio->timer, vhd_timer_now_ns() + bb->latency_ns);
+}
+
+static int ram_init(struct vhd_bdev_builtin *bb, uint64_t size)
+{
+    bool hugepages = bb->flags & VHD_BDEV_BACKEND_F_HUGEPAGES;
+    int ret;
+
+    bb->page_size = hugepages ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    bb->size = size;
+
+    bb->memfd = memfd_create("vhd-ramdisk",
+                             MFD_CLOEXEC | (hugepages ? MFD_HUGETLB : 0));
+    if (bb->memfd < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("memfd_create: %s", strerror(-ret));
+        return ret;
+    }
+
+    /* huge page backed files can only be sized in whole pages */
+    if (ftruncate(bb->memfd, VHD_ALIGN_UP(size, bb->page_size)) < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("ftruncate(%" PRIu64 "): %s", size, strerror(-ret));
+        goto close_fd;
+    }
+
+    /* pages are only populated when written */
+    bb->data = mmap(NULL, VHD_ALIGN_UP(size, bb->page_size),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE,
+                    bb->memfd, 0);
+    if (bb->data == MAP_FAILED) {
+        ret = -errno;
+        VHD_LOG_ERROR("mmap(%" PRIu64 "): %s", size, strerror(-ret));
+        goto close_fd;
+    }
+
+    return 0;
+
+close_fd:
+    close(bb->memfd);
+    return ret;
+}
+
+static void zones_init(struct vhd_bdev_builtin *bb,
+                       const struct vhd_bdev_zoned_info *zoned)
+{
+    uint64_t sectors = bb->size >> VHD_SECTOR_SHIFT;
+    uint64_t i;
+
+    bb->zone_shift = vhd_find_first_bit32(zoned->zone_sectors);
+    bb->nr_zones = VHD_ALIGN_UP(sectors, zoned->zone_sectors) >>
+                   bb->zone_shift;
+    bb->max_open_zones = zoned->max_open_zones;
+    bb->max_active_zones = zoned->max_active_zones;
+    bb->zones_host_aware = zoned->model == VHD_BDEV_ZONED_HOST_AWARE;
+    pthread_mutex_init(&bb->zone_lock, NULL);
+
+    bb->zones = vhd_calloc(bb->nr_zones, sizeof(bb->zones[0]));
+    for (i = 0; i < bb->nr_zones; i++) {
+        struct builtin_zone *zone = &bb->zones[i];
+
+        zone->start = i << bb->zone_shift;
+        zone->len = MIN(zoned->zone_sectors, sectors - zone->start);
+        zone->wp = zone->start;
+        zone->state = VHD_ZONE_STATE_EMPTY;
+    }
+}
+
+struct vhd_bdev_builtin *vhd_bdev_builtin_new(const struct vhd_bdev_info *bdev)
+{
+    const struct vhd_bdev_backend *backend = &bdev->backend;
+    const uint32_t valid_flags = VHD_BDEV_BACKEND_F_ZERO_FILL |
+                                 VHD_BDEV_BACKEND_F_HUGEPAGES;
+    struct vhd_bdev_builtin *bb;
+
+    if (backend->type != VHD_BDEV_BACKEND_NULL &&
+        backend->type != VHD_BDEV_BACKEND_RAM) {
+        VHD_LOG_ERROR("Invalid blockdev backend type %d", backend->type);
+        return NULL;
+    }
+
+    if ((backend->flags & valid_flags) != backend->flags) {
+        VHD_LOG_ERROR("Invalid blockdev backend flags %" PRIu32,
+                      backend->flags);
+        return NULL;
+    }
+
+    if (vhd_blockdev_is_zoned(bdev) && backend->type != VHD_BDEV_BACKEND_RAM) {
+        VHD_LOG_ERROR("Zones are only emulated by the RAM backend");
+        return NULL;
+    }
+
+    bb = vhd_zalloc(sizeof(*bb));
+    bb->type = backend->type;
+    bb->flags = backend->flags;
+    bb->latency_ns = backend->latency_us * 1000ull;
+    bb->memfd = -1;
+
+    if (bb->type == VHD_BDEV_BACKEND_RAM &&
+        ram_init(bb, bdev->total_blocks * bdev->block_size) < 0) {
+        vhd_free(bb);
+        return NULL;
+    }
+
+    if (vhd_blockdev_is_zoned(bdev)) {
+        zones_init(bb, &bdev->zoned);
+    }
+
+    return bb;
+}
+
+void vhd_bdev_builtin_free(struct vhd_bdev_builtin *bb)
+{
+    if (bb->data) {
+        munmap(bb->data, VHD_ALIGN_UP(bb->size, bb->page_size));
+    }
+    if (bb->memfd >= 0) {
+        close(bb->memfd);
+    }
+    if (bb->zones) {
+        pthread_mutex_destroy(&bb->zone_lock);
+        vhd_free(bb->zones);
+    }
+    vhd_free(bb);
+}
@@ -0,0 +1,30 @@
+/*
+ * Block device backends built into the library
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vhd_bdev_info;
+struct vhd_bdev_builtin;
+struct vhd_io;
+
+/*
+ * Create the built-in backend described in @bdev->backend.
+ * Returns NULL on error.
+ */
+struct vhd_bdev_builtin *vhd_bdev_builtin_new(const struct vhd_bdev_info *bdev);
+
+void vhd_bdev_builtin_free(struct vhd_bdev_builtin *bb);
+
+/*
+ * Serve @io in the request queue thread of its vring.
+ */
+void vhd_bdev_builtin_submit(struct vhd_bdev_builtin *bb, struct vhd_io *io);
+
+#ifdef __cplusplus
+}
+#endif
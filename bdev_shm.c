@@ -0,0 +1,554 @@
+/*
+ * Shared memory request channel
+ *
+ * Block requests of a request queue are handed to a backend in another
+ * process through the rings described in vhost/shm_ring.h.  The channel keeps
+ * a slot per request the backend may hold, so a ring can never overflow, and
+ * the requests in excess wait in the channel until completions free some
+ * slots.  The completion tags name the slots, with a generation number to
+ * catch stale or bogus completions from a misbehaving backend.
+ *
+ * The memory maps the exported requests refer to are announced to the client
+ * through the map callback before the first use, and retracted once no
+ * exported request refers to them and either the slot in the small map table
+ * is needed for another map or nobody else uses the map any more.
+ *
+ * Everything but attach, detach and reset runs in the request queue thread.
+ */
+
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "vhost/blockdev.h"
+
+#include "bdev_shm.h"
+#include "bio.h"
+#include "event.h"
+#include "logging.h"
+#include "memmap.h"
+#include "platform.h"
+#include "queue.h"
+#include "server_internal.h"
+#include "vdev.h"
+
+/* memory maps the backend may have mapped at a time */
+#define SHM_MAX_MAPS        8
+/* how often to look for the maps nobody uses any more */
+#define SHM_MAP_REAP_NS     (1000ull * 1000 * 1000)
+
+struct shm_map {
+    /* NULL if the table entry is free */
+    struct vhd_memory_map *mm;
+    /* exported requests referring to the map */
+    uint32_t num_requests;
+};
+
+struct shm_slot {
+    /* NULL if the slot is free */
+    struct vhd_io *io;
+    struct shm_map *map;
+    uint32_t gen;
+};
+
+/* request waiting for a free slot or map table entry */
+struct shm_pending {
+    struct vhd_io *io;
+    struct vhd_memory_map *mm;
+    TAILQ_ENTRY(shm_pending) link;
+};
+
+struct vhd_shm_channel {
+    struct vhd_request_queue *rq;
+    struct vhd_shm_channel_ops ops;
+    void *opaque;
+
+    int ring_fd;
+    uint64_t ring_size;
+    struct vhd_shm_ring_hdr *hdr;
+    struct vhd_shm_ring req_ring;
+    struct vhd_shm_ring cpl_ring;
+
+    int req_doorbell;
+    int cpl_doorbell;
+    struct vhd_io_handler *cpl_handler;
+    /* kicks the backend once per batch of exported requests */
+    struct vhd_bh *kick_bh;
+
+    uint32_t num_slots;
+    struct shm_slot *slots;
+    uint32_t *free_slots;
+    uint32_t num_free_slots;
+
+    struct shm_map maps[SHM_MAX_MAPS];
+    struct vhd_shm_region *regions;
+    struct vhd_timer reap_timer;
+
+    TAILQ_HEAD(, shm_pending) pending;
+};
+
+static void release_map(struct vhd_shm_channel *ch, struct shm_map *map)
+{
+    if (ch->ops.unmap) {
+        ch->ops.unmap(ch->opaque, vhd_memmap_id(map->mm));
+    }
+    vhd_memmap_unref(map->mm);
+    map->mm = NULL;
+}
+
+static struct shm_map *get_map(struct vhd_shm_channel *ch,
+                               struct vhd_memory_map *mm)
+{
+    struct shm_map *map, *free_map = NULL, *idle_map = NULL;
+    unsigned num_regions;
+
+    for (map = ch->maps; map < ch->maps + SHM_MAX_MAPS; map++) {
+        if (map->mm == mm) {
+            return map;
+        }
+        if (!map->mm) {
+            free_map = free_map ?: map;
+        } else if (!map->num_requests) {
+            idle_map = idle_map ?: map;
+        }
+    }
+
+    if (!free_map) {
+        if (!idle_map) {
+            return NULL;
+        }
+        release_map(ch, idle_map);
+        free_map = idle_map;
+    }
+
+    vhd_memmap_ref(mm);
+    free_map->mm = mm;
+    free_map->num_requests = 0;
+
+    num_regions = vhd_memmap_get_regions(mm, ch->regions);
+    if (ch->ops.map) {
+        ch->ops.map(ch->opaque, vhd_memmap_id(mm), ch->regions, num_regions);
+    }
+
+    if (!ch->reap_timer.pending) {
+        vhd_timer_mod(&ch->reap_timer, vhd_timer_now_ns() + SHM_MAP_REAP_NS);
+    }
+    return free_map;
+}
+
+static void reap_maps(void *opaque)
+{
+    struct vhd_shm_channel *ch = opaque;
+    struct shm_map *map;
+    bool any_left = false;
+
+    for (map = ch->maps; map < ch->maps + SHM_MAX_MAPS; map++) {
+        if (!map->mm) {
+            continue;
+        }
+        if (!map->num_requests && !vhd_memmap_is_shared(map->mm)) {
+            release_map(ch, map);
+            continue;
+        }
+        any_left = true;
+    }
+
+    if (any_left) {
+        vhd_timer_mod(&ch->reap_timer, vhd_timer_now_ns() + SHM_MAP_REAP_NS);
+    }
+}
+
+static void fill_request(struct vhd_shm_req *req, uint32_t idx,
+                         struct shm_slot *slot)
+{
+    struct vhd_bdev_io *bio = vhd_get_bdev_io(slot->io);
+    struct vhd_memory_map *mm = slot->map->mm;
+    uint32_t i;
+
+    req->tag = (uint64_t)slot->gen << 32 | idx;
+    req->dev = (uintptr_t)vhd_vdev_get_priv(slot->io->vring->vdev);
+    req->map_id = vhd_memmap_id(mm);
+    req->first_sector = bio->first_sector;
+    req->total_sectors = bio->total_sectors;
+    req->type = bio->type;
+    req->nsegs = bio->sglist.nbuffers;
+
+    for (i = 0; i < bio->sglist.nbuffers; i++) {
+        struct vhd_buffer *buf = &bio->sglist.buffers[i];
+
+        req->segs[i] = (struct vhd_shm_seg) {
+            .gpa = ptr_to_gpa(mm, buf->base),
+            .len = buf->len,
+        };
+        VHD_ASSERT(req->segs[i].gpa != TRANSLATION_FAILED);
+    }
+}
+
+static void push_request(struct vhd_shm_channel *ch, uint32_t idx)
+{
+    struct vhd_shm_req *req = vhd_shm_ring_reserve(&ch->req_ring);
+
+    /* there are no more slots than ring entries */
+    VHD_VERIFY(req);
+
+    fill_request(req, idx, &ch->slots[idx]);
+    vhd_shm_ring_push(&ch->req_ring);
+    vhd_bh_schedule(ch->kick_bh);
+}
+
+/*
+ * Returns false if the request has to wait for a slot or a map table entry.
+ */
+static bool export_request(struct vhd_shm_channel *ch, struct vhd_io *io,
+                           struct vhd_memory_map *mm)
+{
+    struct vhd_bdev_io *bio = vhd_get_bdev_io(io);
+    struct shm_slot *slot;
+    struct shm_map *map;
+    uint32_t idx;
+
+    /* the rings carry no zone append results nor zone reports */
+    if (bio->type >= VHD_BDEV_ZONE_APPEND) {
+        VHD_LOG_ERROR("zone requests are not supported over shared memory");
+        vhd_complete_bio(io, VHD_BDEV_IOERR);
+        return true;
+    }
+
+    if (bio->sglist.nbuffers > VHD_SHM_MAX_SEGS) {
+        VHD_LOG_ERROR("request with %" PRIu32 " segments, max %u",
+                      bio->sglist.nbuffers, VHD_SHM_MAX_SEGS);
+        vhd_complete_bio(io, VHD_BDEV_IOERR);
+        return true;
+    }
+
+    if (!ch->num_free_slots) {
+        return false;
+    }
+
+    map = get_map(ch, mm);
+    if (!map) {
+        return false;
+    }
+
+    idx = ch->free_slots[--ch->num_free_slots];
+    slot = &ch->slots[idx];
+    slot->io = io;
+    slot->map = map;
+    map->num_requests++;
+
+    push_request(ch, idx);
+    return true;
+}
+
+static void export_pending(struct vhd_shm_channel *ch)
+{
+    struct shm_pending *p;
+
+    while ((p = TAILQ_FIRST(&ch->pending))) {
+        if (!export_request(ch, p->io, p->mm)) {
+            break;
+        }
+        TAILQ_REMOVE(&ch->pending, p, link);
+        vhd_free(p);
+    }
+}
+
+void vhd_shm_channel_submit(struct vhd_shm_channel *ch, struct vhd_io *io,
+                            struct vhd_memory_map *mm)
+{
+    struct shm_pending *p;
+
+    vhd_start_request(ch->rq, io);
+
+    if (TAILQ_EMPTY(&ch->pending) && export_request(ch, io, mm)) {
+        return;
+    }
+
+    /* the request holds a reference to its memory map until completed */
+    p = vhd_alloc(sizeof(*p));
+    p->io = io;
+    p->mm = mm;
+    TAILQ_INSERT_TAIL(&ch->pending, p, link);
+}
+
+static void complete_request(struct vhd_shm_channel *ch,
+                             const struct vhd_shm_cpl *cpl)
+{
+    uint32_t idx = cpl->tag & UINT32_MAX;
+    uint32_t gen = cpl->tag >> 32;
+    enum vhd_bdev_io_result status;
+    struct shm_slot *slot;
+    struct vhd_io *io;
+
+    if (idx >= ch->num_slots || !ch->slots[idx].io ||
+        ch->slots[idx].gen != gen) {
+        VHD_LOG_ERROR("backend completed unknown request 0x%" PRIx64,
+                      cpl->tag);
+        return;
+    }
+
+    slot = &ch->slots[idx];
+    io = slot->io;
+    slot->io = NULL;
+    slot->gen++;
+    slot->map->num_requests--;
+    ch->free_slots[ch->num_free_slots++] = idx;
+
+    status = cpl->status == VHD_BDEV_SUCCESS ? VHD_BDEV_SUCCESS :
+                                               VHD_BDEV_IOERR;
+    vhd_complete_bio(io, status);
+}
+
+static void reap_completions(struct vhd_shm_channel *ch)
+{
+    const struct vhd_shm_cpl *cpl;
+
+    /* the backend doesn't kick us while we're at it */
+    vhd_shm_ring_wake_up(&ch->cpl_ring);
+
+    do {
+        while ((cpl = vhd_shm_ring_peek(&ch->cpl_ring))) {
+            complete_request(ch, cpl);
+            vhd_shm_ring_pop(&ch->cpl_ring);
+        }
+    } while (!vhd_shm_ring_prepare_sleep(&ch->cpl_ring));
+
+    export_pending(ch);
+}
+
+static int cpl_doorbell_read(void *opaque)
+{
+    struct vhd_shm_channel *ch = opaque;
+
+    vhd_clear_eventfd(ch->cpl_doorbell);
+    reap_completions(ch);
+    return 0;
+}
+
+static void kick_backend(void *opaque)
+{
+    struct vhd_shm_channel *ch = opaque;
+
+    if (vhd_shm_ring_kick_needed(&ch->req_ring)) {
+        vhd_set_eventfd(ch->req_doorbell);
+    }
+}
+
+static void init_rings(struct vhd_shm_channel *ch)
+{
+    struct vhd_shm_ring_hdr *hdr = ch->hdr;
+
+    /* both sides start asleep, waiting for a kick */
+    hdr->req = (struct vhd_shm_ring_idx) { .need_wakeup = 1 };
+    hdr->cpl = (struct vhd_shm_ring_idx) { .need_wakeup = 1 };
+
+    vhd_shm_ring_attach(&ch->req_ring, hdr, false);
+    vhd_shm_ring_attach(&ch->cpl_ring, hdr, true);
+}
+
+static int create_rings(struct vhd_shm_channel *ch, uint32_t num_entries)
+{
+    struct vhd_shm_ring_hdr *hdr;
+    int ret;
+
+    ch->ring_size = vhd_shm_ring_file_size(num_entries);
+
+    ch->ring_fd = memfd_create("vhd-shm-ring", MFD_CLOEXEC);
+    if (ch->ring_fd < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("memfd_create: %s", strerror(-ret));
+        return ret;
+    }
+
+    if (ftruncate(ch->ring_fd, ch->ring_size) < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("ftruncate(%" PRIu64 "): %s", ch->ring_size,
+                      strerror(-ret));
+        goto close_fd;
+    }
+
+    hdr = mmap(NULL, ch->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               ch->ring_fd, 0);
+    if (hdr == MAP_FAILED) {
+        ret = -errno;
+        VHD_LOG_ERROR("mmap(%" PRIu64 "): %s", ch->ring_size, strerror(-ret));
+        goto close_fd;
+    }
+
+    *hdr = (struct vhd_shm_ring_hdr) {
+        .magic = VHD_SHM_RING_MAGIC,
+        .version = VHD_SHM_RING_VERSION,
+        .num_entries = num_entries,
+        .req_offset = sizeof(*hdr),
+        .cpl_offset = sizeof(*hdr) +
+                      (uint64_t)num_entries * sizeof(struct vhd_shm_req),
+    };
+    ch->hdr = hdr;
+    init_rings(ch);
+    return 0;
+
+close_fd:
+    close(ch->ring_fd);
+    return ret;
+}
+
+static void destroy_channel(struct vhd_shm_channel *ch)
+{
+    if (ch->hdr) {
+        munmap(ch->hdr, ch->ring_size);
+        close(ch->ring_fd);
+    }
+    if (ch->req_doorbell >= 0) {
+        close(ch->req_doorbell);
+    }
+    if (ch->cpl_doorbell >= 0) {
+        close(ch->cpl_doorbell);
+    }
+    vhd_free(ch->regions);
+    vhd_free(ch->free_slots);
+    vhd_free(ch->slots);
+    vhd_free(ch);
+}
+
+static void attach_work(struct vhd_work *work, void *opaque)
+{
+    struct vhd_shm_channel *ch = opaque;
+
+    if (vhd_rq_get_shm_channel(ch->rq)) {
+        VHD_LOG_ERROR("request queue already has a shm channel");
+        vhd_complete_work(work, -EBUSY);
+        return;
+    }
+
+    ch->cpl_handler = vhd_add_rq_io_handler(ch->rq, ch->cpl_doorbell,
+                                            cpl_doorbell_read, ch);
+    if (!ch->cpl_handler) {
+        vhd_complete_work(work, -EIO);
+        return;
+    }
+
+    ch->kick_bh = vhd_rq_bh_new(ch->rq, kick_backend, ch);
+    vhd_rq_timer_init(ch->rq, &ch->reap_timer, reap_maps, ch);
+    vhd_rq_set_shm_channel(ch->rq, ch);
+    vhd_complete_work(work, 0);
+}
+
+struct vhd_shm_channel *vhd_attach_shm_channel(
+    struct vhd_request_queue *rq, uint32_t num_entries,
+    const struct vhd_shm_channel_ops *ops, void *opaque)
+{
+    struct vhd_shm_channel *ch;
+    uint32_t i;
+
+    if (!num_entries || (num_entries & (num_entries - 1))) {
+        VHD_LOG_ERROR("ring size %" PRIu32 " is not a power of two",
+                      num_entries);
+        return NULL;
+    }
+
+    ch = vhd_zalloc(sizeof(*ch));
+    ch->rq = rq;
+    ch->ops = *ops;
+    ch->opaque = opaque;
+    ch->req_doorbell = -1;
+    ch->cpl_doorbell = -1;
+    TAILQ_INIT(&ch->pending);
+
+    ch->num_slots = num_entries;
+    ch->slots = vhd_calloc(num_entries, sizeof(ch->slots[0]));
+    ch->free_slots = vhd_calloc(num_entries, sizeof(ch->free_slots[0]));
+    for (i = 0; i < num_entries; i++) {
+        ch->free_slots[i] = num_entries - 1 - i;
+    }
+    ch->num_free_slots = num_entries;
+    ch->regions = vhd_calloc(vhd_memmap_max_memslots(),
+                             sizeof(ch->regions[0]));
+
+    if (create_rings(ch, num_entries) < 0) {
+        goto fail;
+    }
+
+    ch->req_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ch->cpl_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ch->req_doorbell < 0 || ch->cpl_doorbell < 0) {
+        VHD_LOG_ERROR("eventfd: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (vhd_submit_rq_work_and_wait(rq, attach_work, ch) < 0) {
+        goto fail;
+    }
+
+    return ch;
+
+fail:
+    destroy_channel(ch);
+    return NULL;
+}
+
+static void detach_work(struct vhd_work *work, void *opaque)
+{
+    struct vhd_shm_channel *ch = opaque;
+    struct shm_map *map;
+
+    VHD_VERIFY(ch->num_free_slots == ch->num_slots);
+    VHD_VERIFY(TAILQ_EMPTY(&ch->pending));
+
+    vhd_rq_set_shm_channel(ch->rq, NULL);
+    vhd_del_io_handler(ch->cpl_handler);
+    vhd_bh_delete(ch->kick_bh);
+    vhd_timer_del(&ch->reap_timer);
+
+    for (map = ch->maps; map < ch->maps + SHM_MAX_MAPS; map++) {
+        if (map->mm) {
+            release_map(ch, map);
+        }
+    }
+
+    vhd_complete_work(work, 0);
+}
+
+void vhd_detach_shm_channel(struct vhd_shm_channel *ch)
+{
+    vhd_submit_rq_work_and_wait(ch->rq, detach_work, ch);
+    destroy_channel(ch);
+}
+
+void vhd_shm_channel_get_fds(struct vhd_shm_channel *ch,
+                             struct vhd_shm_channel_fds *fds)
+{
+    *fds = (struct vhd_shm_channel_fds) {
+        .ring_fd = ch->ring_fd,
+        .ring_size = ch->ring_size,
+        .req_doorbell = ch->req_doorbell,
+        .cpl_doorbell = ch->cpl_doorbell,
+    };
+}
+
+static void reset_work(struct vhd_work *work, void *opaque)
+{
+    struct vhd_shm_channel *ch = opaque;
+    uint32_t idx, num_requeued = 0;
+
+    /* whatever the old backend managed to complete */
+    reap_completions(ch);
+
+    init_rings(ch);
+    vhd_clear_eventfd(ch->req_doorbell);
+
+    for (idx = 0; idx < ch->num_slots; idx++) {
+        if (ch->slots[idx].io) {
+            push_request(ch, idx);
+            num_requeued++;
+        }
+    }
+
+    VHD_LOG_INFO("shm channel reset, %" PRIu32 " requests exported again",
+                 num_requeued);
+    vhd_complete_work(work, 0);
+}
+
+void vhd_shm_channel_reset(struct vhd_shm_channel *ch)
+{
+    vhd_submit_rq_work_and_wait(ch->rq, reset_work, ch);
+}
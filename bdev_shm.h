@@ -0,0 +1,24 @@
+/*
+ * Shared memory request channel
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vhd_shm_channel;
+struct vhd_memory_map;
+struct vhd_io;
+
+/*
+ * Export block request @io, whose buffers are in @mm, to the backend.  Called
+ * in the request queue thread in place of vhd_enqueue_request().
+ */
+void vhd_shm_channel_submit(struct vhd_shm_channel *ch, struct vhd_io *io,
+                            struct vhd_memory_map *mm);
+
+#ifdef __cplusplus
+}
+#endif
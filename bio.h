@@ -20,11 +20,10 @@ struct vhd_io {
 
     void (*completion_handler)(struct vhd_io *io);
 
-    TAILQ_ENTRY(vhd_io) submission_link;
-    TAILQ_ENTRY(vhd_io) inflight_link;
     SLIST_ENTRY(vhd_io) completion_link;
 
-    time_t ts;
+    /* position in the in-flight ring of the request queue */
+    uint32_t inflight_pos;
 };
 
 #ifdef __cplusplus
@@ -6,6 +6,8 @@
 #include "vdev.h"
 #include "logging.h"
 
+#include "bdev_builtin.h"
+#include "event.h"
 #include "bio.h"
 #include "virtio/virtio_blk.h"
 
@@ -16,6 +18,9 @@ struct vhd_bdev {
     /* VM-facing interface type */
     struct virtio_blk_dev vblk;
 
+    /* vhost-user protocol features specific to the device */
+    uint64_t protocol_features;
+
     LIST_ENTRY(vhd_bdev) blockdevs;
 };
 
@@ -31,6 +36,12 @@ static uint64_t vblk_get_features(struct vhd_vdev *vdev)
     return virtio_blk_get_features(&dev->vblk);
 }
 
+static uint64_t vblk_get_protocol_features(struct vhd_vdev *vdev)
+{
+    struct vhd_bdev *dev = VHD_BLOCKDEV_FROM_VDEV(vdev);
+    return dev->protocol_features;
+}
+
 static int vblk_set_features(struct vhd_vdev *vdev, uint64_t features)
 {
     return 0;
@@ -58,17 +69,23 @@ static void vblk_free(struct vhd_vdev *vdev)
     struct vhd_bdev *bdev = VHD_BLOCKDEV_FROM_VDEV(vdev);
 
     LIST_REMOVE(bdev, blockdevs);
+    if (bdev->vblk.builtin) {
+        vhd_bdev_builtin_free(bdev->vblk.builtin);
+    }
     virtio_blk_destroy_dev(&bdev->vblk);
     vhd_free(bdev);
 }
 
 static const struct vhd_vdev_type g_virtio_blk_vdev_type = {
-    .desc               = "virtio-blk",
-    .get_features       = vblk_get_features,
-    .set_features       = vblk_set_features,
-    .get_config         = vblk_get_config,
-    .dispatch_requests  = vblk_dispatch,
-    .free               = vblk_free,
+    .desc                  = "virtio-blk",
+    .device_id             = VIRTIO_ID_BLOCK,
+    .queue_size            = VIRTIO_BLK_QUEUE_SIZE,
+    .get_features          = vblk_get_features,
+    .get_protocol_features = vblk_get_protocol_features,
+    .set_features          = vblk_set_features,
+    .get_config            = vblk_get_config,
+    .dispatch_requests     = vblk_dispatch,
+    .free                  = vblk_free,
 };
 
 struct set_total_blocks {
@@ -82,6 +99,7 @@ static void set_total_blocks_entry(struct vhd_work *work, void *opaque)
     struct vhd_bdev *dev = VHD_BLOCKDEV_FROM_VDEV(stb->vdev);
 
     virtio_blk_set_total_blocks(&dev->vblk, stb->total_blocks);
+    vhd_vdev_config_changed(stb->vdev);
     vhd_complete_work(work, 0);
 }
 
@@ -105,14 +123,158 @@ void vhd_blockdev_set_total_blocks(struct vhd_vdev *vdev, uint64_t total_blocks)
     VHD_VERIFY(ret == 0);
 }
 
+int vhd_blockdev_start_trace(struct vhd_vdev *vdev, const char *path)
+{
+    struct vhd_bdev *dev = VHD_BLOCKDEV_FROM_VDEV(vdev);
+    int ret;
+
+    ret = virtio_blk_start_trace(&dev->vblk, path);
+    if (ret < 0) {
+        VHD_OBJ_ERROR(vdev, "failed to start trace to %s: %s", path,
+                      strerror(-ret));
+        return ret;
+    }
+
+    VHD_OBJ_INFO(vdev, "tracing I/O to %s", path);
+    return 0;
+}
+
+void vhd_blockdev_stop_trace(struct vhd_vdev *vdev)
+{
+    struct vhd_bdev *dev = VHD_BLOCKDEV_FROM_VDEV(vdev);
+
+    virtio_blk_stop_trace(&dev->vblk);
+}
+
+int vhd_blockdev_set_faults(struct vhd_vdev *vdev,
+                            const struct vhd_fault_config *conf)
+{
+    struct vhd_bdev *dev = VHD_BLOCKDEV_FROM_VDEV(vdev);
+    int ret;
+
+    ret = virtio_blk_set_faults(&dev->vblk, conf);
+    if (ret < 0) {
+        VHD_OBJ_ERROR(vdev, "failed to set up fault injection: %s",
+                      strerror(-ret));
+        return ret;
+    }
+
+    VHD_OBJ_INFO(vdev, "fault injection %s", conf ? "enabled" : "disabled");
+    return 0;
+}
+
+int vhd_blockdev_stall_vring(struct vhd_vdev *vdev, uint32_t vring_idx,
+                             uint32_t duration_ms)
+{
+    struct vhd_bdev *dev = VHD_BLOCKDEV_FROM_VDEV(vdev);
+    uint64_t until_ns = vhd_timer_now_ns() + duration_ms * 1000000ull;
+    int ret;
+
+    ret = virtio_blk_stall_vring(&dev->vblk, vring_idx, until_ns);
+    if (ret < 0) {
+        VHD_OBJ_ERROR(vdev, "failed to stall vring %" PRIu32 ": %s",
+                      vring_idx, strerror(-ret));
+        return ret;
+    }
+
+    VHD_OBJ_INFO(vdev, "vring %" PRIu32 " stalled for %" PRIu32 " ms",
+                 vring_idx, duration_ms);
+    return 0;
+}
+
 static bool blockdev_validate_features(const struct vhd_bdev_info *bdev)
 {
     const uint64_t valid_features = VHD_BDEV_F_READONLY |
                                     VHD_BDEV_F_DISCARD |
-                                    VHD_BDEV_F_WRITE_ZEROES;
+                                    VHD_BDEV_F_WRITE_ZEROES |
+                                    VHD_BDEV_F_IN_ORDER |
+                                    VHD_BDEV_F_MIGRATE_INFLIGHT;
     return (bdev->features & valid_features) == bdev->features;
 }
 
+static bool blockdev_validate_zoned(const struct vhd_bdev_info *bdev)
+{
+    const struct vhd_bdev_zoned_info *zoned = &bdev->zoned;
+    uint32_t block_sectors = bdev->block_size >> VHD_SECTOR_SHIFT;
+
+    switch (zoned->model) {
+    case VHD_BDEV_ZONED_NONE:
+        return true;
+    case VHD_BDEV_ZONED_HOST_MANAGED:
+    case VHD_BDEV_ZONED_HOST_AWARE:
+        break;
+    default:
+        VHD_LOG_ERROR("Invalid zoned model %d", zoned->model);
+        return false;
+    }
+
+    if (!zoned->zone_sectors ||
+        (zoned->zone_sectors & (zoned->zone_sectors - 1)) ||
+        zoned->zone_sectors % block_sectors) {
+        VHD_LOG_ERROR("Zone size %" PRIu32 " is not a power of two"
+                      " multiple of block size", zoned->zone_sectors);
+        return false;
+    }
+
+    if (zoned->max_append_sectors > zoned->zone_sectors ||
+        zoned->max_append_sectors % block_sectors) {
+        VHD_LOG_ERROR("Invalid max zone append size %" PRIu32,
+                      zoned->max_append_sectors);
+        return false;
+    }
+
+    if (zoned->write_granularity % bdev->block_size) {
+        VHD_LOG_ERROR("Zone write granularity %" PRIu32 " is not a multiple"
+                      " of block size", zoned->write_granularity);
+        return false;
+    }
+
+    if (zoned->max_active_zones &&
+        zoned->max_open_zones > zoned->max_active_zones) {
+        VHD_LOG_ERROR("More open zones %" PRIu32 " than active ones %" PRIu32,
+                      zoned->max_open_zones, zoned->max_active_zones);
+        return false;
+    }
+
+    return true;
+}
+
+static bool blockdev_validate_zeroes(const struct vhd_bdev_info *bdev)
+{
+    const struct vhd_bdev_zeroes_info *zeroes = &bdev->zeroes;
+    uint64_t capacity = bdev->total_blocks * bdev->block_size /
+                        VHD_SECTOR_SIZE;
+    uint32_t i;
+
+    if (!zeroes->enabled) {
+        return true;
+    }
+
+    for (i = 0; i < zeroes->num_ranges; i++) {
+        const struct vhd_bdev_range *range = &zeroes->ranges[i];
+
+        if (range->num_sectors > capacity ||
+            range->sector > capacity - range->num_sectors) {
+            VHD_LOG_ERROR("Zero range (%" PRIu64 "s, +%" PRIu64 "s) spans"
+                          " beyond device capacity %" PRIu64,
+                          range->sector, range->num_sectors, capacity);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool blockdev_validate_align(const struct vhd_bdev_info *bdev)
+{
+    if (bdev->align_to_blocks && vhd_blockdev_is_zoned(bdev)) {
+        VHD_LOG_ERROR("Zoned devices can't align requests to blocks");
+        return false;
+    }
+
+    return true;
+}
+
 struct vhd_vdev *vhd_register_blockdev(const struct vhd_bdev_info *bdev,
                                        struct vhd_request_queue **rqs,
                                        int num_rqs, void *priv)
@@ -138,14 +300,43 @@ struct vhd_vdev *vhd_register_blockdev(const struct vhd_bdev_info *bdev,
         return NULL;
     }
 
+    if (!blockdev_validate_zoned(bdev)) {
+        return NULL;
+    }
+
+    if (!blockdev_validate_zeroes(bdev)) {
+        return NULL;
+    }
+
+    if (!blockdev_validate_align(bdev)) {
+        return NULL;
+    }
+
     struct vhd_bdev *dev = vhd_zalloc(sizeof(*dev));
 
     virtio_blk_init_dev(&dev->vblk, bdev);
+    if (vhd_blockdev_migrates_inflight(bdev)) {
+        dev->protocol_features |= 1ull << VHOST_USER_PROTOCOL_F_DEVICE_STATE;
+    }
 
-    res = vhd_vdev_init_server(&dev->vdev, bdev->socket_path,
-                               &g_virtio_blk_vdev_type,
-                               bdev->num_queues, rqs, num_rqs, priv,
-                               bdev->map_cb, bdev->unmap_cb);
+    if (bdev->backend.type != VHD_BDEV_BACKEND_CLIENT) {
+        dev->vblk.builtin = vhd_bdev_builtin_new(bdev);
+        if (!dev->vblk.builtin) {
+            goto error_out;
+        }
+    }
+
+    if (bdev->vduse_name) {
+        res = vhd_vdev_init_vduse(&dev->vdev, bdev->vduse_name,
+                                  &g_virtio_blk_vdev_type,
+                                  bdev->num_queues, rqs, num_rqs, priv,
+                                  bdev->map_cb, bdev->unmap_cb);
+    } else {
+        res = vhd_vdev_init_server(&dev->vdev, bdev->socket_path,
+                                   &g_virtio_blk_vdev_type,
+                                   bdev->num_queues, rqs, num_rqs, priv,
+                                   bdev->map_cb, bdev->unmap_cb);
+    }
     if (res != 0) {
         goto error_out;
     }
@@ -154,6 +345,9 @@ struct vhd_vdev *vhd_register_blockdev(const struct vhd_bdev_info *bdev,
     return &dev->vdev;
 
 error_out:
+    if (dev->vblk.builtin) {
+        vhd_bdev_builtin_free(dev->vblk.builtin);
+    }
     virtio_blk_destroy_dev(&dev->vblk);
     vhd_free(dev);
     return NULL;
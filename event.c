@@ -25,8 +25,10 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <semaphore.h>
 
 #include "catomic.h"
@@ -59,6 +61,8 @@ struct vhd_bh {
 
 typedef SLIST_HEAD(, vhd_bh) vhd_bh_list;
 
+TAILQ_HEAD(vhd_timer_list, vhd_timer);
+
 struct vhd_event_loop {
     int epollfd;
 
@@ -66,6 +70,10 @@ struct vhd_event_loop {
     int notifyfd;
     bool notified;
 
+    /* timerfd armed for the earliest of the pending timers sorted by expiry */
+    int timerfd;
+    struct vhd_timer_list timers;
+
     /* vhd_terminate_event_loop has been completed */
     bool is_terminated;
 
@@ -235,6 +243,105 @@ static void bh_cleanup(struct vhd_event_loop *ctx)
     }
 }
 
+uint64_t vhd_timer_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void timers_rearm(struct vhd_event_loop *evloop)
+{
+    struct vhd_timer *first = TAILQ_FIRST(&evloop->timers);
+    struct itimerspec its = {};
+
+    if (first) {
+        /* all zeroes would disarm the timerfd */
+        uint64_t expire_ns = MAX(first->expire_ns, 1);
+        its.it_value.tv_sec = expire_ns / 1000000000;
+        its.it_value.tv_nsec = expire_ns % 1000000000;
+    }
+
+    if (timerfd_settime(evloop->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        VHD_LOG_ERROR("timerfd_settime: %s", strerror(errno));
+    }
+}
+
+void vhd_timer_init(struct vhd_timer *timer, struct vhd_event_loop *evloop,
+                    vhd_timer_cb *cb, void *opaque)
+{
+    *timer = (struct vhd_timer) {
+        .evloop = evloop,
+        .cb = cb,
+        .opaque = opaque,
+    };
+}
+
+static void timer_remove(struct vhd_timer *timer)
+{
+    TAILQ_REMOVE(&timer->evloop->timers, timer, link);
+    timer->pending = false;
+}
+
+void vhd_timer_mod(struct vhd_timer *timer, uint64_t expire_ns)
+{
+    struct vhd_event_loop *evloop = timer->evloop;
+    struct vhd_timer *prev;
+
+    if (timer->pending) {
+        timer_remove(timer);
+    }
+
+    timer->expire_ns = expire_ns;
+    timer->pending = true;
+
+    /* timers are mostly armed with the same delay, so look from the tail */
+    TAILQ_FOREACH_REVERSE(prev, &evloop->timers, vhd_timer_list, link) {
+        if (prev->expire_ns <= expire_ns) {
+            TAILQ_INSERT_AFTER(&evloop->timers, prev, timer, link);
+            return;
+        }
+    }
+
+    TAILQ_INSERT_HEAD(&evloop->timers, timer, link);
+    timers_rearm(evloop);
+}
+
+void vhd_timer_del(struct vhd_timer *timer)
+{
+    struct vhd_event_loop *evloop = timer->evloop;
+    bool was_first = timer == TAILQ_FIRST(&evloop->timers);
+
+    if (!timer->pending) {
+        return;
+    }
+
+    timer_remove(timer);
+    if (was_first) {
+        timers_rearm(evloop);
+    }
+}
+
+static void timers_run(struct vhd_event_loop *evloop)
+{
+    uint64_t now = vhd_timer_now_ns();
+    uint64_t unused;
+    struct vhd_timer *timer;
+
+    while (read(evloop->timerfd, &unused, sizeof(unused)) < 0 &&
+           errno == EINTR) {
+        ;
+    }
+
+    /* only run what's due by now so that re-armed timers can't spin here */
+    while ((timer = TAILQ_FIRST(&evloop->timers)) && timer->expire_ns <= now) {
+        timer_remove(timer);
+        timer->cb(timer->opaque);
+    }
+
+    timers_rearm(evloop);
+}
+
 struct vhd_io_handler {
     struct vhd_event_loop *evloop;
     int fd;
@@ -266,6 +373,11 @@ static int handle_events(struct vhd_event_loop *evloop, int nevents)
         if (!handler) {
             continue;
         }
+        /* neither does the timerfd, it's tagged with the event loop itself */
+        if (handler == (void *)evloop) {
+            timers_run(evloop);
+            continue;
+        }
         /* don't call into detached handler even if it's on the ready list */
         if (!handler->attached) {
             continue;
@@ -292,6 +404,7 @@ static int handle_events(struct vhd_event_loop *evloop, int nevents)
 struct vhd_event_loop *vhd_create_event_loop(size_t max_events)
 {
     int notifyfd;
+    int timerfd;
     int epollfd;
 
     epollfd = epoll_create1(EPOLL_CLOEXEC);
@@ -316,19 +429,38 @@ struct vhd_event_loop *vhd_create_event_loop(size_t max_events)
         goto error_out;
     }
 
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd < 0) {
+        VHD_LOG_ERROR("timerfd_create: %s", strerror(errno));
+        goto error_out;
+    }
+
     struct vhd_event_loop *evloop = vhd_alloc(sizeof(*evloop));
-    max_events++; /* +1 for notify eventfd */
+
+    ev.data.ptr = evloop;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &ev) == -1) {
+        VHD_LOG_ERROR("epoll_ctl(EPOLL_CTL_ADD, timerfd): %s",
+                      strerror(errno));
+        vhd_free(evloop);
+        goto close_timerfd;
+    }
+
+    max_events += 2; /* +1 for notify eventfd, +1 for timerfd */
     *evloop = (struct vhd_event_loop) {
         .epollfd = epollfd,
         .notifyfd = notifyfd,
+        .timerfd = timerfd,
         .max_events = max_events,
         .events = vhd_calloc(sizeof(evloop->events[0]), max_events),
     };
     SLIST_INIT(&evloop->bh_list);
     SLIST_INIT(&evloop->deleted_handlers);
+    TAILQ_INIT(&evloop->timers);
 
     return evloop;
 
+close_timerfd:
+    close(timerfd);
 error_out:
     close(notifyfd);
 close_epoll:
@@ -398,9 +530,11 @@ void vhd_free_event_loop(struct vhd_event_loop *evloop)
 {
     VHD_ASSERT(evloop->is_terminated);
     VHD_ASSERT(evloop->num_events_attached == 0);
+    VHD_ASSERT(TAILQ_EMPTY(&evloop->timers));
     bh_cleanup(evloop);
     close(evloop->epollfd);
     close(evloop->notifyfd);
+    close(evloop->timerfd);
     vhd_free(evloop->events);
     vhd_free(evloop);
 }
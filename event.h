@@ -1,6 +1,9 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "queue.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -102,6 +105,34 @@ void vhd_bh_schedule(struct vhd_bh *bh);
 void vhd_bh_cancel(struct vhd_bh *bh);
 void vhd_bh_delete(struct vhd_bh *bh);
 
+/*
+ * Timers run their callback in the event loop thread once CLOCK_MONOTONIC
+ * reaches the expiration time.  Unlike bottom halves they may only be armed
+ * and cancelled in the event loop thread.  The structure is exposed so that
+ * the timers can be embedded into the objects they serve.
+ */
+typedef void vhd_timer_cb(void *opaque);
+
+struct vhd_timer {
+    struct vhd_event_loop *evloop;
+    vhd_timer_cb *cb;
+    void *opaque;
+
+    uint64_t expire_ns;
+    bool pending;
+    TAILQ_ENTRY(vhd_timer) link;
+};
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t vhd_timer_now_ns(void);
+
+void vhd_timer_init(struct vhd_timer *timer, struct vhd_event_loop *evloop,
+                    vhd_timer_cb *cb, void *opaque);
+/* (Re)arm @timer to fire at @expire_ns */
+void vhd_timer_mod(struct vhd_timer *timer, uint64_t expire_ns);
+/* Cancel @timer if pending */
+void vhd_timer_del(struct vhd_timer *timer);
+
 /*
  * Submit a work item onto @evloop and wait till it's finished.
  * Must not be called in the target event loop.
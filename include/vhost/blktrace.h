@@ -0,0 +1,63 @@
+/**
+ * Binary format of the block device I/O traces
+ *
+ * A trace is a header followed by variable-length records, one per guest
+ * request completed, in completion order.  All fields are in host byte order.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VHD_BLKTRACE_MAGIC      "VHDBTRC"
+#define VHD_BLKTRACE_VERSION    1
+
+struct vhd_blktrace_header {
+    /* VHD_BLKTRACE_MAGIC, NUL-terminated */
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+
+    /* Device capacity in sectors at the trace start */
+    uint64_t capacity;
+    /* CLOCK_REALTIME at the trace start, in nanoseconds */
+    uint64_t start_time_ns;
+};
+
+struct vhd_blktrace_record {
+    /* Submission time relative to the trace start */
+    uint64_t ts_ns;
+    /* Time from submission to completion */
+    uint64_t latency_ns;
+
+    uint64_t sector;
+    uint32_t nsectors;
+
+    /* Index of the vring the request came from */
+    uint16_t vring;
+    /* enum vhd_bdev_io_type */
+    uint8_t type;
+    /* enum vhd_bdev_io_result */
+    uint8_t status;
+
+    /* Number of data segments, their lengths follow the record */
+    uint16_t nsegs;
+    uint16_t reserved[3];
+
+    uint32_t seg_len[];
+};
+
+/* Size of the record with @nsegs segments, keeping records 8-byte aligned */
+static inline uint64_t vhd_blktrace_record_size(uint16_t nsegs)
+{
+    return (sizeof(struct vhd_blktrace_record) +
+            nsegs * sizeof(uint32_t) + 7) & ~7ull;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "vhost/types.h"
+#include "vhost/shm_ring.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,6 +19,123 @@ struct vhd_vdev;
 #define VHD_BDEV_F_READONLY     (1ull << 0)
 #define VHD_BDEV_F_DISCARD      (1ull << 1)
 #define VHD_BDEV_F_WRITE_ZEROES (1ull << 2)
+/*
+ * The backend completes the requests of each queue in the order it gets
+ * them, so the device offers VIRTIO_F_IN_ORDER and returns completions to
+ * the guest in batches
+ */
+#define VHD_BDEV_F_IN_ORDER     (1ull << 3)
+/*
+ * Stopping the device doesn't wait for the requests in flight: they are
+ * passed to the migration destination to resubmit in the device state
+ * (VHOST_USER_PROTOCOL_F_DEVICE_STATE), or resubmitted here if the device is
+ * restarted instead.  Only for clients that do transfer the device state when
+ * migrating, and for backends that guarantee a write abandoned on the source
+ * doesn't land past the same one resubmitted on the destination, e.g. by
+ * fencing the source off the storage.
+ */
+#define VHD_BDEV_F_MIGRATE_INFLIGHT (1ull << 4)
+
+/**
+ * Backends built into the library
+ *
+ * Requests to a device with a built-in backend are served right in the
+ * request queue thread and never show up in vhd_dequeue_request().  Useful to
+ * measure the library overhead, and as scratch disks.
+ */
+enum vhd_bdev_backend_type {
+    /* Requests are dequeued and served by the client */
+    VHD_BDEV_BACKEND_CLIENT = 0,
+    /* Requests complete successfully without moving any data */
+    VHD_BDEV_BACKEND_NULL,
+    /* Data is kept in anonymous shared memory, lost on unregister */
+    VHD_BDEV_BACKEND_RAM,
+};
+
+/* Null backend: fill read buffers with zeroes */
+#define VHD_BDEV_BACKEND_F_ZERO_FILL    (1u << 0)
+/* RAM backend: use huge pages for the data */
+#define VHD_BDEV_BACKEND_F_HUGEPAGES    (1u << 1)
+
+struct vhd_bdev_backend {
+    enum vhd_bdev_backend_type type;
+
+    /* VHD_BDEV_BACKEND_F_* flags */
+    uint32_t flags;
+
+    /*
+     * Synthetic latency added to every request, in microseconds.  The
+     * requests wait for it on a timer without blocking the request queue.
+     */
+    uint32_t latency_us;
+};
+
+/**
+ * Zoned block device models
+ *
+ * The device is split into zones of the same size, but for a smaller last
+ * one.  Sequential zones are written at their write pointer, either by plain
+ * writes or by zone appends that let the device pick the sector, and rewound
+ * with zone resets.
+ */
+enum vhd_bdev_zoned_model {
+    /* Regular block device */
+    VHD_BDEV_ZONED_NONE = 0,
+    /* Writes to sequential zones not at the write pointer fail */
+    VHD_BDEV_ZONED_HOST_MANAGED,
+    /* Sequential zones accept random writes but prefer sequential ones */
+    VHD_BDEV_ZONED_HOST_AWARE,
+};
+
+struct vhd_bdev_zoned_info {
+    enum vhd_bdev_zoned_model model;
+
+    /* Zone size in sectors */
+    uint32_t zone_sectors;
+
+    /* Limits on the zones open, and open or closed at a time; 0 for none */
+    uint32_t max_open_zones;
+    uint32_t max_active_zones;
+
+    /* Largest zone append in sectors, up to @zone_sectors if 0 */
+    uint32_t max_append_sectors;
+
+    /* Alignment of writes to sequential zones in bytes, block size if 0 */
+    uint32_t write_granularity;
+};
+
+/* Range of sectors */
+struct vhd_bdev_range {
+    uint64_t sector;
+    uint64_t num_sectors;
+};
+
+/**
+ * Known-zero ranges
+ *
+ * The library keeps track of the sectors known to read as zeroes: those of
+ * the completed write-zeroes, and of the discards if the backend reads them
+ * back as zeroes, until written to again.  The reads within them are served
+ * in the request queue by zeroing the guest buffers, and the reads starting
+ * or ending in them are trimmed to the rest before reaching the backend.
+ * The backend is not to change the data behind the library's back then.
+ * On a zoned device a zone append, landing at the write pointer the library
+ * doesn't know, takes its whole zone out of the known-zero ranges.
+ */
+struct vhd_bdev_zeroes_info {
+    /* Track the known-zero ranges at all */
+    bool enabled;
+
+    /* Discarded sectors read back as zeroes */
+    bool discard_zeroes;
+
+    /*
+     * Ranges known to read as zeroes at registration, e.g. the whole of a
+     * freshly provisioned thin disk; copied by the library
+     */
+    const struct vhd_bdev_range *ranges;
+    uint32_t num_ranges;
+};
 
 /**
  * Client-supplied block device backend definition
@@ -29,6 +147,17 @@ struct vhd_bdev_info {
     /* Path to create listen sockets */
     const char *socket_path;
 
+    /*
+     * Serve the device as the VDUSE device of this name instead of over a
+     * vhost-user socket at @socket_path.  Once attached to the vDPA bus,
+     * e.g. with "vdpa dev add name <name> mgmtdev vduse", it's driven by the
+     * host's own virtio driver, for the host and its containers to use, or
+     * by vhost-vdpa on behalf of a VM.  Requires the vduse kernel module.
+     * The requests in flight are waited for when the driver resets the
+     * device, and are not carried over a restart of the server.
+     */
+    const char *vduse_name;
+
     /* Block size in bytes */
     uint32_t block_size;
 
@@ -46,6 +175,59 @@ struct vhd_bdev_info {
 
     /* Gets called before unmapping guest memory region */
     int (*unmap_cb)(void *addr, size_t len);
+
+    /* Built-in backend to serve the requests, if any */
+    struct vhd_bdev_backend backend;
+
+    /*
+     * Hold requests overlapping the writes, discards and write-zeroes in
+     * flight until those complete, and dispatch the rest right away.  The
+     * backend may then serve the requests in any order, e.g. spread them over
+     * parallel connections, without a range lock of its own.
+     */
+    bool order_overlapping_writes;
+
+    /*
+     * Identity of the data behind the device, e.g. of the base image it
+     * shares with other devices, or 0 if none.  A read fully covered by a
+     * read in flight on any device of the same identity is not passed to the
+     * backend, but served by copying from the buffers of the latter once it
+     * completes.  Writes to any of the devices are assumed to change the
+     * shared data.
+     */
+    uint64_t backing_id;
+
+    /*
+     * Largest readahead window to hint to the backend for sequential reads,
+     * in sectors, or 0 not to look for sequential reads at all.  See
+     * vhd_bdev_io.readahead_sectors.
+     */
+    uint32_t readahead_max_sectors;
+
+    /*
+     * Zone geometry of a zoned device, VHD_BDEV_ZONED_NONE for a regular one.
+     * The backend of a zoned device is to serve the VHD_BDEV_ZONE_* requests
+     * and enforce the write pointers; of the built-in ones only the RAM
+     * backend emulates zones.
+     */
+    struct vhd_bdev_zoned_info zoned;
+
+    /* Tracking of the ranges known to read as zeroes, if enabled */
+    struct vhd_bdev_zeroes_info zeroes;
+
+    /*
+     * Only pass whole @block_size blocks to the backend, while the guest
+     * still addresses the device in sectors.  The library reads the blocks
+     * the guest requests cover partly into bounce buffers of its own, and
+     * for the writes merges the guest data in and writes them back whole;
+     * a write to the same blocks waits until such a write back completes.
+     * Unaligned discards are trimmed to the whole blocks within unless
+     * discarded sectors read back as zeroes (see vhd_bdev_zeroes_info), in
+     * which case the partial blocks are zeroed instead.  Not for zoned
+     * devices, nor for those served through vhd_attach_shm_channel(),
+     * which can't see the bounce buffers.
+     */
+    bool align_to_blocks;
 };
 
 static inline bool vhd_blockdev_is_readonly(const struct vhd_bdev_info *bdev)
@@ -64,6 +246,23 @@ static inline bool vhd_blockdev_has_write_zeroes(
     return bdev->features & VHD_BDEV_F_WRITE_ZEROES;
 }
 
+static inline bool vhd_blockdev_is_in_order(
+        const struct vhd_bdev_info *bdev)
+{
+    return bdev->features & VHD_BDEV_F_IN_ORDER;
+}
+
+static inline bool vhd_blockdev_migrates_inflight(
+        const struct vhd_bdev_info *bdev)
+{
+    return bdev->features & VHD_BDEV_F_MIGRATE_INFLIGHT;
+}
+
+static inline bool vhd_blockdev_is_zoned(const struct vhd_bdev_info *bdev)
+{
+    return bdev->zoned.model != VHD_BDEV_ZONED_NONE;
+}
+
 /**
  * Block io request type
  */
@@ -72,6 +271,47 @@ enum vhd_bdev_io_type {
     VHD_BDEV_WRITE,
     VHD_BDEV_DISCARD,
     VHD_BDEV_WRITE_ZEROES,
+
+    /*
+     * Zoned devices only.  The zone management requests have @first_sector
+     * at the start of the zone and @total_sectors spanning it; reset-all
+     * spans the whole device and the report has no sectors.
+     */
+    VHD_BDEV_ZONE_APPEND,
+    VHD_BDEV_ZONE_REPORT,
+    VHD_BDEV_ZONE_OPEN,
+    VHD_BDEV_ZONE_CLOSE,
+    VHD_BDEV_ZONE_FINISH,
+    VHD_BDEV_ZONE_RESET,
+    VHD_BDEV_ZONE_RESET_ALL,
+};
+
+enum vhd_zone_type {
+    VHD_ZONE_TYPE_CONVENTIONAL = 1,
+    VHD_ZONE_TYPE_SEQWRITE_REQUIRED,
+    VHD_ZONE_TYPE_SEQWRITE_PREFERRED,
+};
+
+enum vhd_zone_state {
+    VHD_ZONE_STATE_NOT_WP = 0,
+    VHD_ZONE_STATE_EMPTY = 1,
+    VHD_ZONE_STATE_IMPLICIT_OPEN = 2,
+    VHD_ZONE_STATE_EXPLICIT_OPEN = 3,
+    VHD_ZONE_STATE_CLOSED = 4,
+    VHD_ZONE_STATE_READONLY = 13,
+    VHD_ZONE_STATE_FULL = 14,
+    VHD_ZONE_STATE_OFFLINE = 15,
+};
+
+/**
+ * Zone as reported by the backend, in sectors
+ */
+struct vhd_zone_descriptor {
+    uint64_t start;
+    uint64_t capacity;
+    uint64_t write_pointer;
+    enum vhd_zone_type type;
+    enum vhd_zone_state state;
 };
 
 /**
@@ -83,6 +323,31 @@ struct vhd_bdev_io {
     uint64_t first_sector;
     uint64_t total_sectors;
     struct vhd_sglist sglist;
+
+    /*
+     * Advisory readahead window of a read continuing a sequential stream on
+     * its vring: the sectors starting at @readahead_sector are likely to be
+     * read soon and may be prefetched.  No hint if @readahead_sectors is 0,
+     * which is also the case for random reads.  Streams are only detected on
+     * devices with vhd_bdev_info.readahead_max_sectors set.
+     */
+    uint64_t readahead_sector;
+    uint32_t readahead_sectors;
+
+    /*
+     * VHD_BDEV_ZONE_APPEND: the backend writes the data at the write pointer
+     * of the zone starting at @first_sector, rather than at @first_sector
+     * itself, and sets @append_sector to where it went before completing.
+     */
+    uint64_t append_sector;
+
+    /*
+     * VHD_BDEV_ZONE_REPORT: room for @nr_zones descriptors of the zones from
+     * the one containing @first_sector on.  The backend fills in @zones and
+     * sets @nr_zones to the number of those before completing.
+     */
+    struct vhd_zone_descriptor *zones;
+    uint32_t nr_zones;
 };
 
 struct vhd_bdev_io *vhd_get_bdev_io(struct vhd_io *io);
@@ -124,6 +389,152 @@ void vhd_unregister_blockdev(struct vhd_vdev *vdev,
 void vhd_blockdev_set_total_blocks(struct vhd_vdev *vdev,
                                    uint64_t total_blocks);
 
+/**
+ * Start recording the guest I/O of a vhost block device.
+ *
+ * Every request completed from now on is recorded to the file at @path in the
+ * format described in vhost/blktrace.h, which can be replayed later without
+ * the guest.  Returns 0 on success or negative error code.
+ */
+int vhd_blockdev_start_trace(struct vhd_vdev *vdev, const char *path);
+
+/**
+ * Stop recording the I/O trace and flush it to the file.
+ */
+void vhd_blockdev_stop_trace(struct vhd_vdev *vdev);
+
+/**
+ * Fault and latency injection
+ *
+ * Requests of a block device may be held on their way to the backend and on
+ * their way back to the guest, or failed without reaching the backend at all,
+ * to reproduce tail latencies and errors without a misbehaving backend.  The
+ * held requests wait on the request queue timers and don't block the queue.
+ * Every vring draws from its own random generator seeded from the config, so
+ * the same guest I/O sees the same faults on every run.
+ */
+enum vhd_fault_delay_type {
+    VHD_FAULT_DELAY_NONE = 0,
+    /* always @us */
+    VHD_FAULT_DELAY_FIXED,
+    /* exponentially distributed with the mean of @us */
+    VHD_FAULT_DELAY_EXPONENTIAL,
+    /* @slow_us with the probability of @slow_ppm, @us otherwise */
+    VHD_FAULT_DELAY_BIMODAL,
+};
+
+/* Probabilities are given in parts per million */
+#define VHD_FAULT_PPM_MAX   1000000
+
+struct vhd_fault_delay {
+    enum vhd_fault_delay_type type;
+    uint32_t us;
+    uint32_t slow_us;
+    uint32_t slow_ppm;
+};
+
+struct vhd_fault_config {
+    /* Before the request is handed to the backend */
+    struct vhd_fault_delay submit_delay;
+    /* After the backend completes the request */
+    struct vhd_fault_delay complete_delay;
+    /* Chance of failing a request, indexed by enum vhd_bdev_io_type */
+    uint32_t error_ppm[VHD_BDEV_WRITE_ZEROES + 1];
+    uint64_t seed;
+};
+
+/**
+ * Start injecting faults per @conf into the requests of the device, replacing
+ * the previous config, or stop if @conf is NULL.  Requests already held keep
+ * their delays.  Returns 0 on success or negative error code.
+ */
+int vhd_blockdev_set_faults(struct vhd_vdev *vdev,
+                            const struct vhd_fault_config *conf);
+
+/**
+ * Stall vring @vring_idx of the device for @duration_ms: its requests are
+ * neither handed to the backend nor returned to the guest until then.  Works
+ * with or without a fault config, and ends early on
+ * vhd_blockdev_set_faults(NULL).  Returns 0 on success or negative error
+ * code.
+ */
+int vhd_blockdev_stall_vring(struct vhd_vdev *vdev, uint32_t vring_idx,
+                             uint32_t duration_ms);
+
+/**
+ * Shared memory request channel
+ *
+ * Block requests landing on a request queue with a channel attached are
+ * exported to a backend in another process through the shared memory rings
+ * described in vhost/shm_ring.h, rather than returned by
+ * vhd_dequeue_request(), and are completed when the backend posts their
+ * completions.  The data buffers are passed as guest physical addresses, so
+ * the backend maps guest memory and moves the data without any copies.
+ *
+ * The queue is still to be run with vhd_run_queue(); it exports the requests,
+ * reaps the completions and rings the doorbells in its thread.
+ */
+struct vhd_shm_channel;
+
+struct vhd_shm_channel_ops {
+    /*
+     * Requests about to be exported refer to the memory map @map_id for the
+     * first time; share its regions with the backend.  The region fds are
+     * only valid during the call.  Called in the request queue thread.
+     */
+    void (*map)(void *opaque, uint64_t map_id,
+                const struct vhd_shm_region *regions, uint32_t num_regions);
+
+    /*
+     * No requests refer to the memory map @map_id any more; the backend may
+     * unmap its regions.  Called in the request queue thread.
+     */
+    void (*unmap)(void *opaque, uint64_t map_id);
+};
+
+struct vhd_shm_channel_fds {
+    /* Ring file to be mapped MAP_SHARED by the backend */
+    int ring_fd;
+    uint64_t ring_size;
+
+    /* Kicked by the library when requests are exported */
+    int req_doorbell;
+    /* To be kicked by the backend when completions are posted */
+    int cpl_doorbell;
+};
+
+/**
+ * Attach a shared memory channel with rings of @num_entries to a running
+ * request queue.  At most @num_entries requests are handed to the backend at
+ * a time, the rest wait in the channel.  Must not be called in the request
+ * queue thread.  Returns NULL on error.
+ */
+struct vhd_shm_channel *vhd_attach_shm_channel(
+    struct vhd_request_queue *rq, uint32_t num_entries,
+    const struct vhd_shm_channel_ops *ops, void *opaque);
+
+/**
+ * Detach and destroy the channel.  Don't call this until all devices using
+ * the request queue are unregistered.
+ */
+void vhd_detach_shm_channel(struct vhd_shm_channel *ch);
+
+/**
+ * Get the file descriptors to pass to the backend.  They stay owned by the
+ * channel.
+ */
+void vhd_shm_channel_get_fds(struct vhd_shm_channel *ch,
+                             struct vhd_shm_channel_fds *fds);
+
+/**
+ * Recover from a backend restart: complete the requests the old backend
+ * posted completions for, reset the rings and export again the requests it
+ * left unfinished.  The memory maps announced before are expected to be
+ * shared with the new backend by the caller.  Must only be called once the
+ * old backend is gone, and not in the request queue thread.
+ */
+void vhd_shm_channel_reset(struct vhd_shm_channel *ch);
+
 #ifdef __cplusplus
 }
 #endif
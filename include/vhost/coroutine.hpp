@@ -0,0 +1,506 @@
+/*
+ * C++20 coroutine adapter for block device backends
+ *
+ * Header-only and optional: the library itself stays C, and this is built on
+ * its public C API alone.  A request queue becomes an awaitable stream of
+ * requests, and a request is served by a coroutine returning vhd::io_task,
+ * which completes it with the status it co_returns:
+ *
+ *     vhd::io_task handle(vhd::request req, storage_client &client)
+ *     {
+ *         vhd_bdev_io *bio = req.bdev_io();
+ *         bool ok = co_await client.submit(bio);
+ *         co_return ok ? VHD_BDEV_SUCCESS : VHD_BDEV_IOERR;
+ *     }
+ *
+ *     vhd::request_queue q(rq);
+ *     vhd::serve(q, [&](vhd::request req) { return handle(req, client); });
+ *     q.run();
+ *
+ * The frames of the request coroutines come from a pool of the request queue
+ * rather than the heap, so serving a request takes no allocation once the
+ * pool has warmed up.  The coroutines may be resumed and finish in any
+ * thread, e.g. that of the storage client; the pool takes the frames back
+ * from there.  The queue itself, and the stream, belong to the thread
+ * running it.
+ */
+
+#pragma once
+
+#if __cplusplus < 202002L || !__has_include(<coroutine>)
+#error "vhost/coroutine.hpp requires C++20 coroutines"
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "vhost/blockdev.h"
+#include "vhost/server.h"
+
+namespace vhd {
+
+/**
+ * Pool of coroutine frames of up to a fixed size
+ *
+ * Allocated from by the thread owning the pool only, but freed to from any
+ * thread.  Frames larger than the block size go to the heap.  The pool must
+ * outlive all the frames allocated from it.
+ */
+class frame_pool {
+public:
+    explicit frame_pool(std::size_t block_size = 1024)
+        : block_size_(block_size)
+    {
+    }
+
+    frame_pool(const frame_pool &) = delete;
+    frame_pool &operator=(const frame_pool &) = delete;
+
+    ~frame_pool()
+    {
+        release_list(local_);
+        release_list(freed_.exchange(nullptr, std::memory_order_acquire));
+    }
+
+    void *allocate(std::size_t size)
+    {
+        block *b;
+
+        if (size > block_size_) {
+            return allocate_unpooled(size);
+        }
+
+        if (!local_) {
+            local_ = freed_.exchange(nullptr, std::memory_order_acquire);
+        }
+
+        b = local_;
+        if (b) {
+            local_ = b->next;
+        } else {
+            b = static_cast<block *>(::operator new(header_size +
+                                                    block_size_));
+            b->pool = this;
+            num_blocks_++;
+        }
+        return payload(b);
+    }
+
+    /* Heap allocation that deallocate() takes back as well */
+    static void *allocate_unpooled(std::size_t size)
+    {
+        block *b = static_cast<block *>(::operator new(header_size + size));
+
+        b->pool = nullptr;
+        return payload(b);
+    }
+
+    static void deallocate(void *ptr) noexcept
+    {
+        block *b = reinterpret_cast<block *>(static_cast<char *>(ptr) -
+                                             header_size);
+        frame_pool *pool = b->pool;
+
+        if (!pool) {
+            ::operator delete(b);
+            return;
+        }
+
+        std::atomic<block *> &freed = pool->freed_;
+
+        b->next = freed.load(std::memory_order_relaxed);
+        while (!freed.compare_exchange_weak(b->next, b,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+            ;
+        }
+    }
+
+    std::size_t block_size() const
+    {
+        return block_size_;
+    }
+
+    /* Number of blocks ever allocated, i.e. the most frames alive at once */
+    std::size_t num_blocks() const
+    {
+        return num_blocks_;
+    }
+
+private:
+    struct block {
+        frame_pool *pool;
+        block *next;
+    };
+
+    /* keeps the frames aligned as if they came from ::operator new */
+    static constexpr std::size_t header_size =
+        (sizeof(block) + __STDCPP_DEFAULT_NEW_ALIGNMENT__ - 1) &
+        ~(__STDCPP_DEFAULT_NEW_ALIGNMENT__ - 1);
+
+    static void *payload(block *b)
+    {
+        return reinterpret_cast<char *>(b) + header_size;
+    }
+
+    static void release_list(block *b)
+    {
+        while (b) {
+            block *next = b->next;
+            ::operator delete(b);
+            b = next;
+        }
+    }
+
+    std::size_t block_size_;
+    std::size_t num_blocks_ = 0;
+    /* owner thread only */
+    block *local_ = nullptr;
+    /* pushed to by any thread, taken over by the owner when out of local */
+    std::atomic<block *> freed_{nullptr};
+};
+
+/**
+ * Request taken from a request queue; empty at the end of the stream
+ */
+class request {
+public:
+    request() = default;
+
+    request(const vhd_request &req, frame_pool *frames)
+        : req_(req), frames_(frames)
+    {
+    }
+
+    explicit operator bool() const
+    {
+        return req_.io != nullptr;
+    }
+
+    vhd_vdev *vdev() const
+    {
+        return req_.vdev;
+    }
+
+    vhd_io *io() const
+    {
+        return req_.io;
+    }
+
+    vhd_bdev_io *bdev_io() const
+    {
+        return vhd_get_bdev_io(req_.io);
+    }
+
+    /* Private data the device was registered with */
+    void *priv() const
+    {
+        return vhd_vdev_get_priv(req_.vdev);
+    }
+
+    frame_pool *frames() const
+    {
+        return frames_;
+    }
+
+private:
+    vhd_request req_ = {};
+    frame_pool *frames_ = nullptr;
+};
+
+namespace detail {
+
+template <typename T>
+constexpr bool is_request_v = std::is_same_v<std::remove_cvref_t<T>, request>;
+
+template <typename... Args>
+const request &find_request(const request &req, const Args &...)
+{
+    return req;
+}
+
+template <typename T, typename... Args>
+    requires (!is_request_v<T>)
+const request &find_request(const T &, const Args &...args)
+{
+    return find_request(args...);
+}
+
+} /* namespace detail */
+
+/**
+ * Return type of the coroutines serving a request
+ *
+ * The coroutine must take the vhd::request among its parameters, by value or
+ * by reference; its frame comes from the pool of the request queue.  It starts
+ * right away, runs until it first suspends, and completes the request with
+ * the status it co_returns, or VHD_BDEV_IOERR if it throws.
+ */
+class io_task {
+public:
+    class promise_type {
+    public:
+        template <typename... Args>
+        explicit promise_type(const Args &...args)
+        {
+            static_assert((detail::is_request_v<Args> || ...),
+                          "vhd::io_task coroutines take a vhd::request");
+            io_ = detail::find_request(args...).io();
+        }
+
+        template <typename... Args>
+        static void *operator new(std::size_t size, const Args &...args)
+        {
+            static_assert((detail::is_request_v<Args> || ...),
+                          "vhd::io_task coroutines take a vhd::request");
+            frame_pool *frames = detail::find_request(args...).frames();
+
+            return frames ? frames->allocate(size) :
+                            frame_pool::allocate_unpooled(size);
+        }
+
+        static void operator delete(void *ptr) noexcept
+        {
+            frame_pool::deallocate(ptr);
+        }
+
+        io_task get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        auto final_suspend() noexcept
+        {
+            struct completer {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                void await_suspend(
+                    std::coroutine_handle<promise_type> h) noexcept
+                {
+                    vhd_io *io = h.promise().io_;
+                    vhd_bdev_io_result status = h.promise().status_;
+
+                    /* back to the pool before the guest may send another */
+                    h.destroy();
+                    vhd_complete_bio(io, status);
+                }
+
+                void await_resume() noexcept
+                {
+                }
+            };
+            return completer{};
+        }
+
+        void return_value(vhd_bdev_io_result status) noexcept
+        {
+            status_ = status;
+        }
+
+        void unhandled_exception() noexcept
+        {
+            status_ = VHD_BDEV_IOERR;
+        }
+
+    private:
+        vhd_io *io_ = nullptr;
+        vhd_bdev_io_result status_ = VHD_BDEV_IOERR;
+    };
+};
+
+/**
+ * Fire-and-forget coroutine, e.g. to consume the request stream
+ */
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+/**
+ * Request queue as a stream of requests
+ *
+ * At most one coroutine awaits next() at a time.  It's resumed in the thread
+ * running the queue as requests arrive, and with an empty request once the
+ * queue is stopped.
+ */
+class request_queue {
+public:
+    explicit request_queue(vhd_request_queue *rq,
+                           std::size_t frame_size = 1024)
+        : rq_(rq), frames_(frame_size)
+    {
+    }
+
+    request_queue(const request_queue &) = delete;
+    request_queue &operator=(const request_queue &) = delete;
+
+    vhd_request_queue *get() const
+    {
+        return rq_;
+    }
+
+    frame_pool &frames()
+    {
+        return frames_;
+    }
+
+    auto next()
+    {
+        struct awaiter {
+            request_queue &q;
+            request req;
+
+            bool await_ready()
+            {
+                return q.try_take(req);
+            }
+
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                q.waiter_ = h;
+                q.waiting_ = &req;
+            }
+
+            request await_resume()
+            {
+                return req;
+            }
+        };
+        return awaiter{*this, {}};
+    }
+
+    /*
+     * Hand the requests already in the queue to the waiting coroutine without
+     * running the queue, e.g. right after vhd_run_queue() in a loop of the
+     * client's own.
+     */
+    void dispatch()
+    {
+        while (waiter_) {
+            request *out = waiting_;
+
+            if (!try_take(*out)) {
+                break;
+            }
+            resume_waiter();
+        }
+    }
+
+    /*
+     * Run the queue for one event loop iteration, then dispatch.  Returns as
+     * vhd_run_queue() does, and ends the stream once it returns other than
+     * -EAGAIN.
+     */
+    int run_once()
+    {
+        int ret = vhd_run_queue(rq_);
+
+        if (ret != -EAGAIN) {
+            finished_ = true;
+        }
+
+        dispatch();
+        if (finished_ && waiter_) {
+            *waiting_ = request();
+            resume_waiter();
+        }
+        return ret;
+    }
+
+    /* Run the queue in the calling thread until stopped with stop() */
+    int run()
+    {
+        int ret;
+
+        do {
+            ret = run_once();
+        } while (ret == -EAGAIN);
+        return ret;
+    }
+
+    void stop()
+    {
+        vhd_stop_queue(rq_);
+    }
+
+private:
+    bool try_take(request &out)
+    {
+        vhd_request req;
+
+        if (finished_ || !vhd_dequeue_request(rq_, &req)) {
+            return false;
+        }
+        out = request(req, &frames_);
+        return true;
+    }
+
+    void resume_waiter()
+    {
+        std::coroutine_handle<> h = std::exchange(waiter_, nullptr);
+
+        waiting_ = nullptr;
+        h.resume();
+    }
+
+    vhd_request_queue *rq_;
+    frame_pool frames_;
+    bool finished_ = false;
+    std::coroutine_handle<> waiter_;
+    request *waiting_ = nullptr;
+};
+
+/**
+ * Call @handler, returning vhd::io_task, on every request from @q until the
+ * queue is stopped
+ */
+template <typename Handler>
+detached serve(request_queue &q, Handler handler)
+{
+    for (;;) {
+        request req = co_await q.next();
+        if (!req) {
+            co_return;
+        }
+        handler(req);
+    }
+}
+
+} /* namespace vhd */
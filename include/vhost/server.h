@@ -69,9 +69,21 @@ struct vhd_request_queue;
  */
 struct vhd_request_queue *vhd_create_request_queue(void);
 
+/**
+ * Create new request queue in multi-consumer mode
+ *
+ * vhd_dequeue_request on such a queue may be called concurrently from any
+ * number of threads, e.g. directly from the backend worker threads, while the
+ * queue itself is run in a single thread with vhd_run_queue.
+ * @capacity is the number of requests the lock-free handover ring can hold
+ * and must be a power of two; requests in excess wait in the queue until the
+ * consumers make room.
+ */
+struct vhd_request_queue *vhd_create_request_queue_mpmc(uint32_t capacity);
+
 /**
  * Destroy request queue.
- * Don't call this until there are devices attached to this queue.
+ * Don't call this while there are devices attached to this queue.
  */
 void vhd_release_request_queue(struct vhd_request_queue *rq);
 
@@ -104,6 +116,68 @@ bool vhd_dequeue_request(struct vhd_request_queue *rq,
 void vhd_get_rq_stat(struct vhd_request_queue *rq,
                      struct vhd_rq_metrics *metrics);
 
+/**
+ * Count the CPU cost of the request queue thread with perf_event_open():
+ * cycles, instructions and cache misses where the hardware counters are
+ * available, and the task clock and context switches also where they aren't,
+ * as in most virtual machines.  The counters cover everything the thread
+ * does, i.e. vring kicks, completions and the client's own work between
+ * vhd_run_queue() calls, and are reported by vhd_get_rq_stat() from then on.
+ * Must not be called in the request queue thread; blocks until the queue
+ * runs.  Returns 0 on success or negative error code.
+ */
+int vhd_rq_enable_perf_counters(struct vhd_request_queue *rq);
+
+/**
+ * Get NUMA node of the thread serving the request queue, or -1 if unknown.
+ * Only known for request queues created as part of a pool.
+ */
+int vhd_rq_get_numa_node(struct vhd_request_queue *rq);
+
+/**
+ * Request queue pool
+ *
+ * A set of request queues run by threads the library creates and pins to the
+ * given CPUs.  Each queue is allocated on the NUMA node of its CPU.  Devices
+ * registered with the queues of a single pool get their vrings placed on the
+ * pool queues local to the guest memory when started.
+ */
+struct vhd_rq_pool;
+
+struct vhd_rq_pool_config {
+    /* Number of request queues, each run by its own thread */
+    int num_rqs;
+
+    /* CPUs to pin the threads to, round-robin; NULL to leave them unpinned */
+    const int *cpus;
+    int num_cpus;
+
+    /*
+     * Called in the queue thread after every event loop iteration; this is
+     * where the backend should take the requests with vhd_dequeue_request.
+     */
+    void (*process)(struct vhd_request_queue *rq, void *opaque);
+    void *opaque;
+};
+
+/**
+ * Create request queue pool and start its threads
+ */
+struct vhd_rq_pool *vhd_create_rq_pool(const struct vhd_rq_pool_config *cfg);
+
+/**
+ * Stop the pool threads and destroy its request queues.
+ * Don't call this while there are devices attached to the pool queues.
+ */
+void vhd_release_rq_pool(struct vhd_rq_pool *pool);
+
+/**
+ * Get request queues of the pool, to be passed on device registration.
+ * Returns number of request queues.
+ */
+int vhd_rq_pool_get_rqs(struct vhd_rq_pool *pool,
+                        struct vhd_request_queue ***rqs);
+
 /**
  * Block io request result
  */
@@ -111,6 +185,13 @@ enum vhd_bdev_io_result {
     VHD_BDEV_SUCCESS = 0,
     VHD_BDEV_IOERR,
     VHD_BDEV_CANCELED,
+    /* Zoned devices: the request doesn't apply to the zone in its state */
+    VHD_BDEV_ZONE_INVALID_CMD,
+    /* Zoned devices: a write not at the write pointer of the zone */
+    VHD_BDEV_ZONE_UNALIGNED_WP,
+    /* Zoned devices: too many zones open or active to open another one */
+    VHD_BDEV_ZONE_OPEN_RESOURCE,
+    VHD_BDEV_ZONE_ACTIVE_RESOURCE,
 };
 
 /*
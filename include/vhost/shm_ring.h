@@ -0,0 +1,253 @@
+/**
+ * Shared memory request rings
+ *
+ * Layout of the rings through which a request queue exports block requests
+ * to a backend running in another process, and the inline helpers both sides
+ * use to access them.  The backend only needs this header, it doesn't link
+ * with the library.
+ *
+ * The ring file starts with struct vhd_shm_ring_hdr, followed by the request
+ * ring of struct vhd_shm_req entries and the completion ring of struct
+ * vhd_shm_cpl entries, at the offsets given in the header.  Each ring has a
+ * single producer and a single consumer: the library produces requests and
+ * consumes completions, the backend does the opposite.  All fields are in
+ * host byte order.
+ *
+ * Data buffers are referred to by guest physical addresses within the memory
+ * map the request names; the regions of the map are shared with the backend
+ * out of band before the first request referring to it is exported, see
+ * vhd_attach_shm_channel().  The backend maps them itself and moves the data
+ * directly from or to guest memory.
+ *
+ * Each ring comes with an eventfd doorbell the producer kicks after
+ * publishing entries, but only if the consumer has announced it's going to
+ * sleep:
+ *
+ *     for (;;) {
+ *         while ((req = vhd_shm_ring_peek(&ring))) {
+ *             ...
+ *             vhd_shm_ring_pop(&ring);
+ *         }
+ *         if (vhd_shm_ring_prepare_sleep(&ring)) {
+ *             wait for the doorbell;
+ *             vhd_shm_ring_wake_up(&ring);
+ *         }
+ *     }
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VHD_SHM_RING_MAGIC      0x52444856 /* "VHDR" */
+#define VHD_SHM_RING_VERSION    1
+
+/* Max data segments in a request */
+#define VHD_SHM_MAX_SEGS        128
+
+#define VHD_SHM_CACHELINE_SIZE  64
+
+struct vhd_shm_seg {
+    uint64_t gpa;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct vhd_shm_req {
+    /* Opaque, to be returned in the completion */
+    uint64_t tag;
+    /* Private data of the device, as passed on its registration */
+    uint64_t dev;
+    /* Memory map the segment addresses belong to */
+    uint64_t map_id;
+
+    uint64_t first_sector;
+    uint64_t total_sectors;
+    /* enum vhd_bdev_io_type */
+    uint32_t type;
+
+    uint32_t nsegs;
+    struct vhd_shm_seg segs[VHD_SHM_MAX_SEGS];
+};
+
+struct vhd_shm_cpl {
+    uint64_t tag;
+    /* enum vhd_bdev_io_result */
+    uint32_t status;
+    uint32_t reserved;
+};
+
+/*
+ * Indices of a ring, free-running and wrapping at 2^32.  The ones written by
+ * the producer and by the consumer live on separate cache lines.
+ */
+struct vhd_shm_ring_idx {
+    uint32_t prod __attribute__((aligned(VHD_SHM_CACHELINE_SIZE)));
+
+    uint32_t cons __attribute__((aligned(VHD_SHM_CACHELINE_SIZE)));
+    /* Set by the consumer while it waits for the doorbell */
+    uint32_t need_wakeup;
+};
+
+struct vhd_shm_ring_hdr {
+    uint32_t magic;
+    uint32_t version;
+    /* Number of entries in each ring, a power of two */
+    uint32_t num_entries;
+    uint32_t reserved;
+
+    /* Offsets of the rings from the start of the file */
+    uint64_t req_offset;
+    uint64_t cpl_offset;
+
+    struct vhd_shm_ring_idx req;
+    struct vhd_shm_ring_idx cpl;
+};
+
+/*
+ * A region of guest memory to be mapped by the backend:
+ * mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset) covers
+ * guest physical addresses [gpa, gpa + size).
+ */
+struct vhd_shm_region {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t offset;
+    int fd;
+};
+
+/*
+ * Process-local handle of one of the rings.
+ */
+struct vhd_shm_ring {
+    struct vhd_shm_ring_idx *idx;
+    char *entries;
+    uint32_t entry_size;
+    uint32_t mask;
+
+    /* own index and the last seen index of the peer */
+    uint32_t prod;
+    uint32_t cons;
+};
+
+/* Size of the ring file for @num_entries entries per ring */
+static inline uint64_t vhd_shm_ring_file_size(uint32_t num_entries)
+{
+    uint64_t req_size = (uint64_t)num_entries * sizeof(struct vhd_shm_req);
+    uint64_t cpl_size = (uint64_t)num_entries * sizeof(struct vhd_shm_cpl);
+
+    return sizeof(struct vhd_shm_ring_hdr) + req_size + cpl_size;
+}
+
+/*
+ * Check the header of a ring file of @size bytes mapped at @hdr before
+ * attaching to its rings.
+ */
+static inline bool vhd_shm_ring_hdr_valid(const struct vhd_shm_ring_hdr *hdr,
+                                          uint64_t size)
+{
+    uint32_t n = hdr->num_entries;
+
+    return hdr->magic == VHD_SHM_RING_MAGIC &&
+           hdr->version == VHD_SHM_RING_VERSION &&
+           n && !(n & (n - 1)) &&
+           size >= vhd_shm_ring_file_size(n) &&
+           hdr->req_offset + (uint64_t)n * sizeof(struct vhd_shm_req) <= size &&
+           hdr->cpl_offset + (uint64_t)n * sizeof(struct vhd_shm_cpl) <= size;
+}
+
+static inline void vhd_shm_ring_attach(struct vhd_shm_ring *ring,
+                                       struct vhd_shm_ring_hdr *hdr,
+                                       bool completions)
+{
+    ring->idx = completions ? &hdr->cpl : &hdr->req;
+    ring->entries = (char *)hdr +
+                    (completions ? hdr->cpl_offset : hdr->req_offset);
+    ring->entry_size = completions ? sizeof(struct vhd_shm_cpl) :
+                                     sizeof(struct vhd_shm_req);
+    ring->mask = hdr->num_entries - 1;
+    ring->prod = __atomic_load_n(&ring->idx->prod, __ATOMIC_ACQUIRE);
+    ring->cons = __atomic_load_n(&ring->idx->cons, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Producer side: get the next free entry, or NULL if the ring is full.  The
+ * entry becomes visible to the consumer with vhd_shm_ring_push().
+ */
+static inline void *vhd_shm_ring_reserve(struct vhd_shm_ring *ring)
+{
+    if (ring->prod - ring->cons > ring->mask) {
+        ring->cons = __atomic_load_n(&ring->idx->cons, __ATOMIC_ACQUIRE);
+        if (ring->prod - ring->cons > ring->mask) {
+            return NULL;
+        }
+    }
+    return ring->entries + (size_t)(ring->prod & ring->mask) * ring->entry_size;
+}
+
+static inline void vhd_shm_ring_push(struct vhd_shm_ring *ring)
+{
+    __atomic_store_n(&ring->idx->prod, ++ring->prod, __ATOMIC_RELEASE);
+}
+
+/*
+ * Producer side: whether the doorbell needs a kick after pushing entries.
+ */
+static inline bool vhd_shm_ring_kick_needed(struct vhd_shm_ring *ring)
+{
+    /* order the prod store against the need_wakeup load */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->idx->need_wakeup, __ATOMIC_RELAXED);
+}
+
+/*
+ * Consumer side: get the oldest entry, or NULL if the ring is empty.  The
+ * entry stays valid until vhd_shm_ring_pop().
+ */
+static inline void *vhd_shm_ring_peek(struct vhd_shm_ring *ring)
+{
+    if (ring->cons == ring->prod) {
+        ring->prod = __atomic_load_n(&ring->idx->prod, __ATOMIC_ACQUIRE);
+        if (ring->cons == ring->prod) {
+            return NULL;
+        }
+    }
+    return ring->entries + (size_t)(ring->cons & ring->mask) * ring->entry_size;
+}
+
+static inline void vhd_shm_ring_pop(struct vhd_shm_ring *ring)
+{
+    __atomic_store_n(&ring->idx->cons, ++ring->cons, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer side: announce going to sleep on the doorbell.  Returns false if
+ * entries showed up in the meantime, and the consumer should go on instead.
+ */
+static inline bool vhd_shm_ring_prepare_sleep(struct vhd_shm_ring *ring)
+{
+    __atomic_store_n(&ring->idx->need_wakeup, 1, __ATOMIC_RELAXED);
+    /* order the need_wakeup store against the prod load */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->idx->prod, __ATOMIC_ACQUIRE) != ring->cons) {
+        __atomic_store_n(&ring->idx->need_wakeup, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+static inline void vhd_shm_ring_wake_up(struct vhd_shm_ring *ring)
+{
+    __atomic_store_n(&ring->idx->need_wakeup, 0, __ATOMIC_RELAXED);
+}
+
+#ifdef __cplusplus
+}
+#endif
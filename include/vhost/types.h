@@ -42,6 +42,36 @@ struct vhd_vq_metrics {
     /* total amount of requests completed */
     uint64_t request_completed;
 
+    /* Ordering counters, for block devices ordering overlapping writes */
+    /* number of requests held behind an overlapping write in flight */
+    uint64_t order_held;
+
+    /* Read coalescing counters, for block devices with a backing_id */
+    /* number of reads looked up among the reads in flight */
+    uint64_t read_coalesce_lookups;
+    /* number of reads served by another read in flight */
+    uint64_t read_coalesce_hits;
+
+    /* Known-zero range counters, for block devices tracking those */
+    /* number of reads served without the backend */
+    uint64_t read_zero_hits;
+    /* number of reads trimmed before reaching the backend */
+    uint64_t read_zero_trims;
+
+    /* Read-modify-write counters, for block devices aligning to blocks */
+    /* number of reads covering some blocks partly */
+    uint64_t rmw_reads;
+    /* number of writes, discards and write-zeroes read-modify-written */
+    uint64_t rmw_writes;
+    /* number of writes that waited for another one to the same blocks */
+    uint64_t rmw_waits;
+
+    /* Polling of the avail ring after a batch of completions */
+    /* number of polls that found new requests and dispatched them */
+    uint64_t avail_poll_hits;
+    /* number of polls that found none, leaving them to the kick */
+    uint64_t avail_poll_misses;
+
     /* Other counters*/
     /* number of requests was dispatched from vring last time*/
     uint16_t queue_len_last;
@@ -63,11 +93,34 @@ struct vhd_rq_metrics {
     uint64_t completed;
     /* number of requests canceled from internal queue before dispatch */
     uint64_t cancelled;
+    /* number of requests that found the multi-consumer handover ring full */
+    uint64_t overflowed;
 
     /* timestamp of oldest infight request */
     time_t oldest_inflight_ts;
+
+    /*
+     * CPU cost of the request queue thread since
+     * vhd_rq_enable_perf_counters(); divide by @completed for the cost per
+     * request.  Only the counters flagged in @perf_flags are valid.
+     */
+    uint32_t perf_flags;
+    uint64_t perf_task_clock_ns;
+    uint64_t perf_context_switches;
+    uint64_t perf_cycles;
+    uint64_t perf_instructions;
+    uint64_t perf_cache_misses;
 };
 
+/* vhd_rq_metrics.perf_flags */
+#define VHD_RQ_PERF_TASK_CLOCK          (1u << 0)
+#define VHD_RQ_PERF_CONTEXT_SWITCHES    (1u << 1)
+#define VHD_RQ_PERF_CYCLES              (1u << 2)
+#define VHD_RQ_PERF_INSTRUCTIONS        (1u << 3)
+#define VHD_RQ_PERF_CACHE_MISSES        (1u << 4)
+/* the kernel isn't allowed to count the kernel time of the thread for us */
+#define VHD_RQ_PERF_USER_ONLY           (1u << 31)
+
 #ifdef __cplusplus
 }
 #endif
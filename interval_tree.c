@@ -0,0 +1,162 @@
+/*
+ * Interval tree over half-open [start, end) ranges
+ *
+ * A treap ordered by the interval start, with ties broken by the address to
+ * make every key unique, and heap-ordered by random priorities to stay
+ * balanced on average.  Each node caches the largest end in its subtree, so
+ * the overlap lookup skips the subtrees ending before the range of interest
+ * and costs O(log n + k) for k matches.
+ */
+
+#include "interval_tree.h"
+#include "platform.h"
+
+static bool key_less(const struct vhd_interval *a,
+                     const struct vhd_interval *b)
+{
+    return a->start < b->start ||
+           (a->start == b->start && (uintptr_t)a < (uintptr_t)b);
+}
+
+static void update_max_end(struct vhd_interval *iv)
+{
+    iv->max_end = iv->end;
+    if (iv->left && iv->left->max_end > iv->max_end) {
+        iv->max_end = iv->left->max_end;
+    }
+    if (iv->right && iv->right->max_end > iv->max_end) {
+        iv->max_end = iv->right->max_end;
+    }
+}
+
+/* xorshift32; only needs to be uncorrelated with the keys */
+static uint32_t next_prio(struct vhd_interval_tree *tree)
+{
+    uint32_t x = tree->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    tree->rng = x;
+    return x;
+}
+
+/* every key in @a is less than every key in @b */
+static struct vhd_interval *merge(struct vhd_interval *a,
+                                  struct vhd_interval *b)
+{
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+
+    if (a->prio > b->prio) {
+        a->right = merge(a->right, b);
+        update_max_end(a);
+        return a;
+    }
+
+    b->left = merge(a, b->left);
+    update_max_end(b);
+    return b;
+}
+
+/* split @t into the keys less than @key's and the rest */
+static void split(struct vhd_interval *t, const struct vhd_interval *key,
+                  struct vhd_interval **l, struct vhd_interval **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+
+    if (key_less(t, key)) {
+        split(t->right, key, &t->right, r);
+        *l = t;
+    } else {
+        split(t->left, key, l, &t->left);
+        *r = t;
+    }
+    update_max_end(t);
+}
+
+static struct vhd_interval *remove_from(struct vhd_interval *t,
+                                        struct vhd_interval *iv)
+{
+    VHD_ASSERT(t);
+
+    if (t == iv) {
+        return merge(t->left, t->right);
+    }
+
+    if (key_less(iv, t)) {
+        t->left = remove_from(t->left, iv);
+    } else {
+        t->right = remove_from(t->right, iv);
+    }
+    update_max_end(t);
+    return t;
+}
+
+static bool visit_overlaps(struct vhd_interval *t, uint64_t start,
+                           uint64_t end,
+                           bool (*cb)(struct vhd_interval *, void *),
+                           void *opaque)
+{
+    if (!t || t->max_end <= start) {
+        return true;
+    }
+
+    if (!visit_overlaps(t->left, start, end, cb, opaque)) {
+        return false;
+    }
+
+    /* the right subtree starts even further */
+    if (t->start >= end) {
+        return true;
+    }
+
+    if (t->end > start && !cb(t, opaque)) {
+        return false;
+    }
+
+    return visit_overlaps(t->right, start, end, cb, opaque);
+}
+
+void vhd_interval_tree_init(struct vhd_interval_tree *tree)
+{
+    tree->root = NULL;
+    tree->rng = 0x9e3779b9;
+}
+
+void vhd_interval_tree_insert(struct vhd_interval_tree *tree,
+                              struct vhd_interval *iv)
+{
+    struct vhd_interval *l, *r;
+
+    VHD_ASSERT(iv->start < iv->end);
+
+    iv->prio = next_prio(tree);
+    iv->left = iv->right = NULL;
+    iv->max_end = iv->end;
+
+    split(tree->root, iv, &l, &r);
+    tree->root = merge(merge(l, iv), r);
+}
+
+void vhd_interval_tree_remove(struct vhd_interval_tree *tree,
+                              struct vhd_interval *iv)
+{
+    tree->root = remove_from(tree->root, iv);
+}
+
+bool vhd_interval_tree_foreach_overlap(struct vhd_interval_tree *tree,
+                                       uint64_t start, uint64_t end,
+                                       bool (*cb)(struct vhd_interval *,
+                                                  void *),
+                                       void *opaque)
+{
+    return visit_overlaps(tree->root, start, end, cb, opaque);
+}
@@ -0,0 +1,63 @@
+/*
+ * Interval tree over half-open [start, end) ranges
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Embedded into the objects to be indexed; the caller sets @start and @end
+ * before inserting the interval and keeps them intact while it's in the tree.
+ */
+struct vhd_interval {
+    uint64_t start;
+    uint64_t end;
+
+    /* private */
+    uint64_t max_end;
+    uint32_t prio;
+    struct vhd_interval *left;
+    struct vhd_interval *right;
+};
+
+struct vhd_interval_tree {
+    struct vhd_interval *root;
+    uint32_t rng;
+};
+
+void vhd_interval_tree_init(struct vhd_interval_tree *tree);
+
+static inline bool vhd_interval_tree_empty(struct vhd_interval_tree *tree)
+{
+    return !tree->root;
+}
+
+/*
+ * Intervals must not be empty, but may overlap and coincide with each other.
+ */
+void vhd_interval_tree_insert(struct vhd_interval_tree *tree,
+                              struct vhd_interval *iv);
+
+void vhd_interval_tree_remove(struct vhd_interval_tree *tree,
+                              struct vhd_interval *iv);
+
+/*
+ * Call @cb for each interval overlapping [@start, @end), in the order of
+ * their starts, until it returns false.  Returns false if stopped by @cb.
+ * The tree must not be modified from @cb.
+ */
+bool vhd_interval_tree_foreach_overlap(struct vhd_interval_tree *tree,
+                                       uint64_t start, uint64_t end,
+                                       bool (*cb)(struct vhd_interval *,
+                                                  void *),
+                                       void *opaque);
+
+#ifdef __cplusplus
+}
+#endif
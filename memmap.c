@@ -1,6 +1,14 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <inttypes.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/userfaultfd.h>
+
+#include "vhost/shm_ring.h"
 
 #include "queue.h"
 #include "memmap.h"
@@ -28,19 +36,54 @@ struct vhd_memory_region {
     size_t size;
     /* offset of the region from the file base */
     off_t offset;
+    /* the file, kept to share the region with other processes */
+    int fd;
 
     /* unique identifiers of this region for caching purposes */
     dev_t device;
     ino_t inode;
 
+    /* the missing pages are reported to the userfaultfd of the map */
+    bool uffd_registered;
+
     /* callbacks associated with this memory region */
     struct vhd_mmap_callbacks callbacks;
 
     LIST_ENTRY(vhd_memory_region) region_link;
 };
 
-static LIST_HEAD(, vhd_memory_region) g_regions =
-    LIST_HEAD_INITIALIZER(g_regions);
+/*
+ * The regions mapped, for the maps of the same guest memory to share them,
+ * and the maps published for the devices setting up the same memory table to
+ * share them, both hashed by the identities of the regions.  The lookups
+ * only take a reference to a region or map which isn't being released yet,
+ * and the release takes it out under the lock.
+ */
+#define REGION_HASH_BUCKETS 256
+#define MEMMAP_HASH_BUCKETS 64
+
+static LIST_HEAD(, vhd_memory_region) g_regions[REGION_HASH_BUCKETS];
+static LIST_HEAD(, vhd_memory_map) g_memmaps[MEMMAP_HASH_BUCKETS];
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash_mix(uint64_t hash, uint64_t val)
+{
+    hash = (hash ^ val) * 0x9e3779b97f4a7c15ull;
+    return hash ^ (hash >> 29);
+}
+
+static uint64_t region_hash(dev_t device, ino_t inode, uint64_t gpa,
+                            uint64_t uva, size_t size, off_t offset)
+{
+    uint64_t hash = 0;
+
+    hash = hash_mix(hash, device);
+    hash = hash_mix(hash, inode);
+    hash = hash_mix(hash, gpa);
+    hash = hash_mix(hash, uva);
+    hash = hash_mix(hash, size);
+    return hash_mix(hash, offset);
+}
 
 static void region_init_id(struct vhd_memory_region *reg, int fd)
 {
@@ -70,8 +113,19 @@ size_t vhd_memmap_max_memslots(void)
 struct vhd_memory_map {
     struct objref ref;
 
+    /* unique across all maps ever created */
+    uint64_t id;
+
     struct vhd_mmap_callbacks callbacks;
 
+    /* userfaultfd to register the regions added with, or -1 */
+    int uffd;
+
+    /* published to be shared, see vhd_memmap_get_shared() */
+    bool published;
+    uint64_t hash;
+    LIST_ENTRY(vhd_memory_map) link;
+
     /* actual number of slots used */
     unsigned num;
     struct vhd_memory_region *regions[VHD_RAM_SLOTS_MAX];
@@ -158,21 +212,31 @@ static int map_region(struct vhd_memory_region *region, uint64_t gpa,
                       uint64_t uva, size_t size, int fd, off_t offset)
 {
     void *ptr;
+    int ret;
+
+    region->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (region->fd < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("can't dup memory region fd: %s", strerror(-ret));
+        return ret;
+    }
 
     ptr = map_memory(NULL, size, fd, offset);
     if (ptr == MAP_FAILED) {
-        int ret = -errno;
+        ret = -errno;
         VHD_LOG_ERROR("can't mmap memory: %s", strerror(-ret));
+        close(region->fd);
         return ret;
     }
 
     if (region->callbacks.map_cb) {
         size_t len = VHD_ALIGN_PTR_UP(size, HUGE_PAGE_SIZE);
-        int ret = region->callbacks.map_cb(ptr, len);
+        ret = region->callbacks.map_cb(ptr, len);
         if (ret < 0) {
             VHD_LOG_ERROR("map callback failed for region %p-%p: %s",
                           ptr, ptr + len, strerror(-ret));
             munmap(ptr, size);
+            close(region->fd);
             return ret;
         }
     }
@@ -213,13 +277,65 @@ static int unmap_region(struct vhd_memory_region *reg)
     return 0;
 }
 
+static int region_uffd_register(struct vhd_memory_region *reg, int uffd)
+{
+    struct uffdio_register uffd_reg = {
+        .range = {
+            .start = (uintptr_t)reg->ptr,
+            .len = VHD_ALIGN_UP(reg->size, PAGE_SIZE),
+        },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    int ret;
+
+    if (ioctl(uffd, UFFDIO_REGISTER, &uffd_reg) < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("can't register region %p-%p with userfaultfd: %s",
+                      reg->ptr, reg->ptr + reg->size, strerror(-ret));
+        return ret;
+    }
+
+    /* the master wakes the faulting threads up once the page is in place */
+    if (!(uffd_reg.ioctls & (1ull << _UFFDIO_WAKE))) {
+        VHD_LOG_ERROR("userfaultfd can't wake up faults on region %p-%p",
+                      reg->ptr, reg->ptr + reg->size);
+        return -ENOTSUP;
+    }
+
+    reg->uffd_registered = true;
+    return 0;
+}
+
+static int region_uffd_unregister(struct vhd_memory_region *reg, int uffd)
+{
+    struct uffdio_range range = {
+        .start = (uintptr_t)reg->ptr,
+        .len = VHD_ALIGN_UP(reg->size, PAGE_SIZE),
+    };
+    int ret;
+
+    if (ioctl(uffd, UFFDIO_UNREGISTER, &range) < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("can't unregister region %p-%p from userfaultfd: %s",
+                      reg->ptr, reg->ptr + reg->size, strerror(-ret));
+        return ret;
+    }
+
+    reg->uffd_registered = false;
+    return 0;
+}
+
 static void region_release(struct objref *objref)
 {
     struct vhd_memory_region *reg =
             containerof(objref, struct vhd_memory_region, ref);
 
+    pthread_mutex_lock(&g_cache_lock);
     LIST_REMOVE(reg, region_link);
+    pthread_mutex_unlock(&g_cache_lock);
+
     unmap_region(reg);
+    close(reg->fd);
     vhd_free(reg);
 }
 
@@ -242,15 +358,23 @@ static inline struct vhd_memory_region *region_get_cached(
 {
     struct vhd_memory_region *region;
     struct stat stat;
+    uint64_t hash;
 
     if (fstat(fd, &stat) < 0) {
         return NULL;
     }
 
-    LIST_FOREACH(region, &g_regions, region_link) {
+    hash = region_hash(stat.st_dev, stat.st_ino, gpa, uva, size, offset);
+
+    pthread_mutex_lock(&g_cache_lock);
+    LIST_FOREACH(region, &g_regions[hash % REGION_HASH_BUCKETS],
+                 region_link) {
         if (region->inode != stat.st_ino || region->device != stat.st_dev) {
             continue;
         }
+        if (region->uffd_registered) {
+            continue;
+        }
         if (region->gpa != gpa || region->uva != uva ||
             region->size != size || region->offset != offset) {
             continue;
@@ -259,12 +383,35 @@ static inline struct vhd_memory_region *region_get_cached(
             region->callbacks.unmap_cb != callbacks->unmap_cb) {
             continue;
         }
-
-        region_ref(region);
-        return region;
+        if (!objref_get_unless_zero(&region->ref)) {
+            continue;
+        }
+        break;
     }
+    pthread_mutex_unlock(&g_cache_lock);
 
-    return NULL;
+    return region;
+}
+
+static void region_cache_insert(struct vhd_memory_region *reg)
+{
+    uint64_t hash = region_hash(reg->device, reg->inode, reg->gpa, reg->uva,
+                                reg->size, reg->offset);
+
+    pthread_mutex_lock(&g_cache_lock);
+    LIST_INSERT_HEAD(&g_regions[hash % REGION_HASH_BUCKETS], reg,
+                     region_link);
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+static void memmap_unpublish(struct vhd_memory_map *mm)
+{
+    pthread_mutex_lock(&g_cache_lock);
+    if (mm->published) {
+        LIST_REMOVE(mm, link);
+        mm->published = false;
+    }
+    pthread_mutex_unlock(&g_cache_lock);
 }
 
 static void memmap_release(struct objref *objref)
@@ -273,6 +420,8 @@ static void memmap_release(struct objref *objref)
         containerof(objref, struct vhd_memory_map, ref);
     unsigned i;
 
+    memmap_unpublish(mm);
+
     for (i = 0; i < mm->num; i++) {
         region_unref(mm->regions[i]);
     }
@@ -332,15 +481,19 @@ void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len)
     return NULL;
 }
 
+static uint64_t g_memmap_id;
+
 struct vhd_memory_map *vhd_memmap_new(int (*map_cb)(void *, size_t),
                                       int (*unmap_cb)(void *, size_t))
 {
     struct vhd_memory_map *mm = vhd_alloc(sizeof(*mm));
     *mm = (struct vhd_memory_map) {
+        .id = catomic_fetch_inc(&g_memmap_id),
         .callbacks = (struct vhd_mmap_callbacks) {
             .map_cb = map_cb,
             .unmap_cb = unmap_cb,
-        }
+        },
+        .uffd = -1,
     };
 
     objref_init(&mm->ref, memmap_release);
@@ -352,7 +505,10 @@ struct vhd_memory_map *vhd_memmap_dup(struct vhd_memory_map *mm)
     size_t i;
     struct vhd_memory_map *new_mm = vhd_alloc(sizeof(*mm));
 
+    new_mm->id = catomic_fetch_inc(&g_memmap_id);
     new_mm->callbacks = mm->callbacks;
+    new_mm->uffd = mm->uffd;
+    new_mm->published = false;
     new_mm->num = mm->num;
     objref_init(&new_mm->ref, memmap_release);
 
@@ -376,6 +532,7 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
     if (gpa + size < gpa || uva + size < uva) {
         return -EINVAL;
     }
+
     /* check for spare slots */
     if (mm->num == VHD_RAM_SLOTS_MAX) {
         return -ENOBUFS;
@@ -398,7 +555,13 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
         }
     }
 
-    region = region_get_cached(gpa, uva, size, fd, offset, &mm->callbacks);
+    /*
+     * A region registered with userfaultfd needs a mapping of its own: a
+     * mapping can only be registered with one, and the faults on it are only
+     * to be reported to the master of this map.
+     */
+    region = mm->uffd < 0 ?
+        region_get_cached(gpa, uva, size, fd, offset, &mm->callbacks) : NULL;
     if (region == NULL) {
         region = vhd_calloc(1, sizeof(*region));
         *region = (struct vhd_memory_region) {
@@ -413,7 +576,17 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
             return ret;
         }
 
-        LIST_INSERT_HEAD(&g_regions, region, region_link);
+        if (mm->uffd >= 0) {
+            ret = region_uffd_register(region, mm->uffd);
+            if (ret < 0) {
+                unmap_region(region);
+                close(region->fd);
+                vhd_free(region);
+                return ret;
+            }
+        }
+
+        region_cache_insert(region);
     } else {
         VHD_LOG_INFO(
             "region %jd-%ju (GPA 0x%016"PRIX64" -> 0x%016"PRIX64") cache hit, "
@@ -422,6 +595,9 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
         );
     }
 
+    /* the map no longer matches the table it was published with */
+    memmap_unpublish(mm);
+
     if (i < mm->num) {
         memmove(&mm->regions[i + 1], &mm->regions[i],
                 sizeof(mm->regions[0]) * (mm->num - i));
@@ -448,6 +624,7 @@ int vhd_memmap_del_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
         return -ENXIO;
     }
 
+    memmap_unpublish(mm);
     region_unref(mm->regions[i]);
 
     mm->num--;
@@ -458,3 +635,239 @@ int vhd_memmap_del_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
 
     return 0;
 }
+
+/* memory slot with the identity of the file behind it */
+struct slot_key {
+    const struct vhd_memmap_slot *slot;
+    int fd;
+    dev_t device;
+    ino_t inode;
+};
+
+static bool memmap_matches(struct vhd_memory_map *mm,
+                           const struct vhd_mmap_callbacks *callbacks,
+                           const struct slot_key *keys, unsigned num)
+{
+    unsigned i;
+
+    if (mm->num != num || mm->uffd >= 0 ||
+        mm->callbacks.map_cb != callbacks->map_cb ||
+        mm->callbacks.unmap_cb != callbacks->unmap_cb) {
+        return false;
+    }
+
+    for (i = 0; i < num; i++) {
+        const struct vhd_memory_region *reg = mm->regions[i];
+        const struct vhd_memmap_slot *slot = keys[i].slot;
+
+        if (reg->device != keys[i].device || reg->inode != keys[i].inode ||
+            reg->gpa != slot->gpa || reg->uva != slot->uva ||
+            reg->size != slot->size || reg->offset != slot->offset) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int vhd_memmap_get_shared(struct vhd_memory_map **pmm,
+                          int (*map_cb)(void *, size_t),
+                          int (*unmap_cb)(void *, size_t),
+                          const struct vhd_memmap_slot *slots, const int *fds,
+                          unsigned num)
+{
+    struct vhd_mmap_callbacks callbacks = {
+        .map_cb = map_cb,
+        .unmap_cb = unmap_cb,
+    };
+    struct slot_key keys[VHD_RAM_SLOTS_MAX];
+    struct vhd_memory_map *mm;
+    uint64_t hash = 0;
+    unsigned i, j;
+    int ret;
+
+    if (num > VHD_RAM_SLOTS_MAX) {
+        return -ENOBUFS;
+    }
+
+    /* the regions of a map are in ascending order in gpa, match that */
+    for (i = 0; i < num; i++) {
+        struct stat stat;
+
+        if (fstat(fds[i], &stat) < 0) {
+            ret = -errno;
+            VHD_LOG_ERROR("can't stat memory region fd: %s", strerror(-ret));
+            return ret;
+        }
+
+        for (j = i; j > 0 && keys[j - 1].slot->gpa > slots[i].gpa; j--) {
+            keys[j] = keys[j - 1];
+        }
+        keys[j] = (struct slot_key) {
+            .slot = &slots[i],
+            .fd = fds[i],
+            .device = stat.st_dev,
+            .inode = stat.st_ino,
+        };
+    }
+
+    hash = hash_mix(hash, (uintptr_t)map_cb);
+    hash = hash_mix(hash, (uintptr_t)unmap_cb);
+    for (i = 0; i < num; i++) {
+        const struct vhd_memmap_slot *slot = keys[i].slot;
+
+        hash = hash_mix(hash, region_hash(keys[i].device, keys[i].inode,
+                                          slot->gpa, slot->uva, slot->size,
+                                          slot->offset));
+    }
+
+    pthread_mutex_lock(&g_cache_lock);
+    LIST_FOREACH(mm, &g_memmaps[hash % MEMMAP_HASH_BUCKETS], link) {
+        if (mm->hash == hash && memmap_matches(mm, &callbacks, keys, num) &&
+            objref_get_unless_zero(&mm->ref)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+
+    if (mm) {
+        VHD_LOG_INFO("memory map %" PRIu64 " cache hit, sharing"
+                     " (%u refs total)", mm->id, objref_read(&mm->ref));
+        *pmm = mm;
+        return 0;
+    }
+
+    mm = vhd_memmap_new(map_cb, unmap_cb);
+    for (i = 0; i < num; i++) {
+        const struct vhd_memmap_slot *slot = keys[i].slot;
+
+        ret = vhd_memmap_add_slot(mm, slot->gpa, slot->uva, slot->size,
+                                  keys[i].fd, slot->offset);
+        if (ret < 0) {
+            vhd_memmap_unref(mm);
+            return ret;
+        }
+    }
+
+    pthread_mutex_lock(&g_cache_lock);
+    mm->hash = hash;
+    mm->published = true;
+    LIST_INSERT_HEAD(&g_memmaps[hash % MEMMAP_HASH_BUCKETS], mm, link);
+    pthread_mutex_unlock(&g_cache_lock);
+
+    *pmm = mm;
+    return 0;
+}
+
+void vhd_memmap_set_uffd(struct vhd_memory_map *mm, int uffd)
+{
+    mm->uffd = uffd;
+}
+
+int vhd_memmap_uffd_unregister(struct vhd_memory_map *mm)
+{
+    unsigned i;
+    int ret;
+
+    if (mm->uffd < 0) {
+        return 0;
+    }
+
+    for (i = 0; i < mm->num; i++) {
+        struct vhd_memory_region *reg = mm->regions[i];
+
+        if (!reg->uffd_registered) {
+            continue;
+        }
+        ret = region_uffd_unregister(reg, mm->uffd);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    mm->uffd = -1;
+    return 0;
+}
+
+/*
+ * Returns the NUMA node backing most of the guest memory, or -1 if unknown.
+ * The node of each region is judged by its first page.  The regions
+ * registered with userfaultfd are left out: the lookup faults the page in,
+ * which would block until the postcopy migration delivers it.
+ */
+int vhd_memmap_numa_node(struct vhd_memory_map *mm)
+{
+    struct {
+        int node;
+        size_t size;
+    } nodes[VHD_RAM_SLOTS_MAX];
+    unsigned num_nodes = 0;
+    int best = -1;
+    size_t best_size = 0;
+    unsigned i, j;
+
+    for (i = 0; i < mm->num; i++) {
+        struct vhd_memory_region *reg = mm->regions[i];
+        int node;
+
+        if (reg->uffd_registered) {
+            continue;
+        }
+
+        if (syscall(SYS_get_mempolicy, &node, NULL, 0, reg->ptr,
+                    MPOL_F_NODE | MPOL_F_ADDR) < 0) {
+            return -1;
+        }
+
+        for (j = 0; j < num_nodes; j++) {
+            if (nodes[j].node == node) {
+                break;
+            }
+        }
+        if (j == num_nodes) {
+            nodes[num_nodes].node = node;
+            nodes[num_nodes].size = 0;
+            num_nodes++;
+        }
+        nodes[j].size += reg->size;
+
+        if (nodes[j].size > best_size) {
+            best_size = nodes[j].size;
+            best = node;
+        }
+    }
+
+    return best;
+}
+
+/* Unique id of the map, never reused for another one */
+uint64_t vhd_memmap_id(struct vhd_memory_map *mm)
+{
+    return mm->id;
+}
+
+/* Whether anybody else holds the map too */
+bool vhd_memmap_is_shared(struct vhd_memory_map *mm)
+{
+    return objref_read(&mm->ref) > 1;
+}
+
+/* Fill @regions with the map regions and return their number */
+unsigned vhd_memmap_get_regions(struct vhd_memory_map *mm,
+                                struct vhd_shm_region *regions)
+{
+    unsigned i;
+
+    for (i = 0; i < mm->num; i++) {
+        struct vhd_memory_region *reg = mm->regions[i];
+
+        regions[i] = (struct vhd_shm_region) {
+            .gpa = reg->gpa,
+            .size = reg->size,
+            .offset = reg->offset,
+            .fd = reg->fd,
+        };
+    }
+
+    return mm->num;
+}
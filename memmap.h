@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/mman.h>
@@ -21,6 +22,26 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
 int vhd_memmap_del_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
                         size_t size);
 
+/* Guest memory slot as described by the master */
+struct vhd_memmap_slot {
+    uint64_t gpa;
+    uint64_t uva;
+    size_t size;
+    off_t offset;
+};
+
+/*
+ * Get a map of the @num @slots backed by @fds, shared with the devices which
+ * set up the same ones, e.g. the other disks of the same VM, or a new one if
+ * none did.  Adding or deleting slots takes the map out of sharing; the map
+ * is not to be changed in place while anybody else holds it.
+ */
+int vhd_memmap_get_shared(struct vhd_memory_map **mm,
+                          int (*map_cb)(void *, size_t),
+                          int (*unmap_cb)(void *, size_t),
+                          const struct vhd_memmap_slot *slots, const int *fds,
+                          unsigned num);
+
 void vhd_memmap_ref(struct vhd_memory_map *mm);
 void vhd_memmap_unref(struct vhd_memory_map *mm);
 
@@ -29,6 +50,37 @@ void *uva_to_ptr(struct vhd_memory_map *mm, uint64_t uva);
 #define TRANSLATION_FAILED ((uint64_t)-1)
 uint64_t ptr_to_gpa(struct vhd_memory_map *mm, void *ptr);
 
+int vhd_memmap_numa_node(struct vhd_memory_map *mm);
+
+/*
+ * Register the regions added to @mm from now on with userfaultfd @uffd, for
+ * the master to serve the faults on the pages yet to arrive during postcopy
+ * migration.  Such regions are mapped anew rather than reused from another
+ * map.  @uffd stays owned by the caller.
+ */
+void vhd_memmap_set_uffd(struct vhd_memory_map *mm, int uffd);
+
+/*
+ * Unregister the regions of @mm from its userfaultfd once all the pages have
+ * arrived, and stop registering the ones added later.
+ */
+int vhd_memmap_uffd_unregister(struct vhd_memory_map *mm);
+
+/* Identifier of the map, unique for the lifetime of the process */
+uint64_t vhd_memmap_id(struct vhd_memory_map *mm);
+
+/* Whether anybody but the caller holds a reference to the map */
+bool vhd_memmap_is_shared(struct vhd_memory_map *mm);
+
+/*
+ * Describe the regions of the map for another process to map them.  @regions
+ * must have room for vhd_memmap_max_memslots() entries.  Returns the number of
+ * regions.  The fds stay owned by the map.
+ */
+struct vhd_shm_region;
+unsigned vhd_memmap_get_regions(struct vhd_memory_map *mm,
+                                struct vhd_shm_region *regions);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,112 @@
+/*
+ * Bounded lock-free multi-producer multi-consumer ring of pointers.
+ *
+ * Every cell carries a sequence number telling whether it's ready to be
+ * written or read at the given ring position, so that producers and consumers
+ * only contend on their respective position counters (D. Vyukov's bounded
+ * MPMC queue).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "catomic.h"
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vhd_mpmc_cell {
+    uint64_t seq;
+    void *data;
+};
+
+struct vhd_mpmc_ring {
+    struct vhd_mpmc_cell *cells;
+    uint64_t mask;
+
+    /* keep producer and consumer positions on separate cache lines */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+};
+
+/* @size must be a power of two */
+static inline void vhd_mpmc_ring_init(struct vhd_mpmc_ring *ring,
+                                      uint64_t size)
+{
+    uint64_t i;
+
+    VHD_ASSERT(size && !(size & (size - 1)));
+
+    ring->cells = vhd_calloc(size, sizeof(ring->cells[0]));
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    for (i = 0; i < size; i++) {
+        ring->cells[i].seq = i;
+    }
+}
+
+static inline void vhd_mpmc_ring_destroy(struct vhd_mpmc_ring *ring)
+{
+    vhd_free(ring->cells);
+}
+
+/* Returns false if the ring is full */
+static inline bool vhd_mpmc_ring_push(struct vhd_mpmc_ring *ring, void *data)
+{
+    uint64_t pos = catomic_read(&ring->head);
+
+    for (;;) {
+        struct vhd_mpmc_cell *cell = &ring->cells[pos & ring->mask];
+        uint64_t seq = catomic_load_acquire(&cell->seq);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            uint64_t cur = catomic_cmpxchg(&ring->head, pos, pos + 1);
+            if (cur == pos) {
+                cell->data = data;
+                catomic_store_release(&cell->seq, pos + 1);
+                return true;
+            }
+            pos = cur;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = catomic_read(&ring->head);
+        }
+    }
+}
+
+/* Returns NULL if the ring is empty */
+static inline void *vhd_mpmc_ring_pop(struct vhd_mpmc_ring *ring)
+{
+    uint64_t pos = catomic_read(&ring->tail);
+
+    for (;;) {
+        struct vhd_mpmc_cell *cell = &ring->cells[pos & ring->mask];
+        uint64_t seq = catomic_load_acquire(&cell->seq);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+
+        if (diff == 0) {
+            uint64_t cur = catomic_cmpxchg(&ring->tail, pos, pos + 1);
+            if (cur == pos) {
+                void *data = cell->data;
+                catomic_store_release(&cell->seq, pos + ring->mask + 1);
+                return data;
+            }
+            pos = cur;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = catomic_read(&ring->tail);
+        }
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -50,6 +50,28 @@ static inline void objref_get(struct objref *objref)
     refcount_inc(&objref->refcount);
 }
 
+static inline bool refcount_inc_not_zero(unsigned long *ptr)
+{
+    unsigned long old = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+
+    do {
+        if (!old) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(ptr, &old, old + 1, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+/*
+ * Take a reference to an object found in a lookup structure which doesn't
+ * hold one itself, unless it's already being released.
+ */
+static inline bool objref_get_unless_zero(struct objref *objref)
+{
+    return refcount_inc_not_zero(&objref->refcount);
+}
+
 static inline bool refcount_dec_and_test(unsigned long *ptr)
 {
     unsigned long old = __atomic_fetch_sub(ptr, 1, __ATOMIC_RELEASE);
@@ -0,0 +1,185 @@
+/*
+ * CPU cost accounting of a thread with perf_event_open() counters
+ *
+ * The counters are opened in the thread to be counted and keep counting
+ * whatever it does, so the hot path costs nothing; they are only read, with
+ * one read() each, when the metrics are queried.  The software ones, task
+ * clock and context switches, are there on any Linux, while the hardware
+ * ones are often missing in virtual machines and are skipped then.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "vhost/types.h"
+
+#include "perf_counters.h"
+#include "logging.h"
+#include "platform.h"
+
+struct perf_counter_desc {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    uint32_t flag;
+    /* counts nothing if restricted to user space */
+    bool kernel_only;
+};
+
+enum {
+    PERF_TASK_CLOCK,
+    PERF_CONTEXT_SWITCHES,
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+};
+
+static const struct perf_counter_desc counters[] = {
+    [PERF_TASK_CLOCK] = {
+        .name = "task-clock",
+        .type = PERF_TYPE_SOFTWARE,
+        .config = PERF_COUNT_SW_TASK_CLOCK,
+        .flag = VHD_RQ_PERF_TASK_CLOCK,
+    },
+    [PERF_CONTEXT_SWITCHES] = {
+        .name = "context-switches",
+        .type = PERF_TYPE_SOFTWARE,
+        .config = PERF_COUNT_SW_CONTEXT_SWITCHES,
+        .flag = VHD_RQ_PERF_CONTEXT_SWITCHES,
+        .kernel_only = true,
+    },
+    [PERF_CYCLES] = {
+        .name = "cycles",
+        .type = PERF_TYPE_HARDWARE,
+        .config = PERF_COUNT_HW_CPU_CYCLES,
+        .flag = VHD_RQ_PERF_CYCLES,
+    },
+    [PERF_INSTRUCTIONS] = {
+        .name = "instructions",
+        .type = PERF_TYPE_HARDWARE,
+        .config = PERF_COUNT_HW_INSTRUCTIONS,
+        .flag = VHD_RQ_PERF_INSTRUCTIONS,
+    },
+    [PERF_CACHE_MISSES] = {
+        .name = "cache-misses",
+        .type = PERF_TYPE_HARDWARE,
+        .config = PERF_COUNT_HW_CACHE_MISSES,
+        .flag = VHD_RQ_PERF_CACHE_MISSES,
+    },
+};
+
+struct vhd_perf_counters {
+    int fds[countof(counters)];
+    uint32_t flags;
+};
+
+static int perf_event_open(struct perf_event_attr *attr)
+{
+    /* the calling thread, on any cpu */
+    return syscall(SYS_perf_event_open, attr, 0, -1, -1,
+                   PERF_FLAG_FD_CLOEXEC);
+}
+
+static int open_counter(const struct perf_counter_desc *desc, bool *user_only)
+{
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = desc->type,
+        .config = desc->config,
+        .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING,
+    };
+    int fd;
+
+    fd = perf_event_open(&attr);
+    if (fd >= 0 || desc->kernel_only || (errno != EACCES && errno != EPERM)) {
+        return fd;
+    }
+
+    /* perf_event_paranoid > 1 only lets unprivileged users count user space */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = perf_event_open(&attr);
+    if (fd >= 0) {
+        *user_only = true;
+    }
+    return fd;
+}
+
+struct vhd_perf_counters *vhd_perf_counters_open(void)
+{
+    struct vhd_perf_counters *pc = vhd_zalloc(sizeof(*pc));
+    bool user_only = false;
+    size_t i;
+
+    for (i = 0; i < countof(counters); i++) {
+        pc->fds[i] = open_counter(&counters[i], &user_only);
+        if (pc->fds[i] < 0) {
+            VHD_LOG_INFO("perf counter %s unavailable: %s", counters[i].name,
+                         strerror(errno));
+            continue;
+        }
+        pc->flags |= counters[i].flag;
+    }
+
+    if (!pc->flags) {
+        vhd_free(pc);
+        return NULL;
+    }
+
+    if (user_only) {
+        pc->flags |= VHD_RQ_PERF_USER_ONLY;
+    }
+    return pc;
+}
+
+void vhd_perf_counters_close(struct vhd_perf_counters *pc)
+{
+    size_t i;
+
+    for (i = 0; i < countof(counters); i++) {
+        if (pc->fds[i] >= 0) {
+            close(pc->fds[i]);
+        }
+    }
+    vhd_free(pc);
+}
+
+static uint64_t read_counter(int fd)
+{
+    /* value, time enabled, time running */
+    uint64_t buf[3];
+
+    if (read(fd, buf, sizeof(buf)) != sizeof(buf) || !buf[2]) {
+        return 0;
+    }
+
+    /* the pmu was shared with other events, extrapolate */
+    if (buf[2] < buf[1]) {
+        return (double)buf[0] * buf[1] / buf[2];
+    }
+    return buf[0];
+}
+
+void vhd_perf_counters_read(struct vhd_perf_counters *pc,
+                            struct vhd_rq_metrics *metrics)
+{
+    uint64_t values[countof(counters)] = {};
+    size_t i;
+
+    for (i = 0; i < countof(counters); i++) {
+        if (pc->fds[i] >= 0) {
+            values[i] = read_counter(pc->fds[i]);
+        }
+    }
+
+    metrics->perf_flags = pc->flags;
+    metrics->perf_task_clock_ns = values[PERF_TASK_CLOCK];
+    metrics->perf_context_switches = values[PERF_CONTEXT_SWITCHES];
+    metrics->perf_cycles = values[PERF_CYCLES];
+    metrics->perf_instructions = values[PERF_INSTRUCTIONS];
+    metrics->perf_cache_misses = values[PERF_CACHE_MISSES];
+}
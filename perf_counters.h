@@ -0,0 +1,31 @@
+/*
+ * CPU cost accounting of a thread with perf_event_open() counters
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vhd_perf_counters;
+struct vhd_rq_metrics;
+
+/*
+ * Start counting the CPU cost of the calling thread.  Returns NULL if none of
+ * the counters can be opened.
+ */
+struct vhd_perf_counters *vhd_perf_counters_open(void);
+
+void vhd_perf_counters_close(struct vhd_perf_counters *pc);
+
+/*
+ * Fill the perf_* fields of @metrics with the current counter values.  May be
+ * called in any thread, including after the counted one has exited.
+ */
+void vhd_perf_counters_read(struct vhd_perf_counters *pc,
+                            struct vhd_rq_metrics *metrics);
+
+#ifdef __cplusplus
+}
+#endif
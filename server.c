@@ -1,10 +1,16 @@
 #include <pthread.h>
+#include <semaphore.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "platform.h"
 #include "server_internal.h"
 #include "queue.h"
 #include "bio.h"
 #include "logging.h"
+#include "mpmc_ring.h"
+#include "perf_counters.h"
 #include "vdev.h"
 
 #define VHOST_EVENT_LOOP_EVENTS 128
@@ -94,18 +100,225 @@ int vhd_submit_ctl_work_and_wait(void (*func)(struct vhd_work *, void *),
 
 typedef SLIST_HEAD(, vhd_io) vhd_io_list;
 
-/* TODO: bounded queue */
+/*
+ * Power-of-two array of requests addressed by free-running positions, only
+ * accessed in the request queue thread.  Used as a FIFO for submission, and
+ * for in-flight tracking where requests leave in arbitrary order: an indexed
+ * ring records the positions in the requests, the completed ones leave holes,
+ * and the oldest request is the one at ->tail once the holes there are
+ * skipped.  When the positions run up against the end of the array, the
+ * holes are squeezed out in place if there are enough of them, or the array
+ * is doubled otherwise: the number of requests a queue holds is only bounded
+ * by the vrings attached to it, which are up to the guest.
+ */
+struct rq_ring_slot {
+    struct vhd_io *io;
+    time_t ts;
+};
+
+struct rq_ring {
+    struct rq_ring_slot *slots;
+    uint32_t mask;
+    /* position to put the next request at */
+    uint32_t head;
+    /* position of the oldest request */
+    uint32_t tail;
+    /* #requests in the ring, less than head - tail if there are holes */
+    uint32_t count;
+    /* whether the positions are recorded in the requests */
+    bool indexed;
+};
+
+#define RQ_RING_INITIAL_SIZE 256
+
+static void rq_ring_init(struct rq_ring *ring, bool indexed)
+{
+    ring->slots = vhd_calloc(RQ_RING_INITIAL_SIZE, sizeof(ring->slots[0]));
+    ring->mask = RQ_RING_INITIAL_SIZE - 1;
+    ring->head = ring->tail = ring->count = 0;
+    ring->indexed = indexed;
+}
+
+static void rq_ring_destroy(struct rq_ring *ring)
+{
+    vhd_free(ring->slots);
+}
+
+static bool rq_ring_empty(const struct rq_ring *ring)
+{
+    return ring->head == ring->tail;
+}
+
+static struct rq_ring_slot *rq_ring_slot(const struct rq_ring *ring,
+                                         uint32_t pos)
+{
+    return &ring->slots[pos & ring->mask];
+}
+
+static void rq_ring_skip_holes(struct rq_ring *ring)
+{
+    while (!rq_ring_empty(ring) && !rq_ring_slot(ring, ring->tail)->io) {
+        ring->tail++;
+    }
+}
+
+/*
+ * Move the requests for which @drop returns false down to close the gaps
+ * left by the holes and the dropped ones, keeping their order and updating
+ * the positions recorded in them.  The dropped requests are chained to @out,
+ * most recent first.
+ */
+static void rq_ring_squeeze(struct rq_ring *ring,
+                            bool (*drop)(struct vhd_io *io, const void *arg),
+                            const void *arg, vhd_io_list *out)
+{
+    uint32_t pos, new_head = ring->tail;
+
+    for (pos = ring->tail; pos != ring->head; pos++) {
+        struct rq_ring_slot slot = *rq_ring_slot(ring, pos);
+        if (!slot.io) {
+            continue;
+        }
+        if (drop && unlikely(drop(slot.io, arg))) {
+            ring->count--;
+            SLIST_INSERT_HEAD(out, slot.io, completion_link);
+            continue;
+        }
+        if (ring->indexed) {
+            slot.io->inflight_pos = new_head;
+        }
+        *rq_ring_slot(ring, new_head) = slot;
+        new_head++;
+    }
+
+    for (pos = new_head; pos != ring->head; pos++) {
+        rq_ring_slot(ring, pos)->io = NULL;
+    }
+    ring->head = new_head;
+}
+
+/*
+ * Double the array.  The positions are free-running, so the requests keep
+ * theirs and only move to the slots those map to with the wider mask.
+ */
+static void rq_ring_grow(struct rq_ring *ring)
+{
+    uint32_t new_size = (ring->mask + 1) * 2;
+    struct rq_ring_slot *slots = vhd_calloc(new_size, sizeof(slots[0]));
+    uint32_t pos;
+
+    for (pos = ring->tail; pos != ring->head; pos++) {
+        slots[pos & (new_size - 1)] = *rq_ring_slot(ring, pos);
+    }
+
+    vhd_free(ring->slots);
+    ring->slots = slots;
+    ring->mask = new_size - 1;
+}
+
+static void rq_ring_push(struct rq_ring *ring, struct vhd_io *io, time_t ts)
+{
+    if (unlikely(ring->head - ring->tail > ring->mask)) {
+        /* squeezing less than half of the array out isn't worth it */
+        if (ring->count > ring->mask / 2) {
+            rq_ring_grow(ring);
+        } else {
+            rq_ring_squeeze(ring, NULL, NULL, NULL);
+        }
+    }
+
+    if (ring->indexed) {
+        io->inflight_pos = ring->head;
+    }
+    *rq_ring_slot(ring, ring->head) = (struct rq_ring_slot) {
+        .io = io,
+        .ts = ts,
+    };
+    ring->head++;
+    ring->count++;
+}
+
+/* Remove @io from an indexed ring */
+static void rq_ring_remove(struct rq_ring *ring, struct vhd_io *io)
+{
+    struct rq_ring_slot *slot = rq_ring_slot(ring, io->inflight_pos);
+
+    VHD_ASSERT(ring->indexed && slot->io == io);
+    slot->io = NULL;
+    ring->count--;
+    if (io->inflight_pos == ring->tail) {
+        rq_ring_skip_holes(ring);
+    }
+}
+
+static struct vhd_io *rq_ring_first(const struct rq_ring *ring)
+{
+    return rq_ring_empty(ring) ? NULL : rq_ring_slot(ring, ring->tail)->io;
+}
+
+/* Take the oldest request out of a non-indexed ring, which has no holes */
+static struct vhd_io *rq_ring_pop(struct rq_ring *ring)
+{
+    struct vhd_io *io = rq_ring_first(ring);
+
+    if (io) {
+        VHD_ASSERT(!ring->indexed);
+        ring->tail++;
+        ring->count--;
+    }
+    return io;
+}
+
+/* timestamp of the oldest request, 0 if none */
+static time_t rq_ring_oldest_ts(const struct rq_ring *ring)
+{
+    return rq_ring_empty(ring) ? 0 : rq_ring_slot(ring, ring->tail)->ts;
+}
+
 struct vhd_request_queue {
     struct vhd_event_loop *evloop;
 
-    TAILQ_HEAD(, vhd_io) submission;
-    TAILQ_HEAD(, vhd_io) inflight;
+    struct rq_ring submission;
+    struct rq_ring inflight;
     vhd_io_list completion;
 
     struct vhd_bh *completion_bh;
     struct vhd_rq_metrics metrics;
+
+    /*
+     * In multi-consumer mode the requests are handed over to the backend
+     * through @ring, and @submission only holds the overflow when the ring is
+     * full; it's moved into the ring by @refill_bh once the consumers make
+     * room.  The requests are put on @inflight right on enqueue as the
+     * consumers can't touch it.
+     */
+    bool mpmc;
+    struct vhd_mpmc_ring ring;
+    struct vhd_bh *refill_bh;
+    bool overflow;
+    /* room to take everything out of @ring when cancelling requests */
+    struct vhd_io **ring_scratch;
+
+    /* pool this queue belongs to, if any, and the NUMA node of its thread */
+    struct vhd_rq_pool *pool;
+    int numa_node;
+
+    /* block requests go to another process through it if attached */
+    struct vhd_shm_channel *shm_channel;
+
+    /* CPU cost of the queue thread, read by vhd_get_rq_stat() in any thread */
+    struct vhd_perf_counters *perf;
 };
 
+/*
+ * Counters only updated in the request queue thread don't need a locked
+ * increment; just make sure the readers never see a torn value.
+ */
+static inline void rq_stat_inc(uint64_t *counter)
+{
+    catomic_set(counter, *counter + 1);
+}
+
 void vhd_run_in_rq(struct vhd_request_queue *rq, void (*cb)(void *),
                    void *opaque)
 {
@@ -120,10 +333,36 @@ static void req_complete(struct vhd_io *io)
     vhd_vring_dec_in_flight(vring);
 }
 
+/* most vrings polled for new requests after a batch of completions */
+#define RQ_POLL_MAX_VRINGS  8
+
+/*
+ * Remember @vring to poll once the batch is complete, keeping it from being
+ * reported drained, and thus released, until then.
+ */
+static void rq_poll_add(struct vhd_vring **vrings, unsigned *num,
+                        struct vhd_vring *vring)
+{
+    unsigned i;
+
+    for (i = 0; i < *num; i++) {
+        if (vrings[i] == vring) {
+            return;
+        }
+    }
+
+    if (*num < RQ_POLL_MAX_VRINGS) {
+        vhd_vring_inc_in_flight(vring);
+        vrings[(*num)++] = vring;
+    }
+}
+
 static void rq_complete_bh(void *opaque)
 {
     struct vhd_request_queue *rq = opaque;
     vhd_io_list io_list, io_list_reverse;
+    struct vhd_vring *poll_vrings[RQ_POLL_MAX_VRINGS];
+    unsigned i, num_poll_vrings = 0;
 
     SLIST_INIT(&io_list);
     SLIST_INIT(&io_list_reverse);
@@ -146,18 +385,38 @@ static void rq_complete_bh(void *opaque)
             break;
         }
         SLIST_REMOVE_HEAD(&io_list, completion_link);
-        TAILQ_REMOVE(&rq->inflight, io, inflight_link);
+        rq_ring_remove(&rq->inflight, io);
+        rq_poll_add(poll_vrings, &num_poll_vrings, io->vring);
         req_complete(io);
         ++rq->metrics.completed;
     }
 
-    struct vhd_io *io = TAILQ_FIRST(&rq->inflight);
-    rq->metrics.oldest_inflight_ts = io ? io->ts : 0;
+    for (i = 0; i < num_poll_vrings; i++) {
+        vhd_vring_poll_avail(poll_vrings[i]);
+        vhd_vring_dec_in_flight(poll_vrings[i]);
+    }
+
+    rq->metrics.oldest_inflight_ts = rq_ring_oldest_ts(&rq->inflight);
+}
+
+static void rq_refill_bh(void *opaque)
+{
+    struct vhd_request_queue *rq = opaque;
+    struct vhd_io *io;
+
+    while ((io = rq_ring_first(&rq->submission))) {
+        if (!vhd_mpmc_ring_push(&rq->ring, io)) {
+            return;
+        }
+        rq_ring_pop(&rq->submission);
+    }
+
+    catomic_set(&rq->overflow, false);
 }
 
 struct vhd_request_queue *vhd_create_request_queue(void)
 {
-    struct vhd_request_queue *rq = vhd_alloc(sizeof(*rq));
+    struct vhd_request_queue *rq = vhd_zalloc(sizeof(*rq));
 
     rq->evloop = vhd_create_event_loop(VHD_EVENT_LOOP_DEFAULT_MAX_EVENTS);
     if (!rq->evloop) {
@@ -165,21 +424,55 @@ struct vhd_request_queue *vhd_create_request_queue(void)
         return NULL;
     }
 
-    TAILQ_INIT(&rq->submission);
-    TAILQ_INIT(&rq->inflight);
+    rq_ring_init(&rq->submission, false);
+    rq_ring_init(&rq->inflight, true);
     SLIST_INIT(&rq->completion);
     rq->completion_bh = vhd_bh_new(rq->evloop, rq_complete_bh, rq);
     memset(&rq->metrics, 0, sizeof(rq->metrics));
+    rq->pool = NULL;
+    rq->numa_node = -1;
+    return rq;
+}
+
+struct vhd_request_queue *vhd_create_request_queue_mpmc(uint32_t capacity)
+{
+    struct vhd_request_queue *rq;
+
+    if (!capacity || (capacity & (capacity - 1))) {
+        VHD_LOG_ERROR("ring capacity %u is not a power of two", capacity);
+        return NULL;
+    }
+
+    rq = vhd_create_request_queue();
+    if (!rq) {
+        return NULL;
+    }
+
+    rq->mpmc = true;
+    vhd_mpmc_ring_init(&rq->ring, capacity);
+    rq->ring_scratch = vhd_calloc(capacity, sizeof(rq->ring_scratch[0]));
+    rq->refill_bh = vhd_bh_new(rq->evloop, rq_refill_bh, rq);
     return rq;
 }
 
 void vhd_release_request_queue(struct vhd_request_queue *rq)
 {
-    assert(TAILQ_EMPTY(&rq->submission));
-    assert(TAILQ_EMPTY(&rq->inflight));
+    assert(rq_ring_empty(&rq->submission));
+    assert(rq_ring_empty(&rq->inflight));
     assert(SLIST_EMPTY(&rq->completion));
+    if (rq->mpmc) {
+        assert(!vhd_mpmc_ring_pop(&rq->ring));
+        vhd_mpmc_ring_destroy(&rq->ring);
+        vhd_free(rq->ring_scratch);
+        vhd_bh_delete(rq->refill_bh);
+    }
+    if (rq->perf) {
+        vhd_perf_counters_close(rq->perf);
+    }
     vhd_bh_delete(rq->completion_bh);
     vhd_free_event_loop(rq->evloop);
+    rq_ring_destroy(&rq->submission);
+    rq_ring_destroy(&rq->inflight);
     vhd_free(rq);
 }
 
@@ -200,57 +493,205 @@ void vhd_stop_queue(struct vhd_request_queue *rq)
     vhd_terminate_event_loop(rq->evloop);
 }
 
-bool vhd_dequeue_request(struct vhd_request_queue *rq,
-                         struct vhd_request *out_req)
+static bool dequeue_request_mpmc(struct vhd_request_queue *rq,
+                                 struct vhd_request *out_req)
 {
-    struct vhd_io *io = TAILQ_FIRST(&rq->submission);
+    struct vhd_io *io = vhd_mpmc_ring_pop(&rq->ring);
 
     if (!io) {
         return false;
     }
 
-    TAILQ_REMOVE(&rq->submission, io, submission_link);
+    if (catomic_read(&rq->overflow)) {
+        vhd_bh_schedule(rq->refill_bh);
+    }
+
+    out_req->vdev = io->vring->vdev;
+    out_req->io = io;
+
+    catomic_inc(&rq->metrics.dequeued);
+    return true;
+}
 
+static void mark_inflight(struct vhd_request_queue *rq, struct vhd_io *io)
+{
     time_t now = time(NULL);
-    io->ts = now;
-    TAILQ_INSERT_TAIL(&rq->inflight, io, inflight_link);
+
+    rq_ring_push(&rq->inflight, io, now);
     if (!rq->metrics.oldest_inflight_ts) {
         rq->metrics.oldest_inflight_ts = now;
     }
+}
+
+bool vhd_dequeue_request(struct vhd_request_queue *rq,
+                         struct vhd_request *out_req)
+{
+    struct vhd_io *io;
+
+    if (rq->mpmc) {
+        return dequeue_request_mpmc(rq, out_req);
+    }
+
+    io = rq_ring_pop(&rq->submission);
+    if (!io) {
+        return false;
+    }
+
+    mark_inflight(rq, io);
 
     out_req->vdev = io->vring->vdev;
     out_req->io = io;
 
-    catomic_inc(&rq->metrics.dequeued);
+    rq_stat_inc(&rq->metrics.dequeued);
     return true;
 }
 
+static void enqueue_request_mpmc(struct vhd_request_queue *rq,
+                                 struct vhd_io *io)
+{
+    mark_inflight(rq, io);
+
+    /* preserve the order: once overflown, go via the overflow ring */
+    if (!rq->overflow && vhd_mpmc_ring_push(&rq->ring, io)) {
+        return;
+    }
+
+    rq_ring_push(&rq->submission, io, 0);
+    rq_stat_inc(&rq->metrics.overflowed);
+    if (!rq->overflow) {
+        catomic_set(&rq->overflow, true);
+        /* consumers may have drained the ring before seeing the flag */
+        vhd_bh_schedule(rq->refill_bh);
+    }
+}
+
 int vhd_enqueue_request(struct vhd_request_queue *rq, struct vhd_io *io)
 {
     vhd_vring_inc_in_flight(io->vring);
 
-    TAILQ_INSERT_TAIL(&rq->submission, io, submission_link);
-    catomic_inc(&rq->metrics.enqueued);
+    if (rq->mpmc) {
+        enqueue_request_mpmc(rq, io);
+    } else {
+        rq_ring_push(&rq->submission, io, 0);
+    }
+    rq_stat_inc(&rq->metrics.enqueued);
     return 0;
 }
 
-void vhd_cancel_queued_requests(struct vhd_request_queue *rq,
-                                const struct vhd_vring *vring)
+void vhd_start_request(struct vhd_request_queue *rq, struct vhd_io *io)
+{
+    vhd_vring_inc_in_flight(io->vring);
+    mark_inflight(rq, io);
+    rq_stat_inc(&rq->metrics.enqueued);
+    catomic_inc(&rq->metrics.dequeued);
+}
+
+void vhd_rq_timer_init(struct vhd_request_queue *rq, struct vhd_timer *timer,
+                       void (*cb)(void *), void *opaque)
+{
+    vhd_timer_init(timer, rq->evloop, cb, opaque);
+}
+
+struct vhd_bh *vhd_rq_bh_new(struct vhd_request_queue *rq,
+                             void (*cb)(void *), void *opaque)
+{
+    return vhd_bh_new(rq->evloop, cb, opaque);
+}
+
+int vhd_submit_rq_work_and_wait(struct vhd_request_queue *rq,
+                                void (*func)(struct vhd_work *, void *),
+                                void *opaque)
+{
+    return vhd_submit_work_and_wait(rq->evloop, func, opaque);
+}
+
+struct vhd_shm_channel *vhd_rq_get_shm_channel(struct vhd_request_queue *rq)
 {
-    struct vhd_io *io = TAILQ_FIRST(&rq->submission);
+    return rq->shm_channel;
+}
 
-    while (io) {
-        struct vhd_io *next = TAILQ_NEXT(io, submission_link);
+void vhd_rq_set_shm_channel(struct vhd_request_queue *rq,
+                            struct vhd_shm_channel *ch)
+{
+    rq->shm_channel = ch;
+}
+
+static void cancel_requests(struct vhd_request_queue *rq,
+                            vhd_io_list *canceled)
+{
+    vhd_io_list io_list;
+    struct vhd_io *io;
+
+    /* the list was filled LIFO, cancel FIFO */
+    SLIST_INIT(&io_list);
+    while ((io = SLIST_FIRST(canceled))) {
+        SLIST_REMOVE_HEAD(canceled, completion_link);
+        SLIST_INSERT_HEAD(&io_list, io, completion_link);
+    }
+
+    while ((io = SLIST_FIRST(&io_list))) {
+        SLIST_REMOVE_HEAD(&io_list, completion_link);
+        if (rq->mpmc) {
+            rq_ring_remove(&rq->inflight, io);
+        }
+        io->status = VHD_BDEV_CANCELED;
+        req_complete(io);
+        catomic_inc(&rq->metrics.cancelled);
+    }
+}
+
+/*
+ * The handover ring doesn't allow removal from the middle, so take
+ * everything out of it and put back the requests of other vrings.  This runs
+ * in the only producer, so everything fits in the scratch array sized as the
+ * ring, and there's certainly room to put them back; the consumers racing
+ * with us just see a shorter ring for a while.
+ */
+static void cancel_handover_requests(struct vhd_request_queue *rq,
+                                     const struct vhd_vring *vring,
+                                     vhd_io_list *canceled)
+{
+    struct vhd_io *io;
+    uint32_t i, num_keep = 0;
+
+    while ((io = vhd_mpmc_ring_pop(&rq->ring))) {
         if (unlikely(io->vring == vring)) {
-            TAILQ_REMOVE(&rq->submission, io, submission_link);
-            io->status = VHD_BDEV_CANCELED;
-            req_complete(io);
-            catomic_inc(&rq->metrics.cancelled);
+            SLIST_INSERT_HEAD(canceled, io, completion_link);
+        } else {
+            rq->ring_scratch[num_keep++] = io;
         }
-        io = next;
+    }
+
+    for (i = 0; i < num_keep; i++) {
+        VHD_VERIFY(vhd_mpmc_ring_push(&rq->ring, rq->ring_scratch[i]));
     }
 }
 
+static bool io_of_vring(struct vhd_io *io, const void *vring)
+{
+    return io->vring == vring;
+}
+
+void vhd_cancel_queued_requests(struct vhd_request_queue *rq,
+                                const struct vhd_vring *vring)
+{
+    vhd_io_list canceled = SLIST_HEAD_INITIALIZER(canceled);
+
+    if (rq->mpmc) {
+        cancel_handover_requests(rq, vring, &canceled);
+    }
+    rq_ring_squeeze(&rq->submission, io_of_vring, vring, &canceled);
+    if (rq->mpmc && rq->overflow) {
+        /*
+         * the overflow may be all gone, and with the ring drained nobody
+         * would ever refill it and clear the flag the new requests queue on
+         */
+        rq_refill_bh(rq);
+    }
+
+    cancel_requests(rq, &canceled);
+}
+
 /*
  * can be called from arbitrary thread; will schedule completion on the rq
  * event loop
@@ -275,5 +716,303 @@ void vhd_complete_bio(struct vhd_io *io, enum vhd_bdev_io_result status)
 void vhd_get_rq_stat(struct vhd_request_queue *rq,
                      struct vhd_rq_metrics *metrics)
 {
+    struct vhd_perf_counters *perf = catomic_load_acquire(&rq->perf);
+
     *metrics = rq->metrics;
+    if (perf) {
+        vhd_perf_counters_read(perf, metrics);
+    }
+}
+
+static void enable_perf_work(struct vhd_work *work, void *opaque)
+{
+    struct vhd_request_queue *rq = opaque;
+    struct vhd_perf_counters *perf;
+
+    if (rq->perf) {
+        vhd_complete_work(work, 0);
+        return;
+    }
+
+    /* the counters follow the thread that opens them */
+    perf = vhd_perf_counters_open();
+    if (!perf) {
+        vhd_complete_work(work, -ENOTSUP);
+        return;
+    }
+
+    catomic_store_release(&rq->perf, perf);
+    vhd_complete_work(work, 0);
+}
+
+int vhd_rq_enable_perf_counters(struct vhd_request_queue *rq)
+{
+    return vhd_submit_rq_work_and_wait(rq, enable_perf_work, rq);
+}
+
+int vhd_rq_get_numa_node(struct vhd_request_queue *rq)
+{
+    return rq->numa_node;
+}
+
+/*////////////////////////////////////////////////////////////////////////////*/
+
+/*
+ * Request queue pools
+ */
+
+struct vhd_rq_pool_thread {
+    struct vhd_rq_pool *pool;
+    struct vhd_request_queue *rq;
+    pthread_t thread;
+    int cpu;
+    int numa_node;
+    sem_t started;
+};
+
+struct vhd_rq_pool {
+    void (*process)(struct vhd_request_queue *rq, void *opaque);
+    void *opaque;
+
+    int num_rqs;
+    struct vhd_request_queue **rqs;
+    struct vhd_rq_pool_thread *threads;
+
+    /*
+     * Where to continue handing out the queues local to a node, for the
+     * devices moved there to spread over them rather than pile up on the
+     * first one
+     */
+    unsigned next_local;
+};
+
+/* The cpu directory in sysfs has a "nodeN" link to the node it belongs to */
+static int cpu_to_numa_node(int cpu)
+{
+    char path[64];
+    struct dirent *de;
+    DIR *dir;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    while ((de = readdir(dir))) {
+        if (sscanf(de->d_name, "node%d", &node) == 1) {
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+/*
+ * Make all further allocations of the calling thread prefer @node, so that
+ * the queue, its event loop and the requests created in its context are
+ * local to the cpu serving them.
+ */
+static void bind_thread_memory(int node)
+{
+    unsigned long nodemask[4] = { 0 };
+    unsigned long bits = sizeof(unsigned long) * 8;
+
+    if (node < 0 || (size_t)node >= sizeof(nodemask) * 8) {
+        return;
+    }
+
+    nodemask[node / bits] = 1UL << (node % bits);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+                sizeof(nodemask) * 8 + 1) < 0) {
+        VHD_LOG_WARN("set_mempolicy(node %d): %s", node, strerror(errno));
+    }
+}
+
+static void *rq_pool_thread_func(void *opaque)
+{
+    struct vhd_rq_pool_thread *t = opaque;
+    struct vhd_rq_pool *pool = t->pool;
+    struct vhd_request_queue *rq;
+    int res;
+
+    bind_thread_memory(t->numa_node);
+
+    rq = vhd_create_request_queue();
+    if (rq) {
+        rq->pool = pool;
+        rq->numa_node = t->numa_node;
+    }
+    t->rq = rq;
+    sem_post(&t->started);
+
+    if (!rq) {
+        return NULL;
+    }
+
+    do {
+        res = vhd_run_queue(rq);
+        if (pool->process) {
+            pool->process(rq, pool->opaque);
+        }
+    } while (res == -EAGAIN);
+
+    if (res < 0) {
+        VHD_LOG_ERROR("request queue pool thread failed: %d", res);
+    }
+
+    return NULL;
+}
+
+static int rq_pool_start_thread(struct vhd_rq_pool_thread *t)
+{
+    pthread_attr_t attr;
+    int ret;
+
+    ret = pthread_attr_init(&attr);
+    if (ret) {
+        return -ret;
+    }
+
+    if (t->cpu >= 0) {
+        cpu_set_t cpuset;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(t->cpu, &cpuset);
+        ret = pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        if (ret) {
+            VHD_LOG_ERROR("can't pin to cpu %d: %s", t->cpu, strerror(ret));
+            goto out;
+        }
+    }
+
+    sem_init(&t->started, 0, 0);
+    ret = pthread_create(&t->thread, &attr, rq_pool_thread_func, t);
+    if (ret) {
+        VHD_LOG_ERROR("failed to start request queue thread: %s",
+                      strerror(ret));
+        sem_destroy(&t->started);
+        goto out;
+    }
+
+    sem_wait(&t->started);
+    sem_destroy(&t->started);
+
+    if (!t->rq) {
+        pthread_join(t->thread, NULL);
+        ret = ENOMEM;
+    }
+
+out:
+    pthread_attr_destroy(&attr);
+    return -ret;
+}
+
+static void rq_pool_stop_thread(struct vhd_rq_pool_thread *t)
+{
+    vhd_stop_queue(t->rq);
+    pthread_join(t->thread, NULL);
+    vhd_release_request_queue(t->rq);
+}
+
+struct vhd_rq_pool *vhd_create_rq_pool(const struct vhd_rq_pool_config *cfg)
+{
+    struct vhd_rq_pool *pool;
+    int i, ret;
+
+    if (cfg->num_rqs < 1 || cfg->num_rqs > VHD_MAX_REQUEST_QUEUES ||
+        (cfg->cpus && cfg->num_cpus < 1)) {
+        VHD_LOG_ERROR("invalid request queue pool configuration");
+        return NULL;
+    }
+
+    pool = vhd_zalloc(sizeof(*pool));
+    pool->process = cfg->process;
+    pool->opaque = cfg->opaque;
+    pool->rqs = vhd_calloc(cfg->num_rqs, sizeof(pool->rqs[0]));
+    pool->threads = vhd_calloc(cfg->num_rqs, sizeof(pool->threads[0]));
+
+    for (i = 0; i < cfg->num_rqs; i++) {
+        struct vhd_rq_pool_thread *t = &pool->threads[i];
+
+        t->pool = pool;
+        t->cpu = cfg->cpus ? cfg->cpus[i % cfg->num_cpus] : -1;
+        t->numa_node = t->cpu >= 0 ? cpu_to_numa_node(t->cpu) : -1;
+
+        ret = rq_pool_start_thread(t);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        pool->rqs[i] = t->rq;
+        pool->num_rqs++;
+
+        VHD_LOG_INFO("request queue %d: cpu %d, numa node %d", i, t->cpu,
+                     t->numa_node);
+    }
+
+    return pool;
+
+fail:
+    vhd_release_rq_pool(pool);
+    return NULL;
+}
+
+void vhd_release_rq_pool(struct vhd_rq_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->num_rqs; i++) {
+        rq_pool_stop_thread(&pool->threads[i]);
+    }
+
+    vhd_free(pool->threads);
+    vhd_free(pool->rqs);
+    vhd_free(pool);
+}
+
+int vhd_rq_pool_get_rqs(struct vhd_rq_pool *pool,
+                        struct vhd_request_queue ***rqs)
+{
+    *rqs = pool->rqs;
+    return pool->num_rqs;
+}
+
+void vhd_rqs_place_on_numa_node(struct vhd_request_queue **rqs, int num_rqs,
+                                int node)
+{
+    struct vhd_rq_pool *pool = rqs[0]->pool;
+    struct vhd_request_queue *local[VHD_MAX_REQUEST_QUEUES];
+    int num_local = 0;
+    int i;
+
+    if (!pool || node < 0) {
+        return;
+    }
+
+    /* only queues all coming from the same pool are interchangeable */
+    for (i = 0; i < num_rqs; i++) {
+        if (rqs[i]->pool != pool) {
+            return;
+        }
+    }
+
+    for (i = 0; i < pool->num_rqs; i++) {
+        if (pool->rqs[i]->numa_node == node) {
+            local[num_local++] = pool->rqs[i];
+        }
+    }
+
+    if (!num_local) {
+        return;
+    }
+
+    /* keep the spread the caller chose over the queues already local */
+    for (i = 0; i < num_rqs; i++) {
+        if (rqs[i]->numa_node != node) {
+            rqs[i] = local[pool->next_local++ % num_local];
+        }
+    }
 }
@@ -2,6 +2,10 @@
 
 #include "vhost/server.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct vhd_io_handler;
 /* Add io handler to vhost control event loop */
 struct vhd_io_handler *vhd_add_vhost_io_handler(int fd, int (*read)(void *),
@@ -26,12 +30,60 @@ int vhd_enqueue_request(struct vhd_request_queue *rq,
 void vhd_cancel_queued_requests(struct vhd_request_queue *rq,
                                 const struct vhd_vring *vring);
 
+/**
+ * Account IO request as dispatched for handling right away, bypassing the
+ * queue, for requests served by the library itself in the request queue
+ * thread.  They are completed with vhd_complete_bio() as usual.
+ */
+void vhd_start_request(struct vhd_request_queue *rq, struct vhd_io *io);
+
+struct vhd_timer;
+/*
+ * Init timer to run in request queue
+ */
+void vhd_rq_timer_init(struct vhd_request_queue *rq, struct vhd_timer *timer,
+                       void (*cb)(void *), void *opaque);
+
+struct vhd_bh;
+/*
+ * Create bottom half to run in request queue
+ */
+struct vhd_bh *vhd_rq_bh_new(struct vhd_request_queue *rq,
+                             void (*cb)(void *), void *opaque);
+
+/*
+ * Submit a work item onto request queue and wait till it's finished.  Must not
+ * be called in the request queue thread.
+ */
+struct vhd_work;
+int vhd_submit_rq_work_and_wait(struct vhd_request_queue *rq,
+                                void (*func)(struct vhd_work *, void *),
+                                void *opaque);
+
+/*
+ * Shared memory channel exporting block requests of the request queue, if
+ * any.  Only set and read in the request queue thread.
+ */
+struct vhd_shm_channel;
+struct vhd_shm_channel *vhd_rq_get_shm_channel(struct vhd_request_queue *rq);
+void vhd_rq_set_shm_channel(struct vhd_request_queue *rq,
+                            struct vhd_shm_channel *ch);
+
 /**
  * Run callback in request queue
  */
 void vhd_run_in_rq(struct vhd_request_queue *rq, void (*cb)(void *),
                    void *opaque);
 
+/*
+ * Replace the request queues in @rqs that aren't local to NUMA @node with the
+ * ones from the same pool that are, if there are any, taking turns over those
+ * across calls.  Queues that don't come from a pool are left untouched.
+ * @rqs is rewritten, so pass a copy of the array the device was given.
+ */
+void vhd_rqs_place_on_numa_node(struct vhd_request_queue **rqs, int num_rqs,
+                                int node);
+
 /*
  * Run callback in vhost control event loop
  */
@@ -41,6 +93,9 @@ void vhd_run_in_ctl(void (*cb)(void *), void *opaque);
  * Submit a work item onto vhost control event loop and wait till it's
  * finished.
  */
-struct vhd_work;
 int vhd_submit_ctl_work_and_wait(void (*func)(struct vhd_work *, void *),
                                  void *opaque);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,366 @@
+/*
+ * Virtio dataplane microbenchmark
+ *
+ * Plays the guest with a synthetic split virtqueue driver and pumps batches of
+ * requests through virtq_dequeue_many(), the virtio-blk or virtio-fs request
+ * parsing, a request queue and virtq_push(), completing them in a null
+ * backend.  Runs offline, in a single thread, without QEMU or a guest.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vhost/blockdev.h"
+#include "vhost/fs.h"
+#include "vhost/server.h"
+#include "server_internal.h"
+#include "vdev.h"
+#include "virtio/virtio_blk.h"
+#include "virtio/virtio_blk_spec.h"
+#include "virtio/virtio_fs.h"
+#include "virtio/virtio_fs_spec.h"
+#include "test_utils.h"
+#include "virtq_driver.h"
+
+/* FUSE opcodes of the requests the fs device is fed with */
+#define BENCH_FUSE_READ     15
+#define BENCH_FUSE_WRITE    16
+
+enum bench_device {
+    BENCH_BLK,
+    BENCH_FS,
+};
+
+struct bench {
+    enum bench_device device;
+    unsigned long qd;
+    unsigned long segs;
+    unsigned long seg_size;
+    bool write;
+
+    struct vhd_request_queue *rq;
+    struct vhd_vdev vdev;
+    struct vhd_vring vring;
+    struct virtq_driver drv;
+    struct virtio_blk_dev blk;
+    struct virtio_fs_dev fs;
+    struct vhd_fsdev_info fsdev;
+
+    /* device-written status of the requests in the batch */
+    void **status;
+
+    unsigned long completed;
+    unsigned long failed;
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-D blk|fs] [-q queue-depth] [-s segments] "
+            "[-b segment-size] [-w] [-d] [-e] [-n iterations]\n"
+            "  -D device        virtio device type (default: blk)\n"
+            "  -q queue-depth   requests per batch (default: 32)\n"
+            "  -s segments      data segments per request (default: 1)\n"
+            "  -b segment-size  data segment size (default: 4096)\n"
+            "  -w               write requests (default: read)\n"
+            "  -d               use direct descriptor chains "
+            "(default: indirect)\n"
+            "  -e               negotiate VIRTIO_F_RING_EVENT_IDX\n"
+            "  -n iterations    number of batches (default: 100000)\n",
+            name);
+}
+
+static int setup(struct bench *b, bool indirect, bool event_idx)
+{
+    uint16_t qsz = 1;
+    int ret;
+
+    /* enough descriptors for the whole batch */
+    while (qsz < b->qd * (indirect ? 1 : b->segs + 2)) {
+        qsz <<= 1;
+    }
+
+    ret = virtq_driver_init(&b->drv, 0, qsz,
+                            sizeof(struct virtio_fs_in_header) +
+                            sizeof(struct virtio_fs_out_header) +
+                            b->segs * b->seg_size, indirect, event_idx);
+    if (ret < 0) {
+        fprintf(stderr, "failed to create virtqueue: %s\n", strerror(-ret));
+        return ret;
+    }
+
+    b->rq = vhd_create_request_queue();
+    if (!b->rq) {
+        return -ENOMEM;
+    }
+
+    b->vdev.rqs = &b->rq;
+    b->vdev.num_rqs = 1;
+    b->vdev.vrings = &b->vring;
+    b->vdev.num_queues = 1;
+    b->vring.vdev = &b->vdev;
+    b->vring.rq = b->rq;
+    /* keeps the completions from reporting the vring drained */
+    b->vring.started_in_rq = true;
+    ret = virtq_driver_attach(&b->drv, &b->vring.vq);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (b->device == BENCH_BLK) {
+        struct vhd_bdev_info bdev = {
+            .serial = "bench",
+            .block_size = VHD_SECTOR_SIZE,
+            .num_queues = 1,
+            .total_blocks = 1ull << 40 >> VHD_SECTOR_SHIFT,
+        };
+        virtio_blk_init_dev(&b->blk, &bdev);
+    } else {
+        b->fsdev = (struct vhd_fsdev_info) { .tag = "bench", .num_queues = 1 };
+        virtio_fs_init_dev(&b->fs, &b->fsdev);
+    }
+    return 0;
+}
+
+static void cleanup(struct bench *b)
+{
+    if (b->device == BENCH_BLK) {
+        virtio_blk_destroy_dev(&b->blk);
+    }
+    virtio_virtq_release(&b->vring.vq);
+    virtq_driver_destroy(&b->drv);
+    vhd_stop_queue(b->rq);
+    vhd_run_queue(b->rq);
+    vhd_release_request_queue(b->rq);
+}
+
+static int add_blk_request(struct bench *b, unsigned long n, void **status)
+{
+    struct virtq_driver_buf bufs[VIRTQ_DRIVER_MAX_BUFS];
+    struct virtio_blk_req_hdr *hdr;
+    uint16_t nbufs = 0;
+    unsigned long i;
+    int ret;
+
+    bufs[nbufs++] = (struct virtq_driver_buf) { .len = sizeof(*hdr) };
+    for (i = 0; i < b->segs; i++) {
+        bufs[nbufs++] = (struct virtq_driver_buf) {
+            .len = b->seg_size,
+            .write = !b->write,
+        };
+    }
+    bufs[nbufs++] = (struct virtq_driver_buf) { .len = 1, .write = true };
+
+    ret = virtq_driver_add(&b->drv, bufs, nbufs, status);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *status = bufs[nbufs - 1].ptr;
+    *(uint8_t *)*status = 0xff;
+    hdr = bufs[0].ptr;
+    *hdr = (struct virtio_blk_req_hdr) {
+        .type = b->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+        .sector = n * b->segs * b->seg_size / VHD_SECTOR_SIZE,
+    };
+    return 0;
+}
+
+static int add_fs_request(struct bench *b, unsigned long n, void **status)
+{
+    struct virtq_driver_buf bufs[VIRTQ_DRIVER_MAX_BUFS];
+    struct virtio_fs_in_header *in;
+    uint16_t nbufs = 0;
+    unsigned long i;
+    int ret;
+
+    /* FUSE_READ- or FUSE_WRITE-like framing */
+    bufs[nbufs++] = (struct virtq_driver_buf) { .len = sizeof(*in) };
+    if (b->write) {
+        for (i = 0; i < b->segs; i++) {
+            bufs[nbufs++] = (struct virtq_driver_buf) { .len = b->seg_size };
+        }
+    }
+    bufs[nbufs++] = (struct virtq_driver_buf) {
+        .len = sizeof(struct virtio_fs_out_header),
+        .write = true,
+    };
+    if (!b->write) {
+        for (i = 0; i < b->segs; i++) {
+            bufs[nbufs++] = (struct virtq_driver_buf) {
+                .len = b->seg_size,
+                .write = true,
+            };
+        }
+    }
+
+    ret = virtq_driver_add(&b->drv, bufs, nbufs, status);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *status = bufs[b->write ? nbufs - 1 : 1].ptr;
+    ((struct virtio_fs_out_header *)*status)->error = -1;
+    in = bufs[0].ptr;
+    *in = (struct virtio_fs_in_header) {
+        .len = sizeof(*in) + (b->write ? b->segs * b->seg_size : 0),
+        .opcode = b->write ? BENCH_FUSE_WRITE : BENCH_FUSE_READ,
+        .unique = n,
+    };
+    return 0;
+}
+
+static void complete_fs_request(struct vhd_io *io)
+{
+    struct vhd_sglist *sglist = &vhd_get_fs_io(io)->sglist;
+    uint32_t i;
+
+    for (i = 0; i < sglist->nbuffers; i++) {
+        if (sglist->buffers[i].write_only) {
+            struct virtio_fs_out_header *out = sglist->buffers[i].base;
+            out->len = sizeof(*out);
+            out->error = 0;
+            break;
+        }
+    }
+    vhd_complete_bio(io, VHD_BDEV_SUCCESS);
+}
+
+static void run_batch(struct bench *b, unsigned long iter)
+{
+    struct vhd_request req;
+    unsigned long i;
+    void **status;
+    uint32_t len;
+
+    for (i = 0; i < b->qd; i++) {
+        int ret = b->device == BENCH_BLK ?
+            add_blk_request(b, iter * b->qd + i, &b->status[i]) :
+            add_fs_request(b, iter * b->qd + i, &b->status[i]);
+        VHD_VERIFY(ret == 0);
+    }
+
+    if (b->device == BENCH_BLK) {
+        virtio_blk_dispatch_requests(&b->blk, &b->vring.vq);
+    } else {
+        virtio_fs_dispatch_requests(&b->fs, &b->vring.vq);
+    }
+
+    while (vhd_dequeue_request(b->rq, &req)) {
+        if (b->device == BENCH_BLK) {
+            vhd_complete_bio(req.io, VHD_BDEV_SUCCESS);
+        } else {
+            complete_fs_request(req.io);
+        }
+    }
+    vhd_run_queue(b->rq);
+
+    while (virtq_driver_get(&b->drv, (void **)&status, &len)) {
+        b->completed++;
+        if (b->device == BENCH_BLK) {
+            b->failed += *(uint8_t *)*status != VIRTIO_BLK_S_OK;
+        } else {
+            struct virtio_fs_out_header *out = *status;
+            b->failed += out->error || len != sizeof(*out);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = { .qd = 32, .segs = 1, .seg_size = 4096 };
+    bool indirect = true, event_idx = false;
+    unsigned long iters = 100000, i;
+    uint64_t start, cpu_start, elapsed, cpu;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "D:q:s:b:wden:h")) != -1) {
+        switch (opt) {
+        case 'D':
+            if (!strcmp(optarg, "blk")) {
+                b.device = BENCH_BLK;
+            } else if (!strcmp(optarg, "fs")) {
+                b.device = BENCH_FS;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+            b.qd = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            b.segs = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            b.seg_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            b.write = true;
+            break;
+        case 'd':
+            indirect = false;
+            break;
+        case 'e':
+            event_idx = true;
+            break;
+        case 'n':
+            iters = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (!b.qd || !iters || !b.segs || b.segs > VIRTQ_DRIVER_MAX_BUFS - 2 ||
+        !b.seg_size || b.seg_size % VHD_SECTOR_SIZE ||
+        b.qd * (indirect ? 1 : b.segs + 2) > VIRTQ_SIZE_MAX) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    b.status = calloc(b.qd, sizeof(b.status[0]));
+    if (setup(&b, indirect, event_idx) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    start = clock_ns(CLOCK_MONOTONIC);
+    cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    for (i = 0; i < iters; i++) {
+        run_batch(&b, i);
+    }
+    elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+    cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+    cleanup(&b);
+    free(b.status);
+
+    if (b.completed != b.qd * iters || b.failed) {
+        fprintf(stderr, "completed %lu of %lu requests, %lu failed\n",
+                b.completed, b.qd * iters, b.failed);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s %s qd %lu segs %lu x %lu %s%s: %.1f ns/request, "
+           "%.0f requests/s per core\n",
+           b.device == BENCH_BLK ? "blk" : "fs", b.write ? "write" : "read",
+           b.qd, b.segs, b.seg_size, indirect ? "indirect" : "direct",
+           event_idx ? " event_idx" : "", (double)cpu / b.completed,
+           b.completed * 1e9 / cpu);
+    printf("wall clock: %.1f ns/request\n", (double)elapsed / b.completed);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,484 @@
+/*
+ * Out-of-process block backend for the blk test server
+ *
+ * Serves the requests the server exports through shared memory channels
+ * (see vhost/shm_ring.h) with synchronous preadv/pwritev on the disk images,
+ * straight from and to guest memory.  The disks, channels and guest memory
+ * maps are handed over the control socket as described in shm_backend_proto.h.
+ * Only needs the library headers, not the library itself, the same way a
+ * backend in a separate project would.
+ *
+ * Usage: vhost-shm-backend FD
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "vhost/server.h"
+#include "vhost/blockdev.h"
+#include "shm_backend_proto.h"
+
+#define MAX_DISKS       4096
+#define MAX_MAPS        64
+
+#define DIE(fmt, ...)                                               \
+    do {                                                            \
+        fprintf(stderr, "shm-backend: " fmt "\n", ##__VA_ARGS__);   \
+        exit(EXIT_FAILURE);                                         \
+    } while (0)
+
+struct disk {
+    uint64_t id;
+    int fd;
+};
+
+struct map_region {
+    uint64_t gpa;
+    uint64_t size;
+    void *ptr;
+};
+
+struct map {
+    uint64_t id;
+    uint32_t num_regions;
+    struct map_region regions[SHM_PROTO_MAX_REGIONS];
+};
+
+struct channel {
+    void *ring_file;
+    uint64_t ring_size;
+    struct vhd_shm_ring req;
+    struct vhd_shm_ring cpl;
+    int req_doorbell;
+    int cpl_doorbell;
+};
+
+static int ctl_sock;
+static int epfd;
+
+static struct disk disks[MAX_DISKS];
+static unsigned num_disks;
+static struct channel channels[SHM_PROTO_MAX_CHANNELS];
+static unsigned num_channels;
+static struct map maps[MAX_MAPS];
+static unsigned num_maps;
+
+static void close_fds(int *fds, unsigned num_fds)
+{
+    unsigned i;
+
+    for (i = 0; i < num_fds; i++) {
+        close(fds[i]);
+    }
+}
+
+static struct disk *find_disk(uint64_t id)
+{
+    unsigned i;
+
+    for (i = 0; i < num_disks; i++) {
+        if (disks[i].id == id) {
+            return &disks[i];
+        }
+    }
+    return NULL;
+}
+
+static struct map *find_map(uint64_t id)
+{
+    unsigned i;
+
+    for (i = 0; i < num_maps; i++) {
+        if (maps[i].id == id) {
+            return &maps[i];
+        }
+    }
+    return NULL;
+}
+
+static void add_disk(const struct shm_msg *msg)
+{
+    int fd;
+
+    if (num_disks == MAX_DISKS) {
+        DIE("too many disks");
+    }
+
+    fd = open(msg->path, O_RDWR);
+    if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+        /* readonly disk */
+        fd = open(msg->path, O_RDONLY);
+    }
+    if (fd < 0) {
+        DIE("open %s: %s", msg->path, strerror(errno));
+    }
+
+    disks[num_disks++] = (struct disk) { .id = msg->id, .fd = fd };
+}
+
+static void add_channel(const struct shm_msg *msg, int *fds, unsigned num_fds)
+{
+    struct channel *ch;
+    struct epoll_event ev;
+
+    if (num_fds != 3) {
+        DIE("channel message with %u fds", num_fds);
+    }
+    if (num_channels == SHM_PROTO_MAX_CHANNELS) {
+        DIE("too many channels");
+    }
+
+    ch = &channels[num_channels];
+    ch->ring_size = msg->ring_size;
+    ch->ring_file = mmap(NULL, ch->ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fds[0], 0);
+    if (ch->ring_file == MAP_FAILED) {
+        DIE("mmap ring: %s", strerror(errno));
+    }
+    close(fds[0]);
+
+    if (!vhd_shm_ring_hdr_valid(ch->ring_file, ch->ring_size)) {
+        DIE("bad ring header");
+    }
+    vhd_shm_ring_attach(&ch->req, ch->ring_file, false);
+    vhd_shm_ring_attach(&ch->cpl, ch->ring_file, true);
+    ch->req_doorbell = fds[1];
+    ch->cpl_doorbell = fds[2];
+
+    ev = (struct epoll_event) {
+        .events = EPOLLIN,
+        .data.u32 = num_channels + 1,
+    };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ch->req_doorbell, &ev) < 0) {
+        DIE("epoll_ctl: %s", strerror(errno));
+    }
+
+    num_channels++;
+}
+
+static void add_map(const struct shm_msg *msg, int *fds, unsigned num_fds)
+{
+    struct map *map;
+    uint32_t i;
+
+    if (num_fds != msg->num_regions ||
+        msg->num_regions > SHM_PROTO_MAX_REGIONS) {
+        DIE("map message with %u regions, %u fds", msg->num_regions, num_fds);
+    }
+    if (num_maps == MAX_MAPS) {
+        DIE("too many memory maps");
+    }
+
+    map = &maps[num_maps++];
+    map->id = msg->id;
+    map->num_regions = msg->num_regions;
+    for (i = 0; i < msg->num_regions; i++) {
+        const struct shm_msg_region *r = &msg->regions[i];
+        void *ptr = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fds[i], r->offset);
+        if (ptr == MAP_FAILED) {
+            DIE("mmap region: %s", strerror(errno));
+        }
+        map->regions[i] = (struct map_region) {
+            .gpa = r->gpa,
+            .size = r->size,
+            .ptr = ptr,
+        };
+    }
+    close_fds(fds, num_fds);
+}
+
+static void remove_map(uint64_t id)
+{
+    struct map *map = find_map(id);
+    uint32_t i;
+
+    if (!map) {
+        return;
+    }
+
+    for (i = 0; i < map->num_regions; i++) {
+        munmap(map->regions[i].ptr, map->regions[i].size);
+    }
+    *map = maps[--num_maps];
+}
+
+/*
+ * Receive and handle one control message.  Returns false if there's none and
+ * @wait is not set.  Exits when the server closes the socket.
+ */
+static bool handle_ctl_message(bool wait)
+{
+    struct shm_msg msg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_PROTO_MAX_REGIONS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    int fds[SHM_PROTO_MAX_REGIONS];
+    unsigned num_fds = 0;
+    ssize_t len;
+
+    do {
+        len = recvmsg(ctl_sock, &mh,
+                      MSG_CMSG_CLOEXEC | (wait ? 0 : MSG_DONTWAIT));
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0) {
+        if (errno == EAGAIN) {
+            return false;
+        }
+        DIE("recvmsg: %s", strerror(errno));
+    }
+    if (len == 0) {
+        /* the server is gone */
+        exit(EXIT_SUCCESS);
+    }
+    if ((size_t)len < offsetof(struct shm_msg, path)) {
+        DIE("short control message");
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+        }
+    }
+
+    switch (msg.type) {
+    case SHM_MSG_DISK:
+        add_disk(&msg);
+        break;
+    case SHM_MSG_CHANNEL:
+        add_channel(&msg, fds, num_fds);
+        break;
+    case SHM_MSG_MAP:
+        add_map(&msg, fds, num_fds);
+        break;
+    case SHM_MSG_UNMAP:
+        remove_map(msg.id);
+        break;
+    default:
+        DIE("unknown control message %u", msg.type);
+    }
+
+    return true;
+}
+
+static void *gpa_to_ptr(const struct map *map, uint64_t gpa, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < map->num_regions; i++) {
+        const struct map_region *r = &map->regions[i];
+        if (gpa >= r->gpa && gpa - r->gpa + len <= r->size) {
+            return (char *)r->ptr + (gpa - r->gpa);
+        }
+    }
+    return NULL;
+}
+
+static bool do_rw(int fd, struct iovec *iov, unsigned iovcnt, off_t offset,
+                  bool write)
+{
+    while (iovcnt) {
+        ssize_t len = write ? pwritev(fd, iov, iovcnt, offset) :
+                              preadv(fd, iov, iovcnt, offset);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return false;
+        }
+
+        offset += len;
+        while (iovcnt && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+    return true;
+}
+
+static enum vhd_bdev_io_result serve_request(const struct vhd_shm_req *req)
+{
+    struct disk *disk = find_disk(req->dev);
+    struct map *map;
+    struct iovec iov[VHD_SHM_MAX_SEGS];
+    off_t offset = req->first_sector * VHD_SECTOR_SIZE;
+    off_t len = req->total_sectors * VHD_SECTOR_SIZE;
+    uint32_t i;
+
+    if (!disk || req->nsegs > VHD_SHM_MAX_SEGS) {
+        return VHD_BDEV_IOERR;
+    }
+
+    switch (req->type) {
+    case VHD_BDEV_READ:
+    case VHD_BDEV_WRITE:
+        /* the map is always sent before the first request referring to it */
+        while (!(map = find_map(req->map_id))) {
+            handle_ctl_message(true);
+        }
+
+        for (i = 0; i < req->nsegs; i++) {
+            const struct vhd_shm_seg *seg = &req->segs[i];
+            iov[i].iov_base = gpa_to_ptr(map, seg->gpa, seg->len);
+            iov[i].iov_len = seg->len;
+            if (!iov[i].iov_base) {
+                return VHD_BDEV_IOERR;
+            }
+        }
+        if (!do_rw(disk->fd, iov, req->nsegs, offset,
+                   req->type == VHD_BDEV_WRITE)) {
+            return VHD_BDEV_IOERR;
+        }
+        return VHD_BDEV_SUCCESS;
+    case VHD_BDEV_DISCARD:
+        if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      offset, len) < 0 && errno != EOPNOTSUPP) {
+            return VHD_BDEV_IOERR;
+        }
+        return VHD_BDEV_SUCCESS;
+    case VHD_BDEV_WRITE_ZEROES:
+        if (fallocate(disk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                      offset, len) < 0) {
+            return VHD_BDEV_IOERR;
+        }
+        return VHD_BDEV_SUCCESS;
+    default:
+        return VHD_BDEV_IOERR;
+    }
+}
+
+/*
+ * Serve all the requests pending on the channel.  Returns whether there were
+ * any.
+ */
+static bool serve_channel(struct channel *ch)
+{
+    struct vhd_shm_req *req;
+    bool busy = false;
+
+    while ((req = vhd_shm_ring_peek(&ch->req))) {
+        struct vhd_shm_cpl *cpl;
+        enum vhd_bdev_io_result status = serve_request(req);
+
+        /*
+         * There are never more requests in flight than ring entries, so the
+         * completion ring can't be full
+         */
+        cpl = vhd_shm_ring_reserve(&ch->cpl);
+        if (!cpl) {
+            DIE("completion ring overflow");
+        }
+        cpl->tag = req->tag;
+        cpl->status = status;
+        vhd_shm_ring_pop(&ch->req);
+        vhd_shm_ring_push(&ch->cpl);
+
+        if (vhd_shm_ring_kick_needed(&ch->cpl)) {
+            eventfd_write(ch->cpl_doorbell, 1);
+        }
+        busy = true;
+    }
+
+    return busy;
+}
+
+static void wait_for_work(void)
+{
+    struct epoll_event events[SHM_PROTO_MAX_CHANNELS + 1];
+    bool sleep = true;
+    unsigned i;
+    int n;
+
+    for (i = 0; i < num_channels; i++) {
+        if (!vhd_shm_ring_prepare_sleep(&channels[i].req)) {
+            sleep = false;
+        }
+    }
+
+    if (sleep) {
+        n = epoll_wait(epfd, events, SHM_PROTO_MAX_CHANNELS + 1, -1);
+        if (n < 0 && errno != EINTR) {
+            DIE("epoll_wait: %s", strerror(errno));
+        }
+        for (i = 0; i < (unsigned)(n > 0 ? n : 0); i++) {
+            eventfd_t unused;
+            if (events[i].data.u32) {
+                eventfd_read(channels[events[i].data.u32 - 1].req_doorbell,
+                             &unused);
+            }
+        }
+    }
+
+    for (i = 0; i < num_channels; i++) {
+        vhd_shm_ring_wake_up(&channels[i].req);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = 0 };
+    char *end;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s FD\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    ctl_sock = strtol(argv[1], &end, 10);
+    if (*end || ctl_sock < 0) {
+        DIE("bad control socket %s", argv[1]);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        DIE("epoll_create1: %s", strerror(errno));
+    }
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctl_sock, &ev) < 0) {
+        DIE("epoll_ctl: %s", strerror(errno));
+    }
+
+    for (;;) {
+        bool busy = false;
+        unsigned i;
+
+        while (handle_ctl_message(false)) {
+            ;
+        }
+
+        for (i = 0; i < num_channels; i++) {
+            busy |= serve_channel(&channels[i]);
+        }
+
+        if (!busy) {
+            wait_for_work();
+        }
+    }
+}
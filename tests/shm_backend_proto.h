@@ -0,0 +1,47 @@
+/*
+ * Control protocol between the blk test server and its out-of-process
+ * backend, vhost-shm-backend.
+ *
+ * The server spawns the backend with one end of a SOCK_SEQPACKET socket pair
+ * and sends it one message per disk, request queue channel and guest memory
+ * map over it; the file descriptors go along in SCM_RIGHTS.
+ */
+
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "vhost/shm_ring.h"
+
+#define SHM_PROTO_MAX_REGIONS   32
+#define SHM_PROTO_MAX_CHANNELS  256
+
+enum shm_msg_type {
+    /* @id: disk private data pointer, @path: image file */
+    SHM_MSG_DISK,
+    /* @id: channel index, fds: ring file, req doorbell, cpl doorbell */
+    SHM_MSG_CHANNEL,
+    /* @id: map id, @regions, one fd per region */
+    SHM_MSG_MAP,
+    /* @id: map id */
+    SHM_MSG_UNMAP,
+};
+
+struct shm_msg_region {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t offset;
+};
+
+struct shm_msg {
+    uint32_t type;
+    uint32_t num_regions;
+    uint64_t id;
+
+    union {
+        char path[PATH_MAX];
+        uint64_t ring_size;
+        struct shm_msg_region regions[SHM_PROTO_MAX_REGIONS];
+    };
+};
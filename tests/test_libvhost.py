@@ -1,10 +1,14 @@
+import json
+import mmap
 import subprocess
 import os
+import re
 import shutil
 import signal
+import socket
 import time
 import pytest
-from typing import Tuple, List, Generator
+from typing import Dict, Tuple, List, Generator, Optional
 
 
 # 1 GiB should be enough
@@ -12,6 +16,8 @@ DISK_IMAGE_SIZE = 1024 * 1024 * 1024
 WORK_DIR = "work"
 LIBBLKIO_GIT = "https://gitlab.com/libblkio/libblkio.git/"
 TEST_SERVER_BINARY_ENV_PATH = "TEST_SERVER_BINARY"
+LOADGEN_BINARY_ENV_PATH = "LOADGEN_BINARY"
+SHM_BACKEND_BINARY_ENV_PATH = "SHM_BACKEND_BINARY"
 
 
 def base_dir_abs_path() -> str:
@@ -35,23 +41,35 @@ def blkio_bench() -> str:
     return blkio_bench_path
 
 
-@pytest.fixture(scope="session")
-def vhost_user_test_server() -> str:
-    server_path = os.path.join(
-        base_dir_abs_path(), os.pardir, "build", "tests",
-        "vhost-user-blk-test-server"
-    )
-    if os.path.exists(server_path):
-        return server_path
+def find_test_binary(name: str, env_var: str) -> str:
+    path = os.path.join(base_dir_abs_path(), os.pardir, "build", "tests", name)
+    if os.path.exists(path):
+        return path
 
-    env_path = os.environ.get(TEST_SERVER_BINARY_ENV_PATH)
+    env_path = os.environ.get(env_var)
     if env_path is None or not os.path.exists(env_path):
-        raise RuntimeError("A valid path to the test server must be specified "
-                           f"in the {TEST_SERVER_BINARY_ENV_PATH} variable")
+        raise RuntimeError(f"A valid path to {name} must be specified "
+                           f"in the {env_var} variable")
 
     return env_path
 
 
+@pytest.fixture(scope="session")
+def vhost_user_test_server() -> str:
+    return find_test_binary("vhost-user-blk-test-server",
+                            TEST_SERVER_BINARY_ENV_PATH)
+
+
+@pytest.fixture(scope="session")
+def vhost_user_loadgen() -> str:
+    return find_test_binary("vhost-user-loadgen", LOADGEN_BINARY_ENV_PATH)
+
+
+@pytest.fixture(scope="session")
+def vhost_shm_backend() -> str:
+    return find_test_binary("vhost-shm-backend", SHM_BACKEND_BINARY_ENV_PATH)
+
+
 @pytest.fixture(scope="session")
 def work_dir() -> Generator[str, None, None]:
     work_dir_path = os.path.join(base_dir_abs_path(), WORK_DIR)
@@ -73,23 +91,29 @@ def disk_image(work_dir: str) -> Generator[str, None, None]:
     os.remove(disk_image_path)
 
 
-@pytest.fixture(scope="session")
-def server_socket(
-    work_dir: str, disk_image: str, vhost_user_test_server: str
+def run_test_server(
+    server: str, socket_path: str, disk_args: str,
+    extra_args: Tuple[str, ...] = (), wait_path: Optional[str] = None,
+    monitor: Optional[str] = None
 ) -> Generator[str, None, None]:
-    socket_path = os.path.join(work_dir, "server.sock")
+    # the stats asked for on the monitor end up in the log, see dump_stats()
+    log = None
+    if monitor:
+        extra_args += ("--monitor", monitor)
+        log = open(f"{monitor}.log", "w")
 
     process = subprocess.Popen([
-        vhost_user_test_server, "--disk",
-        f"socket-path={socket_path},blk-file={disk_image}"
-        ",serial=helloworld"
-    ])
+        server, "--disk", f"socket-path={socket_path},{disk_args}",
+        *extra_args
+    ], stderr=log)
+
+    wait_path = wait_path or socket_path
 
     retry = 0
     retry_limit = 5
 
     while True:
-        if os.path.exists(socket_path):
+        if os.path.exists(wait_path):
             break
 
         if retry < retry_limit:
@@ -102,6 +126,124 @@ def server_socket(
 
     process.send_signal(signal.SIGINT)
     process.wait(10)
+    if log:
+        log.close()
+
+
+def dump_stats(monitor: str, command: str) -> List[str]:
+    """Run stat command on the server monitor and return the lines logged"""
+    for _ in range(50):
+        if os.path.exists(monitor):
+            break
+        time.sleep(0.1)
+
+    with open(f"{monitor}.log") as log:
+        log.seek(0, os.SEEK_END)
+        with socket.socket(socket.AF_UNIX) as sock:
+            sock.connect(monitor)
+            sock.sendall(f"{command}\n".encode())
+            reply = b""
+            while b"Stats dumped" not in reply:
+                data = sock.recv(4096)
+                assert data, f"no reply to {command}"
+                reply += data
+        return log.read().splitlines()
+
+
+def completed_stats(lines: List[str]) -> List[int]:
+    """Requests completed by each disk or queue in the dump"""
+    return [int(m.group(1)) for m in
+            (re.search(r"Stats: .* (\d+) completed", line) for line in lines)
+            if m]
+
+
+VQ_STATS_RE = re.compile(
+    r"vq \d+: (\d+) requests, (\d+) completed, (\d+) of \d+ reads "
+    r"coalesced, (\d+) served and (\d+) trimmed as known zeroes"
+    r".*, (\d+) held behind writes"
+)
+
+
+def vq_stats(lines: List[str]) -> List[Dict[str, int]]:
+    """Counters of each virtqueue of the disk in the dump"""
+    return [dict(zip(("requests", "completed", "read_coalesce_hits",
+                      "read_zero_hits", "read_zero_trims", "order_held"),
+                     map(int, m.groups())))
+            for m in map(VQ_STATS_RE.search, lines) if m]
+
+
+@pytest.fixture(scope="session")
+def server_socket(
+    work_dir: str, disk_image: str, vhost_user_test_server: str
+) -> Generator[str, None, None]:
+    yield from run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "server.sock"),
+        f"blk-file={disk_image},serial=helloworld"
+    )
+
+
+@pytest.fixture(params=["null", "ram"])
+def builtin_server_socket(
+    request: pytest.FixtureRequest, work_dir: str, vhost_user_test_server: str
+) -> Generator[str, None, None]:
+    yield from run_test_server(
+        vhost_user_test_server,
+        os.path.join(work_dir, f"{request.param}.sock"),
+        f"backend={request.param},size={DISK_IMAGE_SIZE},latency=100"
+        ",discard=on,write-zeroes=on,serial=builtin"
+    )
+
+
+@pytest.fixture
+def shm_server_socket(
+    work_dir: str, disk_image: str, vhost_user_test_server: str,
+    vhost_shm_backend: str
+) -> Generator[str, None, None]:
+    yield from run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "shm.sock"),
+        f"blk-file={disk_image},serial=shm,num-rqs=2",
+        extra_args=("--shm-backend", vhost_shm_backend)
+    )
+
+
+DENSE_NUM_DISKS = 64
+
+
+@pytest.fixture
+def dense_server_sockets(
+    work_dir: str, disk_image: str, vhost_user_test_server: str
+) -> Generator[Tuple[List[str], str], None, None]:
+    # served with libaio for the server to count the requests per disk
+    template = os.path.join(work_dir, "dense.%d.sock")
+    monitor = os.path.join(work_dir, "dense.monitor")
+    for _ in run_test_server(
+        vhost_user_test_server, template,
+        f"blk-file={disk_image},serial=dense%d,count={DENSE_NUM_DISKS}",
+        extra_args=("--shared-rqs", "2"),
+        wait_path=template % (DENSE_NUM_DISKS - 1), monitor=monitor
+    ):
+        yield [template % i for i in range(DENSE_NUM_DISKS)], monitor
+
+
+@pytest.fixture
+def pool_server_sockets(
+    work_dir: str, vhost_user_test_server: str
+) -> Generator[Tuple[List[str], str], None, None]:
+    # an image per disk for each job to verify its own writes
+    images = os.path.join(work_dir, "pool.%d.img")
+    for i in range(2):
+        with open(images % i, "wb") as image:
+            image.truncate(64 * 1024 * 1024)
+
+    template = os.path.join(work_dir, "pool.%d.sock")
+    monitor = os.path.join(work_dir, "pool.monitor")
+    for _ in run_test_server(
+        vhost_user_test_server, template,
+        f"blk-file={images},serial=pool%d,count=2",
+        extra_args=("--shared-rqs", "2", "--rq-pool"),
+        wait_path=template % 1, monitor=monitor
+    ):
+        yield [template % i for i in range(2)], monitor
 
 
 def pretty_print_blkio_config(param: List[str]) -> str:
@@ -133,3 +275,704 @@ def test_basic_operations(
     server_socket: str, blkio_bench: str, config: Tuple[str, int]
 ) -> None:
     check_run_blkio_bench(blkio_bench, *config, 30, server_socket)
+
+
+@pytest.mark.parametrize(
+    'rw',
+    ["randread", "randwrite", "randrw"],
+)
+def test_reconnect_under_load(
+    server_socket: str, vhost_user_loadgen: str, rw: str
+) -> None:
+    # a small area for the reads to come across the data written before
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "5", "--job",
+        f"socket-path={server_socket},rw={rw},qd=32,reconnect-ms=250"
+        ",size=16777216,verify=1"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["reconnects"] > 0
+    assert job["errors"] == 0
+    assert job["read"]["ios"] + job["write"]["ios"] > 0
+    # the requests resubmitted after the reconnects left the data intact
+    assert job["verify_errors"] == 0
+    if rw == "randrw":
+        assert job["verified"] > 0
+
+
+@pytest.mark.parametrize('indirect', [0, 1])
+def test_any_layout(
+    server_socket: str, vhost_user_loadgen: str, indirect: int
+) -> None:
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={server_socket},rw=randrw,qd=32,any-layout=1"
+        f",indirect={indirect}"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+
+
+def test_builtin_backend(
+    builtin_server_socket: str, vhost_user_loadgen: str
+) -> None:
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={builtin_server_socket},rw=randrw,qd=16,queues=2"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+    # the synthetic latency of 100us is a lower bound
+    assert job["read"]["lat_ns"]["p50"] >= 100000
+
+
+def test_shared_request_queues(
+    dense_server_sockets: Tuple[List[str], str], vhost_user_loadgen: str
+) -> None:
+    sockets, monitor = dense_server_sockets
+    # an odd stride for the disks to start on either of the queues
+    stride = DENSE_NUM_DISKS // 8 + 1
+    args = [vhost_user_loadgen, "--runtime", "3"]
+    for path in sockets[::stride]:
+        args += ["--job", f"socket-path={path},rw=randrw,qd=8"]
+
+    output = subprocess.check_output(args, timeout=30)
+
+    jobs = json.loads(output)["jobs"]
+    for job in jobs:
+        assert job["errors"] == 0
+        assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+
+    # every disk completed the requests of its job and nothing else
+    disk_completed = [completed_stats(dump_stats(monitor, f"stat {i}"))[0]
+                      for i in range(DENSE_NUM_DISKS)]
+    for i, completed in enumerate(disk_completed):
+        if i % stride:
+            assert completed == 0
+        else:
+            job = jobs[i // stride]
+            assert completed == job["read"]["ios"] + job["write"]["ios"]
+
+    # and the two queues shared by all the disks served them all
+    rq_completed = completed_stats(dump_stats(monitor, "stat rqs"))
+    assert len(rq_completed) == 2
+    assert all(completed > 0 for completed in rq_completed)
+    assert sum(rq_completed) == sum(disk_completed)
+
+
+def test_rq_pool(
+    pool_server_sockets: Tuple[List[str], str], vhost_user_loadgen: str
+) -> None:
+    sockets, monitor = pool_server_sockets
+    args = [vhost_user_loadgen, "--runtime", "3"]
+    for path in sockets:
+        args += ["--job", f"socket-path={path},rw=randrw,qd=32,queues=2"
+                 ",size=16777216,verify=1"]
+    # the queues are placed anew on every start of the device
+    args[-1] += ",reconnect-ms=500"
+
+    output = subprocess.check_output(args, timeout=30)
+
+    for job in json.loads(output)["jobs"]:
+        assert job["errors"] == 0
+        assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+        assert job["verified"] > 0
+        assert job["verify_errors"] == 0
+
+    # the pool threads took the requests off both queues
+    rq_completed = completed_stats(dump_stats(monitor, "stat rqs"))
+    assert len(rq_completed) == 2
+    assert all(completed > 0 for completed in rq_completed)
+
+
+def perf_event_paranoid() -> int:
+    try:
+        with open("/proc/sys/kernel/perf_event_paranoid") as f:
+            return int(f.read())
+    except OSError:
+        return 4
+
+
+@pytest.fixture
+def perf_server_socket(
+    work_dir: str, disk_image: str, vhost_user_test_server: str
+) -> Generator[Tuple[str, str], None, None]:
+    monitor = os.path.join(work_dir, "perf.monitor")
+    for socket_path in run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "perf.sock"),
+        f"blk-file={disk_image},serial=perf",
+        extra_args=("--perf-counters",), monitor=monitor
+    ):
+        yield socket_path, monitor
+
+
+PERF_STATS_RE = re.compile(
+    r"Perf(?: \(user\))?: (\d+) completed, (\d+) ns cpu/IO, (\d+) cycles/IO"
+)
+
+
+@pytest.mark.skipif(perf_event_paranoid() > 2,
+                    reason="perf_event_paranoid forbids counting own threads")
+def test_perf_counters(
+    perf_server_socket: Tuple[str, str], vhost_user_loadgen: str
+) -> None:
+    socket_path, monitor = perf_server_socket
+    loadgen = subprocess.Popen([
+        vhost_user_loadgen, "--runtime", "2", "--job",
+        f"socket-path={socket_path},rw=randrw,qd=32"
+    ], stdout=subprocess.PIPE)
+
+    time.sleep(1)
+    perf = [m for m in map(PERF_STATS_RE.search, dump_stats(monitor, "stat 0"))
+            if m]
+
+    output, _ = loadgen.communicate(timeout=30)
+    assert loadgen.returncode == 0
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+
+    # the counters may still be off limits, e.g. to a seccomp filter; then
+    # the queue just goes without them
+    with open(f"{monitor}.log") as log:
+        if "no perf counters for queue 0" in log.read():
+            assert not perf
+            return
+
+    assert len(perf) == 1
+    completed, cpu_ns, _ = map(int, perf[0].groups())
+    assert completed > 0
+    # the software task clock is there wherever perf events are
+    assert cpu_ns > 0
+
+
+def test_shm_backend_restart(
+    shm_server_socket: str, vhost_shm_backend: str, vhost_user_loadgen: str
+) -> None:
+    loadgen = subprocess.Popen([
+        vhost_user_loadgen, "--runtime", "4", "--job",
+        f"socket-path={shm_server_socket},rw=randrw,qd=32,queues=2"
+    ], stdout=subprocess.PIPE)
+
+    # the server restarts the backend and exports the lost requests again
+    for _ in range(3):
+        time.sleep(1)
+        subprocess.call(["pkill", "-KILL", "-x",
+                         os.path.basename(vhost_shm_backend)[:15]])
+
+    output, _ = loadgen.communicate(timeout=30)
+    assert loadgen.returncode == 0
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+
+
+@pytest.fixture
+def faulty_server_socket(
+    work_dir: str, vhost_user_test_server: str
+) -> Generator[str, None, None]:
+    yield from run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "faulty.sock"),
+        f"backend=null,size={DISK_IMAGE_SIZE},serial=faulty"
+        ",submit-delay=exp:50,complete-delay=bimodal:20:20000:50000"
+        ",read-error-ppm=10000,fault-seed=1"
+    )
+
+
+def test_fault_injection(
+    faulty_server_socket: str, vhost_user_loadgen: str
+) -> None:
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={faulty_server_socket},rw=randrw,qd=16"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    # 1% of reads fail, writes never do
+    reads = job["read"]["ios"]
+    assert 0 < job["errors"] < reads // 20
+    # 5% of the completions are held for 20ms
+    assert job["write"]["lat_ns"]["p50"] < 20000000
+    assert job["write"]["lat_ns"]["p99"] >= 20000000
+
+
+@pytest.fixture
+def mpmc_server_socket(
+    work_dir: str, disk_image: str, vhost_user_test_server: str
+) -> Generator[Tuple[str, str], None, None]:
+    # a handover ring much shorter than the queue depth, to overflow it
+    monitor = os.path.join(work_dir, "mpmc.monitor")
+    for socket_path in run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "mpmc.sock"),
+        f"blk-file={disk_image},serial=mpmc,num-rqs=2,mpmc-workers=3"
+        ",mpmc-ring=8",
+        monitor=monitor
+    ):
+        yield socket_path, monitor
+
+
+def test_mpmc_queues(
+    mpmc_server_socket: Tuple[str, str], vhost_user_loadgen: str
+) -> None:
+    socket_path, monitor = mpmc_server_socket
+
+    # the reconnects cancel the requests left in the ring and the overflow
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={socket_path},rw=randrw,qd=32,queues=2"
+        ",size=16777216,verify=1,reconnect-ms=500"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["reconnects"] > 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+    assert job["verified"] > 0
+    assert job["verify_errors"] == 0
+
+    overflowed = [int(m.group(1)) for m in
+                  (re.search(r"Handover: (\d+) of \d+ requests overflowed",
+                             line)
+                   for line in dump_stats(monitor, "stat 0"))
+                  if m]
+    assert len(overflowed) == 2
+    assert all(n > 0 for n in overflowed)
+
+
+@pytest.fixture
+def delayed_server_socket(
+    work_dir: str, vhost_user_test_server: str
+) -> Generator[str, None, None]:
+    # latency only, on a backend keeping the data
+    yield from run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "delayed.sock"),
+        f"backend=ram,size={DISK_IMAGE_SIZE},serial=delayed,num-rqs=2"
+        ",submit-delay=exp:50,complete-delay=bimodal:20:20000:50000"
+        ",fault-seed=1"
+    )
+
+
+def test_delay_injection(
+    delayed_server_socket: str, vhost_user_loadgen: str
+) -> None:
+    # the held requests must still carry the right data both ways
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={delayed_server_socket},rw=randrw,qd=16,queues=2"
+        ",size=16777216,verify=1,verify-init=zero"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+    assert job["verified"] > 0
+    assert job["verify_errors"] == 0
+    assert job["write"]["lat_ns"]["p99"] >= 20000000
+
+
+@pytest.fixture
+def ordered_server_socket(
+    work_dir: str, vhost_user_test_server: str
+) -> Generator[Tuple[str, str], None, None]:
+    # a tiny disk for the requests to overlap all the time, and random
+    # submit delays for the backend to reorder whatever is let through
+    monitor = os.path.join(work_dir, "ordered.monitor")
+    for socket_path in run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "ordered.sock"),
+        "backend=ram,size=65536,latency=100,num-rqs=2,order-writes=on"
+        ",serial=ordered,submit-delay=exp:200",
+        monitor=monitor
+    ):
+        yield socket_path, monitor
+
+
+def test_ordered_overlapping_writes(
+    ordered_server_socket: Tuple[str, str], vhost_user_loadgen: str
+) -> None:
+    socket_path, monitor = ordered_server_socket
+
+    # every read must return the last write submitted before it, and every
+    # write must land over the ones submitted before it
+    loadgen = subprocess.Popen([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={socket_path},rw=randrw,qd=32,queues=2"
+        ",reconnect-ms=500,verify=1,verify-init=zero,ordered=1"
+    ], stdout=subprocess.PIPE)
+
+    # the virtqueue counters go away with the connection, take them midway
+    time.sleep(2)
+    vqs = vq_stats(dump_stats(monitor, "stat 0"))
+
+    output, _ = loadgen.communicate(timeout=30)
+    assert loadgen.returncode == 0
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["reconnects"] > 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+    assert job["verified"] > 0
+    assert job["verify_errors"] == 0
+    assert sum(vq["order_held"] for vq in vqs) > 0
+
+
+@pytest.fixture
+def in_order_server_socket(
+    work_dir: str, vhost_user_test_server: str
+) -> Generator[str, None, None]:
+    # random submit delays make the backend complete out of order
+    yield from run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "in-order.sock"),
+        f"backend=ram,size={DISK_IMAGE_SIZE},submit-delay=exp:100"
+        ",num-rqs=2,in-order=on,serial=in-order"
+    )
+
+
+def test_in_order_completions(
+    in_order_server_socket: str, vhost_user_loadgen: str
+) -> None:
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={in_order_server_socket},rw=randrw,qd=32,queues=2"
+        ",reconnect-ms=500"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["in_order"]
+    assert job["errors"] == 0
+    assert job["reconnects"] > 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+
+
+@pytest.fixture(params=["off", "on"])
+def zoned_server_socket(
+    request: pytest.FixtureRequest, work_dir: str, vhost_user_test_server: str
+) -> Generator[str, None, None]:
+    # fewer open zones than queues for the zones to be closed implicitly
+    yield from run_test_server(
+        vhost_user_test_server,
+        os.path.join(work_dir, f"zoned-{request.param}.sock"),
+        "backend=ram,size=16777216,zone-size=1048576,max-open-zones=2"
+        f",num-rqs=2,serial=zoned,track-zeroes={request.param}"
+    )
+
+
+def test_zone_appends(
+    zoned_server_socket: str, vhost_user_loadgen: str
+) -> None:
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={zoned_server_socket},rw=append,bs=65536,qd=8"
+        ",queues=4,reconnect-ms=500,verify=1"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    # every append landed within the zone it was sent to
+    assert job["errors"] == 0
+    assert job["write"]["ios"] > 0
+    # and reads back from where it landed, past the sectors the zone starts
+    # with, which were known to be zero before the first append
+    assert job["read"]["ios"] > 0
+    assert job["verified"] > 0
+    assert job["verify_errors"] == 0
+    # the zone reports put the write pointers right past the appends, and
+    # back at the zone starts after the resets
+    assert job["zones_checked"] == 4
+    assert job["zone_wp_errors"] == 0
+
+
+@pytest.fixture
+def shared_backing_sockets(
+    work_dir: str, disk_image: str, vhost_user_test_server: str
+) -> Generator[Tuple[List[str], str], None, None]:
+    template = os.path.join(work_dir, "backing.%d.sock")
+    monitor = os.path.join(work_dir, "backing.monitor")
+    for _ in run_test_server(
+        vhost_user_test_server, template,
+        f"blk-file={disk_image},serial=backing%d,count=2,num-rqs=2"
+        ",backing-id=1",
+        wait_path=template % 1, monitor=monitor
+    ):
+        yield [template % i for i in range(2)], monitor
+
+
+COALESCE_SIZE = 16 * 1024 * 1024
+
+
+def test_coalesced_reads(
+    shared_backing_sockets: Tuple[List[str], str], vhost_user_loadgen: str
+) -> None:
+    sockets, monitor = shared_backing_sockets
+
+    # fill the start of the shared backing with data the reads can check
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "1", "--job",
+        f"socket-path={sockets[0]},rw=write,qd=32,queues=2,bs=65536"
+        f",size={COALESCE_SIZE},verify=1"
+    ], timeout=30)
+    assert json.loads(output)["jobs"][0]["errors"] == 0
+
+    args = [vhost_user_loadgen, "--runtime", "3"]
+    for path in sockets:
+        args += ["--job", f"socket-path={path},rw=randread,qd=32,queues=2"
+                 f",size={COALESCE_SIZE},verify=1,verify-init=data"]
+    args[-1] += ",bs=16384,reconnect-ms=500"
+
+    loadgen = subprocess.Popen(args, stdout=subprocess.PIPE)
+
+    # the virtqueue counters go away with the connection, take them midway
+    time.sleep(2)
+    hits = sum(vq["read_coalesce_hits"]
+               for i in range(len(sockets))
+               for vq in vq_stats(dump_stats(monitor, f"stat {i}")))
+
+    output, _ = loadgen.communicate(timeout=30)
+    assert loadgen.returncode == 0
+
+    # the coalesced reads must hand each disk the data it asked for
+    for job in json.loads(output)["jobs"]:
+        assert job["errors"] == 0
+        assert job["read"]["ios"] > 0
+        assert job["verified"] > 0
+        assert job["verify_errors"] == 0
+    assert hits > 0
+
+
+@pytest.fixture
+def readahead_socket(
+    work_dir: str, disk_image: str, vhost_user_test_server: str
+) -> Generator[Tuple[str, str], None, None]:
+    monitor = os.path.join(work_dir, "readahead.monitor")
+    for socket_path in run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "readahead.sock"),
+        f"blk-file={disk_image},serial=readahead,readahead-max=1048576",
+        monitor=monitor
+    ):
+        yield socket_path, monitor
+
+
+def readahead_hints(monitor: str) -> int:
+    for line in dump_stats(monitor, "stat 0"):
+        m = re.search(r"Readahead: (\d+) hints", line)
+        if m:
+            return int(m.group(1))
+    raise RuntimeError("no readahead stats")
+
+
+def test_readahead_hints(
+    readahead_socket: Tuple[str, str], vhost_user_loadgen: str
+) -> None:
+    socket_path, monitor = readahead_socket
+
+    # random reads never look like a stream, sequential ones soon do
+    for rw in ("randread", "read"):
+        output = subprocess.check_output([
+            vhost_user_loadgen, "--runtime", "2", "--job",
+            f"socket-path={socket_path},rw={rw},qd=4,bs=65536"
+        ], timeout=30)
+
+        job = json.loads(output)["jobs"][0]
+        assert job["errors"] == 0
+        assert job["read"]["ios"] > 0
+
+        hints = readahead_hints(monitor)
+        if rw == "randread":
+            assert hints == 0
+        else:
+            assert hints > 0
+
+
+@pytest.fixture
+def zero_tracking_socket(
+    work_dir: str, vhost_user_test_server: str
+) -> Generator[Tuple[str, str], None, None]:
+    monitor = os.path.join(work_dir, "zeroes.monitor")
+    for socket_path in run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "zeroes.sock"),
+        f"backend=ram,size={DISK_IMAGE_SIZE},serial=zeroes,num-rqs=2"
+        ",track-zeroes=on",
+        monitor=monitor
+    ):
+        yield socket_path, monitor
+
+
+def test_known_zero_reads(
+    zero_tracking_socket: Tuple[str, str], vhost_user_loadgen: str
+) -> None:
+    socket_path, monitor = zero_tracking_socket
+
+    # the writes cover about half of the fresh disk by the end, and the
+    # reads off their grid land in zeroes, in the writes or across both;
+    # all of them must read back what was written there, or zeroes
+    loadgen = subprocess.Popen([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={socket_path},rw=randrw,qd=32,queues=2,bs=98304"
+        ",blockalign=65536,iops=4000,verify=1,verify-init=zero"
+    ], stdout=subprocess.PIPE)
+
+    # the virtqueue counters go away with the connection, take them midway
+    time.sleep(2)
+    vqs = vq_stats(dump_stats(monitor, "stat 0"))
+
+    output, _ = loadgen.communicate(timeout=30)
+    assert loadgen.returncode == 0
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+    assert job["verified"] > 0
+    assert job["verify_errors"] == 0
+    assert sum(vq["read_zero_hits"] for vq in vqs) > 0
+    assert sum(vq["read_zero_trims"] for vq in vqs) > 0
+
+
+@pytest.fixture(scope="session")
+def aligned_socket(
+    work_dir: str, disk_image: str, vhost_user_test_server: str
+) -> Generator[str, None, None]:
+    yield from run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "aligned.sock"),
+        f"blk-file={disk_image},serial=aligned,num-rqs=2"
+        ",write-zeroes=on,align-block-size=4096"
+    )
+
+
+@pytest.mark.parametrize("bs", [512, 1536, 9216])
+def test_align_to_blocks(
+    aligned_socket: str, vhost_user_loadgen: str, bs: int
+) -> None:
+    # the backend fails any request not covering whole blocks, and the
+    # requests straddling them must keep the data around them intact
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "2", "--job",
+        f"socket-path={aligned_socket},rw=randrw,qd=32,queues=2,bs={bs}"
+        ",blockalign=512,size=4194304,verify=1"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+    assert job["verified"] > 0
+    assert job["verify_errors"] == 0
+
+
+@pytest.fixture
+def migration_sockets(
+    work_dir: str, disk_image: str, vhost_user_test_server: str
+) -> Generator[List[str], None, None]:
+    # slow submissions for the requests to still be in flight on migration
+    template = os.path.join(work_dir, "migration.%d.sock")
+    for _ in run_test_server(
+        vhost_user_test_server, template,
+        f"blk-file={disk_image},serial=migration%d,count=2,num-rqs=2"
+        ",submit-delay=exp:2000,migrate-inflight=on",
+        wait_path=template % 1
+    ):
+        yield [template % i for i in range(2)]
+
+
+def test_migrate_inflight(
+    migration_sockets: List[str], vhost_user_loadgen: str
+) -> None:
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={migration_sockets[0]},rw=randrw,qd=32,queues=2"
+        f",migrate-to={migration_sockets[1]},migrate-ms=250"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["errors"] == 0
+    assert job["migrations"] > 0
+    # the vrings stopped without waiting for the requests in flight
+    assert job["handed_over"] > 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+
+
+def test_postcopy_faults(
+    server_socket: str, vhost_user_loadgen: str
+) -> None:
+    # the loadgen plays the master serving the faults on missing pages
+    output = subprocess.check_output([
+        vhost_user_loadgen, "--runtime", "3", "--job",
+        f"socket-path={server_socket},rw=randrw,qd=32,queues=2,bs=16384"
+        ",postcopy-ms=1000"
+    ], timeout=30)
+
+    job = json.loads(output)["jobs"][0]
+    assert job["postcopy_faults"] > 0
+    assert job["errors"] == 0
+    assert job["read"]["ios"] > 0 and job["write"]["ios"] > 0
+
+
+VDUSE_CONTROL = "/dev/vduse/control"
+
+
+@pytest.fixture
+def vduse_device(
+    work_dir: str, vhost_user_test_server: str
+) -> Generator[str, None, None]:
+    name = f"vhd-test-{os.getpid()}"
+    for _ in run_test_server(
+        vhost_user_test_server, os.path.join(work_dir, "vduse.sock"),
+        "backend=ram,size=67108864,serial=vduse,num-rqs=2"
+        f",vduse-name={name}",
+        wait_path=f"/dev/vduse/{name}"
+    ):
+        yield name
+
+
+def vdpa_block_device(name: str) -> Optional[Tuple[str, str]]:
+    """Features and block device of the virtio device on the vDPA one"""
+    vdpa = f"/sys/bus/vdpa/devices/{name}"
+    if not os.path.isdir(vdpa):
+        return None
+    for virtio in os.listdir(vdpa):
+        block = os.path.join(vdpa, virtio, "block")
+        if virtio.startswith("virtio") and os.path.isdir(block):
+            disks = os.listdir(block)
+            if disks:
+                return os.path.join(vdpa, virtio, "features"), disks[0]
+    return None
+
+
+@pytest.mark.skipif(not os.path.exists(VDUSE_CONTROL),
+                    reason="no VDUSE in the kernel")
+def test_vduse(vduse_device: str) -> None:
+    if not shutil.which("vdpa"):
+        pytest.skip("no vdpa tool to put the device on the vDPA bus")
+
+    subprocess.check_call(["vdpa", "dev", "add", "name", vduse_device,
+                           "mgmtdev", "vduse"])
+    try:
+        for _ in range(100):
+            found = vdpa_block_device(vduse_device)
+            if found:
+                break
+            time.sleep(0.1)
+        assert found, "no virtio block device on the vDPA device"
+        features_path, disk = found
+
+        # a modern device, with nothing of vhost-user leaking into it
+        with open(features_path) as f:
+            features = f.read().strip()
+        assert features[32] == "1"  # VIRTIO_F_VERSION_1
+        assert features[30] == "0"  # VHOST_USER_F_PROTOCOL_FEATURES
+
+        # round-trip data past the page cache
+        size = 1024 * 1024
+        data = os.urandom(size)
+        wbuf, rbuf = mmap.mmap(-1, size), mmap.mmap(-1, size)
+        wbuf.write(data)
+        fd = os.open(f"/dev/{disk}", os.O_RDWR | os.O_DIRECT)
+        try:
+            assert os.pwritev(fd, [wbuf], size) == size
+            assert os.preadv(fd, [rbuf], size) == size
+        finally:
+            os.close(fd)
+        assert rbuf[:] == data
+    finally:
+        subprocess.check_call(["vdpa", "dev", "del", vduse_device])
@@ -0,0 +1,597 @@
+/*
+ * Replay of recorded block device I/O traces
+ *
+ * Feeds the requests of a trace written by vhd_blockdev_start_trace() through
+ * the virtio-blk dispatch code and a request queue, playing the guest with a
+ * synthetic virtqueue driver per recorded vring.  The requests are served
+ * either by the tool itself, against a file or discarded, or by one of the
+ * built-in backends of the library, at the recorded pace or as fast as
+ * possible.  No QEMU or guest is needed.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "vhost/blockdev.h"
+#include "vhost/blktrace.h"
+#include "vhost/server.h"
+#include "bdev_builtin.h"
+#include "logging.h"
+#include "server_internal.h"
+#include "vdev.h"
+#include "virtio/virtio_blk.h"
+#include "virtio/virtio_blk_spec.h"
+#include "test_utils.h"
+#include "virtq_driver.h"
+
+struct replay_req {
+    const struct vhd_blktrace_record *rec;
+    uint64_t submit_ns;
+    uint8_t *status;
+};
+
+struct replay {
+    const struct vhd_blktrace_header *hdr;
+    const struct vhd_blktrace_record **recs;
+    size_t num_recs;
+    uint16_t num_vrings;
+    size_t max_data;
+
+    struct vhd_request_queue *rq;
+    struct vhd_vdev vdev;
+    struct vhd_vring *vrings;
+    struct virtq_driver *drivers;
+    struct virtio_blk_dev dev;
+
+    /* backing file, or -1 to discard the requests */
+    int fd;
+
+    struct replay_req *reqs;
+    uint64_t *latencies;
+    size_t in_flight;
+    size_t completed;
+    size_t failed;
+    uint64_t bytes;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s -t trace [-f file | -b backend] [-o trace] [-a] "
+            "[-q queue-size] [-d] [-e]\n"
+            "  -t trace       trace written by vhd_blockdev_start_trace()\n"
+            "  -f file        execute requests against file "
+            "(default: discard them)\n"
+            "  -b backend     serve requests with the built-in null or ram "
+            "backend\n"
+            "  -o trace       record the replayed requests to a new trace\n"
+            "  -a             replay as fast as possible "
+            "(default: recorded timing)\n"
+            "  -q queue-size  virtqueue size (default: 128)\n"
+            "  -d             use direct descriptor chains "
+            "(default: indirect)\n"
+            "  -e             negotiate VIRTIO_F_RING_EVENT_IDX\n",
+            name);
+}
+
+static int compare_ts(const void *a, const void *b)
+{
+    const struct vhd_blktrace_record *ra =
+        *(const struct vhd_blktrace_record **)a;
+    const struct vhd_blktrace_record *rb =
+        *(const struct vhd_blktrace_record **)b;
+
+    if (ra->ts_ns != rb->ts_ns) {
+        return ra->ts_ns < rb->ts_ns ? -1 : 1;
+    }
+    return ra < rb ? -1 : ra > rb;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t record_data_size(const struct vhd_blktrace_record *rec)
+{
+    size_t size = 0;
+    uint16_t i;
+
+    for (i = 0; i < rec->nsegs; i++) {
+        size += rec->seg_len[i];
+    }
+    return size;
+}
+
+static int load_trace(struct replay *r, const char *path)
+{
+    struct stat st;
+    char *buf;
+    size_t off, cap = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    buf = malloc(st.st_size);
+    for (off = 0; off < (size_t)st.st_size; ) {
+        ssize_t ret = read(fd, buf + off, st.st_size - off);
+        if (ret <= 0) {
+            fprintf(stderr, "%s: short read\n", path);
+            close(fd);
+            return -EIO;
+        }
+        off += ret;
+    }
+    close(fd);
+
+    r->hdr = (const struct vhd_blktrace_header *)buf;
+    if ((size_t)st.st_size < sizeof(*r->hdr) ||
+        memcmp(r->hdr->magic, VHD_BLKTRACE_MAGIC,
+               sizeof(VHD_BLKTRACE_MAGIC)) ||
+        r->hdr->version != VHD_BLKTRACE_VERSION) {
+        fprintf(stderr, "%s: not a block I/O trace\n", path);
+        return -EINVAL;
+    }
+
+    for (off = sizeof(*r->hdr); off < (size_t)st.st_size; ) {
+        const struct vhd_blktrace_record *rec = (const void *)(buf + off);
+
+        if (off + sizeof(*rec) > (size_t)st.st_size ||
+            off + vhd_blktrace_record_size(rec->nsegs) > (size_t)st.st_size) {
+            fprintf(stderr, "%s: truncated record at offset %zu\n", path,
+                    off);
+            break;
+        }
+        off += vhd_blktrace_record_size(rec->nsegs);
+
+        if (rec->nsegs > VIRTQ_DRIVER_MAX_BUFS - 2) {
+            fprintf(stderr, "skipping request with %u segments\n",
+                    rec->nsegs);
+            continue;
+        }
+
+        if (r->num_recs == cap) {
+            cap = cap ? cap * 2 : 1024;
+            r->recs = realloc(r->recs, cap * sizeof(r->recs[0]));
+        }
+        r->recs[r->num_recs++] = rec;
+        r->num_vrings = MAX(r->num_vrings, rec->vring + 1);
+        r->max_data = MAX(r->max_data, record_data_size(rec));
+    }
+
+    /* records come in completion order, replay them in submission order */
+    qsort(r->recs, r->num_recs, sizeof(r->recs[0]), compare_ts);
+    return 0;
+}
+
+static int setup_device(struct replay *r, enum vhd_bdev_backend_type backend,
+                        uint16_t qsz, bool indirect, bool event_idx)
+{
+    struct vhd_bdev_info bdev = {
+        .serial = "replay",
+        .block_size = VHD_SECTOR_SIZE,
+        .num_queues = r->num_vrings,
+        .total_blocks = r->hdr->capacity,
+        .features = VHD_BDEV_F_DISCARD | VHD_BDEV_F_WRITE_ZEROES,
+        .backend.type = backend,
+    };
+    uint16_t i;
+    int ret;
+
+    r->rq = vhd_create_request_queue();
+    if (!r->rq) {
+        return -ENOMEM;
+    }
+
+    virtio_blk_init_dev(&r->dev, &bdev);
+    if (backend != VHD_BDEV_BACKEND_CLIENT) {
+        r->dev.builtin = vhd_bdev_builtin_new(&bdev);
+        if (!r->dev.builtin) {
+            return -EINVAL;
+        }
+    }
+
+    r->vrings = calloc(r->num_vrings, sizeof(r->vrings[0]));
+    r->drivers = calloc(r->num_vrings, sizeof(r->drivers[0]));
+    r->vdev.rqs = &r->rq;
+    r->vdev.num_rqs = 1;
+    r->vdev.vrings = r->vrings;
+    r->vdev.num_queues = r->num_vrings;
+
+    for (i = 0; i < r->num_vrings; i++) {
+        ret = virtq_driver_init(&r->drivers[i], 0, qsz,
+                                sizeof(struct virtio_blk_req_hdr) +
+                                sizeof(struct virtio_blk_discard_write_zeroes) +
+                                r->max_data + 1,
+                                indirect, event_idx);
+        if (ret < 0) {
+            fprintf(stderr, "failed to create virtqueue: %s\n",
+                    strerror(-ret));
+            return ret;
+        }
+        r->vrings[i].vdev = &r->vdev;
+        r->vrings[i].rq = r->rq;
+        /* keeps the completions from reporting the vring drained */
+        r->vrings[i].started_in_rq = true;
+        ret = virtq_driver_attach(&r->drivers[i], &r->vrings[i].vq);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int add_request(struct replay *r, struct replay_req *req)
+{
+    const struct vhd_blktrace_record *rec = req->rec;
+    struct virtq_driver_buf bufs[VIRTQ_DRIVER_MAX_BUFS];
+    struct virtio_blk_req_hdr *hdr;
+    uint16_t nbufs = 0, i;
+    int ret;
+
+    bufs[nbufs++] = (struct virtq_driver_buf) { .len = sizeof(*hdr) };
+
+    switch (rec->type) {
+    case VHD_BDEV_READ:
+    case VHD_BDEV_WRITE:
+        for (i = 0; i < rec->nsegs; i++) {
+            bufs[nbufs++] = (struct virtq_driver_buf) {
+                .len = rec->seg_len[i],
+                .write = rec->type == VHD_BDEV_READ,
+            };
+        }
+        break;
+    case VHD_BDEV_DISCARD:
+    case VHD_BDEV_WRITE_ZEROES:
+        bufs[nbufs++] = (struct virtq_driver_buf) {
+            .len = sizeof(struct virtio_blk_discard_write_zeroes),
+        };
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    bufs[nbufs++] = (struct virtq_driver_buf) { .len = 1, .write = true };
+
+    ret = virtq_driver_add(&r->drivers[rec->vring], bufs, nbufs, req);
+    if (ret < 0) {
+        return ret;
+    }
+
+    hdr = bufs[0].ptr;
+    *hdr = (struct virtio_blk_req_hdr) { .sector = rec->sector };
+    switch (rec->type) {
+    case VHD_BDEV_READ:
+        hdr->type = VIRTIO_BLK_T_IN;
+        break;
+    case VHD_BDEV_WRITE:
+        hdr->type = VIRTIO_BLK_T_OUT;
+        break;
+    case VHD_BDEV_DISCARD:
+    case VHD_BDEV_WRITE_ZEROES:
+        hdr->type = rec->type == VHD_BDEV_DISCARD ?
+            VIRTIO_BLK_T_DISCARD : VIRTIO_BLK_T_WRITE_ZEROES;
+        *(struct virtio_blk_discard_write_zeroes *)bufs[1].ptr =
+            (struct virtio_blk_discard_write_zeroes) {
+                .sector = rec->sector,
+                .num_sectors = rec->nsectors,
+            };
+        break;
+    }
+
+    req->status = bufs[nbufs - 1].ptr;
+    *req->status = 0xff;
+    req->submit_ns = now_ns();
+    r->in_flight++;
+    return 0;
+}
+
+static enum vhd_bdev_io_result execute(struct replay *r,
+                                       struct vhd_bdev_io *bio)
+{
+    off_t offset = bio->first_sector * VHD_SECTOR_SIZE;
+    off_t len = bio->total_sectors * VHD_SECTOR_SIZE;
+    struct iovec iov[VIRTQ_DRIVER_MAX_BUFS];
+    ssize_t ret = 0;
+    uint32_t i;
+
+    if (r->fd < 0) {
+        return VHD_BDEV_SUCCESS;
+    }
+
+    switch (bio->type) {
+    case VHD_BDEV_READ:
+    case VHD_BDEV_WRITE:
+        for (i = 0; i < bio->sglist.nbuffers; i++) {
+            iov[i].iov_base = bio->sglist.buffers[i].base;
+            iov[i].iov_len = bio->sglist.buffers[i].len;
+        }
+        if (bio->type == VHD_BDEV_READ) {
+            ret = preadv(r->fd, iov, bio->sglist.nbuffers, offset);
+        } else {
+            ret = pwritev(r->fd, iov, bio->sglist.nbuffers, offset);
+        }
+        break;
+    case VHD_BDEV_DISCARD:
+        ret = fallocate(r->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        offset, len);
+        break;
+    case VHD_BDEV_WRITE_ZEROES:
+        ret = fallocate(r->fd, FALLOC_FL_ZERO_RANGE, offset, len);
+        break;
+    default:
+        /* zone requests are not replayed */
+        return VHD_BDEV_IOERR;
+    }
+
+    return ret < 0 ? VHD_BDEV_IOERR : VHD_BDEV_SUCCESS;
+}
+
+/*
+ * Play the backend, unless a built-in one serves the requests right on
+ * dispatch: run everything dispatched so far to completion
+ */
+static void process_requests(struct replay *r)
+{
+    struct vhd_request req;
+    bool completed = false;
+    uint16_t i;
+
+    for (i = 0; i < r->num_vrings; i++) {
+        virtio_blk_dispatch_requests(&r->dev, &r->vrings[i].vq);
+    }
+
+    while (vhd_dequeue_request(r->rq, &req)) {
+        struct vhd_bdev_io *bio = vhd_get_bdev_io(req.io);
+
+        vhd_complete_bio(req.io, execute(r, bio));
+        completed = true;
+    }
+
+    if (r->dev.builtin && r->in_flight) {
+        completed = true;
+    }
+
+    /* the completion bottom half pushes the used elements */
+    if (completed) {
+        vhd_run_queue(r->rq);
+    }
+}
+
+static void reap_completions(struct replay *r)
+{
+    struct replay_req *req;
+    uint64_t now = now_ns();
+    uint16_t i;
+
+    for (i = 0; i < r->num_vrings; i++) {
+        while (virtq_driver_get(&r->drivers[i], (void **)&req, NULL)) {
+            r->latencies[r->completed++] = now - req->submit_ns;
+            r->in_flight--;
+            r->bytes += (uint64_t)req->rec->nsectors * VHD_SECTOR_SIZE;
+            if (*req->status != VIRTIO_BLK_S_OK) {
+                r->failed++;
+            }
+        }
+    }
+}
+
+static void wait_until(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ull,
+        .tv_nsec = deadline % 1000000000ull,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+        ;
+    }
+}
+
+static void run(struct replay *r, bool asap)
+{
+    uint64_t start = now_ns();
+    size_t next = 0;
+
+    while (next < r->num_recs) {
+        struct replay_req *req = &r->reqs[next];
+        int ret;
+
+        req->rec = r->recs[next];
+        if (!asap) {
+            wait_until(start + req->rec->ts_ns);
+        }
+
+        ret = add_request(r, req);
+        if (ret == -ENOSPC) {
+            /* queue full: let the device catch up */
+            process_requests(r);
+            reap_completions(r);
+            continue;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "failed to add request: %s\n", strerror(-ret));
+            r->latencies[r->completed++] = 0;
+            r->failed++;
+        }
+        next++;
+
+        /*
+         * Kick the device for every request when keeping the recorded pace;
+         * otherwise keep queueing until the virtqueue is full.
+         */
+        if (!asap) {
+            process_requests(r);
+            reap_completions(r);
+        }
+    }
+
+    while (r->completed < r->num_recs) {
+        process_requests(r);
+        reap_completions(r);
+    }
+}
+
+static void print_latencies(const char *what, uint64_t *lat, size_t n)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    if (!n) {
+        return;
+    }
+
+    qsort(lat, n, sizeof(lat[0]), compare_u64);
+    for (i = 0; i < n; i++) {
+        sum += lat[i];
+    }
+
+    printf("%s latency, us: avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n", what,
+           sum / 1e3 / n, lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3,
+           lat[n - 1] / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    const char *trace_path = NULL, *file_path = NULL, *out_path = NULL;
+    struct replay r = { .fd = -1 };
+    enum vhd_bdev_backend_type backend = VHD_BDEV_BACKEND_CLIENT;
+    bool asap = false, indirect = true, event_idx = false;
+    unsigned long qsz = 128;
+    uint64_t start, elapsed;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:f:b:o:aq:deh")) != -1) {
+        switch (opt) {
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'f':
+            file_path = optarg;
+            break;
+        case 'b':
+            if (!strcmp(optarg, "null")) {
+                backend = VHD_BDEV_BACKEND_NULL;
+            } else if (!strcmp(optarg, "ram")) {
+                backend = VHD_BDEV_BACKEND_RAM;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'a':
+            asap = true;
+            break;
+        case 'q':
+            qsz = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            indirect = false;
+            break;
+        case 'e':
+            event_idx = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (!trace_path || !qsz || qsz > VIRTQ_SIZE_MAX ||
+        (file_path && backend != VHD_BDEV_BACKEND_CLIENT)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    g_log_fn = vhd_log_stderr;
+
+    if (load_trace(&r, trace_path) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (!r.num_recs) {
+        printf("empty trace\n");
+        return EXIT_SUCCESS;
+    }
+
+    if (file_path) {
+        r.fd = open(file_path, O_RDWR);
+        if (r.fd < 0) {
+            fprintf(stderr, "%s: %s\n", file_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (setup_device(&r, backend, qsz, indirect, event_idx) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (out_path) {
+        int ret = virtio_blk_start_trace(&r.dev, out_path);
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", out_path, strerror(-ret));
+            return EXIT_FAILURE;
+        }
+    }
+
+    r.reqs = calloc(r.num_recs, sizeof(r.reqs[0]));
+    r.latencies = calloc(r.num_recs, sizeof(r.latencies[0]));
+
+    start = now_ns();
+    run(&r, asap);
+    elapsed = now_ns() - start;
+
+    printf("replayed %zu requests (%zu failed) on %u vrings in %.3f s: "
+           "%.0f IOPS, %.1f MiB/s\n", r.completed, r.failed, r.num_vrings,
+           elapsed / 1e9, r.completed * 1e9 / elapsed,
+           r.bytes * 1e9 / elapsed / (1 << 20));
+    print_latencies("replay", r.latencies, r.completed);
+
+    for (i = 0; i < r.num_recs; i++) {
+        r.latencies[i] = r.recs[i]->latency_ns;
+    }
+    printf("recorded span %.3f s\n", r.recs[r.num_recs - 1]->ts_ns / 1e9);
+    print_latencies("recorded", r.latencies, r.num_recs);
+
+    for (i = 0; i < r.num_vrings; i++) {
+        virtio_virtq_release(&r.vrings[i].vq);
+        virtq_driver_destroy(&r.drivers[i]);
+    }
+    virtio_blk_destroy_dev(&r.dev);
+    if (r.dev.builtin) {
+        vhd_bdev_builtin_free(r.dev.builtin);
+    }
+    vhd_stop_queue(r.rq);
+    vhd_run_queue(r.rq);
+    vhd_release_request_queue(r.rq);
+    if (r.fd >= 0) {
+        close(r.fd);
+    }
+    return r.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
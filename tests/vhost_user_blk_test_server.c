@@ -11,11 +11,13 @@
 #include <sys/stat.h>
 #include <sys/eventfd.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <sched.h>
 
 #include "catomic.h"
 #include "vhost/server.h"
@@ -23,6 +25,7 @@
 #include "test_utils.h"
 #include "platform.h"
 #include "vdev.h"
+#include "shm_backend_proto.h"
 
 #define DIE(fmt, ...)                              \
 do {                                               \
@@ -53,14 +56,37 @@ struct request_stats {
  */
 struct disk_config {
     const char *socket_path;
+    const char *vduse_name;
     const char *serial;
     const char *blk_file;
+    const char *backend;
+    unsigned long size;
+    unsigned long latency;
+    bool zero_fill;
+    bool hugepages;
     unsigned long delay;
     bool readonly;
     bool support_discard;
     bool support_write_zeroes;
     unsigned long batch_size;
     unsigned long num_rqs;
+    unsigned long mpmc_workers;
+    unsigned long mpmc_ring;
+    unsigned long count;
+    struct vhd_fault_delay submit_delay;
+    struct vhd_fault_delay complete_delay;
+    unsigned long read_error_ppm;
+    unsigned long write_error_ppm;
+    unsigned long fault_seed;
+    bool order_writes;
+    bool in_order;
+    bool migrate_inflight;
+    unsigned long backing_id;
+    unsigned long readahead_max;
+    unsigned long zone_size;
+    unsigned long max_open_zones;
+    bool track_zeroes;
+    unsigned long align_block_size;
 };
 
 /*
@@ -73,17 +99,73 @@ struct disk {
     struct vhd_bdev_info info;
     int fd;
 
-    pthread_t *completion_threads;
-    pthread_t *submission_threads;
-
+    /* either own queues or the shared ones */
     struct queue *qdevs;
+    unsigned long num_qdevs;
+    bool shared_queues;
+
+    /* updated from all the queues serving the disk */
+    struct request_stats prev_stats, cur_stats;
+
+    /* readahead hints on the reads dequeued; only counted for now */
+    uint64_t readahead_hints;
+    uint64_t readahead_sectors;
+
+    /* the whole disk, for a fresh ram disk tracking the known-zero ranges */
+    struct vhd_bdev_range zero_range;
+};
+
+#define MAX_NUM_DISKS 4096
+
+/* guest memory map announced to the out-of-process backend */
+struct shm_map_rec {
+    uint64_t id;
+    /* channels that announced it */
+    unsigned refs;
+    uint32_t num_regions;
+    struct shm_msg_region regions[SHM_PROTO_MAX_REGIONS];
+    int fds[SHM_PROTO_MAX_REGIONS];
+    struct shm_map_rec *next;
 };
 
-#define MAX_NUM_DISKS 8
+/*
+ * Out-of-process backend serving the aio disks through shared memory
+ * channels attached to the request queues, see shm_backend.c.
+ */
+struct shm_backend {
+    const char *path;
+    struct disks_context *ctx;
+
+    /* protects the channel list, held across channel resets */
+    pthread_mutex_t channels_lock;
+    struct vhd_shm_channel *channels[SHM_PROTO_MAX_CHANNELS];
+    unsigned num_channels;
+
+    /* protects the rest */
+    pthread_mutex_t lock;
+    int sock;
+    pid_t pid;
+    bool stopping;
+    struct shm_map_rec *maps;
+
+    pthread_t supervisor;
+};
 
 struct disks_context {
-    struct disk disks[MAX_NUM_DISKS];
+    struct disk *disks;
     size_t num_disks;
+
+    /* request queues shared by all the disks, if any */
+    struct queue *shared_qdevs;
+    unsigned long num_shared_rqs;
+    /* the pool running the shared queues instead of our own threads */
+    bool use_rq_pool;
+    struct vhd_rq_pool *rq_pool;
+
+    struct shm_backend shm;
+
+    /* account the CPU cost of the request queue threads */
+    bool perf_counters;
 };
 
 /*
@@ -95,12 +177,23 @@ struct queue {
     unsigned long delay;
     io_context_t io_ctx;
     unsigned batch_size;
+    struct vhd_shm_channel *shm_channel;
+    struct vhd_rq_metrics prev_metrics;
+
+    pthread_t completion_thread;
+    pthread_t submission_thread;
+
+    /* multi-consumer queue: the threads taking the requests off it */
+    unsigned long num_workers;
+    pthread_t *workers;
+    bool stop_workers;
 };
 
 /*
  * Single IO request. Also map libvhost's vhd_buffer to iovec.
  */
 struct request {
+    struct disk *disk;
     struct vhd_io *io;
     struct iocb ios;
     bool bounce_buf;
@@ -161,6 +254,7 @@ static struct iocb *prepare_io_operation(struct vhd_request *lib_req)
     trace_io_op(bio);
 
     req = calloc(1, sizeof(struct request) + sizeof(struct iovec) * nbufs);
+    req->disk = bdev;
     req->io = lib_req->io;
 
     /*
@@ -244,6 +338,15 @@ static void complete_request(struct request *req,
     free(req);
 }
 
+/* whether @bio covers whole blocks of @d only */
+static bool is_block_aligned(struct disk *d, struct vhd_bdev_io *bio)
+{
+    uint64_t block_sectors = d->info.block_size / VHD_SECTOR_SIZE;
+
+    return !(bio->first_sector % block_sectors) &&
+        !(bio->total_sectors % block_sectors);
+}
+
 static int prepare_batch(struct vhd_request_queue *rq,
                          struct iocb **ios, int batch_size,
                          uint64_t *nr_discards)
@@ -253,8 +356,20 @@ static int prepare_batch(struct vhd_request_queue *rq,
     struct vhd_bdev_io *bio;
 
     while (nr < batch_size && vhd_dequeue_request(rq, &req)) {
+        struct disk *d = vhd_vdev_get_priv(req.vdev);
+
         bio = vhd_get_bdev_io(req.io);
 
+        /* play a backend that can't do anything but whole blocks */
+        if (d->info.align_to_blocks && !is_block_aligned(d, bio)) {
+            vhd_log_stderr(LOG_ERROR, "%s request (%" PRIu64 "s, +%" PRIu64
+                           "s) is not block-aligned",
+                           bio_type_to_str(bio->type), bio->first_sector,
+                           bio->total_sectors);
+            vhd_complete_bio(req.io, VHD_BDEV_IOERR);
+            continue;
+        }
+
         /*
          * Pretend we discarded the sectors, and skip the request
          * for the batch as we don't need it there.
@@ -263,15 +378,69 @@ static int prepare_batch(struct vhd_request_queue *rq,
             trace_io_op(bio);
             vhd_complete_bio(req.io, VHD_BDEV_SUCCESS);
             (*nr_discards)++;
+            catomic_inc(&d->cur_stats.discards);
             continue;
         }
 
+        if (bio->readahead_sectors) {
+            catomic_inc(&d->readahead_hints);
+            catomic_add(&d->readahead_sectors, bio->readahead_sectors);
+        }
+
+        catomic_inc(&d->cur_stats.dequeued);
         ios[nr++] = prepare_io_operation(&req);
     }
 
     return nr;
 }
 
+/*
+ * Submit the batch of @nr requests, or as much of it as the kernel takes, and
+ * move the rest to the front of @ios.  Returns the number of requests taken
+ * off the batch, including the first one if it failed, which is flagged in
+ * @failed, or -EAGAIN if the kernel queue is full.
+ */
+static int submit_batch(io_context_t io_ctx, struct iocb **ios,
+                        struct disk **disks, int nr, bool *failed)
+{
+    int ret, j;
+
+    /* the requests may complete before io_submit returns */
+    for (j = 0; j < nr; j++) {
+        disks[j] = ((struct request *)ios[j]->data)->disk;
+    }
+
+    do {
+        ret = io_submit(io_ctx, nr, ios);
+    } while (ret == -EINTR);
+
+    if (ret == -EAGAIN) {
+        return ret;
+    }
+
+    /*
+     * submission failed for other reasons, fail the first request but
+     * keep the rest of the batch
+     */
+    *failed = ret < 0;
+    if (ret < 0) {
+        struct request *req = (*ios)->data;
+
+        PERROR("io_submit", -ret);
+        catomic_inc(&req->disk->cur_stats.sub_failed);
+        complete_request(req, VHD_BDEV_IOERR);
+        ret = 1;
+    } else {
+        for (j = 0; j < ret; j++) {
+            catomic_inc(&disks[j]->cur_stats.submitted);
+        }
+    }
+
+    /* move the rest of the batch to the front of the array */
+    memmove(ios, ios + ret, (nr - ret) * sizeof(ios[0]));
+    return ret;
+}
+
 /*
  * IO requests submission thread, that serve all requests in one vhost
  * eventloop.
@@ -280,11 +449,13 @@ static void *io_submission(void *opaque)
 {
     struct queue *qdev = opaque;
     struct iocb **ios = calloc(qdev->batch_size, sizeof(*ios));
+    struct disk **disks = calloc(qdev->batch_size, sizeof(*disks));
     int nr = 0;
     struct request_stats *stats = &qdev->cur_stats;
     uint64_t dequeued = 0, submitted = 0, sub_failed = 0, discards = 0;
 
     while (true) {
+        bool failed;
         int ret;
 
         ret = vhd_run_queue(qdev->rq);
@@ -305,9 +476,7 @@ static void *io_submission(void *opaque)
                 break;
             }
 
-            do {
-                ret = io_submit(qdev->io_ctx, nr, ios);
-            } while (ret == -EINTR);
+            ret = submit_batch(qdev->io_ctx, ios, disks, nr, &failed);
 
             /*
              * kernel queue full, punt the re-submission to later event
@@ -317,21 +486,9 @@ static void *io_submission(void *opaque)
                 break;
             }
 
-            /*
-             * submission failed for other reasons, fail the first request but
-             * keep the rest of the batch
-             */
-            if (ret < 0) {
-                PERROR("io_submit", -ret);
-                complete_request((*ios)->data, VHD_BDEV_IOERR);
-                sub_failed++;
-                ret = 1;
-            }
-
             nr -= ret;
             submitted += ret;
-            /* move the rest of the batch to the front of the array */
-            memmove(ios, ios + ret, nr * sizeof(ios[0]));
+            sub_failed += failed;
         }
 
         catomic_set(&stats->dequeued, dequeued);
@@ -340,6 +497,70 @@ static void *io_submission(void *opaque)
         catomic_set(&stats->sub_failed, sub_failed);
     }
 
+    free(disks);
+    free(ios);
+    return NULL;
+}
+
+/*
+ * Runner of a multi-consumer request queue, which only serves the vrings;
+ * the workers below take the requests off the queue.
+ */
+static void *io_run_queue(void *opaque)
+{
+    struct queue *qdev = opaque;
+    int ret;
+
+    do {
+        ret = vhd_run_queue(qdev->rq);
+    } while (ret == -EAGAIN);
+
+    if (ret < 0) {
+        vhd_log_stderr(LOG_ERROR, "vhd_run_queue error: %d", ret);
+    }
+    return NULL;
+}
+
+/* how long a worker of a multi-consumer queue waits when out of requests */
+#define WORKER_IDLE_USECS 20
+
+/*
+ * Worker of a multi-consumer request queue, dequeueing the requests
+ * concurrently with the other workers of the queue and submitting them.
+ */
+static void *io_worker(void *opaque)
+{
+    struct queue *qdev = opaque;
+    struct iocb **ios = calloc(qdev->batch_size, sizeof(*ios));
+    struct disk **disks = calloc(qdev->batch_size, sizeof(*disks));
+    struct request_stats *stats = &qdev->cur_stats;
+    int nr = 0;
+
+    while (!catomic_read(&qdev->stop_workers)) {
+        uint64_t discards = 0;
+        bool failed;
+        int ret;
+
+        ret = prepare_batch(qdev->rq, ios + nr, qdev->batch_size - nr,
+                            &discards);
+        nr += ret;
+        catomic_add(&stats->dequeued, ret);
+        catomic_add(&stats->discards, discards);
+
+        /* out of requests, or the kernel queue is full: poll again later */
+        ret = nr ? submit_batch(qdev->io_ctx, ios, disks, nr, &failed) :
+            -EAGAIN;
+        if (ret == -EAGAIN) {
+            usleep(WORKER_IDLE_USECS);
+            continue;
+        }
+
+        nr -= ret;
+        catomic_add(&stats->submitted, ret);
+        catomic_add(&stats->sub_failed, failed);
+    }
+
+    free(disks);
     free(ios);
     return NULL;
 }
@@ -386,8 +607,10 @@ static void *io_completion(void *thread_data)
             vhd_log_stderr(LOG_DEBUG,
                            "IO result event for request with addr: %p", req);
 
+            catomic_inc(&req->disk->cur_stats.completed);
             if ((events[i].res2 != 0) ||
                 (events[i].res != bio->total_sectors * VHD_SECTOR_SIZE)) {
+                catomic_inc(&req->disk->cur_stats.comp_failed);
                 complete_request(req, VHD_BDEV_IOERR);
                 comp_failed++;
                 PERROR("IO request", -events[i].res);
@@ -411,6 +634,43 @@ static void *io_completion(void *thread_data)
 /*
  * Prepare disk before server starts.
  */
+static int init_builtin_disk(struct disk *d)
+{
+    struct disk_config *conf = &d->conf;
+
+    if (!strcmp(conf->backend, "null")) {
+        d->info.backend.type = VHD_BDEV_BACKEND_NULL;
+    } else if (!strcmp(conf->backend, "ram")) {
+        d->info.backend.type = VHD_BDEV_BACKEND_RAM;
+    } else {
+        vhd_log_stderr(LOG_ERROR, "Unknown backend %s", conf->backend);
+        return -EINVAL;
+    }
+
+    if (!conf->size || conf->size % VHD_SECTOR_SIZE) {
+        vhd_log_stderr(LOG_ERROR, "Disk size must be a non-zero multiple of "
+                       "the sector size");
+        return -EINVAL;
+    }
+
+    d->fd = -1;
+    d->info.total_blocks = conf->size / VHD_SECTOR_SIZE;
+    d->info.backend.latency_us = conf->latency;
+    if (conf->zero_fill) {
+        d->info.backend.flags |= VHD_BDEV_BACKEND_F_ZERO_FILL;
+    }
+    if (conf->hugepages) {
+        d->info.backend.flags |= VHD_BDEV_BACKEND_F_HUGEPAGES;
+    }
+
+    if (conf->zone_size) {
+        d->info.zoned.model = VHD_BDEV_ZONED_HOST_MANAGED;
+        d->info.zoned.zone_sectors = conf->zone_size / VHD_SECTOR_SIZE;
+        d->info.zoned.max_open_zones = conf->max_open_zones;
+    }
+    return 0;
+}
+
 static int init_disk(struct disk *d)
 {
     struct disk_config *conf = &d->conf;
@@ -418,6 +678,14 @@ static int init_disk(struct disk *d)
     int ret = 0;
     int flags = (conf->readonly ? O_RDONLY : O_RDWR) | O_DIRECT;
 
+    if (conf->backend && strcmp(conf->backend, "aio")) {
+        ret = init_builtin_disk(d);
+        if (ret < 0) {
+            return ret;
+        }
+        goto set_info;
+    }
+
     d->fd = open(conf->blk_file, flags);
     if (d->fd < 0) {
         ret = errno;
@@ -434,11 +702,14 @@ static int init_disk(struct disk *d)
                        file_len % VHD_SECTOR_SIZE);
     }
 
+    d->info.total_blocks = file_len / VHD_SECTOR_SIZE;
+
+set_info:
     d->info.socket_path = conf->socket_path;
+    d->info.vduse_name = conf->vduse_name;
     d->info.serial = conf->serial;
     d->info.block_size = VHD_SECTOR_SIZE;
     d->info.num_queues = 256; /* Max count of virtio queues */
-    d->info.total_blocks = file_len / VHD_SECTOR_SIZE;
     d->info.map_cb = NULL;
     d->info.unmap_cb = NULL;
 
@@ -452,6 +723,41 @@ static int init_disk(struct disk *d)
     if (conf->support_write_zeroes) {
         d->info.features |= VHD_BDEV_F_WRITE_ZEROES;
     }
+    if (conf->in_order) {
+        d->info.features |= VHD_BDEV_F_IN_ORDER;
+    }
+    if (conf->migrate_inflight) {
+        d->info.features |= VHD_BDEV_F_MIGRATE_INFLIGHT;
+    }
+
+    d->info.order_overlapping_writes = conf->order_writes;
+    d->info.backing_id = conf->backing_id;
+    d->info.readahead_max_sectors = conf->readahead_max / VHD_SECTOR_SIZE;
+
+    if (conf->track_zeroes) {
+        d->info.zeroes.enabled = true;
+        /* the ram backend punches holes for discards, and starts empty */
+        if (d->info.backend.type == VHD_BDEV_BACKEND_RAM) {
+            d->info.zeroes.discard_zeroes = true;
+            d->zero_range.num_sectors = d->info.total_blocks;
+            d->info.zeroes.ranges = &d->zero_range;
+            d->info.zeroes.num_ranges = 1;
+        }
+    }
+
+    if (conf->align_block_size) {
+        if (conf->align_block_size % VHD_SECTOR_SIZE ||
+            (d->info.total_blocks * VHD_SECTOR_SIZE) %
+            conf->align_block_size) {
+            vhd_log_stderr(LOG_ERROR, "Disk size must be a multiple of the "
+                           "aligned block size");
+            return -EINVAL;
+        }
+        d->info.block_size = conf->align_block_size;
+        d->info.total_blocks = d->info.total_blocks * VHD_SECTOR_SIZE /
+                               conf->align_block_size;
+        d->info.align_to_blocks = true;
+    }
 
     return 0;
 }
@@ -469,8 +775,19 @@ static void usage(const char *cmd)
     printf("  -d, --disk=DISK where DISK consists of the following "
            "arguments:\n");
     printf("      ,socket-path=PATH  vhost-user Unix domain socket path\n");
+    printf("      ,vduse-name=NAME   serve as VDUSE device NAME instead of "
+           "over socket-path\n");
     printf("      ,serial=STRING     disk serial\n");
     printf("      ,blk-file=PATH     block device or file path\n");
+    printf("      ,backend=aio|null|ram serve i/o with libaio on blk-file "
+           "(default) or with a library built-in backend\n");
+    printf("      ,size=BYTES        disk size for the built-in backends\n");
+    printf("      ,latency=USECS     latency of the built-in backends\n");
+    printf("      ,zero-fill=on|off  null backend zeroes read buffers\n");
+    printf("      ,hugepages=on|off  ram backend uses huge pages\n");
+    printf("      ,zone-size=BYTES   ram backend emulates a host-managed "
+           "zoned disk with zones of BYTES\n");
+    printf("      ,max-open-zones=NUM limit of the zones open at a time\n");
     printf("      ,readonly=on|off   readonly block device\n");
     printf("      ,discard=on|off    declare discard request support "
            "to guest\n");
@@ -480,6 +797,47 @@ static void usage(const char *cmd)
     printf("      ,num-rqs=NUM       NUM of rqs to spawn\n");
     printf("      ,batch-size=NUM    submit/complete i/o in batches "
            "of up to NUM\n");
+    printf("      ,mpmc-workers=NUM  make the rqs multi-consumer and take "
+           "the requests off each of them in NUM worker threads\n");
+    printf("      ,mpmc-ring=NUM     capacity of the handover ring of the "
+           "multi-consumer rqs, a power of two (default: 256)\n");
+    printf("      ,submit-delay=DELAY hold each request before the backend "
+           "for DELAY, one of fixed:USECS, exp:MEAN_USECS or "
+           "bimodal:USECS:SLOW_USECS:SLOW_PPM\n");
+    printf("      ,complete-delay=DELAY hold each completion for DELAY\n");
+    printf("      ,read-error-ppm=NUM fail NUM reads per million\n");
+    printf("      ,write-error-ppm=NUM fail NUM writes, discards and "
+           "write-zeroes per million\n");
+    printf("      ,fault-seed=NUM    seed of the injected delays and errors\n");
+    printf("      ,order-writes=on|off hold requests overlapping writes in "
+           "flight until those complete\n");
+    printf("      ,in-order=on|off   offer VIRTIO_F_IN_ORDER and return "
+           "completions in batches\n");
+    printf("      ,migrate-inflight=on|off pass the requests in flight in "
+           "the device state on migration instead of waiting for them\n");
+    printf("      ,backing-id=NUM    serve reads covered by reads in flight "
+           "on the disks with the same non-zero NUM from those\n");
+    printf("      ,readahead-max=BYTES detect sequential reads and count "
+           "the readahead hints of up to BYTES\n");
+    printf("      ,track-zeroes=on|off serve the reads of the ranges known "
+           "to be zero without the backend; a ram disk starts all zero\n");
+    printf("      ,align-block-size=BYTES pass only whole blocks of BYTES to "
+           "the backend, which fails any other request, and read-modify-write "
+           "the partial ones\n");
+    printf("      ,count=NUM         create NUM disks from this template, "
+           "with %%d in socket-path, serial and blk-file replaced with "
+           "the disk index\n");
+    printf("  -s, --shared-rqs=NUM    serve all disks with NUM shared request "
+           "queues instead of per-disk ones; per-disk num-rqs, batch-size, "
+           "mpmc-workers and delay are ignored then\n");
+    printf("  -b, --shm-backend=PATH  serve the aio disks with the "
+           "out-of-process backend at PATH through shared memory rings; "
+           "per-disk i/o stats stay at zero then\n");
+    printf("  -P, --rq-pool           run the shared request queues in a "
+           "pool of library threads pinned to the CPUs the server may run "
+           "on, rather than in threads of its own\n");
+    printf("  -p, --perf-counters     report the CPU cost per request of "
+           "the request queue threads with the queue stats\n");
     printf("  -m, --monitor=PATH      Unix socket for interactive command line "
            "to operate with sever. Or 'stdio' keyword to operate through stdin "
            "and stdout\n");
@@ -525,28 +883,105 @@ static bool set_ul(const char *val, void *dst)
     return true;
 }
 
+static bool set_fault_delay(const char *val, void *dst)
+{
+    struct vhd_fault_delay *delay = dst;
+    unsigned us, slow_us, slow_ppm;
+    int pos = -1;
+
+    if (sscanf(val, "fixed:%u%n", &us, &pos) == 1 && !val[pos]) {
+        *delay = (struct vhd_fault_delay) {
+            .type = VHD_FAULT_DELAY_FIXED,
+            .us = us,
+        };
+    } else if (sscanf(val, "exp:%u%n", &us, &pos) == 1 && !val[pos]) {
+        *delay = (struct vhd_fault_delay) {
+            .type = VHD_FAULT_DELAY_EXPONENTIAL,
+            .us = us,
+        };
+    } else if (sscanf(val, "bimodal:%u:%u:%u%n", &us, &slow_us, &slow_ppm,
+                      &pos) == 3 && !val[pos]) {
+        *delay = (struct vhd_fault_delay) {
+            .type = VHD_FAULT_DELAY_BIMODAL,
+            .us = us,
+            .slow_us = slow_us,
+            .slow_ppm = slow_ppm,
+        };
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
 enum disk_arg {
     DISK_ARG_SOCKET_PATH = 0,
     DISK_ARG_SERIAL,
     DISK_ARG_BLK_FILE,
+    DISK_ARG_BACKEND,
+    DISK_ARG_SIZE,
+    DISK_ARG_LATENCY,
+    DISK_ARG_ZERO_FILL,
+    DISK_ARG_HUGEPAGES,
     DISK_ARG_READONLY,
     DISK_ARG_DISCARD,
     DISK_ARG_WRITE_ZEROES,
     DISK_ARG_DELAY,
     DISK_ARG_NUM_RQS,
     DISK_ARG_BATCH_SIZE,
+    DISK_ARG_MPMC_WORKERS,
+    DISK_ARG_MPMC_RING,
+    DISK_ARG_COUNT,
+    DISK_ARG_SUBMIT_DELAY,
+    DISK_ARG_COMPLETE_DELAY,
+    DISK_ARG_READ_ERROR_PPM,
+    DISK_ARG_WRITE_ERROR_PPM,
+    DISK_ARG_FAULT_SEED,
+    DISK_ARG_ORDER_WRITES,
+    DISK_ARG_IN_ORDER,
+    DISK_ARG_MIGRATE_INFLIGHT,
+    DISK_ARG_BACKING_ID,
+    DISK_ARG_READAHEAD_MAX,
+    DISK_ARG_ZONE_SIZE,
+    DISK_ARG_MAX_OPEN_ZONES,
+    DISK_ARG_TRACK_ZEROES,
+    DISK_ARG_ALIGN_BLOCK_SIZE,
+    DISK_ARG_VDUSE_NAME,
 };
 
 static char *const disk_arg_tokens[] = {
     [DISK_ARG_SOCKET_PATH] = "socket-path",
     [DISK_ARG_SERIAL] = "serial",
     [DISK_ARG_BLK_FILE] = "blk-file",
+    [DISK_ARG_BACKEND] = "backend",
+    [DISK_ARG_SIZE] = "size",
+    [DISK_ARG_LATENCY] = "latency",
+    [DISK_ARG_ZERO_FILL] = "zero-fill",
+    [DISK_ARG_HUGEPAGES] = "hugepages",
     [DISK_ARG_READONLY] = "readonly",
     [DISK_ARG_DISCARD] = "discard",
     [DISK_ARG_WRITE_ZEROES] = "write-zeroes",
     [DISK_ARG_DELAY] = "delay",
     [DISK_ARG_NUM_RQS] = "num-rqs",
     [DISK_ARG_BATCH_SIZE] = "batch-size",
+    [DISK_ARG_MPMC_WORKERS] = "mpmc-workers",
+    [DISK_ARG_MPMC_RING] = "mpmc-ring",
+    [DISK_ARG_COUNT] = "count",
+    [DISK_ARG_SUBMIT_DELAY] = "submit-delay",
+    [DISK_ARG_COMPLETE_DELAY] = "complete-delay",
+    [DISK_ARG_READ_ERROR_PPM] = "read-error-ppm",
+    [DISK_ARG_WRITE_ERROR_PPM] = "write-error-ppm",
+    [DISK_ARG_FAULT_SEED] = "fault-seed",
+    [DISK_ARG_ORDER_WRITES] = "order-writes",
+    [DISK_ARG_IN_ORDER] = "in-order",
+    [DISK_ARG_MIGRATE_INFLIGHT] = "migrate-inflight",
+    [DISK_ARG_BACKING_ID] = "backing-id",
+    [DISK_ARG_READAHEAD_MAX] = "readahead-max",
+    [DISK_ARG_ZONE_SIZE] = "zone-size",
+    [DISK_ARG_MAX_OPEN_ZONES] = "max-open-zones",
+    [DISK_ARG_TRACK_ZEROES] = "track-zeroes",
+    [DISK_ARG_ALIGN_BLOCK_SIZE] = "align-block-size",
+    [DISK_ARG_VDUSE_NAME] = "vduse-name",
     NULL
 };
 
@@ -566,12 +1001,36 @@ static struct arg_setter disk_arg_setters[] = {
     [DISK_ARG_SOCKET_PATH] = { set_string, CONF_FIELD(socket_path) },
     [DISK_ARG_SERIAL] = { set_string, CONF_FIELD(serial) },
     [DISK_ARG_BLK_FILE] = { set_string, CONF_FIELD(blk_file) },
+    [DISK_ARG_BACKEND] = { set_string, CONF_FIELD(backend) },
+    [DISK_ARG_SIZE] = { set_ul, CONF_FIELD(size) },
+    [DISK_ARG_LATENCY] = { set_ul, CONF_FIELD(latency) },
+    [DISK_ARG_ZERO_FILL] = { set_bool, CONF_FIELD(zero_fill) },
+    [DISK_ARG_HUGEPAGES] = { set_bool, CONF_FIELD(hugepages) },
     [DISK_ARG_READONLY] = { set_bool, CONF_FIELD(readonly) },
     [DISK_ARG_DISCARD] = { set_bool, CONF_FIELD(support_discard) },
     [DISK_ARG_WRITE_ZEROES] = { set_bool, CONF_FIELD(support_write_zeroes) },
     [DISK_ARG_DELAY] = { set_ul, CONF_FIELD(delay) },
     [DISK_ARG_NUM_RQS] = { set_ul, CONF_FIELD(num_rqs) },
     [DISK_ARG_BATCH_SIZE] = { set_ul, CONF_FIELD(batch_size) },
+    [DISK_ARG_MPMC_WORKERS] = { set_ul, CONF_FIELD(mpmc_workers) },
+    [DISK_ARG_MPMC_RING] = { set_ul, CONF_FIELD(mpmc_ring) },
+    [DISK_ARG_COUNT] = { set_ul, CONF_FIELD(count) },
+    [DISK_ARG_SUBMIT_DELAY] = { set_fault_delay, CONF_FIELD(submit_delay) },
+    [DISK_ARG_COMPLETE_DELAY] = { set_fault_delay,
+                                  CONF_FIELD(complete_delay) },
+    [DISK_ARG_READ_ERROR_PPM] = { set_ul, CONF_FIELD(read_error_ppm) },
+    [DISK_ARG_WRITE_ERROR_PPM] = { set_ul, CONF_FIELD(write_error_ppm) },
+    [DISK_ARG_FAULT_SEED] = { set_ul, CONF_FIELD(fault_seed) },
+    [DISK_ARG_ORDER_WRITES] = { set_bool, CONF_FIELD(order_writes) },
+    [DISK_ARG_IN_ORDER] = { set_bool, CONF_FIELD(in_order) },
+    [DISK_ARG_MIGRATE_INFLIGHT] = { set_bool, CONF_FIELD(migrate_inflight) },
+    [DISK_ARG_BACKING_ID] = { set_ul, CONF_FIELD(backing_id) },
+    [DISK_ARG_READAHEAD_MAX] = { set_ul, CONF_FIELD(readahead_max) },
+    [DISK_ARG_ZONE_SIZE] = { set_ul, CONF_FIELD(zone_size) },
+    [DISK_ARG_MAX_OPEN_ZONES] = { set_ul, CONF_FIELD(max_open_zones) },
+    [DISK_ARG_TRACK_ZEROES] = { set_bool, CONF_FIELD(track_zeroes) },
+    [DISK_ARG_ALIGN_BLOCK_SIZE] = { set_ul, CONF_FIELD(align_block_size) },
+    [DISK_ARG_VDUSE_NAME] = { set_string, CONF_FIELD(vduse_name) },
 };
 
 static bool parse_disk_args(const char *args, struct disk_config *conf)
@@ -595,6 +1054,76 @@ static bool parse_disk_args(const char *args, struct disk_config *conf)
     return true;
 }
 
+/*
+ * Replace the first "%d" in a template disk config string with @idx.
+ */
+static const char *expand_template(const char *tmpl, unsigned long idx)
+{
+    const char *pos;
+    char *str;
+
+    if (!tmpl) {
+        return NULL;
+    }
+
+    pos = strstr(tmpl, "%d");
+    if (!pos) {
+        return strdup(tmpl);
+    }
+
+    if (asprintf(&str, "%.*s%lu%s", (int)(pos - tmpl), tmpl, idx,
+                 pos + 2) < 0) {
+        DIE("asprintf failed");
+    }
+    return str;
+}
+
+/*
+ * Add the disks described by @tmpl, count=N of them.
+ */
+static bool add_disks(struct disks_context *ctx, struct disk_config *tmpl)
+{
+    unsigned long i, count = tmpl->count ? tmpl->count : 1;
+
+    if (count > 1 && tmpl->vduse_name) {
+        if (!strstr(tmpl->vduse_name, "%d")) {
+            vhd_log_stderr(LOG_ERROR, "vduse-name of a disk template must "
+                           "contain %%d");
+            return false;
+        }
+    } else if (count > 1 && (!tmpl->socket_path ||
+                             !strstr(tmpl->socket_path, "%d"))) {
+        vhd_log_stderr(LOG_ERROR, "socket-path of a disk template must "
+                       "contain %%d");
+        return false;
+    }
+
+    if (ctx->num_disks + count > MAX_NUM_DISKS) {
+        DIE("too many disks specified, max is %d\n", MAX_NUM_DISKS);
+    }
+
+    ctx->disks = realloc(ctx->disks,
+                         (ctx->num_disks + count) * sizeof(ctx->disks[0]));
+
+    for (i = 0; i < count; i++) {
+        struct disk *d = &ctx->disks[ctx->num_disks++];
+
+        *d = (struct disk) { .conf = *tmpl };
+        d->conf.socket_path = expand_template(tmpl->socket_path, i);
+        d->conf.vduse_name = expand_template(tmpl->vduse_name, i);
+        d->conf.serial = expand_template(tmpl->serial, i);
+        d->conf.blk_file = expand_template(tmpl->blk_file, i);
+        d->conf.backend = expand_template(tmpl->backend, i);
+    }
+
+    vhd_free((void *)tmpl->socket_path);
+    vhd_free((void *)tmpl->vduse_name);
+    vhd_free((void *)tmpl->serial);
+    vhd_free((void *)tmpl->blk_file);
+    vhd_free((void *)tmpl->backend);
+    return true;
+}
+
 /*
  * Parse command line options.
  */
@@ -604,34 +1133,57 @@ static void parse_opts(int argc, char **argv, struct disks_context *ctx,
     int opt;
     do {
         static struct option long_options[] = {
-            {"disk",     1, NULL, 'd'},
-            {"monitor",  1, NULL, 'm'},
+            {"disk",       1, NULL, 'd'},
+            {"monitor",    1, NULL, 'm'},
+            {"shared-rqs", 1, NULL, 's'},
+            {"shm-backend", 1, NULL, 'b'},
+            {"perf-counters", 0, NULL, 'p'},
+            {"rq-pool",    0, NULL, 'P'},
             {0, 0, 0, 0}
         };
+        struct disk_config conf = {
+            .batch_size = 128,
+            .num_rqs = 1,
+            .mpmc_ring = 256,
+        };
 
-        opt = getopt_long(argc, argv, "d:m:", long_options, NULL);
+        opt = getopt_long(argc, argv, "d:m:s:b:pP", long_options, NULL);
 
         switch (opt) {
         case -1:
             break;
         case 'd':
-            if (ctx->num_disks == MAX_NUM_DISKS) {
-                DIE("too many disks specified, max is %d\n",
-                    MAX_NUM_DISKS);
-            }
-
-            if (!parse_disk_args(optarg, &ctx->disks[ctx->num_disks++].conf)) {
+            if (!parse_disk_args(optarg, &conf) || !add_disks(ctx, &conf)) {
                 goto out_bad_arg;
             }
             break;
         case 'm':
             *monitor = optarg;
             break;
+        case 's':
+            if (!set_ul(optarg, &ctx->num_shared_rqs) ||
+                ctx->num_shared_rqs < 1 ||
+                ctx->num_shared_rqs > VHD_MAX_REQUEST_QUEUES) {
+                goto out_bad_arg;
+            }
+            break;
+        case 'b':
+            ctx->shm.path = optarg;
+            break;
+        case 'p':
+            ctx->perf_counters = true;
+            break;
+        case 'P':
+            ctx->use_rq_pool = true;
+            break;
         default:
             goto out_bad_arg;
         }
     } while (opt != -1);
 
+    if (ctx->use_rq_pool && !ctx->num_shared_rqs) {
+        goto out_bad_arg;
+    }
     return;
 
 out_bad_arg:
@@ -714,6 +1266,45 @@ static void do_dump_stats(struct request_stats *new,
     old->ns = ns;
 }
 
+/*
+ * Per request costs of the queue thread since the previous dump; the counters
+ * the host doesn't provide are printed as zeroes.
+ */
+static void dump_perf_stats(struct queue *qdev)
+{
+    struct vhd_rq_metrics m, *old = &qdev->prev_metrics;
+    uint64_t completed;
+
+    vhd_get_rq_stat(qdev->rq, &m);
+    if (!m.perf_flags) {
+        return;
+    }
+
+    completed = m.completed - old->completed;
+    if (completed) {
+        vhd_log_stderr(LOG_INFO,
+                       "Perf%s: %"PRIu64" completed, "
+                       "%"PRIu64" ns cpu/IO, "
+                       "%"PRIu64" cycles/IO, "
+                       "%"PRIu64" instructions/IO, "
+                       "%"PRIu64" cache misses/IO, "
+                       "%"PRIu64" context switches/1000 IO",
+                       m.perf_flags & VHD_RQ_PERF_USER_ONLY ? " (user)" : "",
+                       completed,
+                       (m.perf_task_clock_ns - old->perf_task_clock_ns) /
+                       completed,
+                       (m.perf_cycles - old->perf_cycles) / completed,
+                       (m.perf_instructions - old->perf_instructions) /
+                       completed,
+                       (m.perf_cache_misses - old->perf_cache_misses) /
+                       completed,
+                       (m.perf_context_switches - old->perf_context_switches) *
+                       1000 / completed);
+    }
+
+    *old = m;
+}
+
 static void dump_per_queue_stats(struct queue *qdevs, unsigned long num_rqs,
                                  bool print_totals)
 {
@@ -722,32 +1313,96 @@ static void dump_per_queue_stats(struct queue *qdevs, unsigned long num_rqs,
     for (i = 0; i < num_rqs; ++i) {
         vhd_log_stderr(LOG_INFO, "======> QUEUE %lu", i);
         do_dump_stats(&qdevs[i].cur_stats, &qdevs[i].prev_stats, print_totals);
+        dump_perf_stats(&qdevs[i]);
+        if (qdevs[i].num_workers) {
+            struct vhd_rq_metrics m;
+
+            vhd_get_rq_stat(qdevs[i].rq, &m);
+            vhd_log_stderr(LOG_INFO, "Handover: %" PRIu64 " of %" PRIu64
+                           " requests overflowed the ring", m.overflowed,
+                           m.enqueued);
+        }
     }
 }
 
-static struct queue *init_queues(struct disk *d)
+static void dump_disk_stats(struct disk *d, bool print_totals)
+{
+    vhd_log_stderr(LOG_INFO, "======> DISK %s", d->conf.vduse_name ?
+                   d->conf.vduse_name : d->conf.socket_path);
+    do_dump_stats(&d->cur_stats, &d->prev_stats, print_totals);
+    if (d->conf.readahead_max) {
+        vhd_log_stderr(LOG_INFO, "Readahead: %" PRIu64 " hints, %" PRIu64
+                       " sectors", catomic_read(&d->readahead_hints),
+                       catomic_read(&d->readahead_sectors));
+    }
+}
+
+/*
+ * The built-in backends serve requests without the test server seeing them,
+ * so the per-disk counters stay at zero for them; the virtqueue counters of
+ * the current connection are the only ones available.
+ */
+static void dump_disk_vq_stats(struct disk *d)
+{
+    struct vhd_vq_metrics vq_metrics;
+    uint32_t i;
+
+    for (i = 0; i < d->info.num_queues; i++) {
+        if (vhd_vdev_get_queue_stat(d->handler, i, &vq_metrics) < 0) {
+            break;
+        }
+        vhd_log_stderr(LOG_INFO, "vq %" PRIu32 ": %" PRIu64 " requests, %"
+                       PRIu64 " completed, %" PRIu64 " of %" PRIu64
+                       " reads coalesced, %" PRIu64 " served and %" PRIu64
+                       " trimmed as known zeroes, %" PRIu64 " reads and %"
+                       PRIu64 " writes read-modify-written, %" PRIu64
+                       " waited, %" PRIu64 " of %" PRIu64
+                       " avail polls hit, %" PRIu64 " held behind writes",
+                       i, vq_metrics.request_total,
+                       vq_metrics.request_completed,
+                       vq_metrics.read_coalesce_hits,
+                       vq_metrics.read_coalesce_lookups,
+                       vq_metrics.read_zero_hits,
+                       vq_metrics.read_zero_trims,
+                       vq_metrics.rmw_reads,
+                       vq_metrics.rmw_writes,
+                       vq_metrics.rmw_waits,
+                       vq_metrics.avail_poll_hits,
+                       vq_metrics.avail_poll_hits +
+                       vq_metrics.avail_poll_misses,
+                       vq_metrics.order_held);
+    }
+}
+
+static struct queue *init_queues(unsigned long num_rqs,
+                                 unsigned long batch_size,
+                                 unsigned long delay,
+                                 unsigned long num_workers,
+                                 unsigned long ring_size)
 {
-    struct disk_config *conf = &d->conf;
-    struct vhd_request_queue *vqs[VHD_MAX_REQUEST_QUEUES];
     struct queue *qdevs;
     unsigned long i;
     uint64_t ns;
 
-    qdevs = calloc(conf->num_rqs, sizeof(struct queue));
+    qdevs = calloc(num_rqs, sizeof(struct queue));
     ns = clock_get_ns();
 
-    for (i = 0; i < conf->num_rqs; ++i) {
+    for (i = 0; i < num_rqs; ++i) {
         struct queue *qdev = &qdevs[i];
 
-        qdev->delay = conf->delay;
-        qdev->batch_size = conf->batch_size;
+        qdev->delay = delay;
+        qdev->batch_size = batch_size;
+        qdev->num_workers = num_workers;
 
         if (io_setup(qdev->batch_size, &qdev->io_ctx) < 0) {
             DIE("io_setup");
         }
 
-        vqs[i] = vhd_create_request_queue();
-        qdev->rq = vqs[i];
+        if (num_workers) {
+            qdev->rq = vhd_create_request_queue_mpmc(ring_size);
+        } else {
+            qdev->rq = vhd_create_request_queue();
+        }
         if (!qdev->rq) {
             DIE("vhd_create_request_queue failed");
         }
@@ -755,54 +1410,123 @@ static struct queue *init_queues(struct disk *d)
         qdev->prev_stats.ns = ns;
     }
 
-    d->handler = vhd_register_blockdev(&d->info, vqs, conf->num_rqs, d);
+    return qdevs;
+}
+
+/*
+ * The vrings of the disk are spread over its queues starting from
+ * @first_qdev, so that the disks sharing the queues don't all pile their
+ * first vrings on the first queue.
+ */
+static void register_disk(struct disk *d, unsigned long first_qdev)
+{
+    struct vhd_request_queue *vqs[VHD_MAX_REQUEST_QUEUES];
+    unsigned long i;
+
+    for (i = 0; i < d->num_qdevs; ++i) {
+        vqs[i] = d->qdevs[(first_qdev + i) % d->num_qdevs].rq;
+    }
+
+    d->prev_stats.ns = clock_get_ns();
+    d->handler = vhd_register_blockdev(&d->info, vqs, d->num_qdevs, d);
     if (!d->handler) {
         vhd_log_stderr(LOG_ERROR,
                        "vhd_register_blockdev: Can't register device");
-        DIE("init_queues failed");
+        DIE("register_disk failed");
     }
-
-    return qdevs;
 }
 
-static void create_threads(struct disk *d)
+static void setup_faults(struct disk *d)
 {
-    unsigned long i;
-    unsigned long num_rqs = d->conf.num_rqs;
+    struct disk_config *conf = &d->conf;
+    struct vhd_fault_config faults = {
+        .submit_delay = conf->submit_delay,
+        .complete_delay = conf->complete_delay,
+        .error_ppm = {
+            [VHD_BDEV_READ] = conf->read_error_ppm,
+            [VHD_BDEV_WRITE] = conf->write_error_ppm,
+            [VHD_BDEV_DISCARD] = conf->write_error_ppm,
+            [VHD_BDEV_WRITE_ZEROES] = conf->write_error_ppm,
+        },
+        .seed = conf->fault_seed,
+    };
 
-    d->completion_threads = malloc(sizeof(pthread_t) * num_rqs);
-    d->submission_threads = malloc(sizeof(pthread_t) * num_rqs);
+    if (!conf->submit_delay.type && !conf->complete_delay.type &&
+        !conf->read_error_ppm && !conf->write_error_ppm) {
+        return;
+    }
+
+    if (vhd_blockdev_set_faults(d->handler, &faults) < 0) {
+        DIE("vhd_blockdev_set_faults failed");
+    }
+}
+
+static void create_threads(struct queue *qdevs, unsigned long num_rqs)
+{
+    unsigned long i, j;
 
     for (i = 0; i < num_rqs; ++i) {
+        struct queue *qdev = &qdevs[i];
+
         /* start the worker thread(s) */
-        pthread_create(&d->completion_threads[i], NULL, io_completion,
-                       &d->qdevs[i]);
+        pthread_create(&qdev->completion_thread, NULL, io_completion, qdev);
 
         /* start libvhost request queue runner thread */
-        pthread_create(&d->submission_threads[i], NULL, io_submission,
-                       &d->qdevs[i]);
+        if (!qdev->num_workers) {
+            pthread_create(&qdev->submission_thread, NULL, io_submission,
+                           qdev);
+            continue;
+        }
+
+        pthread_create(&qdev->submission_thread, NULL, io_run_queue, qdev);
+        qdev->workers = calloc(qdev->num_workers, sizeof(qdev->workers[0]));
+        for (j = 0; j < qdev->num_workers; j++) {
+            pthread_create(&qdev->workers[j], NULL, io_worker, qdev);
+        }
     }
 }
 
-static void stop_and_release_threads(struct disk *d)
+static void enable_perf_counters(struct queue *qdevs, unsigned long num_rqs)
+{
+    unsigned long i;
+
+    for (i = 0; i < num_rqs; ++i) {
+        int ret = vhd_rq_enable_perf_counters(qdevs[i].rq);
+        if (ret < 0) {
+            vhd_log_stderr(LOG_WARNING, "no perf counters for queue %lu: %s",
+                           i, strerror(-ret));
+        }
+    }
+}
+
+static void stop_and_release_threads(struct queue *qdevs,
+                                     unsigned long num_rqs)
 {
     unsigned long i;
 
     /* For each do: */
-    for (i = 0; i < d->conf.num_rqs; ++i) {
+    for (i = 0; i < num_rqs; ++i) {
         /* 1. Stop a request queue */
-        vhd_stop_queue(d->qdevs[i].rq);
+        vhd_stop_queue(qdevs[i].rq);
 
         /* 2 Wait for queue's thread to join */
-        pthread_join(d->submission_threads[i], NULL);
+        pthread_join(qdevs[i].submission_thread, NULL);
+
+        /* 2.1 Stop the threads taking the requests off the queue */
+        if (qdevs[i].num_workers) {
+            unsigned long j;
+
+            catomic_set(&qdevs[i].stop_workers, true);
+            for (j = 0; j < qdevs[i].num_workers; j++) {
+                pthread_join(qdevs[i].workers[j], NULL);
+            }
+            free(qdevs[i].workers);
+        }
 
         /* 3. Stop the worker thread(s) */
-        pthread_kill(d->completion_threads[i], SIGUSR1);
-        pthread_join(d->completion_threads[i], NULL);
+        pthread_kill(qdevs[i].completion_thread, SIGUSR1);
+        pthread_join(qdevs[i].completion_thread, NULL);
     }
-
-    free(d->completion_threads);
-    free(d->submission_threads);
 }
 
 static void release_queues(struct queue *qdevs, unsigned long num_qdevs)
@@ -823,6 +1547,494 @@ static void release_queues(struct queue *qdevs, unsigned long num_qdevs)
     free(qdevs);
 }
 
+/* the number of requests the pool queues take off in one go */
+#define RQ_POOL_BATCH_SIZE 128
+
+/*
+ * Take the requests off a queue of the pool and submit them; called by the
+ * library in the queue thread after every event loop iteration.
+ */
+static void process_pool_rq(struct vhd_request_queue *rq, void *opaque)
+{
+    struct disks_context *ctx = opaque;
+    struct iocb *ios[RQ_POOL_BATCH_SIZE];
+    struct disk *disks[RQ_POOL_BATCH_SIZE];
+    struct queue *qdev = NULL;
+    unsigned long i;
+    int nr;
+
+    /* the queues may start running before they are all set up */
+    for (i = 0; i < ctx->num_shared_rqs; i++) {
+        if (catomic_read(&ctx->shared_qdevs[i].rq) == rq) {
+            qdev = &ctx->shared_qdevs[i];
+            break;
+        }
+    }
+    if (!qdev) {
+        return;
+    }
+
+    do {
+        struct request_stats *stats = &qdev->cur_stats;
+        uint64_t discards = 0;
+        int left;
+
+        nr = prepare_batch(rq, ios, RQ_POOL_BATCH_SIZE, &discards);
+        catomic_add(&stats->dequeued, nr);
+        catomic_add(&stats->discards, discards);
+
+        for (left = nr; left; ) {
+            bool failed;
+            int ret = submit_batch(qdev->io_ctx, ios, disks, left, &failed);
+
+            /* kernel queue full, wait for the completion thread to reap */
+            if (ret == -EAGAIN) {
+                usleep(WORKER_IDLE_USECS);
+                continue;
+            }
+
+            left -= ret;
+            catomic_add(&stats->submitted, ret);
+            catomic_add(&stats->sub_failed, failed);
+        }
+    } while (nr == RQ_POOL_BATCH_SIZE);
+}
+
+/*
+ * Create the shared queues as a pool pinned to the CPUs the server may run
+ * on; only the completion threads are ours.
+ */
+static void init_pool_queues(struct disks_context *ctx)
+{
+    struct vhd_rq_pool_config cfg = {
+        .num_rqs = ctx->num_shared_rqs,
+        .process = process_pool_rq,
+        .opaque = ctx,
+    };
+    struct vhd_request_queue **rqs;
+    int cpus[CPU_SETSIZE];
+    cpu_set_t cpuset;
+    unsigned long i;
+    uint64_t ns;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) < 0) {
+        DIE("sched_getaffinity: %s", strerror(errno));
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpuset)) {
+            cpus[cfg.num_cpus++] = cpu;
+        }
+    }
+    cfg.cpus = cpus;
+
+    ctx->shared_qdevs = calloc(ctx->num_shared_rqs, sizeof(struct queue));
+    ns = clock_get_ns();
+
+    for (i = 0; i < ctx->num_shared_rqs; i++) {
+        struct queue *qdev = &ctx->shared_qdevs[i];
+
+        qdev->batch_size = RQ_POOL_BATCH_SIZE;
+        if (io_setup(qdev->batch_size, &qdev->io_ctx) < 0) {
+            DIE("io_setup");
+        }
+        qdev->prev_stats.ns = ns;
+        pthread_create(&qdev->completion_thread, NULL, io_completion, qdev);
+    }
+
+    ctx->rq_pool = vhd_create_rq_pool(&cfg);
+    if (!ctx->rq_pool) {
+        DIE("vhd_create_rq_pool failed");
+    }
+
+    vhd_rq_pool_get_rqs(ctx->rq_pool, &rqs);
+    for (i = 0; i < ctx->num_shared_rqs; i++) {
+        catomic_set(&ctx->shared_qdevs[i].rq, rqs[i]);
+        vhd_log_stderr(LOG_INFO, "Pool queue %lu: numa node %d", i,
+                       vhd_rq_get_numa_node(rqs[i]));
+    }
+}
+
+static void release_pool_queues(struct disks_context *ctx)
+{
+    unsigned long i;
+
+    vhd_release_rq_pool(ctx->rq_pool);
+
+    for (i = 0; i < ctx->num_shared_rqs; i++) {
+        struct queue *qdev = &ctx->shared_qdevs[i];
+
+        pthread_kill(qdev->completion_thread, SIGUSR1);
+        pthread_join(qdev->completion_thread, NULL);
+        io_destroy(qdev->io_ctx);
+    }
+
+    free(ctx->shared_qdevs);
+}
+
+/*
+ * Out-of-process backend
+ *
+ * With --shm-backend, the requests to the aio disks are exported through
+ * shared memory channels to a vhost-shm-backend process rather than served
+ * with libaio here.  The server hands it the disks, the channels and the guest
+ * memory maps over the control socket, and restarts it with the same state if
+ * it dies; the channels export the requests it left unfinished again.
+ */
+
+#define SHM_RING_ENTRIES 256
+
+/* called with sb->lock held */
+static void shm_send(struct shm_backend *sb, const struct shm_msg *msg,
+                     const int *fds, unsigned num_fds)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_PROTO_MAX_REGIONS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = (void *)msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    /* the backend is being restarted, it'll get everything anew */
+    if (sb->sock < 0) {
+        return;
+    }
+
+    if (num_fds) {
+        struct cmsghdr *cmsg;
+
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+
+    while (sendmsg(sb->sock, &mh, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) {
+            /* the backend died, the supervisor takes care of it */
+            PERROR("shm backend sendmsg", errno);
+            break;
+        }
+    }
+}
+
+static void shm_send_disk(struct shm_backend *sb, struct disk *d)
+{
+    struct shm_msg msg = {
+        .type = SHM_MSG_DISK,
+        .id = (uintptr_t)d,
+    };
+
+    snprintf(msg.path, sizeof(msg.path), "%s", d->conf.blk_file);
+    shm_send(sb, &msg, NULL, 0);
+}
+
+static void shm_send_channel(struct shm_backend *sb, unsigned idx)
+{
+    struct vhd_shm_channel_fds fds;
+    struct shm_msg msg = {
+        .type = SHM_MSG_CHANNEL,
+        .id = idx,
+    };
+
+    vhd_shm_channel_get_fds(sb->channels[idx], &fds);
+    msg.ring_size = fds.ring_size;
+    shm_send(sb, &msg, (int []) {
+        fds.ring_fd, fds.req_doorbell, fds.cpl_doorbell
+    }, 3);
+}
+
+static void shm_send_map(struct shm_backend *sb, struct shm_map_rec *rec)
+{
+    struct shm_msg msg = {
+        .type = SHM_MSG_MAP,
+        .id = rec->id,
+        .num_regions = rec->num_regions,
+    };
+
+    memcpy(msg.regions, rec->regions,
+           sizeof(rec->regions[0]) * rec->num_regions);
+    shm_send(sb, &msg, rec->fds, rec->num_regions);
+}
+
+/* called with sb->lock held */
+static void shm_backend_spawn(struct shm_backend *sb)
+{
+    struct disks_context *ctx = sb->ctx;
+    struct shm_map_rec *rec;
+    char fd_str[16];
+    int sv[2];
+    pid_t pid;
+    size_t i;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        DIE("socketpair: %s", strerror(errno));
+    }
+    snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+
+    pid = fork();
+    if (pid < 0) {
+        DIE("fork: %s", strerror(errno));
+    }
+    if (!pid) {
+        sigset_t empty;
+
+        /* only async-signal-safe calls from here on */
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        fcntl(sv[1], F_SETFD, 0);
+        execl(sb->path, sb->path, fd_str, (char *)NULL);
+        _exit(127);
+    }
+
+    close(sv[1]);
+    sb->sock = sv[0];
+    sb->pid = pid;
+
+    for (i = 0; i < ctx->num_disks; i++) {
+        struct disk *d = &ctx->disks[i];
+        if (!d->conf.backend || !strcmp(d->conf.backend, "aio")) {
+            shm_send_disk(sb, d);
+        }
+    }
+    for (i = 0; i < sb->num_channels; i++) {
+        shm_send_channel(sb, i);
+    }
+    for (rec = sb->maps; rec; rec = rec->next) {
+        shm_send_map(sb, rec);
+    }
+
+    vhd_log_stderr(LOG_INFO, "shm backend started, pid %d", pid);
+}
+
+static void *shm_backend_supervise(void *opaque)
+{
+    struct shm_backend *sb = opaque;
+
+    for (;;) {
+        unsigned i;
+        int status;
+
+        if (waitpid(sb->pid, &status, 0) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DIE("waitpid: %s", strerror(errno));
+        }
+
+        pthread_mutex_lock(&sb->lock);
+        close(sb->sock);
+        sb->sock = -1;
+        if (sb->stopping) {
+            pthread_mutex_unlock(&sb->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&sb->lock);
+
+        vhd_log_stderr(LOG_WARNING, "shm backend exited with status 0x%x, "
+                       "restarting", status);
+
+        /* the dead backend can't touch the rings any more */
+        pthread_mutex_lock(&sb->channels_lock);
+        for (i = 0; i < sb->num_channels; i++) {
+            vhd_shm_channel_reset(sb->channels[i]);
+        }
+
+        pthread_mutex_lock(&sb->lock);
+        if (sb->stopping) {
+            pthread_mutex_unlock(&sb->lock);
+            pthread_mutex_unlock(&sb->channels_lock);
+            return NULL;
+        }
+        shm_backend_spawn(sb);
+        pthread_mutex_unlock(&sb->lock);
+        pthread_mutex_unlock(&sb->channels_lock);
+    }
+}
+
+static void shm_backend_start(struct shm_backend *sb,
+                              struct disks_context *ctx)
+{
+    sb->ctx = ctx;
+    sb->sock = -1;
+    pthread_mutex_init(&sb->channels_lock, NULL);
+    pthread_mutex_init(&sb->lock, NULL);
+
+    pthread_mutex_lock(&sb->lock);
+    shm_backend_spawn(sb);
+    pthread_mutex_unlock(&sb->lock);
+
+    pthread_create(&sb->supervisor, NULL, shm_backend_supervise, sb);
+}
+
+static void shm_backend_stop(struct shm_backend *sb)
+{
+    struct shm_map_rec *rec;
+
+    pthread_mutex_lock(&sb->lock);
+    sb->stopping = true;
+    kill(sb->pid, SIGTERM);
+    pthread_mutex_unlock(&sb->lock);
+
+    pthread_join(sb->supervisor, NULL);
+
+    while ((rec = sb->maps)) {
+        unsigned i;
+
+        sb->maps = rec->next;
+        for (i = 0; i < rec->num_regions; i++) {
+            close(rec->fds[i]);
+        }
+        free(rec);
+    }
+}
+
+/* called in request queue threads */
+static void shm_backend_map(void *opaque, uint64_t map_id,
+                            const struct vhd_shm_region *regions,
+                            uint32_t num_regions)
+{
+    struct shm_backend *sb = opaque;
+    struct shm_map_rec *rec;
+    uint32_t i;
+
+    if (num_regions > SHM_PROTO_MAX_REGIONS) {
+        DIE("too many memory regions for the shm backend: %u", num_regions);
+    }
+
+    pthread_mutex_lock(&sb->lock);
+
+    /* the other channels may have announced it already */
+    for (rec = sb->maps; rec; rec = rec->next) {
+        if (rec->id == map_id) {
+            rec->refs++;
+            goto out;
+        }
+    }
+
+    rec = calloc(1, sizeof(*rec));
+    rec->id = map_id;
+    rec->refs = 1;
+    rec->num_regions = num_regions;
+    for (i = 0; i < num_regions; i++) {
+        rec->regions[i] = (struct shm_msg_region) {
+            .gpa = regions[i].gpa,
+            .size = regions[i].size,
+            .offset = regions[i].offset,
+        };
+        rec->fds[i] = fcntl(regions[i].fd, F_DUPFD_CLOEXEC, 0);
+        if (rec->fds[i] < 0) {
+            DIE("fcntl: %s", strerror(errno));
+        }
+    }
+    rec->next = sb->maps;
+    sb->maps = rec;
+    shm_send_map(sb, rec);
+
+out:
+    pthread_mutex_unlock(&sb->lock);
+}
+
+static void shm_backend_unmap(void *opaque, uint64_t map_id)
+{
+    struct shm_backend *sb = opaque;
+    struct shm_map_rec **prec, *rec;
+    struct shm_msg msg = {
+        .type = SHM_MSG_UNMAP,
+        .id = map_id,
+    };
+    uint32_t i;
+
+    pthread_mutex_lock(&sb->lock);
+
+    for (prec = &sb->maps; (rec = *prec); prec = &rec->next) {
+        if (rec->id == map_id) {
+            break;
+        }
+    }
+    if (!rec || --rec->refs) {
+        goto out;
+    }
+
+    *prec = rec->next;
+    shm_send(sb, &msg, NULL, 0);
+    for (i = 0; i < rec->num_regions; i++) {
+        close(rec->fds[i]);
+    }
+    free(rec);
+
+out:
+    pthread_mutex_unlock(&sb->lock);
+}
+
+static const struct vhd_shm_channel_ops shm_backend_ops = {
+    .map = shm_backend_map,
+    .unmap = shm_backend_unmap,
+};
+
+static void shm_backend_attach_queues(struct shm_backend *sb,
+                                      struct queue *qdevs,
+                                      unsigned long num_qdevs)
+{
+    unsigned long i;
+
+    pthread_mutex_lock(&sb->channels_lock);
+    for (i = 0; i < num_qdevs; i++) {
+        struct vhd_shm_channel *ch;
+
+        if (sb->num_channels == SHM_PROTO_MAX_CHANNELS) {
+            DIE("too many request queues for the shm backend");
+        }
+
+        ch = vhd_attach_shm_channel(qdevs[i].rq, SHM_RING_ENTRIES,
+                                    &shm_backend_ops, sb);
+        if (!ch) {
+            DIE("vhd_attach_shm_channel failed");
+        }
+        qdevs[i].shm_channel = ch;
+        sb->channels[sb->num_channels] = ch;
+
+        pthread_mutex_lock(&sb->lock);
+        shm_send_channel(sb, sb->num_channels);
+        pthread_mutex_unlock(&sb->lock);
+
+        sb->num_channels++;
+    }
+    pthread_mutex_unlock(&sb->channels_lock);
+}
+
+/* once the disks using the queues are unregistered */
+static void shm_backend_detach_queues(struct shm_backend *sb,
+                                      struct queue *qdevs,
+                                      unsigned long num_qdevs)
+{
+    unsigned long i;
+    unsigned j;
+
+    for (i = 0; i < num_qdevs; i++) {
+        struct vhd_shm_channel *ch = qdevs[i].shm_channel;
+
+        if (!ch) {
+            continue;
+        }
+
+        pthread_mutex_lock(&sb->channels_lock);
+        for (j = 0; j < sb->num_channels; j++) {
+            if (sb->channels[j] == ch) {
+                sb->channels[j] = sb->channels[--sb->num_channels];
+                break;
+            }
+        }
+        pthread_mutex_unlock(&sb->channels_lock);
+
+        vhd_detach_shm_channel(ch);
+        qdevs[i].shm_channel = NULL;
+    }
+}
+
 static int resize(struct disk *d, uint64_t new_size)
 {
     int ret;
@@ -838,10 +2050,13 @@ static int resize(struct disk *d, uint64_t new_size)
                        new_size % block_size);
     }
 
-    ret = ftruncate(d->fd, new_size);
-    if (ret < 0) {
-        vhd_log_stderr(LOG_ERROR, "ftruncate failed %m");
-        return ret;
+    /* the built-in backends have no image to resize */
+    if (d->fd >= 0) {
+        ret = ftruncate(d->fd, new_size);
+        if (ret < 0) {
+            vhd_log_stderr(LOG_ERROR, "ftruncate failed %m");
+            return ret;
+        }
     }
 
     vhd_blockdev_set_total_blocks(d->handler, new_size / block_size);
@@ -857,8 +2072,10 @@ static bool monitor_serve_fd(FILE *f_in, FILE *f_out,
     const char *help = "Commands:\n"
         "  help  -  print this message\n"
         "  stop  -  stop the server and quit\n"
-        "  stat  -  print statistics\n"
-        "  resize <new_size>  -  resize the disk\n";
+        "  stat <disk>  -  print disk statistics\n"
+        "  stat rqs  -  print shared request queue statistics\n"
+        "  resize <new_size>  -  resize the disk\n"
+        "  stall <disk> <vring> <ms>  -  hold the vring requests for ms\n";
 
     bool interactive = (f_in == stdin && f_out == stdout);
 
@@ -871,6 +2088,7 @@ static bool monitor_serve_fd(FILE *f_in, FILE *f_out,
     while (true) {
         char cmdline[100];
         uint64_t new_size, dev_idx;
+        uint32_t vring_idx, stall_ms;
         int ret;
         size_t len;
         char output_buf[100];
@@ -910,10 +2128,18 @@ static bool monitor_serve_fd(FILE *f_in, FILE *f_out,
             return true;
         } else if (!strcmp(cmdline, "help")) {
             out = help;
+        } else if (!strcmp(cmdline, "stat rqs")) {
+            dump_per_queue_stats(ctx->shared_qdevs, ctx->num_shared_rqs,
+                                 false);
+            out = "Stats dumped\n";
         } else if (sscanf(cmdline, "stat %" PRIu64 "\n", &dev_idx) == 1) {
             if (dev_idx < ctx->num_disks) {
                 struct disk *d = &ctx->disks[dev_idx];
-                dump_per_queue_stats(d->qdevs, d->conf.num_rqs, false);
+                dump_disk_stats(d, false);
+                dump_disk_vq_stats(d);
+                if (!d->shared_queues) {
+                    dump_per_queue_stats(d->qdevs, d->num_qdevs, false);
+                }
                 out = "Stats dumped\n";
             } else {
                 snprintf(output_buf, output_buf_size,
@@ -935,6 +2161,21 @@ static bool monitor_serve_fd(FILE *f_in, FILE *f_out,
                 snprintf(output_buf, output_buf_size,
                          "Invalid device index %" PRIu64 "\n", dev_idx);
             }
+        } else if (sscanf(cmdline, "stall %" PRIu64 " %" PRIu32 " %" PRIu32,
+                          &dev_idx, &vring_idx, &stall_ms) == 3) {
+            if (dev_idx < ctx->num_disks) {
+                ret = vhd_blockdev_stall_vring(ctx->disks[dev_idx].handler,
+                                               vring_idx, stall_ms);
+                if (ret == 0) {
+                    out = "Stalled\n";
+                } else {
+                    snprintf(output_buf, output_buf_size,
+                             "Stall failed: %s\n", strerror(-ret));
+                }
+            } else {
+                snprintf(output_buf, output_buf_size,
+                         "Invalid device index %" PRIu64 "\n", dev_idx);
+            }
         } else {
             out = "Unknown command\n";
         }
@@ -1059,12 +2300,12 @@ static void monitor_serve(const char *path, struct disks_context *ctx)
 
 static bool validate_disk_config(struct disk_config *conf, const char **err)
 {
-    if (!conf->socket_path) {
-        *err = "no socket-path specified";
+    if (!conf->socket_path && !conf->vduse_name) {
+        *err = "no socket-path or vduse-name specified";
         return false;
     }
 
-    if (!conf->blk_file) {
+    if (!conf->blk_file && (!conf->backend || !strcmp(conf->backend, "aio"))) {
         *err = "no blk-file specified";
         return false;
     }
@@ -1080,21 +2321,48 @@ static bool validate_disk_config(struct disk_config *conf, const char **err)
         return false;
     }
 
+    if (conf->mpmc_workers &&
+        (!conf->mpmc_ring || (conf->mpmc_ring & (conf->mpmc_ring - 1)) ||
+         conf->mpmc_ring > UINT32_MAX)) {
+        *err = "invalid mpmc-ring, expected a power of two";
+        return false;
+    }
+
     return true;
 }
 
-static void disk_start(struct disk *d)
+static void disk_start(struct disk *d, struct disks_context *ctx)
 {
+    struct disk_config *conf = &d->conf;
+
     if (init_disk(d) < 0) {
         DIE("init_disk failed");
     }
 
-    d->qdevs = init_queues(d);
+    if (ctx->shared_qdevs) {
+        d->qdevs = ctx->shared_qdevs;
+        d->num_qdevs = ctx->num_shared_rqs;
+        d->shared_queues = true;
+        register_disk(d, d - ctx->disks);
+        setup_faults(d);
+        return;
+    }
 
-    create_threads(d);
+    d->qdevs = init_queues(conf->num_rqs, conf->batch_size, conf->delay,
+                           conf->mpmc_workers, conf->mpmc_ring);
+    d->num_qdevs = conf->num_rqs;
+    create_threads(d->qdevs, d->num_qdevs);
+    if (ctx->perf_counters) {
+        enable_perf_counters(d->qdevs, d->num_qdevs);
+    }
+    if (ctx->shm.path) {
+        shm_backend_attach_queues(&ctx->shm, d->qdevs, d->num_qdevs);
+    }
+    register_disk(d, 0);
+    setup_faults(d);
 }
 
-static void disk_stop(struct disk *d)
+static void disk_stop(struct disk *d, struct disks_context *ctx)
 {
     struct disk_config *conf = &d->conf;
     int unreg_done_fd;
@@ -1113,21 +2381,32 @@ static void disk_stop(struct disk *d)
     /* 1.3. Wait until the unregestering finishes */
     wait_event(unreg_done_fd);
 
-    /* 2. Stop request queues. */
-    stop_and_release_threads(d);
+    /* 2. Stop request queues, unless they serve other disks too */
+    if (!d->shared_queues) {
+        if (ctx->shm.path) {
+            shm_backend_detach_queues(&ctx->shm, d->qdevs, d->num_qdevs);
+        }
+        stop_and_release_threads(d->qdevs, d->num_qdevs);
+
+        /* dump total stats for this run */
+        dump_per_queue_stats(d->qdevs, d->num_qdevs, true);
 
-    /* dump total stats for this run */
-    dump_per_queue_stats(d->qdevs, conf->num_rqs, true);
+        /* 3. Release request queues */
+        release_queues(d->qdevs, d->num_qdevs);
+    }
 
-    /* 3. Release request queues */
-    release_queues(d->qdevs, conf->num_rqs);
+    dump_disk_stats(d, true);
 
     /* 4. Close the image */
-    close(d->fd);
+    if (d->fd >= 0) {
+        close(d->fd);
+    }
 
     /* 5. Free config strings */
     vhd_free((void *)conf->socket_path);
+    vhd_free((void *)conf->vduse_name);
     vhd_free((void *)conf->blk_file);
+    vhd_free((void *)conf->backend);
     vhd_free((void *)conf->serial);
 }
 
@@ -1138,14 +2417,9 @@ int main(int argc, char **argv)
 {
     struct disks_context ctx = {};
     const char *monitor = NULL, *err = NULL;
+    sigset_t sigset;
     size_t i;
 
-    for (i = 0; i < MAX_NUM_DISKS; ++i) {
-        struct disk_config *conf = &ctx.disks[i].conf;
-        conf->batch_size = 128;
-        conf->num_rqs = 1;
-    }
-
     parse_opts(argc, argv, &ctx, &monitor);
 
     for (i = 0; i < ctx.num_disks; ++i) {
@@ -1157,12 +2431,47 @@ int main(int argc, char **argv)
         }
     }
 
+    /*
+     * Block the signal to wait for before spawning any threads so that they
+     * all inherit the mask and it can't kill the server from one of them.
+     */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    if (!monitor) {
+        pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    }
+
     if (vhd_start_vhost_server(vhd_log_stderr) < 0) {
         DIE("vhd_start_vhost_server failed");
     }
 
+    if (ctx.shm.path) {
+        shm_backend_start(&ctx.shm, &ctx);
+    }
+
+    if (ctx.use_rq_pool) {
+        init_pool_queues(&ctx);
+        if (ctx.perf_counters) {
+            enable_perf_counters(ctx.shared_qdevs, ctx.num_shared_rqs);
+        }
+        if (ctx.shm.path) {
+            shm_backend_attach_queues(&ctx.shm, ctx.shared_qdevs,
+                                      ctx.num_shared_rqs);
+        }
+    } else if (ctx.num_shared_rqs) {
+        ctx.shared_qdevs = init_queues(ctx.num_shared_rqs, 128, 0, 0, 0);
+        create_threads(ctx.shared_qdevs, ctx.num_shared_rqs);
+        if (ctx.perf_counters) {
+            enable_perf_counters(ctx.shared_qdevs, ctx.num_shared_rqs);
+        }
+        if (ctx.shm.path) {
+            shm_backend_attach_queues(&ctx.shm, ctx.shared_qdevs,
+                                      ctx.num_shared_rqs);
+        }
+    }
+
     for (i = 0; i < ctx.num_disks; ++i) {
-        disk_start(&ctx.disks[i]);
+        disk_start(&ctx.disks[i], &ctx);
     }
 
     vhd_log_stderr(LOG_INFO, "Test server started");
@@ -1170,12 +2479,7 @@ int main(int argc, char **argv)
     if (monitor) {
         monitor_serve(monitor, &ctx);
     } else {
-        sigset_t sigset;
         int sig;
-        /* tune the signal to block on waiting for "stop server" command */
-        sigemptyset(&sigset);
-        sigaddset(&sigset, SIGINT);
-        pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
         /* wait for signal to stop the server (Ctrl+C) */
         sigwait(&sigset, &sig);
@@ -1184,8 +2488,28 @@ int main(int argc, char **argv)
     vhd_log_stderr(LOG_INFO, "Stopping the server");
 
     for (i = 0; i < ctx.num_disks; ++i) {
-        disk_stop(&ctx.disks[i]);
+        disk_stop(&ctx.disks[i], &ctx);
+    }
+
+    if (ctx.shared_qdevs) {
+        if (ctx.shm.path) {
+            shm_backend_detach_queues(&ctx.shm, ctx.shared_qdevs,
+                                      ctx.num_shared_rqs);
+        }
+        if (ctx.rq_pool) {
+            dump_per_queue_stats(ctx.shared_qdevs, ctx.num_shared_rqs, true);
+            release_pool_queues(&ctx);
+        } else {
+            stop_and_release_threads(ctx.shared_qdevs, ctx.num_shared_rqs);
+            dump_per_queue_stats(ctx.shared_qdevs, ctx.num_shared_rqs, true);
+            release_queues(ctx.shared_qdevs, ctx.num_shared_rqs);
+        }
+    }
+
+    if (ctx.shm.path) {
+        shm_backend_stop(&ctx.shm);
     }
+    free(ctx.disks);
 
     vhd_stop_vhost_server();
 
@@ -0,0 +1,2378 @@
+/*
+ * vhost-user-blk load generator
+ *
+ * A vhost-user front-end playing the part of QEMU and the guest at once: it
+ * connects to vhost-user-blk sockets, sets up memfd-backed guest memory, the
+ * inflight region and the vrings over the control protocol, and keeps them
+ * busy with fio-like workloads, one thread per queue.  Results are reported
+ * as JSON.  Several jobs may run against different devices at once to look
+ * at tenants interfering with each other, and a job may disconnect and
+ * reconnect periodically with requests in flight, which the backend has to
+ * recover from via the inflight region, or migrate back and forth between
+ * two devices with the requests in flight passed in the device state.  A job
+ * may also start as a postcopy migration destination, playing the master
+ * serving the faults on the guest memory pages that haven't arrived yet.
+ * With verify=1 the writes carry data the reads can check, see
+ * verify_sector().
+ */
+
+#define _GNU_SOURCE 1
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/falloc.h>
+#include <linux/userfaultfd.h>
+
+#include "catomic.h"
+#include "vhost_spec.h"
+#include "virtio/virtio_blk_spec.h"
+#include "virtq_driver.h"
+
+#define MAX_NUM_JOBS        16
+#define MAX_NUM_QUEUES      VHOST_USER_MEM_REGIONS_MAX
+
+/* every queue has its own guest memory region */
+#define QUEUE_GPA_STRIDE    (1ull << 40)
+
+/* the zone append status trailer, padded the way Linux does */
+#define ZONE_APPEND_INHDR_LEN   16
+
+#define HIST_SUB_BITS       5
+#define HIST_NUM_BUCKETS    (64 << HIST_SUB_BITS)
+
+#define DIE(fmt, ...)                                           \
+    do {                                                        \
+        fprintf(stderr, "loadgen: " fmt "\n", ##__VA_ARGS__);   \
+        exit(EXIT_FAILURE);                                     \
+    } while (0)
+
+enum rw_mode {
+    RW_READ,
+    RW_WRITE,
+    RW_RANDREAD,
+    RW_RANDWRITE,
+    RW_RW,
+    RW_RANDRW,
+    RW_APPEND,
+};
+
+static const char *const rw_mode_names[] = {
+    [RW_READ] = "read",
+    [RW_WRITE] = "write",
+    [RW_RANDREAD] = "randread",
+    [RW_RANDWRITE] = "randwrite",
+    [RW_RW] = "rw",
+    [RW_RANDRW] = "randrw",
+    [RW_APPEND] = "append",
+};
+
+struct job_config {
+    char *name;
+    char *socket_path;
+    char *rw;
+    unsigned long bs;
+    unsigned long qd;
+    unsigned long num_queues;
+    unsigned long qsz;
+    unsigned long rwmixread;
+    unsigned long iops;
+    unsigned long reconnect_ms;
+    unsigned long migrate_ms;
+    char *migrate_to;
+    unsigned long postcopy_ms;
+    unsigned long blockalign;
+    unsigned long size;
+    bool verify;
+    char *verify_init;
+    bool ordered;
+    bool indirect;
+    bool event_idx;
+    bool in_order;
+    bool any_layout;
+};
+
+struct lat_stats {
+    uint64_t ios;
+    uint64_t bytes;
+    uint64_t lat_sum;
+    uint64_t lat_max;
+    uint64_t hist[HIST_NUM_BUCKETS];
+};
+
+struct request {
+    uint64_t submit_ns;
+    uint64_t bytes;
+    bool write;
+    uint8_t *status;
+
+    /* rw=append: zone reset, or zone append and where it's to land */
+    bool zone_reset;
+    uint64_t zone_start;
+    uint8_t *append_sector;
+
+    /*
+     * verify=1: the data with its first sector and key, and the stamp of a
+     * write, or the last one given out when a read was submitted
+     */
+    uint8_t *data;
+    uint64_t sector;
+    uint64_t key;
+    uint32_t stamp;
+};
+
+/* rw=append with verify=1: an append to read back */
+struct readback {
+    uint64_t sector;
+    uint32_t stamp;
+};
+
+struct job;
+
+struct queue {
+    struct job *job;
+    unsigned idx;
+
+    struct virtq_driver drv;
+    int kickfd;
+    int callfd;
+
+    struct request *reqs;
+    struct request **free_reqs;
+    unsigned long num_free;
+
+    uint64_t rng;
+    uint64_t next_sector;
+    uint64_t next_submit_ns;
+
+    /* part of the device the queue keeps to, all of it unless verify=1 */
+    uint64_t slice_start;
+    uint64_t slice_sectors;
+
+    /*
+     * verify=1: for every sector of the slice, what it's to hold, the stamp
+     * of the last write submitted to it and the number of writes to it in
+     * flight; the last stamp given out, the sectors checked and the ones
+     * found wrong
+     */
+    uint32_t *expect;
+    uint32_t *last_write;
+    uint16_t *pending;
+    uint32_t stamp;
+    uint64_t verified;
+    uint64_t verify_errors;
+
+    /* verify=1: what the sectors of each read are to hold, see req_expect() */
+    uint32_t *read_expect;
+
+    /* rw=append with verify=1: the appends completed and not read back yet */
+    struct readback *readbacks;
+    unsigned long num_readbacks;
+
+    /*
+     * rw=append: zone of the queue being appended to, the sectors submitted
+     * to it, and whether it's being reset to start over
+     */
+    uint64_t zone;
+    uint64_t zone_fill;
+    bool zone_resetting;
+
+    /*
+     * rw=append: zones whose write pointer was checked once the queue was
+     * drained, and the checks that failed
+     */
+    uint64_t zones_checked;
+    uint64_t zone_wp_errors;
+
+    /* any-layout=1: initial contents of the buffers shared with the data */
+    uint8_t *stage;
+
+    struct lat_stats stats[2];
+    uint64_t errors;
+
+    pthread_t thread;
+};
+
+struct job {
+    struct job_config conf;
+    enum rw_mode rw;
+
+    int sock;
+    uint64_t features;
+    uint64_t capacity;
+    uint64_t zone_sectors;
+    uint64_t nr_zones;
+
+    /* verify=1: what the sectors hold before the job writes them */
+    uint32_t verify_init;
+
+    int inflight_fd;
+    struct vhost_user_inflight_desc inflight;
+    char *inflight_mem;
+
+    struct queue queues[MAX_NUM_QUEUES];
+
+    uint64_t reconnects;
+    pthread_t reconnect_thread;
+
+    /*
+     * migrate-ms: the vring bases and the device state carried over to the
+     * other device, and the longest it took the vrings to stop
+     */
+    bool migrating;
+    uint16_t vring_base[MAX_NUM_QUEUES];
+    char *state;
+    size_t state_len;
+    uint64_t migrations;
+    uint64_t handed_over;
+    uint64_t stop_ns_max;
+
+    /*
+     * postcopy-ms: the backend's userfaultfd, where it has the guest memory
+     * of each queue mapped, whether the device setup is over so that postcopy
+     * may end, and the number of faults served
+     */
+    int uffd;
+    uint64_t postcopy_base[MAX_NUM_QUEUES];
+    bool postcopy_setup_done;
+    uint64_t postcopy_faults;
+};
+
+static struct job g_jobs[MAX_NUM_JOBS];
+static unsigned g_num_jobs;
+static bool g_stop;
+
+static uint64_t clock_get_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/******************************************************************************/
+
+/* xorshift64* */
+static uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+static unsigned hist_index(uint64_t v)
+{
+    unsigned shift;
+
+    if (v < (1u << HIST_SUB_BITS)) {
+        return v;
+    }
+
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) +
+        ((v >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t hist_value(unsigned idx)
+{
+    unsigned shift;
+    uint64_t sub;
+
+    if (idx < (1u << HIST_SUB_BITS)) {
+        return idx;
+    }
+
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    sub = idx & ((1u << HIST_SUB_BITS) - 1);
+    return ((sub | (1u << HIST_SUB_BITS)) << shift) + (1ull << shift) / 2;
+}
+
+static void stats_add(struct lat_stats *stats, uint64_t lat, uint64_t bytes)
+{
+    stats->ios++;
+    stats->bytes += bytes;
+    stats->lat_sum += lat;
+    stats->lat_max = MAX(stats->lat_max, lat);
+    stats->hist[hist_index(lat)]++;
+}
+
+static void stats_merge(struct lat_stats *dst, const struct lat_stats *src)
+{
+    unsigned i;
+
+    dst->ios += src->ios;
+    dst->bytes += src->bytes;
+    dst->lat_sum += src->lat_sum;
+    dst->lat_max = MAX(dst->lat_max, src->lat_max);
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+        dst->hist[i] += src->hist[i];
+    }
+}
+
+static uint64_t stats_percentile(const struct lat_stats *stats, double pct)
+{
+    uint64_t rank = stats->ios * pct / 100, seen = 0;
+    unsigned i;
+
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+        seen += stats->hist[i];
+        if (seen > rank) {
+            return MIN(hist_value(i), stats->lat_max);
+        }
+    }
+    return stats->lat_max;
+}
+
+/******************************************************************************/
+
+static int vu_send(int sock, uint32_t req, uint32_t flags, const void *payload,
+                   size_t size, const int *fds, size_t num_fds)
+{
+    struct vhost_user_msg_hdr hdr = {
+        .req = req,
+        .flags = VHOST_USER_MSG_VERSION | flags,
+        .size = size,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)payload, .iov_len = size },
+    };
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)] = {};
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = size ? 2 : 1,
+    };
+    ssize_t ret;
+
+    if (num_fds) {
+        struct cmsghdr *cmsg;
+
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+
+    do {
+        ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return -errno;
+    }
+    return ret == (ssize_t)(sizeof(hdr) + size) ? 0 : -EIO;
+}
+
+static int vu_recv(int sock, uint32_t req, void *payload, size_t size,
+                   int *fd)
+{
+    struct vhost_user_msg_hdr hdr;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)];
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    do {
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return -errno;
+    }
+    if (ret != sizeof(hdr)) {
+        return -EIO;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int rfd;
+            memcpy(&rfd, CMSG_DATA(cmsg), sizeof(rfd));
+            if (fd) {
+                *fd = rfd;
+            } else {
+                close(rfd);
+            }
+        }
+    }
+
+    if (hdr.req != req ||
+        (hdr.flags & VHOST_USER_MSG_FLAGS_REPLY) != VHOST_USER_MSG_FLAGS_REPLY ||
+        hdr.size > size) {
+        return -EPROTO;
+    }
+    if (!hdr.size) {
+        return 0;
+    }
+
+    do {
+        ret = recv(sock, payload, hdr.size, MSG_WAITALL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return -errno;
+    }
+    return ret == hdr.size ? 0 : -EIO;
+}
+
+/* Send a message and wait for its reply or, for the others, the ack */
+static int vu_call(struct job *job, uint32_t req, const void *payload,
+                   size_t size, const int *fds, size_t num_fds, void *reply,
+                   size_t reply_size, int *reply_fd)
+{
+    uint64_t ack = 0;
+    int ret;
+
+    if (!reply) {
+        reply = &ack;
+        reply_size = sizeof(ack);
+    }
+
+    ret = vu_send(job->sock, req, reply == &ack ?
+                  VHOST_USER_MSG_FLAGS_REPLY_ACK : 0, payload, size, fds,
+                  num_fds);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vu_recv(job->sock, req, reply, reply_size, reply_fd);
+    if (ret < 0) {
+        return ret;
+    }
+    return ack ? -EREMOTEIO : 0;
+}
+
+static int vu_get_u64(struct job *job, uint32_t req, uint64_t *val)
+{
+    return vu_call(job, req, NULL, 0, NULL, 0, val, sizeof(*val), NULL);
+}
+
+static int vu_set_u64(struct job *job, uint32_t req, uint64_t val,
+                      const int *fds, size_t num_fds)
+{
+    return vu_call(job, req, &val, sizeof(val), fds, num_fds, NULL, 0, NULL);
+}
+
+static int vu_set_vring_state(struct job *job, uint32_t req, unsigned idx,
+                              unsigned num)
+{
+    struct vhost_user_vring_state state = { .index = idx, .num = num };
+    return vu_call(job, req, &state, sizeof(state), NULL, 0, NULL, 0, NULL);
+}
+
+static int sock_connect(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -errno;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int ret = -errno;
+        close(sock);
+        return ret;
+    }
+    return sock;
+}
+
+/******************************************************************************/
+
+/*
+ * Where the backend has to resume fetching from the avail ring, the way QEMU
+ * restores it after losing the backend: the used index.  The requests past it
+ * still marked in-flight in the inflight region are resubmitted by the
+ * backend, which moves past them in the avail ring as it does.
+ */
+static uint16_t queue_vring_base(struct queue *q)
+{
+    return catomic_load_acquire(&q->drv.used->idx);
+}
+
+static int job_setup_queue(struct job *job, struct queue *q, bool reconnect)
+{
+    struct virtq_driver *drv = &q->drv;
+    struct vhost_user_vring_addr addr = {
+        .index = q->idx,
+        .desc_addr = (uintptr_t)drv->desc,
+        .avail_addr = (uintptr_t)drv->avail,
+        .used_addr = (uintptr_t)drv->used,
+        .used_gpa_base = drv->used_gpa,
+    };
+    int ret;
+
+    ret = vu_set_vring_state(job, VHOST_USER_SET_VRING_NUM, q->idx, drv->qsz);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = vu_set_vring_state(job, VHOST_USER_SET_VRING_BASE, q->idx,
+                             job->migrating ? job->vring_base[q->idx] :
+                             reconnect ? queue_vring_base(q) : 0);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = vu_call(job, VHOST_USER_SET_VRING_ADDR, &addr, sizeof(addr), NULL, 0,
+                  NULL, 0, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = vu_set_u64(job, VHOST_USER_SET_VRING_CALL, q->idx, &q->callfd, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = vu_set_u64(job, VHOST_USER_SET_VRING_KICK, q->idx, &q->kickfd, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    return vu_set_vring_state(job, VHOST_USER_SET_VRING_ENABLE, q->idx, 1);
+}
+
+/* Write or read the whole device state through @fd */
+static int state_write(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0) {
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int state_read(int fd, char **buf, size_t *len)
+{
+    size_t size = 4096;
+
+    *buf = realloc(*buf, size);
+    *len = 0;
+    for (;;) {
+        ssize_t ret = read(fd, *buf + *len, size - *len);
+        if (ret < 0) {
+            return -errno;
+        }
+        if (!ret) {
+            return 0;
+        }
+        *len += ret;
+        if (*len == size) {
+            size *= 2;
+            *buf = realloc(*buf, size);
+        }
+    }
+}
+
+/*
+ * Pass the device state through a pipe, or the fd the backend returns in
+ * place of it, the way QEMU does.
+ */
+static int job_transfer_state(struct job *job, uint32_t direction)
+{
+    struct vhost_user_device_state dstate = {
+        .direction = direction,
+        .phase = VHOST_TRANSFER_STATE_PHASE_STOPPED,
+    };
+    bool save = direction == VHOST_TRANSFER_STATE_DIRECTION_SAVE;
+    uint64_t reply;
+    int pipefd[2];
+    int fd = -1;
+    int ret;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        return -errno;
+    }
+
+    ret = vu_call(job, VHOST_USER_SET_DEVICE_STATE_FD, &dstate,
+                  sizeof(dstate), &pipefd[save ? 1 : 0], 1, &reply,
+                  sizeof(reply), &fd);
+    close(pipefd[save ? 1 : 0]);
+    if (ret < 0 || (reply & VHOST_USER_DEVICE_STATE_ERROR_MASK)) {
+        close(pipefd[save ? 0 : 1]);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ret < 0 ? ret : -EREMOTEIO;
+    }
+
+    if (reply & VHOST_USER_DEVICE_STATE_INVALID_FD) {
+        fd = pipefd[save ? 0 : 1];
+    } else {
+        close(pipefd[save ? 0 : 1]);
+    }
+
+    ret = save ? state_read(fd, &job->state, &job->state_len) :
+                 state_write(fd, job->state, job->state_len);
+    close(fd);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vu_get_u64(job, VHOST_USER_CHECK_DEVICE_STATE, &reply);
+    if (ret < 0) {
+        return ret;
+    }
+    return reply ? -EREMOTEIO : 0;
+}
+
+/*
+ * Have a guest memory page arrive: allocate it in the memfd unless it's there
+ * already, and wake the backend threads waiting for it up.
+ */
+static int postcopy_place(struct job *job, unsigned q, uint64_t offset,
+                          uint64_t len)
+{
+    struct uffdio_range range = {
+        .start = job->postcopy_base[q] + offset,
+        .len = len,
+    };
+
+    if (fallocate(job->queues[q].drv.memfd, 0, offset, len) < 0) {
+        return -errno;
+    }
+    if (ioctl(job->uffd, UFFDIO_WAKE, &range) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int postcopy_serve_fault(struct job *job, uint64_t addr)
+{
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    unsigned i;
+
+    for (i = 0; i < job->conf.num_queues; i++) {
+        uint64_t offset = addr - job->postcopy_base[i];
+
+        if (addr >= job->postcopy_base[i] &&
+            offset < job->queues[i].drv.mem_size) {
+            return postcopy_place(job, i, offset & ~(page_size - 1),
+                                  page_size);
+        }
+    }
+    return -EFAULT;
+}
+
+/*
+ * Serve the faults for postcopy-ms, and at least until the device is set up,
+ * then have the rest of the guest memory arrive at once and end postcopy.
+ */
+static void *postcopy_thread(void *opaque)
+{
+    struct job *job = opaque;
+    uint64_t deadline = clock_get_ns() +
+        job->conf.postcopy_ms * 1000000ull;
+    struct pollfd pfd = { .fd = job->uffd, .events = POLLIN };
+    uint64_t reply;
+    unsigned i;
+    int ret;
+
+    while ((clock_get_ns() < deadline && !catomic_read(&g_stop)) ||
+           !catomic_read(&job->postcopy_setup_done)) {
+        struct uffd_msg msg;
+
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+
+        while (read(job->uffd, &msg, sizeof(msg)) == sizeof(msg)) {
+            if (msg.event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+            ret = postcopy_serve_fault(job, msg.arg.pagefault.address);
+            if (ret < 0) {
+                DIE("%s: can't serve fault at 0x%llx: %s", job->conf.name,
+                    msg.arg.pagefault.address, strerror(-ret));
+            }
+            job->postcopy_faults++;
+        }
+    }
+
+    for (i = 0; i < job->conf.num_queues; i++) {
+        ret = postcopy_place(job, i, 0, job->queues[i].drv.mem_size);
+        if (ret < 0) {
+            DIE("%s: can't complete postcopy: %s", job->conf.name,
+                strerror(-ret));
+        }
+    }
+
+    ret = vu_get_u64(job, VHOST_USER_POSTCOPY_END, &reply);
+    if (ret < 0 || reply) {
+        DIE("%s: postcopy end failed", job->conf.name);
+    }
+    close(job->uffd);
+    return NULL;
+}
+
+/*
+ * Set the guest memory up the way QEMU does on a postcopy migration
+ * destination: have the backend register it with a userfaultfd handed over
+ * to us, and learn where it's mapped there to serve the faults, which starts
+ * right away.  The request buffers are punched out as if they haven't
+ * arrived yet, along with the pages we haven't touched.
+ */
+static int job_postcopy_set_mem_table(struct job *job,
+                                      struct vhost_user_mem_desc *mem,
+                                      const int *fds)
+{
+    size_t size = offsetof(struct vhost_user_mem_desc, regions) +
+        mem->nregions * sizeof(mem->regions[0]);
+    uint64_t reply;
+    unsigned i;
+    int ret;
+
+    job->uffd = -1;
+    ret = vu_call(job, VHOST_USER_POSTCOPY_ADVISE, NULL, 0, NULL, 0, &reply,
+                  sizeof(reply), &job->uffd);
+    if (ret < 0) {
+        return ret;
+    }
+    if (job->uffd < 0) {
+        return -EPROTO;
+    }
+
+    for (i = 0; i < mem->nregions; i++) {
+        struct virtq_driver *drv = &job->queues[i].drv;
+        off_t offset = drv->slots_gpa - drv->gpa_base;
+
+        if (fallocate(drv->memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      offset, drv->mem_size - offset) < 0) {
+            return -errno;
+        }
+    }
+
+    ret = vu_get_u64(job, VHOST_USER_POSTCOPY_LISTEN, &reply);
+    if (ret < 0) {
+        return ret;
+    }
+    if (reply) {
+        return -EREMOTEIO;
+    }
+
+    /* the regions come back with the addresses in the backend */
+    ret = vu_call(job, VHOST_USER_SET_MEM_TABLE, mem, size, fds,
+                  mem->nregions, mem, size, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    for (i = 0; i < mem->nregions; i++) {
+        job->postcopy_base[i] = mem->regions[i].user_addr;
+    }
+
+    pthread_create(&job->reconnect_thread, NULL, postcopy_thread, job);
+
+    /* ready to serve the faults */
+    return vu_set_u64(job, VHOST_USER_SET_MEM_TABLE, 0, NULL, 0);
+}
+
+/*
+ * Run the control protocol the way QEMU starts a vhost-user-blk device.  On
+ * reconnect the guest memory and the inflight region are reused, so that the
+ * backend picks up the requests that were in flight.  On migration the guest
+ * memory stays the same as well, but the inflight region is a new one, and
+ * the requests in flight come in the device state instead.
+ */
+static int job_connect(struct job *job, bool reconnect)
+{
+    const uint64_t wanted_protocol_features =
+        (1ull << VHOST_USER_PROTOCOL_F_MQ) |
+        (1ull << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
+        (1ull << VHOST_USER_PROTOCOL_F_CONFIG) |
+        (1ull << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) |
+        (job->conf.migrate_ms ?
+         1ull << VHOST_USER_PROTOCOL_F_DEVICE_STATE : 0) |
+        (job->conf.postcopy_ms ? 1ull << VHOST_USER_PROTOCOL_F_PAGEFAULT : 0);
+    uint64_t features, protocol_features, num_queues;
+    struct vhost_user_config_space config = {
+        .size = sizeof(struct virtio_blk_config),
+    };
+    struct vhost_user_mem_desc mem = {};
+    int fds[MAX_NUM_QUEUES];
+    unsigned i;
+    int ret;
+
+    job->sock = sock_connect(job->conf.socket_path);
+    if (job->sock < 0) {
+        return job->sock;
+    }
+
+    ret = vu_get_u64(job, VHOST_USER_GET_FEATURES, &features);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!(features & (1ull << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        return -ENOTSUP;
+    }
+
+    /* no REPLY_ACK yet: the backend only answers GET_* messages */
+    ret = vu_send(job->sock, VHOST_USER_GET_PROTOCOL_FEATURES, 0, NULL, 0,
+                  NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = vu_recv(job->sock, VHOST_USER_GET_PROTOCOL_FEATURES,
+                  &protocol_features, sizeof(protocol_features), NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((protocol_features & wanted_protocol_features) !=
+        wanted_protocol_features) {
+        return -ENOTSUP;
+    }
+    protocol_features = wanted_protocol_features;
+    ret = vu_send(job->sock, VHOST_USER_SET_PROTOCOL_FEATURES, 0,
+                  &protocol_features, sizeof(protocol_features), NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vu_get_u64(job, VHOST_USER_GET_QUEUE_NUM, &num_queues);
+    if (ret < 0) {
+        return ret;
+    }
+    if (num_queues < job->conf.num_queues) {
+        fprintf(stderr, "%s: device has only %" PRIu64 " queues\n",
+                job->conf.name, num_queues);
+        return -EINVAL;
+    }
+
+    ret = vu_call(job, VHOST_USER_SET_OWNER, NULL, 0, NULL, 0, NULL, 0, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vu_call(job, VHOST_USER_GET_CONFIG, &config, VHOST_CONFIG_HDR_SIZE +
+                  config.size, NULL, 0, &config, sizeof(config), NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    job->capacity = ((struct virtio_blk_config *)config.payload)->capacity;
+    if (job->conf.size) {
+        job->capacity = MIN(job->capacity,
+                            job->conf.size / VIRTIO_BLK_SECTOR_SIZE);
+    }
+
+    if (job->rw == RW_APPEND) {
+        const struct virtio_blk_zoned_characteristics *zoned =
+            &((struct virtio_blk_config *)config.payload)->zoned;
+
+        if (!(features & (1ull << VIRTIO_BLK_F_ZONED))) {
+            fprintf(stderr, "%s: device is not zoned\n", job->conf.name);
+            return -ENOTSUP;
+        }
+        job->zone_sectors = zoned->zone_sectors;
+        /* a smaller last zone is left alone */
+        job->nr_zones = job->capacity / job->zone_sectors;
+        if (job->nr_zones < job->conf.num_queues ||
+            job->conf.bs / VIRTIO_BLK_SECTOR_SIZE >
+            zoned->max_append_sectors) {
+            fprintf(stderr, "%s: need a zone per queue and zone appends "
+                    "of bs\n", job->conf.name);
+            return -EINVAL;
+        }
+    }
+
+    if (!reconnect || job->migrating) {
+        struct vhost_user_inflight_desc idesc = {
+            .num_queues = job->conf.num_queues,
+            .queue_size = job->conf.qsz,
+        };
+
+        if (job->inflight_mem) {
+            munmap(job->inflight_mem, job->inflight.mmap_size);
+            close(job->inflight_fd);
+        }
+
+        ret = vu_call(job, VHOST_USER_GET_INFLIGHT_FD, &idesc, sizeof(idesc),
+                      NULL, 0, &job->inflight, sizeof(job->inflight),
+                      &job->inflight_fd);
+        if (ret < 0) {
+            return ret;
+        }
+        job->inflight.num_queues = idesc.num_queues;
+        job->inflight.queue_size = idesc.queue_size;
+        job->inflight_mem = mmap(NULL, job->inflight.mmap_size,
+                                 PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 job->inflight_fd, job->inflight.mmap_offset);
+        if (job->inflight_mem == MAP_FAILED) {
+            return -errno;
+        }
+    }
+    ret = vu_call(job, VHOST_USER_SET_INFLIGHT_FD, &job->inflight,
+                  sizeof(job->inflight), &job->inflight_fd, 1, NULL, 0, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    job->features = features & ((1ull << VIRTIO_F_VERSION_1) |
+                                (1ull << VHOST_USER_F_PROTOCOL_FEATURES) |
+                                (1ull << VIRTIO_BLK_F_MQ) |
+                                (1ull << VIRTIO_BLK_F_BLK_SIZE));
+    if (job->conf.indirect) {
+        job->features |= features & (1ull << VIRTIO_F_RING_INDIRECT_DESC);
+    }
+    if (job->conf.event_idx) {
+        job->features |= features & (1ull << VIRTIO_F_RING_EVENT_IDX);
+    }
+    if (job->conf.in_order) {
+        job->features |= features & (1ull << VIRTIO_F_IN_ORDER);
+    }
+    if (job->conf.any_layout) {
+        job->features |= features & (1ull << VIRTIO_F_ANY_LAYOUT);
+    }
+    if (job->rw == RW_APPEND) {
+        job->features |= 1ull << VIRTIO_BLK_F_ZONED;
+    }
+    ret = vu_set_u64(job, VHOST_USER_SET_FEATURES, job->features, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    mem.nregions = job->conf.num_queues;
+    for (i = 0; i < job->conf.num_queues; i++) {
+        struct virtq_driver *drv = &job->queues[i].drv;
+
+        if (!reconnect) {
+            drv->in_order = job->features & (1ull << VIRTIO_F_IN_ORDER);
+        }
+        mem.regions[i] = (struct vhost_user_mem_region) {
+            .guest_addr = drv->gpa_base,
+            .size = drv->mem_size,
+            .user_addr = (uintptr_t)drv->mem,
+        };
+        fds[i] = drv->memfd;
+    }
+    if (job->conf.postcopy_ms && !reconnect) {
+        ret = job_postcopy_set_mem_table(job, &mem, fds);
+    } else {
+        ret = vu_call(job, VHOST_USER_SET_MEM_TABLE, &mem,
+                      offsetof(struct vhost_user_mem_desc, regions) +
+                      mem.nregions * sizeof(mem.regions[0]), fds,
+                      mem.nregions, NULL, 0, NULL);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (job->migrating) {
+        ret = job_transfer_state(job, VHOST_TRANSFER_STATE_DIRECTION_LOAD);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < job->conf.num_queues; i++) {
+        ret = job_setup_queue(job, &job->queues[i], reconnect);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (job->conf.postcopy_ms && !reconnect) {
+        catomic_set(&job->postcopy_setup_done, true);
+    }
+    return 0;
+}
+
+static void job_disconnect(struct job *job, bool graceful)
+{
+    unsigned i;
+
+    if (graceful) {
+        for (i = 0; i < job->conf.num_queues; i++) {
+            struct vhost_user_vring_state state = { .index = i };
+            vu_call(job, VHOST_USER_GET_VRING_BASE, &state, sizeof(state),
+                    NULL, 0, &state, sizeof(state), NULL);
+        }
+    }
+
+    close(job->sock);
+    job->sock = -1;
+}
+
+static void *reconnect_thread(void *opaque)
+{
+    struct job *job = opaque;
+    struct timespec ts = {
+        .tv_sec = job->conf.reconnect_ms / 1000,
+        .tv_nsec = job->conf.reconnect_ms % 1000 * 1000000,
+    };
+
+    for (;;) {
+        int ret;
+
+        nanosleep(&ts, NULL);
+        if (catomic_read(&g_stop)) {
+            break;
+        }
+
+        job_disconnect(job, false);
+        ret = job_connect(job, true);
+        if (ret < 0) {
+            DIE("%s: reconnect failed: %s", job->conf.name, strerror(-ret));
+        }
+        job->reconnects++;
+    }
+    return NULL;
+}
+
+/*
+ * Stop the vrings and save the device state the way QEMU does on migration,
+ * then start over on the other device with it.  Both share the guest memory
+ * as there's nothing to copy: the source is not to touch it past the stop.
+ */
+static int job_migrate(struct job *job)
+{
+    uint64_t start = clock_get_ns();
+    char *peer;
+    unsigned i;
+    int ret;
+
+    for (i = 0; i < job->conf.num_queues; i++) {
+        struct vhost_user_vring_state state = { .index = i };
+
+        ret = vu_call(job, VHOST_USER_GET_VRING_BASE, &state, sizeof(state),
+                      NULL, 0, &state, sizeof(state), NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        job->vring_base[i] = state.num;
+        job->handed_over += (uint16_t)(state.num -
+            catomic_load_acquire(&job->queues[i].drv.used->idx));
+    }
+    job->stop_ns_max = MAX(job->stop_ns_max, clock_get_ns() - start);
+
+    ret = job_transfer_state(job, VHOST_TRANSFER_STATE_DIRECTION_SAVE);
+    if (ret < 0) {
+        return ret;
+    }
+    job_disconnect(job, false);
+
+    peer = job->conf.migrate_to;
+    job->conf.migrate_to = job->conf.socket_path;
+    job->conf.socket_path = peer;
+
+    job->migrating = true;
+    ret = job_connect(job, true);
+    job->migrating = false;
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* have the destination pick up the requests from the device state */
+    for (i = 0; i < job->conf.num_queues; i++) {
+        eventfd_write(job->queues[i].kickfd, 1);
+    }
+    return 0;
+}
+
+static void *migrate_thread(void *opaque)
+{
+    struct job *job = opaque;
+    struct timespec ts = {
+        .tv_sec = job->conf.migrate_ms / 1000,
+        .tv_nsec = job->conf.migrate_ms % 1000 * 1000000,
+    };
+
+    for (;;) {
+        int ret;
+
+        nanosleep(&ts, NULL);
+        if (catomic_read(&g_stop)) {
+            break;
+        }
+
+        ret = job_migrate(job);
+        if (ret < 0) {
+            DIE("%s: migration failed: %s", job->conf.name, strerror(-ret));
+        }
+        job->migrations++;
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+
+/*
+ * verify=1: every sector written starts with its key and the stamp of the
+ * write, and the rest of it is derived from both.  The key is the sector
+ * number, or the index in the request for zone appends, which only learn
+ * where they landed on completion.  Each queue gives out the stamps in
+ * submission order; the values below them tell what else a sector may hold.
+ */
+#define STAMP_SKIP      0   /* unknown, not checked */
+#define STAMP_ZERO      1   /* zeroes */
+#define STAMP_DATA      2   /* data of any write */
+#define STAMP_FIRST     3
+
+#define SECTOR_WORDS    (VIRTIO_BLK_SECTOR_SIZE / sizeof(uint64_t))
+
+/* max verify errors reported per queue */
+#define VERIFY_MAX_REPORTS  10
+
+static const char *const verify_init_names[] = {
+    [STAMP_SKIP] = "unknown",
+    [STAMP_ZERO] = "zero",
+    [STAMP_DATA] = "data",
+};
+
+/* splitmix64 of the key, the stamp and the word index */
+static uint64_t pattern_word(uint64_t key, uint32_t stamp, unsigned i)
+{
+    uint64_t x = key * 0x9e3779b97f4a7c15ull + ((uint64_t)stamp << 32) + i;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static void pattern_fill(uint8_t *buf, uint64_t nsectors, uint64_t key,
+                         uint32_t stamp)
+{
+    uint64_t words[SECTOR_WORDS];
+    uint64_t i;
+    unsigned j;
+
+    for (i = 0; i < nsectors; i++) {
+        words[0] = key + i;
+        words[1] = stamp;
+        for (j = 2; j < SECTOR_WORDS; j++) {
+            words[j] = pattern_word(key + i, stamp, j);
+        }
+        memcpy(buf + i * VIRTIO_BLK_SECTOR_SIZE, words, sizeof(words));
+    }
+}
+
+static bool verify_sector(const uint8_t *buf, uint64_t key, uint32_t expect,
+                          uint64_t *got_key, uint64_t *got_stamp)
+{
+    uint64_t words[SECTOR_WORDS];
+    unsigned j;
+
+    memcpy(words, buf, sizeof(words));
+    *got_key = words[0];
+    *got_stamp = words[1];
+
+    if (expect == STAMP_ZERO) {
+        for (j = 0; j < SECTOR_WORDS; j++) {
+            if (words[j]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (words[0] != key || words[1] < STAMP_FIRST || words[1] > UINT32_MAX ||
+        (expect != STAMP_DATA && words[1] != expect)) {
+        return false;
+    }
+    for (j = 2; j < SECTOR_WORDS; j++) {
+        if (words[j] != pattern_word(key, words[1], j)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t *req_expect(struct queue *q, struct request *req)
+{
+    return q->read_expect +
+        (req - q->reqs) * (q->job->conf.bs / VIRTIO_BLK_SECTOR_SIZE);
+}
+
+/*
+ * Overlapping requests in flight may be served in any order unless the
+ * device is known to keep them ordered, so a read overlapping a write in
+ * flight may see the data from before or after it, and of overlapping
+ * writes any may win; the sectors are left unchecked then.
+ */
+static void verify_submitted(struct queue *q, struct request *req,
+                             uint8_t *data, uint64_t sector)
+{
+    bool ordered = q->job->conf.ordered;
+    uint64_t nsectors = q->job->conf.bs / VIRTIO_BLK_SECTOR_SIZE;
+    uint64_t first = sector - q->slice_start, i;
+    uint32_t *expect = req_expect(q, req);
+
+    req->data = data;
+    req->sector = sector;
+    req->key = sector;
+
+    if (req->write) {
+        req->stamp = ++q->stamp;
+        for (i = first; i < first + nsectors; i++) {
+            q->expect[i] = q->pending[i] && !ordered ? STAMP_SKIP : req->stamp;
+            q->last_write[i] = req->stamp;
+            q->pending[i]++;
+        }
+        return;
+    }
+
+    req->stamp = q->stamp;
+    for (i = 0; i < nsectors; i++) {
+        expect[i] = q->pending[first + i] && !ordered ?
+            STAMP_SKIP : q->expect[first + i];
+    }
+}
+
+/* check what @req read, skipping the sectors written since it was submitted */
+static void verify_read(struct queue *q, struct request *req)
+{
+    uint64_t nsectors = req->bytes / VIRTIO_BLK_SECTOR_SIZE;
+    uint64_t first = req->sector - q->slice_start, i;
+    uint32_t *expect = req_expect(q, req);
+
+    for (i = 0; i < nsectors; i++) {
+        uint64_t got_key, got_stamp;
+
+        if (expect[i] == STAMP_SKIP ||
+            (q->last_write && q->last_write[first + i] > req->stamp)) {
+            continue;
+        }
+
+        q->verified++;
+        if (verify_sector(req->data + i * VIRTIO_BLK_SECTOR_SIZE,
+                          req->key + i, expect[i], &got_key, &got_stamp)) {
+            continue;
+        }
+
+        if (q->verify_errors++ < VERIFY_MAX_REPORTS) {
+            char want[32];
+
+            if (expect[i] >= STAMP_FIRST) {
+                snprintf(want, sizeof(want), "stamp %" PRIu32, expect[i]);
+            } else {
+                snprintf(want, sizeof(want), "%s",
+                         expect[i] == STAMP_ZERO ? "zeroes" : "any stamp");
+            }
+            fprintf(stderr, "%s: queue %u: sector %" PRIu64 ": expected %s, "
+                    "got key %" PRIu64 " stamp %" PRIu64 "\n",
+                    q->job->conf.name, q->idx, req->sector + i, want,
+                    got_key, got_stamp);
+        }
+    }
+}
+
+static void verify_completed(struct queue *q, struct request *req, bool ok)
+{
+    uint64_t nsectors = req->bytes / VIRTIO_BLK_SECTOR_SIZE;
+    uint64_t first = req->sector - q->slice_start, i;
+
+    if (req->append_sector) {
+        if (ok) {
+            struct readback *rb = &q->readbacks[q->num_readbacks++];
+
+            assert(q->num_readbacks <= q->job->conf.qd);
+            memcpy(&rb->sector, req->append_sector, sizeof(rb->sector));
+            rb->stamp = req->stamp;
+        }
+        return;
+    }
+
+    if (!req->write) {
+        if (ok) {
+            verify_read(q, req);
+        }
+        return;
+    }
+
+    for (i = first; i < first + nsectors; i++) {
+        q->pending[i]--;
+        if (!ok && q->last_write[i] == req->stamp) {
+            q->expect[i] = STAMP_SKIP;
+        }
+    }
+}
+
+/******************************************************************************/
+
+static bool rw_is_random(enum rw_mode rw)
+{
+    return rw == RW_RANDREAD || rw == RW_RANDWRITE || rw == RW_RANDRW;
+}
+
+static bool pick_write(struct queue *q)
+{
+    switch (q->job->rw) {
+    case RW_READ:
+    case RW_RANDREAD:
+        return false;
+    case RW_WRITE:
+    case RW_RANDWRITE:
+        return true;
+    default:
+        return rng_next(&q->rng) % 100 >= q->job->conf.rwmixread;
+    }
+}
+
+static uint64_t pick_sector(struct queue *q)
+{
+    struct job *job = q->job;
+    uint64_t bs_sectors = job->conf.bs / VIRTIO_BLK_SECTOR_SIZE;
+    uint64_t align_sectors = job->conf.blockalign / VIRTIO_BLK_SECTOR_SIZE;
+    uint64_t slice_end = q->slice_start + q->slice_sectors;
+    uint64_t sector;
+
+    if (rw_is_random(job->rw)) {
+        uint64_t npos = (q->slice_sectors - bs_sectors) / align_sectors + 1;
+        return q->slice_start + rng_next(&q->rng) % npos * align_sectors;
+    }
+
+    sector = q->next_sector;
+    q->next_sector += bs_sectors;
+    if (q->next_sector + bs_sectors > slice_end) {
+        q->next_sector = q->slice_start;
+    }
+    return sector;
+}
+
+/* rw=append with verify=1: read back the last append completed */
+static int submit_readback(struct queue *q)
+{
+    struct job *job = q->job;
+    uint64_t bs_sectors = job->conf.bs / VIRTIO_BLK_SECTOR_SIZE;
+    struct request *req = q->free_reqs[q->num_free - 1];
+    struct readback *rb = &q->readbacks[q->num_readbacks - 1];
+    struct virtio_blk_req_hdr hdr = {
+        .type = VIRTIO_BLK_T_IN,
+        .sector = rb->sector,
+    };
+    uint8_t status = 0xff;
+    struct virtq_driver_buf bufs[3] = {
+        { .len = sizeof(hdr), .data = &hdr },
+        { .len = job->conf.bs, .write = true },
+        { .len = 1, .write = true, .data = &status },
+    };
+    uint32_t *expect = req_expect(q, req);
+    uint64_t i;
+    int ret;
+
+    *req = (struct request) {
+        .submit_ns = clock_get_ns(),
+        .bytes = job->conf.bs,
+        .sector = rb->sector,
+        .stamp = rb->stamp,
+    };
+    for (i = 0; i < bs_sectors; i++) {
+        expect[i] = rb->stamp;
+    }
+
+    ret = virtq_driver_add(&q->drv, bufs, 3, req);
+    if (ret < 0) {
+        return ret;
+    }
+
+    q->num_free--;
+    q->num_readbacks--;
+    req->status = bufs[2].ptr;
+    req->data = bufs[1].ptr;
+    return 0;
+}
+
+/*
+ * Every queue appends to its own zones in turn, resetting each before
+ * starting over it.  The zone is only switched once the appends to the
+ * previous one complete, so that those don't race with the reset when the
+ * queue wraps around.  With verify=1 the appends are read back once
+ * complete, before the queue moves on.
+ */
+static int submit_append(struct queue *q)
+{
+    struct job *job = q->job;
+    uint64_t bs_sectors = job->conf.bs / VIRTIO_BLK_SECTOR_SIZE;
+    struct request *req = q->free_reqs[q->num_free - 1];
+    struct virtio_blk_req_hdr hdr;
+    struct virtq_driver_buf bufs[3];
+    uint8_t inhdr[ZONE_APPEND_INHDR_LEN];
+    uint16_t nbufs = 0;
+    bool reset = false;
+    int ret;
+
+    if (q->zone_resetting) {
+        return -EAGAIN;
+    }
+
+    if (q->num_readbacks) {
+        return submit_readback(q);
+    }
+
+    if (q->zone == UINT64_MAX || q->zone_fill + bs_sectors > job->zone_sectors) {
+        if (q->num_free != job->conf.qd) {
+            return -EAGAIN;
+        }
+        if (q->zone == UINT64_MAX ||
+            q->zone + job->conf.num_queues >= job->nr_zones) {
+            q->zone = q->idx;
+        } else {
+            q->zone += job->conf.num_queues;
+        }
+        q->zone_fill = 0;
+        reset = true;
+    }
+
+    hdr = (struct virtio_blk_req_hdr) {
+        .type = reset ? VIRTIO_BLK_T_ZONE_RESET : VIRTIO_BLK_T_ZONE_APPEND,
+        .sector = q->zone * job->zone_sectors,
+    };
+    bufs[nbufs++] = (struct virtq_driver_buf) {
+        .len = sizeof(hdr), .data = &hdr,
+    };
+    if (!reset) {
+        bufs[nbufs++] = (struct virtq_driver_buf) { .len = job->conf.bs };
+        if (job->conf.verify) {
+            pattern_fill(q->stage, bs_sectors, 0, q->stamp + 1);
+            bufs[nbufs - 1].data = q->stage;
+        }
+    }
+    memset(inhdr, 0xff, sizeof(inhdr));
+    bufs[nbufs++] = (struct virtq_driver_buf) {
+        .len = reset ? 1 : ZONE_APPEND_INHDR_LEN, .write = true,
+        .data = inhdr,
+    };
+
+    *req = (struct request) {
+        .submit_ns = clock_get_ns(),
+        .bytes = reset ? 0 : job->conf.bs,
+        .write = true,
+        .zone_reset = reset,
+        .zone_start = hdr.sector,
+    };
+
+    ret = virtq_driver_add(&q->drv, bufs, nbufs, req);
+    if (ret < 0) {
+        return ret;
+    }
+
+    q->num_free--;
+    req->status = (uint8_t *)bufs[nbufs - 1].ptr + bufs[nbufs - 1].len - 1;
+    if (reset) {
+        q->zone_resetting = true;
+    } else {
+        req->append_sector = bufs[nbufs - 1].ptr;
+        q->zone_fill += bs_sectors;
+        if (job->conf.verify) {
+            req->stamp = ++q->stamp;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Descriptor boundaries don't have to follow the request structure: writes
+ * get the header and the data in one descriptor, reads get the header split
+ * in two and the data in one descriptor with the status.
+ */
+static int submit_any_layout(struct queue *q, bool write,
+                             const struct virtio_blk_req_hdr *hdr)
+{
+    struct job *job = q->job;
+    struct request *req = q->free_reqs[q->num_free - 1];
+    uint8_t status = 0xff;
+    struct virtq_driver_buf bufs[3];
+    uint16_t nbufs;
+    int ret;
+
+    if (write) {
+        memcpy(q->stage, hdr, sizeof(*hdr));
+        if (job->conf.verify) {
+            pattern_fill(q->stage + sizeof(*hdr),
+                         job->conf.bs / VIRTIO_BLK_SECTOR_SIZE, hdr->sector,
+                         q->stamp + 1);
+        }
+        bufs[0] = (struct virtq_driver_buf) {
+            .len = sizeof(*hdr) + job->conf.bs, .data = q->stage,
+        };
+        bufs[1] = (struct virtq_driver_buf) {
+            .len = 1, .write = true, .data = &status,
+        };
+        nbufs = 2;
+    } else {
+        bufs[0] = (struct virtq_driver_buf) {
+            .len = sizeof(*hdr) / 2, .data = hdr,
+        };
+        bufs[1] = (struct virtq_driver_buf) {
+            .len = sizeof(*hdr) - sizeof(*hdr) / 2,
+            .data = (const char *)hdr + sizeof(*hdr) / 2,
+        };
+        q->stage[job->conf.bs] = 0xff;
+        bufs[2] = (struct virtq_driver_buf) {
+            .len = job->conf.bs + 1, .write = true, .data = q->stage,
+        };
+        nbufs = 3;
+    }
+
+    *req = (struct request) {
+        .submit_ns = clock_get_ns(),
+        .bytes = job->conf.bs,
+        .write = write,
+    };
+
+    ret = virtq_driver_add(&q->drv, bufs, nbufs, req);
+    if (ret < 0) {
+        return ret;
+    }
+
+    q->num_free--;
+    req->status = (uint8_t *)bufs[nbufs - 1].ptr + bufs[nbufs - 1].len - 1;
+    if (job->conf.verify) {
+        verify_submitted(q, req, write ? NULL : bufs[nbufs - 1].ptr,
+                         hdr->sector);
+    }
+    return 0;
+}
+
+static int submit_one(struct queue *q)
+{
+    struct job *job = q->job;
+    struct request *req = q->free_reqs[q->num_free - 1];
+    bool write = pick_write(q);
+    struct virtio_blk_req_hdr hdr = {
+        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+        .sector = pick_sector(q),
+    };
+    uint8_t status = 0xff;
+    struct virtq_driver_buf bufs[3] = {
+        { .len = sizeof(hdr), .data = &hdr },
+        { .len = job->conf.bs, .write = !write },
+        { .len = 1, .write = true, .data = &status },
+    };
+    int ret;
+
+    if (job->rw == RW_APPEND) {
+        return submit_append(q);
+    }
+
+    if (job->conf.any_layout) {
+        return submit_any_layout(q, write, &hdr);
+    }
+
+    if (job->conf.verify && write) {
+        pattern_fill(q->stage, job->conf.bs / VIRTIO_BLK_SECTOR_SIZE,
+                     hdr.sector, q->stamp + 1);
+        bufs[1].data = q->stage;
+    }
+
+    /* the device may pick the request up as soon as it's added */
+    *req = (struct request) {
+        .submit_ns = clock_get_ns(),
+        .bytes = job->conf.bs,
+        .write = write,
+    };
+
+    ret = virtq_driver_add(&q->drv, bufs, 3, req);
+    if (ret < 0) {
+        return ret;
+    }
+
+    q->num_free--;
+    req->status = bufs[2].ptr;
+    if (job->conf.verify) {
+        verify_submitted(q, req, bufs[1].ptr, hdr.sector);
+    }
+    return 0;
+}
+
+static bool append_landed_in_zone(struct queue *q, struct request *req)
+{
+    uint64_t sector;
+
+    if (!req->append_sector) {
+        return true;
+    }
+
+    memcpy(&sector, req->append_sector, sizeof(sector));
+    return sector >= req->zone_start &&
+           sector + req->bytes / VIRTIO_BLK_SECTOR_SIZE <=
+           req->zone_start + q->job->zone_sectors;
+}
+
+static unsigned reap(struct queue *q)
+{
+    struct request *req;
+    unsigned n = 0;
+    uint64_t now = clock_get_ns();
+
+    while (virtq_driver_get(&q->drv, (void **)&req, NULL)) {
+        bool ok = *req->status == VIRTIO_BLK_S_OK;
+
+        if (req->zone_reset) {
+            q->zone_resetting = false;
+            q->errors += !ok;
+        } else if (ok && append_landed_in_zone(q, req)) {
+            stats_add(&q->stats[req->write], now - req->submit_ns,
+                      req->bytes);
+        } else {
+            ok = false;
+            q->errors++;
+        }
+        if (q->job->conf.verify && !req->zone_reset) {
+            verify_completed(q, req, ok);
+        }
+        q->free_reqs[q->num_free++] = req;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Run a single request on the drained queue @q and wait for it to complete.
+ * The kick is repeated meanwhile, as a reconnect may have swallowed it.
+ */
+static int run_one(struct queue *q, struct virtq_driver_buf *bufs,
+                   uint16_t nbufs)
+{
+    uint64_t deadline = clock_get_ns() + 10000000000ull;
+    void *cookie;
+    int ret;
+
+    ret = virtq_driver_add(&q->drv, bufs, nbufs, q);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (;;) {
+        struct pollfd pfd = { .fd = q->callfd, .events = POLLIN };
+
+        eventfd_write(q->kickfd, 1);
+        if (poll(&pfd, 1, 100) > 0) {
+            eventfd_t unused;
+            eventfd_read(q->callfd, &unused);
+        }
+        if (virtq_driver_get(&q->drv, &cookie, NULL)) {
+            return *(uint8_t *)bufs[nbufs - 1].ptr == VIRTIO_BLK_S_OK ?
+                0 : -EIO;
+        }
+        if (clock_get_ns() > deadline) {
+            return -ETIMEDOUT;
+        }
+    }
+}
+
+static int report_zone_wp(struct queue *q, uint64_t start, uint64_t *wp)
+{
+    struct virtio_blk_req_hdr hdr = {
+        .type = VIRTIO_BLK_T_ZONE_REPORT,
+        .sector = start,
+    };
+    struct virtio_blk_zone_report *report;
+    struct virtq_driver_buf bufs[3] = {
+        { .len = sizeof(hdr), .data = &hdr },
+        { .len = sizeof(*report) + sizeof(report->zones[0]), .write = true },
+        { .len = 1, .write = true },
+    };
+    int ret;
+
+    ret = run_one(q, bufs, 3);
+    if (ret < 0) {
+        return ret;
+    }
+
+    report = bufs[1].ptr;
+    if (report->nr_zones != 1 || report->zones[0].z_start != start) {
+        return -EIO;
+    }
+    *wp = report->zones[0].z_wp;
+    return 0;
+}
+
+static int reset_zone(struct queue *q, uint64_t start)
+{
+    struct virtio_blk_req_hdr hdr = {
+        .type = VIRTIO_BLK_T_ZONE_RESET,
+        .sector = start,
+    };
+    struct virtq_driver_buf bufs[2] = {
+        { .len = sizeof(hdr), .data = &hdr },
+        { .len = 1, .write = true },
+    };
+
+    return run_one(q, bufs, 2);
+}
+
+/*
+ * rw=append: the write pointer of the zone the queue ended up in must be
+ * right past the appends to it, and back at the zone start after a reset.
+ */
+static void check_zone(struct queue *q)
+{
+    uint64_t start, wp;
+
+    if (q->zone == UINT64_MAX) {
+        return;
+    }
+
+    start = q->zone * q->job->zone_sectors;
+    if (report_zone_wp(q, start, &wp) < 0 || wp != start + q->zone_fill) {
+        q->zone_wp_errors++;
+    }
+    if (reset_zone(q, start) < 0 || report_zone_wp(q, start, &wp) < 0 ||
+        wp != start) {
+        q->zone_wp_errors++;
+    }
+    q->zones_checked++;
+}
+
+/*
+ * rw=append: start on the first zone of the queue, appending right away if
+ * it's empty the way a guest would, or resetting it first otherwise.
+ */
+static void start_zone(struct queue *q)
+{
+    uint64_t start = q->idx * q->job->zone_sectors, wp;
+
+    if (report_zone_wp(q, start, &wp) < 0 ||
+        (wp != start && reset_zone(q, start) < 0)) {
+        q->errors++;
+        return;
+    }
+    q->zone = q->idx;
+    q->zone_fill = 0;
+}
+
+static void *queue_thread(void *opaque)
+{
+    struct queue *q = opaque;
+    struct job *job = q->job;
+    uint64_t interval = job->conf.iops ?
+        1000000000ull * job->conf.num_queues / job->conf.iops : 0;
+    uint64_t drain_deadline = 0;
+
+    if (job->rw == RW_APPEND) {
+        start_zone(q);
+    }
+
+    q->next_submit_ns = clock_get_ns();
+
+    for (;;) {
+        uint16_t old_idx = q->drv.avail_idx;
+        bool stop = catomic_read(&g_stop);
+        struct pollfd pfd = { .fd = q->callfd, .events = POLLIN };
+        int timeout = 100;
+
+        if (stop) {
+            uint64_t now = clock_get_ns();
+
+            if (q->num_free == job->conf.qd) {
+                break;
+            }
+            if (!drain_deadline) {
+                drain_deadline = now + 10000000000ull;
+            } else if (now > drain_deadline) {
+                fprintf(stderr, "%s: queue %u: %lu requests never completed\n",
+                        job->conf.name, q->idx, job->conf.qd - q->num_free);
+                break;
+            }
+        }
+
+        while (!stop && q->num_free) {
+            if (interval) {
+                uint64_t now = clock_get_ns();
+
+                if (now < q->next_submit_ns) {
+                    timeout = (q->next_submit_ns - now) / 1000000;
+                    break;
+                }
+                q->next_submit_ns += interval;
+            }
+            if (submit_one(q) < 0) {
+                break;
+            }
+        }
+
+        if (q->drv.avail_idx != old_idx &&
+            virtq_driver_kick_needed(&q->drv, old_idx)) {
+            eventfd_write(q->kickfd, 1);
+        }
+
+        if (reap(q)) {
+            continue;
+        }
+
+        if (poll(&pfd, 1, timeout) > 0) {
+            eventfd_t unused;
+            eventfd_read(q->callfd, &unused);
+        }
+    }
+
+    if (job->rw == RW_APPEND && q->num_free == job->conf.qd) {
+        check_zone(q);
+    }
+    return NULL;
+}
+
+/******************************************************************************/
+
+static void job_init_queues(struct job *job)
+{
+    unsigned i;
+    unsigned long j;
+
+    for (i = 0; i < job->conf.num_queues; i++) {
+        struct queue *q = &job->queues[i];
+        int ret;
+
+        q->job = job;
+        q->idx = i;
+        q->rng = 0x9e3779b97f4a7c15ull * (i + 1) ^ (uintptr_t)job;
+        q->zone = UINT64_MAX;
+
+        ret = virtq_driver_init(&q->drv, i * QUEUE_GPA_STRIDE, job->conf.qsz,
+                                sizeof(struct virtio_blk_req_hdr) +
+                                job->conf.bs + ZONE_APPEND_INHDR_LEN,
+                                job->conf.indirect,
+                                job->conf.event_idx);
+        if (ret < 0) {
+            DIE("%s: failed to create queue: %s", job->conf.name,
+                strerror(-ret));
+        }
+
+        q->kickfd = eventfd(0, EFD_CLOEXEC);
+        q->callfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (q->kickfd < 0 || q->callfd < 0) {
+            DIE("eventfd: %s", strerror(errno));
+        }
+
+        q->reqs = calloc(job->conf.qd, sizeof(q->reqs[0]));
+        q->free_reqs = calloc(job->conf.qd, sizeof(q->free_reqs[0]));
+        q->stage = calloc(1, sizeof(struct virtio_blk_req_hdr) +
+                          job->conf.bs + 1);
+        for (j = 0; j < job->conf.qd; j++) {
+            q->free_reqs[j] = &q->reqs[j];
+        }
+        q->num_free = job->conf.qd;
+
+        if (job->conf.verify) {
+            q->read_expect = calloc(job->conf.qd * job->conf.bs /
+                                    VIRTIO_BLK_SECTOR_SIZE,
+                                    sizeof(q->read_expect[0]));
+            q->readbacks = calloc(job->conf.qd, sizeof(q->readbacks[0]));
+            q->stamp = STAMP_FIRST - 1;
+        }
+    }
+}
+
+/*
+ * Once the capacity is known, give every queue the part of the device it
+ * runs on.  With verify=1 every queue keeps to its own slice, so that each
+ * knows what the sectors it reads are to hold.
+ */
+static void job_init_slices(struct job *job)
+{
+    uint64_t bs_sectors = job->conf.bs / VIRTIO_BLK_SECTOR_SIZE;
+    uint64_t align_sectors = job->conf.blockalign / VIRTIO_BLK_SECTOR_SIZE;
+    bool sliced = job->conf.verify && job->rw != RW_APPEND;
+    uint64_t slice_sectors = job->capacity;
+    unsigned i;
+    uint64_t j;
+
+    if (sliced) {
+        slice_sectors = job->capacity / job->conf.num_queues /
+            align_sectors * align_sectors;
+    }
+    if (job->rw != RW_APPEND && slice_sectors < bs_sectors) {
+        DIE("%s: device too small for the queues", job->conf.name);
+    }
+
+    for (i = 0; i < job->conf.num_queues; i++) {
+        struct queue *q = &job->queues[i];
+
+        q->slice_start = sliced ? i * slice_sectors : 0;
+        q->slice_sectors = slice_sectors;
+        q->next_sector = q->slice_start;
+
+        if (sliced) {
+            q->expect = calloc(slice_sectors, sizeof(q->expect[0]));
+            q->last_write = calloc(slice_sectors, sizeof(q->last_write[0]));
+            q->pending = calloc(slice_sectors, sizeof(q->pending[0]));
+            for (j = 0; j < slice_sectors; j++) {
+                q->expect[j] = job->verify_init;
+            }
+        }
+    }
+}
+
+static void job_destroy_queues(struct job *job)
+{
+    unsigned i;
+
+    for (i = 0; i < job->conf.num_queues; i++) {
+        struct queue *q = &job->queues[i];
+
+        virtq_driver_destroy(&q->drv);
+        close(q->kickfd);
+        close(q->callfd);
+        free(q->reqs);
+        free(q->free_reqs);
+        free(q->stage);
+        free(q->expect);
+        free(q->last_write);
+        free(q->pending);
+        free(q->read_expect);
+        free(q->readbacks);
+    }
+    if (job->inflight_mem) {
+        munmap(job->inflight_mem, job->inflight.mmap_size);
+        close(job->inflight_fd);
+    }
+    free(job->state);
+}
+
+/******************************************************************************/
+
+static void print_stats_json(FILE *f, const char *name,
+                             const struct lat_stats *st, double runtime)
+{
+    fprintf(f, "      \"%s\": {\n", name);
+    fprintf(f, "        \"ios\": %" PRIu64 ",\n", st->ios);
+    fprintf(f, "        \"bytes\": %" PRIu64 ",\n", st->bytes);
+    fprintf(f, "        \"iops\": %.1f,\n", st->ios / runtime);
+    fprintf(f, "        \"bw_bytes\": %.0f,\n", st->bytes / runtime);
+    fprintf(f, "        \"lat_ns\": {\n");
+    fprintf(f, "          \"mean\": %.0f,\n",
+            st->ios ? (double)st->lat_sum / st->ios : 0.0);
+    fprintf(f, "          \"p50\": %" PRIu64 ",\n",
+            stats_percentile(st, 50));
+    fprintf(f, "          \"p90\": %" PRIu64 ",\n",
+            stats_percentile(st, 90));
+    fprintf(f, "          \"p99\": %" PRIu64 ",\n",
+            stats_percentile(st, 99));
+    fprintf(f, "          \"p99.9\": %" PRIu64 ",\n",
+            stats_percentile(st, 99.9));
+    fprintf(f, "          \"max\": %" PRIu64 "\n", st->lat_max);
+    fprintf(f, "        }\n");
+    fprintf(f, "      }");
+}
+
+static void print_results_json(FILE *f, double runtime)
+{
+    unsigned i, j;
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"runtime_s\": %.3f,\n", runtime);
+    fprintf(f, "  \"jobs\": [\n");
+    for (i = 0; i < g_num_jobs; i++) {
+        struct job *job = &g_jobs[i];
+        struct lat_stats *st = calloc(2, sizeof(*st));
+        uint64_t errors = 0, zones_checked = 0, zone_wp_errors = 0;
+        uint64_t verified = 0, verify_errors = 0;
+
+        for (j = 0; j < job->conf.num_queues; j++) {
+            stats_merge(&st[0], &job->queues[j].stats[0]);
+            stats_merge(&st[1], &job->queues[j].stats[1]);
+            errors += job->queues[j].errors;
+            zones_checked += job->queues[j].zones_checked;
+            zone_wp_errors += job->queues[j].zone_wp_errors;
+            verified += job->queues[j].verified;
+            verify_errors += job->queues[j].verify_errors;
+        }
+
+        fprintf(f, "    {\n");
+        fprintf(f, "      \"name\": \"%s\",\n", job->conf.name);
+        fprintf(f, "      \"socket\": \"%s\",\n", job->conf.socket_path);
+        fprintf(f, "      \"rw\": \"%s\",\n", rw_mode_names[job->rw]);
+        fprintf(f, "      \"bs\": %lu,\n", job->conf.bs);
+        fprintf(f, "      \"qd\": %lu,\n", job->conf.qd);
+        fprintf(f, "      \"queues\": %lu,\n", job->conf.num_queues);
+        fprintf(f, "      \"in_order\": %s,\n",
+                job->features & (1ull << VIRTIO_F_IN_ORDER) ? "true" : "false");
+        fprintf(f, "      \"reconnects\": %" PRIu64 ",\n", job->reconnects);
+        fprintf(f, "      \"migrations\": %" PRIu64 ",\n", job->migrations);
+        fprintf(f, "      \"handed_over\": %" PRIu64 ",\n", job->handed_over);
+        fprintf(f, "      \"stop_ms_max\": %.3f,\n", job->stop_ns_max / 1e6);
+        fprintf(f, "      \"postcopy_faults\": %" PRIu64 ",\n",
+                job->postcopy_faults);
+        fprintf(f, "      \"zones_checked\": %" PRIu64 ",\n", zones_checked);
+        fprintf(f, "      \"zone_wp_errors\": %" PRIu64 ",\n",
+                zone_wp_errors);
+        fprintf(f, "      \"verified\": %" PRIu64 ",\n", verified);
+        fprintf(f, "      \"verify_errors\": %" PRIu64 ",\n", verify_errors);
+        fprintf(f, "      \"errors\": %" PRIu64 ",\n", errors);
+        print_stats_json(f, "read", &st[0], runtime);
+        fprintf(f, ",\n");
+        print_stats_json(f, "write", &st[1], runtime);
+        fprintf(f, "\n    }%s\n", i + 1 < g_num_jobs ? "," : "");
+        free(st);
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+}
+
+/******************************************************************************/
+
+static bool set_string(const char *val, void *dst)
+{
+    *(char **)dst = strdup(val);
+    return true;
+}
+
+static bool set_ul(const char *val, void *dst)
+{
+    char *end;
+
+    errno = 0;
+    *(unsigned long *)dst = strtoul(val, &end, 0);
+    return !errno && *end == '\0';
+}
+
+static bool set_bool(const char *val, void *dst)
+{
+    unsigned long v;
+
+    if (!set_ul(val, &v) || v > 1) {
+        return false;
+    }
+    *(bool *)dst = v;
+    return true;
+}
+
+enum {
+    JOB_ARG_NAME,
+    JOB_ARG_SOCKET_PATH,
+    JOB_ARG_RW,
+    JOB_ARG_BS,
+    JOB_ARG_QD,
+    JOB_ARG_QUEUES,
+    JOB_ARG_QSZ,
+    JOB_ARG_RWMIXREAD,
+    JOB_ARG_IOPS,
+    JOB_ARG_RECONNECT,
+    JOB_ARG_MIGRATE,
+    JOB_ARG_MIGRATE_TO,
+    JOB_ARG_POSTCOPY,
+    JOB_ARG_BLOCKALIGN,
+    JOB_ARG_SIZE,
+    JOB_ARG_VERIFY,
+    JOB_ARG_VERIFY_INIT,
+    JOB_ARG_ORDERED,
+    JOB_ARG_INDIRECT,
+    JOB_ARG_EVENT_IDX,
+    JOB_ARG_IN_ORDER,
+    JOB_ARG_ANY_LAYOUT,
+};
+
+static char *const job_arg_tokens[] = {
+    [JOB_ARG_NAME] = "name",
+    [JOB_ARG_SOCKET_PATH] = "socket-path",
+    [JOB_ARG_RW] = "rw",
+    [JOB_ARG_BS] = "bs",
+    [JOB_ARG_QD] = "qd",
+    [JOB_ARG_QUEUES] = "queues",
+    [JOB_ARG_QSZ] = "queue-size",
+    [JOB_ARG_RWMIXREAD] = "rwmixread",
+    [JOB_ARG_IOPS] = "iops",
+    [JOB_ARG_RECONNECT] = "reconnect-ms",
+    [JOB_ARG_MIGRATE] = "migrate-ms",
+    [JOB_ARG_MIGRATE_TO] = "migrate-to",
+    [JOB_ARG_POSTCOPY] = "postcopy-ms",
+    [JOB_ARG_BLOCKALIGN] = "blockalign",
+    [JOB_ARG_SIZE] = "size",
+    [JOB_ARG_VERIFY] = "verify",
+    [JOB_ARG_VERIFY_INIT] = "verify-init",
+    [JOB_ARG_ORDERED] = "ordered",
+    [JOB_ARG_INDIRECT] = "indirect",
+    [JOB_ARG_EVENT_IDX] = "event-idx",
+    [JOB_ARG_IN_ORDER] = "in-order",
+    [JOB_ARG_ANY_LAYOUT] = "any-layout",
+    NULL
+};
+
+struct arg_setter {
+    bool (*set)(const char *val, void *dst);
+    size_t field_offset;
+};
+
+#define CONF_FIELD(field) offsetof(struct job_config, field)
+static struct arg_setter job_arg_setters[] = {
+    [JOB_ARG_NAME] = { set_string, CONF_FIELD(name) },
+    [JOB_ARG_SOCKET_PATH] = { set_string, CONF_FIELD(socket_path) },
+    [JOB_ARG_RW] = { set_string, CONF_FIELD(rw) },
+    [JOB_ARG_BS] = { set_ul, CONF_FIELD(bs) },
+    [JOB_ARG_QD] = { set_ul, CONF_FIELD(qd) },
+    [JOB_ARG_QUEUES] = { set_ul, CONF_FIELD(num_queues) },
+    [JOB_ARG_QSZ] = { set_ul, CONF_FIELD(qsz) },
+    [JOB_ARG_RWMIXREAD] = { set_ul, CONF_FIELD(rwmixread) },
+    [JOB_ARG_IOPS] = { set_ul, CONF_FIELD(iops) },
+    [JOB_ARG_RECONNECT] = { set_ul, CONF_FIELD(reconnect_ms) },
+    [JOB_ARG_MIGRATE] = { set_ul, CONF_FIELD(migrate_ms) },
+    [JOB_ARG_MIGRATE_TO] = { set_string, CONF_FIELD(migrate_to) },
+    [JOB_ARG_POSTCOPY] = { set_ul, CONF_FIELD(postcopy_ms) },
+    [JOB_ARG_BLOCKALIGN] = { set_ul, CONF_FIELD(blockalign) },
+    [JOB_ARG_SIZE] = { set_ul, CONF_FIELD(size) },
+    [JOB_ARG_VERIFY] = { set_bool, CONF_FIELD(verify) },
+    [JOB_ARG_VERIFY_INIT] = { set_string, CONF_FIELD(verify_init) },
+    [JOB_ARG_ORDERED] = { set_bool, CONF_FIELD(ordered) },
+    [JOB_ARG_INDIRECT] = { set_bool, CONF_FIELD(indirect) },
+    [JOB_ARG_EVENT_IDX] = { set_bool, CONF_FIELD(event_idx) },
+    [JOB_ARG_IN_ORDER] = { set_bool, CONF_FIELD(in_order) },
+    [JOB_ARG_ANY_LAYOUT] = { set_bool, CONF_FIELD(any_layout) },
+};
+
+static bool parse_job_args(char *subopts, struct job *job)
+{
+    struct job_config *conf = &job->conf;
+    char *value;
+    unsigned i;
+
+    *conf = (struct job_config) {
+        .rw = "randread",
+        .bs = 4096,
+        .qd = 32,
+        .num_queues = 1,
+        .qsz = 128,
+        .rwmixread = 50,
+        .verify_init = "unknown",
+        .indirect = true,
+        .event_idx = true,
+        .in_order = true,
+    };
+
+    while (*subopts != '\0') {
+        int ret = getsubopt(&subopts, job_arg_tokens, &value);
+        if (ret < 0 || value == NULL) {
+            return false;
+        }
+
+        if (!job_arg_setters[ret].set(value, ((char *)conf) +
+                                      job_arg_setters[ret].field_offset)) {
+            return false;
+        }
+    }
+
+    for (i = 0; i < countof(rw_mode_names); i++) {
+        if (!strcmp(conf->rw, rw_mode_names[i])) {
+            break;
+        }
+    }
+    if (i == countof(rw_mode_names)) {
+        return false;
+    }
+    job->rw = i;
+
+    for (i = 0; i < countof(verify_init_names); i++) {
+        if (!strcmp(conf->verify_init, verify_init_names[i])) {
+            break;
+        }
+    }
+    if (i == countof(verify_init_names)) {
+        return false;
+    }
+    job->verify_init = i;
+
+    if (!conf->blockalign) {
+        conf->blockalign = conf->bs;
+    }
+
+    if (!conf->name) {
+        conf->name = conf->socket_path;
+    }
+
+    return conf->socket_path && conf->bs &&
+        !(conf->bs % VIRTIO_BLK_SECTOR_SIZE) &&
+        !(conf->blockalign % VIRTIO_BLK_SECTOR_SIZE) && conf->qd &&
+        conf->num_queues && conf->num_queues <= MAX_NUM_QUEUES &&
+        conf->qsz && !(conf->qsz & (conf->qsz - 1)) &&
+        conf->qsz <= VIRTQ_SIZE_MAX &&
+        conf->qd * (conf->indirect ? 1 : 3) <= conf->qsz &&
+        conf->rwmixread <= 100 &&
+        !conf->migrate_ms == !conf->migrate_to &&
+        !(conf->migrate_ms && conf->reconnect_ms) &&
+        !(conf->postcopy_ms && (conf->migrate_ms || conf->reconnect_ms));
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s --job socket-path=PATH[,...] [--job ...] "
+            "[--runtime SEC] [--output FILE]\n"
+            "Job parameters:\n"
+            "  name=NAME            job name in the report "
+            "(default: socket path)\n"
+            "  rw=MODE              read, write, randread, randwrite, rw, "
+            "randrw, or append for zone appends to a zoned device "
+            "(default: randread)\n"
+            "  bs=BYTES             request size (default: 4096)\n"
+            "  qd=N                 requests in flight per queue "
+            "(default: 32)\n"
+            "  queues=N             number of queues (default: 1)\n"
+            "  queue-size=N         virtqueue size (default: 128)\n"
+            "  rwmixread=PCT        share of reads for rw and randrw "
+            "(default: 50)\n"
+            "  iops=N               rate limit, 0 for none (default: 0)\n"
+            "  reconnect-ms=MS      reconnect with requests in flight every "
+            "MS milliseconds (default: never)\n"
+            "  migrate-ms=MS        migrate with requests in flight every MS "
+            "milliseconds, back and forth between the device at socket-path "
+            "and the one at migrate-to (default: never)\n"
+            "  migrate-to=PATH      socket of the device to migrate to\n"
+            "  postcopy-ms=MS       start as a postcopy migration destination "
+            "with the request buffers arriving on demand for MS milliseconds "
+            "(default: off)\n"
+            "  blockalign=BYTES     alignment of the random offsets "
+            "(default: bs)\n"
+            "  size=BYTES           part of the device to run on, from its "
+            "start (default: all of it)\n"
+            "  verify=0|1           write data for the reads to check; every "
+            "queue keeps to its own slice of the device and checks the "
+            "sectors it knows the contents of, and zone appends are read "
+            "back (default: 0)\n"
+            "  verify-init=WHAT     what the sectors hold before the job "
+            "writes them: unknown, zero, or data written by an earlier "
+            "verify=1 job (default: unknown)\n"
+            "  ordered=0|1          the device keeps the requests overlapping "
+            "writes in flight in submission order (default: 0)\n"
+            "  indirect=0|1         indirect descriptors (default: 1)\n"
+            "  event-idx=0|1        VIRTIO_F_RING_EVENT_IDX (default: 1)\n"
+            "  in-order=0|1         VIRTIO_F_IN_ORDER if the device offers it "
+            "(default: 1)\n"
+            "  any-layout=0|1       pack the header with the write data, "
+            "split it for reads and pack the read data with the status "
+            "(default: 0)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"job",     1, NULL, 'j'},
+        {"runtime", 1, NULL, 't'},
+        {"output",  1, NULL, 'o'},
+        {"help",    0, NULL, 'h'},
+        {0, 0, 0, 0}
+    };
+    unsigned long runtime = 10;
+    const char *output = NULL;
+    struct timespec ts;
+    uint64_t start;
+    double elapsed;
+    FILE *out = stdout;
+    unsigned i, j;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "j:t:o:h", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            if (g_num_jobs == MAX_NUM_JOBS) {
+                DIE("too many jobs, max is %d", MAX_NUM_JOBS);
+            }
+            if (!parse_job_args(optarg, &g_jobs[g_num_jobs++])) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 't':
+            runtime = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : 2;
+        }
+    }
+
+    if (!g_num_jobs || !runtime) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    for (i = 0; i < g_num_jobs; i++) {
+        struct job *job = &g_jobs[i];
+        int ret;
+
+        job_init_queues(job);
+        ret = job_connect(job, false);
+        if (ret < 0) {
+            DIE("%s: failed to set up the device: %s", job->conf.name,
+                strerror(-ret));
+        }
+        job_init_slices(job);
+    }
+
+    start = clock_get_ns();
+    for (i = 0; i < g_num_jobs; i++) {
+        struct job *job = &g_jobs[i];
+
+        for (j = 0; j < job->conf.num_queues; j++) {
+            pthread_create(&job->queues[j].thread, NULL, queue_thread,
+                           &job->queues[j]);
+        }
+        if (job->conf.reconnect_ms) {
+            pthread_create(&job->reconnect_thread, NULL, reconnect_thread,
+                           job);
+        } else if (job->conf.migrate_ms) {
+            pthread_create(&job->reconnect_thread, NULL, migrate_thread, job);
+        }
+    }
+
+    ts = (struct timespec) { .tv_sec = runtime };
+    while (nanosleep(&ts, &ts) && errno == EINTR) {
+        ;
+    }
+    catomic_set(&g_stop, true);
+
+    for (i = 0; i < g_num_jobs; i++) {
+        struct job *job = &g_jobs[i];
+
+        if (job->conf.reconnect_ms || job->conf.migrate_ms ||
+            job->conf.postcopy_ms) {
+            pthread_join(job->reconnect_thread, NULL);
+        }
+        for (j = 0; j < job->conf.num_queues; j++) {
+            pthread_join(job->queues[j].thread, NULL);
+        }
+    }
+    elapsed = (clock_get_ns() - start) / 1e9;
+
+    for (i = 0; i < g_num_jobs; i++) {
+        job_disconnect(&g_jobs[i], true);
+    }
+
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            DIE("%s: %s", output, strerror(errno));
+        }
+    }
+    print_results_json(out, elapsed);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    for (i = 0; i < g_num_jobs; i++) {
+        job_destroy_queues(&g_jobs[i]);
+    }
+    return EXIT_SUCCESS;
+}
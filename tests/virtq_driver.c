@@ -0,0 +1,299 @@
+/*
+ * Synthetic virtio split virtqueue driver
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "catomic.h"
+#include "memmap.h"
+#include "platform.h"
+#include "virtio/virt_queue.h"
+
+#include "virtq_driver.h"
+
+/* Device mappings of the guest memory don't need to match the driver ones */
+#define VIRTQ_DRIVER_UVA_BASE   (1ull << 40)
+
+#define VIRTQ_DRIVER_BUF_ALIGN  8
+
+static size_t indirect_table_size(void)
+{
+    return VIRTQ_DRIVER_MAX_BUFS * sizeof(struct virtq_desc);
+}
+
+static void *gpa_to_ptr(struct virtq_driver *drv, uint64_t gpa)
+{
+    return drv->mem + (gpa - drv->gpa_base);
+}
+
+int virtq_driver_init(struct virtq_driver *drv, uint64_t gpa_base,
+                      uint16_t qsz, size_t max_data, bool indirect,
+                      bool event_idx)
+{
+    uint64_t gpa;
+    uint16_t i;
+    int ret;
+
+    if (!qsz || (qsz & (qsz - 1)) || qsz > VIRTQ_SIZE_MAX) {
+        return -EINVAL;
+    }
+
+    *drv = (struct virtq_driver) {
+        .memfd = -1,
+        .gpa_base = gpa_base,
+        .qsz = qsz,
+        .indirect = indirect,
+        .event_idx = event_idx,
+    };
+
+    drv->desc_gpa = gpa_base;
+    drv->avail_gpa = drv->desc_gpa + qsz * sizeof(struct virtq_desc);
+    gpa = drv->avail_gpa + sizeof(struct virtq_avail) + (qsz + 1) * 2;
+    drv->used_gpa = VHD_ALIGN_UP(gpa, PAGE_SIZE);
+    gpa = drv->used_gpa + sizeof(struct virtq_used) +
+        qsz * sizeof(struct virtq_used_elem) + 2;
+    drv->slots_gpa = VHD_ALIGN_UP(gpa, PAGE_SIZE);
+
+    drv->slot_size = VHD_ALIGN_UP(indirect_table_size() + max_data +
+                                  VIRTQ_DRIVER_MAX_BUFS *
+                                  VIRTQ_DRIVER_BUF_ALIGN, PAGE_SIZE);
+    drv->mem_size = VHD_ALIGN_UP(drv->slots_gpa - gpa_base +
+                                 qsz * drv->slot_size, HUGE_PAGE_SIZE);
+
+    drv->memfd = memfd_create("virtq-driver", MFD_CLOEXEC);
+    if (drv->memfd < 0) {
+        return -errno;
+    }
+    if (ftruncate(drv->memfd, drv->mem_size) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    drv->mem = mmap(NULL, drv->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    drv->memfd, 0);
+    if (drv->mem == MAP_FAILED) {
+        drv->mem = NULL;
+        ret = -errno;
+        goto fail;
+    }
+
+    drv->desc = gpa_to_ptr(drv, drv->desc_gpa);
+    drv->avail = gpa_to_ptr(drv, drv->avail_gpa);
+    drv->used = gpa_to_ptr(drv, drv->used_gpa);
+
+    for (i = 0; i < qsz; i++) {
+        drv->desc[i].next = i + 1;
+    }
+    drv->free_head = 0;
+    drv->num_free = qsz;
+
+    drv->cookies = vhd_calloc(qsz, sizeof(drv->cookies[0]));
+    drv->chain_len = vhd_calloc(qsz, sizeof(drv->chain_len[0]));
+    return 0;
+
+fail:
+    virtq_driver_destroy(drv);
+    return ret;
+}
+
+void virtq_driver_destroy(struct virtq_driver *drv)
+{
+    if (drv->mm) {
+        vhd_memmap_unref(drv->mm);
+    }
+    if (drv->mem) {
+        munmap(drv->mem, drv->mem_size);
+    }
+    if (drv->memfd >= 0) {
+        close(drv->memfd);
+    }
+    vhd_free(drv->cookies);
+    vhd_free(drv->chain_len);
+    *drv = (struct virtq_driver) { .memfd = -1 };
+}
+
+int virtq_driver_attach(struct virtq_driver *drv, struct virtio_virtq *vq)
+{
+    int ret;
+
+    drv->mm = vhd_memmap_new(NULL, NULL);
+    ret = vhd_memmap_add_slot(drv->mm, drv->gpa_base, VIRTQ_DRIVER_UVA_BASE,
+                              drv->mem_size, drv->memfd, 0);
+    if (ret < 0) {
+        vhd_memmap_unref(drv->mm);
+        drv->mm = NULL;
+        return ret;
+    }
+
+    vq->qsz = drv->qsz;
+    vq->desc = gpa_range_to_ptr(drv->mm, drv->desc_gpa,
+                                drv->qsz * sizeof(struct virtq_desc));
+    vq->avail = gpa_range_to_ptr(drv->mm, drv->avail_gpa,
+                                 sizeof(struct virtq_avail) +
+                                 (drv->qsz + 1) * 2);
+    vq->used = gpa_range_to_ptr(drv->mm, drv->used_gpa,
+                                sizeof(struct virtq_used) +
+                                drv->qsz * sizeof(struct virtq_used_elem) + 2);
+    vq->used_gpa_base = drv->used_gpa;
+    vq->mm = drv->mm;
+    vq->notify_fd = -1;
+    vq->enabled = true;
+    vq->has_event_idx = drv->event_idx;
+    vq->log_tag = "virtq-driver";
+    virtio_virtq_init(vq);
+    return 0;
+}
+
+static void fill_desc(struct virtq_desc *desc, uint64_t gpa,
+                      const struct virtq_driver_buf *buf, bool last)
+{
+    desc->addr = gpa;
+    desc->len = buf->len;
+    desc->flags = (buf->write ? VIRTQ_DESC_F_WRITE : 0) |
+        (last ? 0 : VIRTQ_DESC_F_NEXT);
+}
+
+int virtq_driver_add(struct virtq_driver *drv, struct virtq_driver_buf *bufs,
+                     uint16_t nbufs, void *cookie)
+{
+    uint16_t ndescs = drv->indirect ? 1 : nbufs;
+    uint16_t head, idx, i;
+    uint64_t slot_gpa, data_gpa, data_end;
+
+    if (!nbufs || nbufs > VIRTQ_DRIVER_MAX_BUFS || ndescs > drv->qsz) {
+        return -EINVAL;
+    }
+    if (drv->num_free < ndescs) {
+        return -ENOSPC;
+    }
+
+    head = drv->free_head;
+    slot_gpa = drv->slots_gpa + head * drv->slot_size;
+    data_gpa = slot_gpa + indirect_table_size();
+    data_end = slot_gpa + drv->slot_size;
+
+    for (i = 0; i < nbufs; i++) {
+        if (bufs[i].len > data_end - data_gpa) {
+            return -EINVAL;
+        }
+        bufs[i].ptr = gpa_to_ptr(drv, data_gpa);
+        if (bufs[i].data) {
+            memcpy(bufs[i].ptr, bufs[i].data, bufs[i].len);
+        }
+        data_gpa = VHD_ALIGN_UP(data_gpa + bufs[i].len,
+                                VIRTQ_DRIVER_BUF_ALIGN);
+    }
+
+    data_gpa = slot_gpa + indirect_table_size();
+    if (drv->indirect) {
+        struct virtq_desc *table = gpa_to_ptr(drv, slot_gpa);
+
+        for (i = 0; i < nbufs; i++) {
+            fill_desc(&table[i], data_gpa, &bufs[i], i == nbufs - 1);
+            table[i].next = i + 1;
+            data_gpa = VHD_ALIGN_UP(data_gpa + bufs[i].len,
+                                    VIRTQ_DRIVER_BUF_ALIGN);
+        }
+
+        drv->free_head = drv->desc[head].next;
+        drv->desc[head].addr = slot_gpa;
+        drv->desc[head].len = nbufs * sizeof(struct virtq_desc);
+        drv->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+    } else {
+        /* the free list links double as the chain links */
+        idx = head;
+        for (i = 0; i < nbufs; i++) {
+            fill_desc(&drv->desc[idx], data_gpa, &bufs[i], i == nbufs - 1);
+            data_gpa = VHD_ALIGN_UP(data_gpa + bufs[i].len,
+                                    VIRTQ_DRIVER_BUF_ALIGN);
+            if (i < nbufs - 1) {
+                idx = drv->desc[idx].next;
+            }
+        }
+        drv->free_head = drv->desc[idx].next;
+    }
+
+    drv->num_free -= ndescs;
+    drv->chain_len[head] = ndescs;
+    drv->cookies[head] = cookie;
+
+    drv->avail->ring[drv->avail_idx % drv->qsz] = head;
+    drv->avail_idx++;
+    catomic_store_release(&drv->avail->idx, drv->avail_idx);
+    return head;
+}
+
+bool virtq_driver_kick_needed(struct virtq_driver *drv, uint16_t old_idx)
+{
+    uint16_t event;
+
+    /* order avail->idx store against the used ring flags/event load */
+    smp_mb();
+
+    if (!drv->event_idx) {
+        return !(catomic_read(&drv->used->flags) & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    /* avail_event */
+    event = catomic_read((le16 *)&drv->used->ring[drv->qsz]);
+    return (uint16_t)(drv->avail_idx - event - 1) <
+        (uint16_t)(drv->avail_idx - old_idx);
+}
+
+bool virtq_driver_get(struct virtq_driver *drv, void **cookie, uint32_t *len)
+{
+    struct virtq_used_elem *elem;
+    uint16_t head, idx, i;
+    uint32_t used_len;
+
+    if (!drv->in_batch &&
+        drv->last_used == catomic_load_acquire(&drv->used->idx)) {
+        return false;
+    }
+
+    elem = &drv->used->ring[drv->last_used % drv->qsz];
+    if (!drv->in_order) {
+        head = elem->id;
+        used_len = elem->len;
+    } else {
+        /* buffers are used in the order they were made available */
+        if (!drv->in_batch) {
+            drv->batch_last_head = elem->id;
+            drv->batch_last_len = elem->len;
+            drv->in_batch = true;
+        }
+        head = drv->avail->ring[drv->last_used % drv->qsz];
+        used_len = 0;
+        if (head == drv->batch_last_head) {
+            used_len = drv->batch_last_len;
+            drv->in_batch = false;
+        }
+    }
+    if (len) {
+        *len = used_len;
+    }
+    if (cookie) {
+        *cookie = drv->cookies[head];
+    }
+    drv->last_used++;
+
+    if (drv->event_idx) {
+        /* used_event: ask for a notification on the very next completion */
+        catomic_store_release(&drv->avail->ring[drv->qsz], drv->last_used);
+    }
+
+    idx = head;
+    for (i = 1; i < drv->chain_len[head]; i++) {
+        idx = drv->desc[idx].next;
+    }
+    drv->desc[idx].next = drv->free_head;
+    drv->free_head = head;
+    drv->num_free += drv->chain_len[head];
+    drv->cookies[head] = NULL;
+    return true;
+}
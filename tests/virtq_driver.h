@@ -0,0 +1,126 @@
+/*
+ * Synthetic virtio split virtqueue driver
+ *
+ * Plays the guest side of a single virtqueue in the same process as the
+ * library: lays out the rings and request buffers in a memfd-backed "guest
+ * memory", publishes descriptor chains and reaps used elements.  Lets tools
+ * drive the device dispatch code without QEMU or a guest.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "virtio/virtio_spec.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vhd_memory_map;
+struct virtio_virtq;
+
+/* Max number of buffers in a single request */
+#define VIRTQ_DRIVER_MAX_BUFS   256
+
+struct virtq_driver_buf {
+    /* Buffer length, filled in by the caller */
+    uint32_t len;
+    /* Device-writable buffer */
+    bool write;
+    /* Driver view of the buffer, filled in by virtq_driver_add() */
+    void *ptr;
+    /*
+     * Optional initial contents, copied into the buffer before it becomes
+     * visible to the device
+     */
+    const void *data;
+};
+
+struct virtq_driver {
+    int memfd;
+    /* Driver view of the guest memory, mapped at gpa_base */
+    char *mem;
+    size_t mem_size;
+    uint64_t gpa_base;
+    /* Device view of the guest memory, set up by virtq_driver_attach() */
+    struct vhd_memory_map *mm;
+
+    uint16_t qsz;
+    bool indirect;
+    bool event_idx;
+
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint64_t desc_gpa;
+    uint64_t avail_gpa;
+    uint64_t used_gpa;
+
+    /*
+     * Every head owns a slot of guest memory for its indirect table and
+     * data buffers.
+     */
+    size_t slot_size;
+    uint64_t slots_gpa;
+
+    /* Free descriptors chained through desc[].next */
+    uint16_t free_head;
+    uint16_t num_free;
+    void **cookies;
+    uint16_t *chain_len;
+
+    uint16_t avail_idx;
+    uint16_t last_used;
+
+    /*
+     * VIRTIO_F_IN_ORDER is negotiated; set by the user before the device
+     * starts.  A used element may then stand for a batch of buffers ending
+     * with its id.
+     */
+    bool in_order;
+    bool in_batch;
+    uint16_t batch_last_head;
+    uint32_t batch_last_len;
+};
+
+/*
+ * Create a driver for a queue of @qsz descriptors with room for @max_data
+ * bytes of buffers per request, in guest memory starting at @gpa_base.
+ */
+int virtq_driver_init(struct virtq_driver *drv, uint64_t gpa_base,
+                      uint16_t qsz, size_t max_data, bool indirect,
+                      bool event_idx);
+void virtq_driver_destroy(struct virtq_driver *drv);
+
+/*
+ * Point the device side of @vq at the driver rings, for in-process devices.
+ * @vq must be embedded in a struct vhd_vring if it is going to be used with a
+ * request queue.
+ */
+int virtq_driver_attach(struct virtq_driver *drv, struct virtio_virtq *vq);
+
+/*
+ * Publish a request of @nbufs buffers and return its head, or -ENOSPC if the
+ * queue has no room for it.  Buffer pointers are filled in.
+ */
+int virtq_driver_add(struct virtq_driver *drv, struct virtq_driver_buf *bufs,
+                     uint16_t nbufs, void *cookie);
+
+/*
+ * Whether the device wants a notification after the avail index has moved on
+ * from @old_idx.
+ */
+bool virtq_driver_kick_needed(struct virtq_driver *drv, uint16_t old_idx);
+
+/*
+ * Reap the next used element.  Returns false if there is none.  Within an
+ * in-order batch only the last buffer gets its @len, the others get 0.
+ */
+bool virtq_driver_get(struct virtq_driver *drv, void **cookie, uint32_t *len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
@@ -11,6 +13,8 @@
 #include <sys/mman.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <linux/userfaultfd.h>
+#include <linux/vduse.h>
 
 #include "vdev.h"
 #include "server_internal.h"
@@ -55,6 +59,8 @@ static const char *const vhost_req_names[] = {
     VHOST_REQ(GET_MAX_MEM_SLOTS),
     VHOST_REQ(ADD_MEM_REG),
     VHOST_REQ(REM_MEM_REG),
+    VHOST_REQ(SET_DEVICE_STATE_FD),
+    VHOST_REQ(CHECK_DEVICE_STATE),
 };
 #undef VHOST_REQ
 
@@ -76,8 +82,29 @@ static uint16_t vring_idx(struct vhd_vring *vring)
 
 struct vhd_request_queue *vhd_get_rq_for_vring(struct vhd_vring *vring)
 {
-    struct vhd_vdev *vdev = vring->vdev;
-    return vdev->rqs[vring_idx(vring) % vdev->num_rqs];
+    return vring->rq;
+}
+
+/*
+ * Spread the vrings over the request queues the caller attached, replacing
+ * those not local to the guest memory with the ones that are; recomputed
+ * from the caller's choice on every placement, so nothing sticks across
+ * connections.  Only with no vrings running.
+ */
+static void vdev_place_rqs(struct vhd_vdev *vdev)
+{
+    struct vhd_request_queue *rqs[VHD_MAX_REQUEST_QUEUES];
+    uint16_t i;
+
+    memcpy(rqs, vdev->rqs, vdev->num_rqs * sizeof(rqs[0]));
+    if (vdev->memmap) {
+        vhd_rqs_place_on_numa_node(rqs, vdev->num_rqs,
+                                   vhd_memmap_numa_node(vdev->memmap));
+    }
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        vdev->vrings[i].rq = rqs[i % vdev->num_rqs];
+    }
 }
 
 static void replace_fd(int *fd, int newfd)
@@ -95,11 +122,27 @@ static size_t vring_inflight_buf_size(uint16_t num)
         num * sizeof(struct inflight_split_desc);
 }
 
-static int vring_kick(void *opaque)
+static void vring_dispatch(struct vhd_vring *vring)
 {
+    struct vhd_vdev *vdev = vring->vdev;
     int ret;
+
+    ret = vdev->type->dispatch_requests(vdev, vring);
+    if (ret < 0) {
+        /*
+         * seems like full-fledged vring stop may surprize the client, so just
+         * disable notifications and effectively suspend the vring
+         */
+        VHD_OBJ_ERROR(vring, "dispatch_requests: %s, suspending vring",
+                      strerror(-ret));
+        vhd_detach_io_handler(vring->kick_handler);
+        vring->suspended = true;
+    }
+}
+
+static int vring_kick(void *opaque)
+{
     struct vhd_vring *vring = opaque;
-    struct vhd_vdev *vdev = vring->vdev;
 
     /*
      * Clear vring event now, before processing virtq.
@@ -112,17 +155,7 @@ static int vring_kick(void *opaque)
         return 0;
     }
 
-    ret = vdev->type->dispatch_requests(vdev, vring);
-    if (ret < 0) {
-        /*
-         * seems like full-fledged vring stop may surprize the client, so just
-         * disable notifications and effectively suspend the vring
-         */
-        VHD_OBJ_ERROR(vring, "dispatch_requests: %s, suspending vring",
-                      strerror(-ret));
-        vhd_detach_io_handler(vring->kick_handler);
-    }
-
+    vring_dispatch(vring);
     return 0;
 }
 
@@ -154,6 +187,8 @@ static int vring_update_shadow_vq_addrs(struct vhd_vring *vring,
     return 0;
 }
 
+static void vduse_notify(struct virtio_virtq *vq);
+
 static void vring_sync_to_virtq(struct vhd_vring *vring)
 {
     bool should_kick;
@@ -174,6 +209,7 @@ static void vring_sync_to_virtq(struct vhd_vring *vring)
     should_kick = !vring->vq.enabled && vring->shadow_vq.enabled;
     vring->vq.enabled = vring->shadow_vq.enabled;
 
+    vring->vq.notify_cb = vring->vdev->vduse_fd >= 0 ? vduse_notify : NULL;
     virtq_set_notify_fd(&vring->vq, vring->callfd);
 
     if (should_kick) {
@@ -267,6 +303,14 @@ static void vring_mark_stopped(struct vhd_vring *vring)
 
     replace_fd(&vring->kickfd, -1);
 
+    if (vring->on_stop_cb) {
+        int ret = vring->on_stop_cb(vring);
+        vring->on_stop_cb = NULL;
+        if (ret < 0) {
+            vdev_disconnect(vdev);
+        }
+    }
+
     VHD_ASSERT(vdev->num_vrings_started);
     vdev->num_vrings_started--;
 
@@ -278,6 +322,17 @@ static void vring_mark_stopped_bh(void *opaque)
     vring_mark_stopped(opaque);
 }
 
+static void vring_free_state(struct vhd_vring *vring)
+{
+    if (!vring->state) {
+        return;
+    }
+
+    vhd_free(vring->state->heads);
+    vhd_free(vring->state);
+    vring->state = NULL;
+}
+
 static void vring_reset(struct vhd_vring *vring)
 {
     replace_fd(&vring->callfd, -1);
@@ -289,6 +344,8 @@ static void vring_reset(struct vhd_vring *vring)
     vring->num_in_flight_at_stop = 0;
 
     vring->disconnecting = false;
+
+    vring_free_state(vring);
 }
 
 static void vring_mark_drained(struct vhd_vring *vring)
@@ -306,8 +363,23 @@ static void vring_mark_drained(struct vhd_vring *vring)
         }
     }
 
+    if (vring->vq.flush_bh) {
+        vhd_bh_delete(vring->vq.flush_bh);
+    }
     virtio_virtq_release(&vring->vq);
 
+    if (vring->handing_over) {
+        vring->handing_over = false;
+        VHD_ASSERT(vdev->num_vrings_handing_over);
+        vdev->num_vrings_handing_over--;
+
+        /* resume reading the messages held off while draining */
+        if (!vdev->num_vrings_handing_over && vdev->conn_held) {
+            vdev->conn_held = false;
+            vhd_attach_io_handler(vdev->conn_handler);
+        }
+    }
+
     VHD_ASSERT(vdev->num_vrings_in_flight);
     vdev->num_vrings_in_flight--;
 
@@ -319,6 +391,24 @@ static void vring_mark_drained_bh(void *opaque)
     vring_mark_drained(opaque);
 }
 
+static void vring_flush_bh(void *opaque)
+{
+    struct vhd_vring *vring = opaque;
+    virtq_flush(&vring->vq);
+}
+
+/*
+ * Publish the completions held back for batching right away, e.g. once there
+ * are no more to come.
+ */
+static void vring_flush(struct vhd_vring *vring)
+{
+    if (vring->vq.flush_bh) {
+        vhd_bh_cancel(vring->vq.flush_bh);
+    }
+    virtq_flush(&vring->vq);
+}
+
 void vhd_vring_inc_in_flight(struct vhd_vring *vring)
 {
     vring->num_in_flight++;
@@ -327,9 +417,58 @@ void vhd_vring_inc_in_flight(struct vhd_vring *vring)
 void vhd_vring_dec_in_flight(struct vhd_vring *vring)
 {
     vring->num_in_flight--;
-    if (!vring->num_in_flight && !vring->started_in_rq) {
-        vhd_run_in_ctl(vring_mark_drained_bh, vring);
+    if (!vring->num_in_flight) {
+        vring_flush(vring);
+        if (!vring->started_in_rq) {
+            vhd_run_in_ctl(vring_mark_drained_bh, vring);
+        }
+    }
+}
+
+/*
+ * Called in dataplane right after a batch of completions on the vring.  The
+ * guest often has its next requests ready by then, so pick them up now rather
+ * than wait for the kick to come through another event loop iteration.  The
+ * kick may still arrive and then finds the vring empty, which is harmless.
+ */
+void vhd_vring_poll_avail(struct vhd_vring *vring)
+{
+    struct virtio_virtq *vq = &vring->vq;
+
+    if (!vring->started_in_rq || vring->suspended || !vq->enabled ||
+        virtq_is_broken(vq)) {
+        return;
+    }
+
+    /* the guest only moves on once it sees the completions */
+    vring_flush(vring);
+
+    if (!virtq_has_avail(vq)) {
+        vq->stat.metrics.avail_poll_misses++;
+        return;
     }
+
+    vq->stat.metrics.avail_poll_hits++;
+    vring_dispatch(vring);
+}
+
+/*
+ * Record the requests in flight for the device state, so that the vring can
+ * be reported stopped without waiting for them.  From now on they no longer
+ * complete to the guest: they are resubmitted either on the migration
+ * destination, or here if the vring is restarted instead.
+ */
+static void vring_save_state(struct vhd_vring *vring)
+{
+    struct vhd_vring_state *state = vhd_zalloc(sizeof(*state));
+
+    vring->vq.handed_over = true;
+
+    state->last_avail = vring->vq.last_avail;
+    state->heads = virtq_get_inflight_heads(&vring->vq, &state->num_heads);
+
+    vring_free_state(vring);
+    vring->state = state;
 }
 
 static void vring_stop_bh(void *opaque)
@@ -344,18 +483,22 @@ static void vring_stop_bh(void *opaque)
     vring->kick_handler = NULL;
 
     /*
-     * FIXME: if the vring is stopped on request from the client via
-     * GET_VRING_BASE message (as opposed to a disconnect), the requests have
-     * to run through the backend because inflight requests aren't migrated by
-     * QEMU yet.  Once this is fixed (with the help of the inflight region
-     * migration), the requests should be canceled here unconditionally,
-     * speeding up vm migration and shutdown.
+     * If the vring is stopped on request from the client via GET_VRING_BASE
+     * message (as opposed to a disconnect), the requests have to run through
+     * the backend: unless handed over in the device state they have to
+     * complete before the vring is reported stopped, and when they are, the
+     * backend may still have them in progress.
      */
     if (vring->disconnecting) {
         vhd_cancel_queued_requests(vhd_get_rq_for_vring(vring), vring);
     }
 
     vring->started_in_rq = false;
+    vring_flush(vring);
+
+    if (vring->handing_over) {
+        vring_save_state(vring);
+    }
 
     vring->num_in_flight_at_stop = vring->num_in_flight;
     vhd_run_in_ctl(vring_mark_stopped_bh, vring);
@@ -546,7 +689,8 @@ static const uint64_t g_default_protocol_features =
     (1UL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
     (1UL << VHOST_USER_PROTOCOL_F_CONFIG) |
     (1UL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) |
-    (1UL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS);
+    (1UL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS) |
+    (1UL << VHOST_USER_PROTOCOL_F_PAGEFAULT);
 
 static inline bool has_feature(uint64_t features_qword, size_t feature_bit)
 {
@@ -679,7 +823,7 @@ static int vhost_send_vring_base(struct vhd_vring *vring)
 {
     struct vhost_user_vring_state vrstate = {
         .index = vring_idx(vring),
-        .num = vring->vq.last_avail,
+        .num = vring->state ? vring->state->last_avail : vring->vq.last_avail,
     };
 
     return vhost_reply(vring->vdev, &vrstate, sizeof(vrstate));
@@ -711,6 +855,12 @@ static int vhost_get_protocol_features(struct vhd_vdev *vdev,
         return -EINVAL;
     }
 
+    vdev->supported_protocol_features = g_default_protocol_features;
+    if (vdev->type->get_protocol_features) {
+        vdev->supported_protocol_features |=
+            vdev->type->get_protocol_features(vdev);
+    }
+
     return vhost_reply_u64(vdev, vdev->supported_protocol_features);
 }
 
@@ -786,6 +936,7 @@ static int vhost_set_features(struct vhd_vdev *vdev, const void *payload,
     uint16_t i;
     const uint64_t *features = payload;
     bool has_event_idx = has_feature(*features, VIRTIO_F_RING_EVENT_IDX);
+    bool in_order = has_feature(*features, VIRTIO_F_IN_ORDER);
     bool has_vring_enable = has_feature(*features, VHOST_USER_F_PROTOCOL_FEATURES);
 
     uint64_t supported_features = vdev->supported_features;
@@ -807,6 +958,7 @@ static int vhost_set_features(struct vhd_vdev *vdev, const void *payload,
         vdev->negotiated_features = *features;
         for (i = 0; i < vdev->num_queues; i++) {
             vdev->vrings[i].vq.has_event_idx = has_event_idx;
+            vdev->vrings[i].vq.in_order = in_order;
             vdev->vrings[i].shadow_vq.enabled = !has_vring_enable;
             vdev->vrings[i].vq.enabled = vdev->vrings[i].shadow_vq.enabled;
         }
@@ -856,6 +1008,84 @@ static int set_mem_table_complete(struct vhd_vdev *vdev)
     return vhost_ack(vdev, 0);
 }
 
+/*
+ * Switch the vrings over to the memory map @mm and consume the reference;
+ * @complete is called once they have
+ */
+static int set_mem_table_install(struct vhd_vdev *vdev,
+                                 struct vhd_memory_map *mm,
+                                 int (*complete)(struct vhd_vdev *vdev))
+{
+    int ret;
+    uint16_t i;
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        if (!vdev->vrings[i].started_in_ctl) {
+            continue;
+        }
+        ret = vring_update_shadow_vq_addrs(&vdev->vrings[i], mm);
+        if (ret < 0) {
+            vhd_memmap_unref(mm);
+            return ret;
+        }
+    }
+
+    vdev->old_memmap = vdev->memmap;
+    vdev->memmap = mm;
+
+    if (!vdev->num_vrings_in_flight) {
+        return complete(vdev);
+    }
+
+    vdev->handle_complete = complete;
+    for (i = 0; i < vdev->num_queues; i++) {
+        vring_handle_msg(&vdev->vrings[i], vring_sync_to_virtq_bh);
+    }
+    return 0;
+}
+
+/*
+ * In postcopy the memory table is replied back with the regions' addresses
+ * in this process, for the master to tell the faults on them, and the master
+ * acknowledges it with a second SET_MEM_TABLE once ready to serve the faults.
+ * The memory map is only put to use after that.
+ */
+static int set_mem_table_postcopy_reply(struct vhd_vdev *vdev,
+                                        struct vhd_memory_map *mm,
+                                        const void *payload, size_t size)
+{
+    struct vhost_user_mem_desc reply;
+    uint32_t i;
+
+    size = MIN(size, sizeof(reply));
+    memcpy(&reply, payload, size);
+    for (i = 0; i < reply.nregions; i++) {
+        struct vhost_user_mem_region *region = &reply.regions[i];
+        region->user_addr = (uintptr_t)gpa_range_to_ptr(mm, region->guest_addr,
+                                                        region->size);
+    }
+
+    vdev->postcopy_memmap = mm;
+    return vhost_reply(vdev, &reply, size);
+}
+
+static int set_mem_table_postcopy_ack(struct vhd_vdev *vdev,
+                                      const void *payload, size_t size,
+                                      size_t num_fds)
+{
+    struct vhd_memory_map *mm = vdev->postcopy_memmap;
+
+    vdev->postcopy_memmap = NULL;
+
+    if (num_fds || size < sizeof(uint64_t) || *(uint64_t *)payload) {
+        VHD_OBJ_ERROR(vdev, "master failed to get ready for postcopy faults");
+        vhd_memmap_unref(mm);
+        return -EINVAL;
+    }
+
+    return set_mem_table_install(vdev, mm, set_mem_table_complete);
+}
+
 static int vhost_set_mem_table(struct vhd_vdev *vdev, const void *payload,
                                size_t size, const int *fds, size_t num_fds)
 {
@@ -866,6 +1096,10 @@ static int vhost_set_mem_table(struct vhd_vdev *vdev, const void *payload,
     struct vhd_memory_map *mm;
     uint16_t i;
 
+    if (vdev->postcopy_memmap) {
+        return set_mem_table_postcopy_ack(vdev, payload, size, num_fds);
+    }
+
     if (size < exp_size) {
         VHD_OBJ_ERROR(vdev, "malformed message: size %zu expected %zu", size,
                       exp_size);
@@ -881,43 +1115,69 @@ static int vhost_set_mem_table(struct vhd_vdev *vdev, const void *payload,
         return -EINVAL;
     }
 
+    if (!vdev->postcopy_listening) {
+        struct vhd_memmap_slot slots[VHOST_USER_MEM_REGIONS_MAX];
+
+        /* the other devices of the VM are likely to have the same map */
+        for (i = 0; i < desc->nregions; i++) {
+            const struct vhost_user_mem_region *region = &desc->regions[i];
+            slots[i] = (struct vhd_memmap_slot) {
+                .gpa = region->guest_addr,
+                .uva = region->user_addr,
+                .size = region->size,
+                .offset = region->mmap_offset,
+            };
+        }
+
+        ret = vhd_memmap_get_shared(&mm, vdev->map_cb, vdev->unmap_cb, slots,
+                                    fds, desc->nregions);
+        if (ret < 0) {
+            return ret;
+        }
+
+        return set_mem_table_install(vdev, mm, set_mem_table_complete);
+    }
+
     mm = vhd_memmap_new(vdev->map_cb, vdev->unmap_cb);
+    vhd_memmap_set_uffd(mm, vdev->postcopy_ufd);
 
     for (i = 0; i < desc->nregions; i++) {
         const struct vhost_user_mem_region *region = &desc->regions[i];
         ret = vhd_memmap_add_slot(mm, region->guest_addr, region->user_addr,
                                   region->size, fds[i], region->mmap_offset);
         if (ret < 0) {
-            goto fail;
+            vhd_memmap_unref(mm);
+            return ret;
         }
     }
 
-    for (i = 0; i < vdev->num_queues; i++) {
-        if (!vdev->vrings[i].started_in_ctl) {
-            continue;
-        }
-        ret = vring_update_shadow_vq_addrs(&vdev->vrings[i], mm);
-        if (ret < 0) {
-            goto fail;
-        }
-    }
+    return set_mem_table_postcopy_reply(vdev, mm, payload, size);
+}
 
-    vdev->old_memmap = vdev->memmap;
-    vdev->memmap = mm;
+/*
+ * In postcopy the master learns where the added region is mapped from the
+ * reply instead of the ack.
+ */
+static int add_mem_reg_complete(struct vhd_vdev *vdev)
+{
+    struct vhost_user_mem_single_mem_desc reply = {
+        .region = vdev->postcopy_region,
+    };
+    struct vhost_user_mem_region *region = &reply.region;
 
-    if (!vdev->num_vrings_in_flight) {
+    if (!vdev->postcopy_listening) {
         return set_mem_table_complete(vdev);
     }
 
-    vdev->handle_complete = set_mem_table_complete;
-    for (i = 0; i < vdev->num_queues; i++) {
-        vring_handle_msg(&vdev->vrings[i], vring_sync_to_virtq_bh);
+    if (vdev->old_memmap) {
+        vhd_memmap_unref(vdev->old_memmap);
+        vdev->old_memmap = NULL;
     }
-    return 0;
 
-fail:
-    vhd_memmap_unref(mm);
-    return ret;
+    region->user_addr = (uintptr_t)gpa_range_to_ptr(vdev->memmap,
+                                                    region->guest_addr,
+                                                    region->size);
+    return vhost_reply(vdev, &reply, sizeof(reply));
 }
 
 static int vhost_add_mem_reg(struct vhd_vdev *vdev, const void *payload,
@@ -942,14 +1202,19 @@ static int vhost_add_mem_reg(struct vhd_vdev *vdev, const void *payload,
 
     if (mm == NULL) {
         mm = vhd_memmap_new(vdev->map_cb, vdev->unmap_cb);
+        if (vdev->postcopy_listening) {
+            vhd_memmap_set_uffd(mm, vdev->postcopy_ufd);
+        }
     } else {
-        can_add_inplace = vdev->num_vrings_in_flight == 0;
+        can_add_inplace = vdev->num_vrings_in_flight == 0 &&
+                          !vhd_memmap_is_shared(mm);
 
         /*
          * Slow path:
-         * The rings are already live, therefore we cannot touch their memory
-         * map here. All we can do is create a copy, modify it how we want,
-         * and then tell the rings to use it via a message to their event loop.
+         * The rings are already live, or the map is shared with other
+         * devices, therefore we cannot touch their memory map here. All we
+         * can do is create a copy, modify it how we want, and then tell the
+         * rings to use it via a message to their event loop.
          */
         if (!can_add_inplace) {
             mm = vhd_memmap_dup(mm);
@@ -961,6 +1226,7 @@ static int vhost_add_mem_reg(struct vhd_vdev *vdev, const void *payload,
     if (ret < 0) {
         goto fail;
     }
+    vdev->postcopy_region = *region;
 
     for (i = 0; i < vdev->num_queues; i++) {
         if (!vdev->vrings[i].started_in_ctl) {
@@ -980,17 +1246,17 @@ static int vhost_add_mem_reg(struct vhd_vdev *vdev, const void *payload,
      * of it.
      */
     if (can_add_inplace) {
-        return vhost_ack(vdev, 0);
+        return add_mem_reg_complete(vdev);
     }
 
     vdev->old_memmap = vdev->memmap;
     vdev->memmap = mm;
 
     if (!vdev->num_vrings_in_flight) {
-        return set_mem_table_complete(vdev);
+        return add_mem_reg_complete(vdev);
     }
 
-    vdev->handle_complete = set_mem_table_complete;
+    vdev->handle_complete = add_mem_reg_complete;
     for (i = 0; i < vdev->num_queues; i++) {
         vring_handle_msg(&vdev->vrings[i], vring_sync_to_virtq_bh);
     }
@@ -1203,12 +1469,15 @@ static int set_vring_kick_fail_complete(struct vhd_vdev *vdev)
     return vhost_ack(vdev, -EIO);
 }
 
+static int vduse_start_fail_complete(struct vhd_vdev *vdev);
+
 static void vring_start_failed_bh(void *opaque)
 {
     struct vhd_vring *vring = opaque;
     struct vhd_vdev *vdev = vring->vdev;
 
-    vdev->handle_complete = set_vring_kick_fail_complete;
+    vdev->handle_complete = vdev->vduse_fd < 0 ?
+        set_vring_kick_fail_complete : vduse_start_fail_complete;
 
     vring_mark_msg_handled(vring);
     vring_mark_stopped(vring);
@@ -1237,6 +1506,7 @@ static void vring_start_bh(void *opaque)
     }
 
     vring_sync_to_virtq(vring);
+    vring->suspended = false;
     vring->started_in_rq = true;
     vhd_run_in_ctl(vring_mark_msg_handled_bh, vring);
     return;
@@ -1245,6 +1515,86 @@ fail:
     vhd_run_in_ctl(vring_start_failed_bh, vring);
 }
 
+/*
+ * Consume the state the vring was left with: resubmit the requests in flight
+ * on the migration source, or the ones handed over here on stop.
+ */
+static int vring_load_state(struct vhd_vring *vring)
+{
+    struct vhd_vring_state *state = vring->state;
+    int ret = 0;
+
+    if (vring->vq.last_avail != state->last_avail) {
+        if (state->loaded) {
+            VHD_OBJ_ERROR(vring, "vring base %u doesn't match %u in the"
+                          " device state", vring->vq.last_avail,
+                          state->last_avail);
+            ret = -EINVAL;
+        } else {
+            /* the client has reset the vring, dropping the requests */
+            VHD_OBJ_INFO(vring, "vring base %u moved from %u, dropping %u"
+                         " requests handed over", vring->vq.last_avail,
+                         state->last_avail, state->num_heads);
+        }
+    } else if (state->num_heads) {
+        VHD_OBJ_INFO(vring, "resubmitting %u requests %s", state->num_heads,
+                     state->loaded ? "from the device state" :
+                                     "handed over on stop");
+        ret = virtq_set_inflight_heads(&vring->vq, state->heads,
+                                       state->num_heads);
+    }
+
+    vring_free_state(vring);
+    return ret;
+}
+
+/*
+ * Start the vring with its addresses resolved into the shadow structure and
+ * @kickfd to be kicked through, in the control event loop; it's yet to be
+ * started in the dataplane with vring_start_bh.  @kickfd is consumed.
+ */
+static int vring_start(struct vhd_vring *vring, int kickfd)
+{
+    struct vhd_vdev *vdev = vring->vdev;
+    int ret;
+
+    VHD_ASSERT(vring->kickfd < 0);
+    vring->kickfd = kickfd;
+
+    /*
+     * With no vrings running the request queues can be safely reassigned;
+     * prefer those local to the guest memory.
+     */
+    if (!vdev->num_vrings_in_flight) {
+        vdev_place_rqs(vdev);
+    }
+
+    vring_sync_to_virtq(vring);
+    vring->vq.log_tag = vring->log_tag;
+    if (vring->vq.in_order) {
+        vring->vq.flush_bh = vhd_rq_bh_new(vhd_get_rq_for_vring(vring),
+                                           vring_flush_bh, vring);
+    }
+    virtio_virtq_init(&vring->vq);
+
+    if (vring->state) {
+        ret = vring_load_state(vring);
+        if (ret < 0) {
+            if (vring->vq.flush_bh) {
+                vhd_bh_delete(vring->vq.flush_bh);
+            }
+            virtio_virtq_release(&vring->vq);
+            replace_fd(&vring->kickfd, -1);
+            return ret;
+        }
+    }
+
+    vring->started_in_ctl = true;
+    vdev->num_vrings_started++;
+    vdev->num_vrings_in_flight++;
+    return 0;
+}
+
 static int vhost_set_vring_kick(struct vhd_vdev *vdev, const void *payload,
                                 size_t size, const int *fds, size_t num_fds)
 {
@@ -1276,16 +1626,10 @@ static int vhost_set_vring_kick(struct vhd_vdev *vdev, const void *payload,
         return ret;
     }
 
-    VHD_ASSERT(vring->kickfd < 0);
-    vring->kickfd = kickfd;
-
-    vring_sync_to_virtq(vring);
-    vring->vq.log_tag = vring->log_tag;
-    virtio_virtq_init(&vring->vq);
-
-    vring->started_in_ctl = true;
-    vdev->num_vrings_started++;
-    vdev->num_vrings_in_flight++;
+    ret = vring_start(vring, kickfd);
+    if (ret < 0) {
+        return ret;
+    }
 
     vdev->handle_complete = set_vring_kick_complete;
     vring_handle_msg(vring, vring_start_bh);
@@ -1408,7 +1752,7 @@ static int vhost_get_vring_base(struct vhd_vdev *vdev, const void *payload,
         return -EINVAL;
     }
 
-    if (!vring->started_in_ctl) {
+    if (!vring->started_in_ctl || vring->handing_over) {
         return vhost_send_vring_base(vring);
     }
 
@@ -1416,8 +1760,21 @@ static int vhost_get_vring_base(struct vhd_vdev *vdev, const void *payload,
      * This command is special as it needs to wait for drain, not just until
      * the message is handled in rq.  Mark this in the vring and submit
      * vring_stop_bh() instead of going through vring_handle_msg().
+     *
+     * The exception is when the requests in flight can be passed in the
+     * device state, as recorded in the inflight region, to the destination
+     * to resubmit: then only wait for the vring to stop, cutting the
+     * migration downtime by the slowest request's latency.
      */
-    vring->on_drain_cb = vhost_send_vring_base;
+    if (has_feature(vdev->negotiated_protocol_features,
+                    VHOST_USER_PROTOCOL_F_DEVICE_STATE) &&
+        vring->vq.inflight_region) {
+        vring->handing_over = true;
+        vdev->num_vrings_handing_over++;
+        vring->on_stop_cb = vhost_send_vring_base;
+    } else {
+        vring->on_drain_cb = vhost_send_vring_base;
+    }
     vhd_run_in_rq(vhd_get_rq_for_vring(vring), vring_stop_bh, vring);
     return 0;
 }
@@ -1670,19 +2027,390 @@ static int vhost_set_inflight_fd(struct vhd_vdev *vdev, const void *payload,
     return vhost_ack(vdev, 0);
 }
 
-static int vhost_get_max_mem_slots(struct vhd_vdev *vdev, const void *payload,
-                                   size_t size, const int *fds, size_t num_fds)
-{
-    if (num_fds) {
-        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
-        return -EINVAL;
-    }
+/*
+ * Device state transfer
+ *
+ * The state is passed via a memfd the device returns in place of the
+ * client's pipe: it's filled in right away on save, and parsed on
+ * VHOST_USER_CHECK_DEVICE_STATE on load, so neither side needs to wait for
+ * the other while the message is handled.
+ */
 
-    return vhost_reply_u64(vdev, vhd_memmap_max_memslots());
-}
+#define VDEV_STATE_MAGIC    0x54534456  /* "VDST" */
+#define VDEV_STATE_VERSION  1
 
-static int vring_enable_complete(struct vhd_vdev *vdev)
-{
+struct vdev_state_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_vrings;
+    uint32_t padding;
+};
+
+struct vdev_state_vring {
+    uint16_t index;
+    uint16_t last_avail;
+    uint16_t num_heads;
+    uint16_t padding;
+    uint16_t heads[];
+};
+
+static bool vring_has_saved_state(struct vhd_vring *vring)
+{
+    return vring->state && !vring->state->loaded;
+}
+
+static int vdev_save_state(struct vhd_vdev *vdev, int fd)
+{
+    struct vdev_state_hdr *hdr;
+    size_t size = sizeof(*hdr);
+    size_t off;
+    void *buf;
+    uint16_t i;
+    int ret = 0;
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        struct vhd_vring *vring = &vdev->vrings[i];
+        if (vring_has_saved_state(vring)) {
+            size += sizeof(struct vdev_state_vring) +
+                vring->state->num_heads * sizeof(vring->state->heads[0]);
+        }
+    }
+
+    buf = vhd_zalloc(size);
+    hdr = buf;
+    *hdr = (struct vdev_state_hdr) {
+        .magic = VDEV_STATE_MAGIC,
+        .version = VDEV_STATE_VERSION,
+    };
+
+    off = sizeof(*hdr);
+    for (i = 0; i < vdev->num_queues; i++) {
+        struct vhd_vring *vring = &vdev->vrings[i];
+        struct vdev_state_vring *vs = buf + off;
+
+        if (!vring_has_saved_state(vring)) {
+            continue;
+        }
+
+        vs->index = i;
+        vs->last_avail = vring->state->last_avail;
+        vs->num_heads = vring->state->num_heads;
+        memcpy(vs->heads, vring->state->heads,
+               vs->num_heads * sizeof(vs->heads[0]));
+        off += sizeof(*vs) + vs->num_heads * sizeof(vs->heads[0]);
+        hdr->num_vrings++;
+
+        VHD_OBJ_INFO(vring, "saving %u requests in flight at avail index %u",
+                     vs->num_heads, vs->last_avail);
+    }
+
+    for (off = 0; off < size; ) {
+        ssize_t len = pwrite(fd, buf + off, size - off, off);
+        if (len < 0) {
+            ret = -errno;
+            VHD_OBJ_ERROR(vdev, "write device state: %s", strerror(-ret));
+            break;
+        }
+        off += len;
+    }
+
+    vhd_free(buf);
+    return ret;
+}
+
+static int vdev_parse_state(struct vhd_vdev *vdev, const void *buf,
+                            size_t size, bool install)
+{
+    const struct vdev_state_hdr *hdr = buf;
+    size_t off = sizeof(*hdr);
+    uint32_t i;
+
+    if (size < sizeof(*hdr) || hdr->magic != VDEV_STATE_MAGIC ||
+        hdr->version != VDEV_STATE_VERSION) {
+        VHD_OBJ_ERROR(vdev, "invalid device state header");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < hdr->num_vrings; i++) {
+        const struct vdev_state_vring *vs = buf + off;
+        struct vhd_vring *vring;
+        struct vhd_vring_state *state;
+        size_t heads_size;
+
+        if (size - off < sizeof(*vs)) {
+            goto truncated;
+        }
+        heads_size = vs->num_heads * sizeof(vs->heads[0]);
+        if (size - off - sizeof(*vs) < heads_size) {
+            goto truncated;
+        }
+        off += sizeof(*vs) + heads_size;
+
+        vring = get_vring(vdev, vs->index);
+        if (!vring) {
+            return -EINVAL;
+        }
+        if (vring->started_in_ctl) {
+            VHD_OBJ_ERROR(vring, "vring is already started");
+            return -EISCONN;
+        }
+
+        if (!install) {
+            continue;
+        }
+
+        state = vhd_zalloc(sizeof(*state));
+        state->last_avail = vs->last_avail;
+        state->num_heads = vs->num_heads;
+        state->heads = vhd_alloc(heads_size + 1);
+        memcpy(state->heads, vs->heads, heads_size);
+        state->loaded = true;
+
+        vring_free_state(vring);
+        vring->state = state;
+
+        VHD_OBJ_INFO(vring, "loaded %u requests in flight at avail index %u",
+                     vs->num_heads, vs->last_avail);
+    }
+
+    return 0;
+
+truncated:
+    VHD_OBJ_ERROR(vdev, "device state truncated at %zu bytes", size);
+    return -EINVAL;
+}
+
+static int vdev_load_state(struct vhd_vdev *vdev, int fd)
+{
+    struct stat st;
+    size_t off;
+    void *buf;
+    int ret;
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        VHD_OBJ_ERROR(vdev, "fstat device state: %s", strerror(-ret));
+        return ret;
+    }
+
+    buf = vhd_alloc(st.st_size + 1);
+    for (off = 0; off < (size_t)st.st_size; ) {
+        ssize_t len = pread(fd, buf + off, st.st_size - off, off);
+        if (len <= 0) {
+            ret = len < 0 ? -errno : -EIO;
+            VHD_OBJ_ERROR(vdev, "read device state: %s", strerror(-ret));
+            goto out;
+        }
+        off += len;
+    }
+
+    /* validate everything before touching any vring */
+    ret = vdev_parse_state(vdev, buf, st.st_size, false);
+    if (!ret) {
+        ret = vdev_parse_state(vdev, buf, st.st_size, true);
+    }
+
+out:
+    vhd_free(buf);
+    return ret;
+}
+
+static int vhost_set_device_state_fd(struct vhd_vdev *vdev,
+                                     const void *payload, size_t size,
+                                     const int *fds, size_t num_fds)
+{
+    const struct vhost_user_device_state *dstate = payload;
+    uint64_t reply = 0;
+    int fd;
+
+    if (num_fds != 1 || size < sizeof(*dstate)) {
+        VHD_OBJ_ERROR(vdev, "malformed message size=%zu #fds=%zu", size,
+                      num_fds);
+        return -EINVAL;
+    }
+
+    if (!has_feature(vdev->negotiated_protocol_features,
+                     VHOST_USER_PROTOCOL_F_DEVICE_STATE)) {
+        VHD_OBJ_ERROR(vdev, "device state transfer not negotiated");
+        return -EINVAL;
+    }
+
+    /* a transfer in progress, if any, is abandoned */
+    replace_fd(&vdev->state_fd, -1);
+
+    if (dstate->phase != VHOST_TRANSFER_STATE_PHASE_STOPPED ||
+        vdev->num_vrings_started) {
+        VHD_OBJ_ERROR(vdev, "device state transfer is only supported with"
+                      " all vrings stopped");
+        goto fail;
+    }
+    if (dstate->direction != VHOST_TRANSFER_STATE_DIRECTION_SAVE &&
+        dstate->direction != VHOST_TRANSFER_STATE_DIRECTION_LOAD) {
+        VHD_OBJ_ERROR(vdev, "invalid device state transfer direction %u",
+                      dstate->direction);
+        goto fail;
+    }
+
+    fd = memfd_create("vhost_device_state", MFD_CLOEXEC);
+    if (fd == -1) {
+        VHD_OBJ_ERROR(vdev, "memfd_create: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (dstate->direction == VHOST_TRANSFER_STATE_DIRECTION_SAVE &&
+        vdev_save_state(vdev, fd) < 0) {
+        close(fd);
+        goto fail;
+    }
+
+    vdev->state_fd = fd;
+    vdev->state_direction = dstate->direction;
+
+    /* the client is to use our fd rather than the one it's passed */
+    return vhost_reply_fds(vdev, &reply, sizeof(reply), &fd, 1);
+
+fail:
+    reply = VHOST_USER_DEVICE_STATE_INVALID_FD | 1;
+    return vhost_reply_u64(vdev, reply);
+}
+
+static int vhost_check_device_state(struct vhd_vdev *vdev,
+                                    const void *payload, size_t size,
+                                    const int *fds, size_t num_fds)
+{
+    int ret = 0;
+
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
+    }
+
+    if (vdev->state_fd < 0) {
+        VHD_OBJ_ERROR(vdev, "no device state transfer in progress");
+        ret = -EINVAL;
+    } else if (vdev->state_direction == VHOST_TRANSFER_STATE_DIRECTION_LOAD) {
+        ret = vdev_load_state(vdev, vdev->state_fd);
+    }
+
+    replace_fd(&vdev->state_fd, -1);
+    return vhost_reply_u64(vdev, ret < 0);
+}
+
+/*
+ * Postcopy migration: the guest memory pages yet to arrive are left missing,
+ * and the faults on them are reported to the master via a userfaultfd; the
+ * faulting threads are woken up by the master once the page is in place.
+ */
+static int userfaultfd_open(void)
+{
+    int fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+
+#ifdef USERFAULTFD_IOC_NEW
+    /* unprivileged userfaultfd may be only allowed via the device */
+    if (fd < 0 && errno == EPERM) {
+        int devfd = open("/dev/userfaultfd", O_RDWR | O_CLOEXEC);
+        if (devfd >= 0) {
+            fd = ioctl(devfd, USERFAULTFD_IOC_NEW, O_CLOEXEC | O_NONBLOCK);
+            close(devfd);
+        }
+    }
+#endif
+
+    return fd < 0 ? -errno : fd;
+}
+
+static int vhost_postcopy_advise(struct vhd_vdev *vdev, const void *payload,
+                                 size_t size, const int *fds, size_t num_fds)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int ufd, ret;
+
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
+    }
+    if (!has_feature(vdev->negotiated_protocol_features,
+                     VHOST_USER_PROTOCOL_F_PAGEFAULT)) {
+        VHD_OBJ_ERROR(vdev, "postcopy without VHOST_USER_PROTOCOL_F_PAGEFAULT");
+        return -EINVAL;
+    }
+
+    ufd = userfaultfd_open();
+    if (ufd < 0) {
+        VHD_OBJ_ERROR(vdev, "can't open userfaultfd: %s", strerror(-ufd));
+        return ufd;
+    }
+    if (ioctl(ufd, UFFDIO_API, &api) < 0) {
+        ret = -errno;
+        VHD_OBJ_ERROR(vdev, "userfaultfd API handshake failed: %s",
+                      strerror(-ret));
+        close(ufd);
+        return ret;
+    }
+
+    replace_fd(&vdev->postcopy_ufd, ufd);
+    VHD_OBJ_INFO(vdev, "postcopy advised, userfaultfd %d", ufd);
+    return vhost_reply_fds(vdev, NULL, 0, &ufd, 1);
+}
+
+/* The master always waits for a reply to LISTEN and END */
+static int vhost_postcopy_listen(struct vhd_vdev *vdev, const void *payload,
+                                 size_t size, const int *fds, size_t num_fds)
+{
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
+    }
+    if (vdev->postcopy_ufd < 0) {
+        VHD_OBJ_ERROR(vdev, "postcopy listen without advise");
+        return -EINVAL;
+    }
+    /* the guest memory mapped earlier has no pages missing to fault on */
+    if (vdev->memmap) {
+        VHD_OBJ_ERROR(vdev, "postcopy listen with guest memory mapped");
+        return -EINVAL;
+    }
+
+    vdev->postcopy_listening = true;
+    return vhost_reply_u64(vdev, 0);
+}
+
+static int vhost_postcopy_end(struct vhd_vdev *vdev, const void *payload,
+                              size_t size, const int *fds, size_t num_fds)
+{
+    int ret;
+
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
+    }
+
+    if (vdev->memmap) {
+        ret = vhd_memmap_uffd_unregister(vdev->memmap);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    vdev->postcopy_listening = false;
+    replace_fd(&vdev->postcopy_ufd, -1);
+    VHD_OBJ_INFO(vdev, "postcopy ended");
+    return vhost_reply_u64(vdev, 0);
+}
+
+static int vhost_get_max_mem_slots(struct vhd_vdev *vdev, const void *payload,
+                                   size_t size, const int *fds, size_t num_fds)
+{
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
+    }
+
+    return vhost_reply_u64(vdev, vhd_memmap_max_memslots());
+}
+
+static int vring_enable_complete(struct vhd_vdev *vdev)
+{
     return vhost_ack(vdev, 0);
 }
 
@@ -1748,6 +2476,11 @@ static int (*vhost_msg_handlers[])(struct vhd_vdev *vdev,
     [VHOST_USER_ADD_MEM_REG]            = vhost_add_mem_reg,
     [VHOST_USER_REM_MEM_REG]            = vhost_rem_mem_reg,
     [VHOST_USER_SET_VRING_ENABLE]       = vhost_vring_enable,
+    [VHOST_USER_SET_DEVICE_STATE_FD]    = vhost_set_device_state_fd,
+    [VHOST_USER_CHECK_DEVICE_STATE]     = vhost_check_device_state,
+    [VHOST_USER_POSTCOPY_ADVISE]        = vhost_postcopy_advise,
+    [VHOST_USER_POSTCOPY_LISTEN]        = vhost_postcopy_listen,
+    [VHOST_USER_POSTCOPY_END]           = vhost_postcopy_end,
 };
 
 static int vhost_handle_msg(struct vhd_vdev *vdev, uint32_t req,
@@ -1820,6 +2553,14 @@ static void vdev_cleanup(struct vhd_vdev *vdev)
     }
 
     inflight_mem_cleanup(vdev);
+    replace_fd(&vdev->state_fd, -1);
+
+    if (vdev->postcopy_memmap) {
+        vhd_memmap_unref(vdev->postcopy_memmap);
+        vdev->postcopy_memmap = NULL;
+    }
+    vdev->postcopy_listening = false;
+    replace_fd(&vdev->postcopy_ufd, -1);
 
     if (vdev->memmap) {
         vhd_memmap_unref(vdev->memmap);
@@ -1845,12 +2586,18 @@ static void vdev_cleanup(struct vhd_vdev *vdev)
      replace_fd(&vdev->connfd, -1);
 }
 
+static void vduse_destroy(struct vhd_vdev *vdev);
+
 static void vhd_vdev_release(struct vhd_vdev *vdev)
 {
     uint16_t i;
 
     LIST_REMOVE(vdev, vdev_list);
 
+    if (vdev->vduse_fd >= 0) {
+        vduse_destroy(vdev);
+    }
+
     for (i = 0; i < vdev->num_queues; i++) {
         vhd_free(vdev->vrings[i].log_tag);
     }
@@ -1865,10 +2612,20 @@ static void vhd_vdev_release(struct vhd_vdev *vdev)
     vdev->type->free(vdev);
 }
 
-static void vdev_disconnect(struct vhd_vdev *vdev)
+/* Stop the vrings and release what they hold once drained */
+static void vdev_disconnect_vrings(struct vhd_vdev *vdev)
 {
     uint16_t i;
 
+    for (i = 0; i < vdev->num_queues; i++) {
+        vring_disconnect(&vdev->vrings[i]);
+    }
+
+    vdev_maybe_finished(vdev);
+}
+
+static void vdev_disconnect(struct vhd_vdev *vdev)
+{
     /* prevent double disconnect on error paths */
     if (!vdev->conn_handler) {
         return;
@@ -1883,12 +2640,21 @@ static void vdev_disconnect(struct vhd_vdev *vdev)
      */
     vhd_del_io_handler(vdev->conn_handler);
     vdev->conn_handler = NULL;
+    vdev->conn_held = false;
 
-    for (i = 0; i < vdev->num_queues; i++) {
-        vring_disconnect(&vdev->vrings[i]);
-    }
+    vdev_disconnect_vrings(vdev);
+}
 
-    vdev_maybe_finished(vdev);
+static bool msg_allowed_while_handing_over(uint32_t req)
+{
+    switch (req) {
+    case VHOST_USER_GET_VRING_BASE:
+    case VHOST_USER_SET_DEVICE_STATE_FD:
+    case VHOST_USER_CHECK_DEVICE_STATE:
+        return true;
+    default:
+        return false;
+    }
 }
 
 /*
@@ -1905,6 +2671,21 @@ static int conn_read(void *opaque)
     size_t num_fds = VHOST_USER_MAX_FDS;
     int ret;
 
+    /*
+     * The vrings stopped without waiting for their requests in flight can't
+     * be touched until drained; meanwhile only let the device state transfer
+     * through, and leave the rest in the socket till then.
+     */
+    if (vdev->num_vrings_handing_over &&
+        recv(vdev->connfd, &hdr, sizeof(hdr), MSG_PEEK) == sizeof(hdr) &&
+        !msg_allowed_while_handing_over(hdr.req)) {
+        VHD_OBJ_DEBUG(vdev, "%s (%u) held until vrings are drained",
+                      vhost_req_name(hdr.req), hdr.req);
+        vhd_detach_io_handler(vdev->conn_handler);
+        vdev->conn_held = true;
+        return 0;
+    }
+
     if (net_recv_msg(vdev->connfd, &hdr, &payload, sizeof(payload),
                      fds, &num_fds) <= 0) {
         goto recv_fail;
@@ -2031,12 +2812,14 @@ static void vdev_stop_listening(struct vhd_vdev *vdev)
 static void vdev_vrings_stopped(struct vhd_vdev *vdev)
 {
     /* vdev is being shut down */
-    if (!vdev->listen_handler) {
+    if (vdev->stopping) {
         /* there must be a work pending completion */
         vdev_complete_work(vdev, 0);
     }
 }
 
+static void vduse_drained(struct vhd_vdev *vdev);
+
 /*
  * Action to perform when the device is fully drained, i.e. when it's finished
  * handling all dataplane requests and all control messages and no longer
@@ -2047,8 +2830,10 @@ static void vdev_drained(struct vhd_vdev *vdev)
     vdev_cleanup(vdev);
 
     /* vdev is being shut down */
-    if (!vdev->listen_handler) {
+    if (vdev->stopping) {
         vhd_vdev_release(vdev);
+    } else if (vdev->vduse_fd >= 0) {
+        vduse_drained(vdev);
     } else {
         /* resume listening */
         if (vhd_attach_io_handler(vdev->listen_handler) < 0) {
@@ -2106,59 +2891,611 @@ close_fd:
     return ret;
 }
 
-static void vdev_start(struct vhd_vdev *vdev, void *opaque)
+/*
+ * VDUSE transport: the device is created in the kernel as a vDPA device in
+ * userspace, and once attached to the vDPA bus it's driven by the virtio
+ * driver of the host itself, or by vhost-vdpa on behalf of a VM.  Instead of
+ * the vhost-user messages the kernel sends requests through the device fd:
+ * the vrings are started on DRIVER_OK status and stopped on reset, with the
+ * guest (or bounce buffer) memory mapped from the fds the kernel hands out
+ * for its IOVA ranges.  The vrings are processed just like the vhost-user
+ * ones, only the kicks come through eventfds registered with the kernel, and
+ * the interrupts are injected with an ioctl.
+ */
+
+#define VDUSE_CONTROL_PATH "/dev/vduse/control"
+#define VDUSE_DEV_DIR "/dev/vduse"
+
+/* the vhost-user transport feature bits, meaningless to VDUSE */
+#define VDUSE_FEATURES_MASK \
+    (~((1ull << VHOST_USER_F_PROTOCOL_FEATURES) | (1ull << VHOST_F_LOG_ALL)))
+
+#define VIRTIO_CONFIG_S_DRIVER_OK 4
+
+static int vduse_reply(struct vhd_vdev *vdev, struct vduse_dev_response *resp)
 {
-    int ret;
+    int ret = 0;
 
-    ret = vdev_start_listening(vdev);
+    VHD_ASSERT(vdev->vduse_req_pending);
+    vdev->vduse_req_pending = false;
 
-    vdev_complete_work(vdev, ret);
+    resp->request_id = vdev->vduse_req_id;
+    if (write(vdev->vduse_fd, resp, sizeof(*resp)) < 0) {
+        ret = -errno;
+        VHD_OBJ_ERROR(vdev, "failed to respond to VDUSE request %u: %s",
+                      vdev->vduse_req_type, strerror(-ret));
+    }
+
+    /* resume reading the requests unless being shut down */
+    if (vdev->vduse_handler) {
+        vhd_attach_io_handler(vdev->vduse_handler);
+    }
+    return ret;
 }
 
-int vhd_vdev_init_server(
-    struct vhd_vdev *vdev,
-    const char *socket_path,
-    const struct vhd_vdev_type *type,
-    int max_queues,
-    struct vhd_request_queue **rqs,
-    int num_rqs,
-    void *priv,
-    int (*map_cb)(void *addr, size_t len),
-    int (*unmap_cb)(void *addr, size_t len))
+static int vduse_ack(struct vhd_vdev *vdev, int ret)
 {
-    int ret;
-    int listenfd;
-    uint16_t i;
-    struct vhd_request_queue **vhd_rqs;
+    struct vduse_dev_response resp = {
+        .result = ret < 0 ? VDUSE_REQ_RESULT_FAILED : VDUSE_REQ_RESULT_OK,
+    };
 
-    /*
-     * The spec is unclear about the maximum number of queues allowed, using
-     * different types for the vring index in different messages.  The most
-     * limiting appear to VHOST_USER_SET_VRING_{CALL,ERR,KICK}, which allow
-     * only 8 bits for the vring index.
-     */
-    if (max_queues > VHOST_VRING_IDX_MASK + 1) {
-        VHD_LOG_ERROR("%s: %d queues is too many", socket_path, max_queues);
-        return -1;
+    if (ret >= 0 && vdev->vduse_req_type == VDUSE_SET_STATUS) {
+        vdev->vduse_status = vdev->vduse_req_status;
     }
 
-    if (num_rqs < 1 || num_rqs > VHD_MAX_REQUEST_QUEUES ||
-        num_rqs > max_queues) {
-        VHD_LOG_ERROR("%s: invalid number of requests queues: %d",
-                      socket_path, num_rqs);
-        return -1;
+    return vduse_reply(vdev, &resp);
+}
+
+static void vduse_notify(struct virtio_virtq *vq)
+{
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(vq);
+    uint32_t index = vring_idx(vring);
+
+    if (ioctl(vring->vdev->vduse_fd, VDUSE_VQ_INJECT_IRQ, &index) < 0) {
+        VHD_OBJ_ERROR(vring, "VDUSE_VQ_INJECT_IRQ: %s", strerror(errno));
+    }
+}
+
+/*
+ * Map all the IOVA ranges the kernel has set up for the device, at the same
+ * addresses as seen by the device; the vring and buffer addresses are IOVAs.
+ */
+static int vduse_get_memmap(struct vhd_vdev *vdev, struct vhd_memory_map **pmm)
+{
+    struct vhd_memory_map *mm = vhd_memmap_new(vdev->map_cb, vdev->unmap_cb);
+    uint64_t iova = 0;
+    int ret;
+
+    for (;;) {
+        struct vduse_iotlb_entry entry = {
+            .start = iova,
+            .last = UINT64_MAX,
+        };
+        int fd = ioctl(vdev->vduse_fd, VDUSE_IOTLB_GET_FD, &entry);
+
+        if (fd < 0) {
+            /* no more ranges past @iova */
+            if (errno == EINVAL) {
+                break;
+            }
+            ret = -errno;
+            VHD_OBJ_ERROR(vdev, "VDUSE_IOTLB_GET_FD: %s", strerror(-ret));
+            goto fail;
+        }
+
+        ret = vhd_memmap_add_slot(mm, entry.start, entry.start,
+                                  entry.last - entry.start + 1, fd,
+                                  entry.offset);
+        close(fd);
+        if (ret < 0) {
+            VHD_OBJ_ERROR(vdev, "failed to map IOVA range 0x%llx-0x%llx: %s",
+                          entry.start, entry.last, strerror(-ret));
+            goto fail;
+        }
+
+        if (entry.last == UINT64_MAX) {
+            break;
+        }
+        iova = entry.last + 1;
+    }
+
+    *pmm = mm;
+    return 0;
+
+fail:
+    vhd_memmap_unref(mm);
+    return ret;
+}
+
+/* Start the vring if the driver has set it up */
+static int vduse_start_vring(struct vhd_vring *vring)
+{
+    struct vhd_vdev *vdev = vring->vdev;
+    struct vduse_vq_info info = { .index = vring_idx(vring) };
+    struct vduse_vq_eventfd kick = { .index = info.index };
+    int ret;
+
+    if (ioctl(vdev->vduse_fd, VDUSE_VQ_GET_INFO, &info) < 0) {
+        ret = -errno;
+        VHD_OBJ_ERROR(vring, "VDUSE_VQ_GET_INFO: %s", strerror(-ret));
+        return ret;
+    }
+
+    if (!info.ready) {
+        return 0;
+    }
+
+    if (!info.num || info.num > vdev->type->queue_size) {
+        VHD_OBJ_ERROR(vring, "invalid vring size %u", info.num);
+        return -EINVAL;
+    }
+
+    vring->vq.qsz = info.num;
+    vring->vq.last_avail = info.split.avail_index;
+    vring->shadow_vq.desc_addr = info.desc_addr;
+    vring->shadow_vq.avail_addr = info.driver_addr;
+    vring->shadow_vq.used_addr = info.device_addr;
+    vring->shadow_vq.used_gpa_base = info.device_addr;
+    vring->shadow_vq.flags = 0;
+
+    ret = vring_update_shadow_vq_addrs(vring, vdev->memmap);
+    if (ret < 0) {
+        return ret;
+    }
+
+    kick.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (kick.fd < 0) {
+        ret = -errno;
+        VHD_OBJ_ERROR(vring, "eventfd: %s", strerror(-ret));
+        return ret;
+    }
+
+    if (ioctl(vdev->vduse_fd, VDUSE_VQ_SETUP_KICKFD, &kick) < 0) {
+        ret = -errno;
+        VHD_OBJ_ERROR(vring, "VDUSE_VQ_SETUP_KICKFD: %s", strerror(-ret));
+        close(kick.fd);
+        return ret;
+    }
+
+    return vring_start(vring, kick.fd);
+}
+
+static int vduse_start_complete(struct vhd_vdev *vdev)
+{
+    return vduse_ack(vdev, 0);
+}
+
+static int vduse_start_fail_complete(struct vhd_vdev *vdev)
+{
+    return vduse_ack(vdev, -EIO);
+}
+
+/*
+ * The driver has set DRIVER_OK: pick up the negotiated features and the
+ * memory, and start the vrings it has set up.  If some fail to start, the
+ * rest keep running until the driver resets the device.
+ */
+static int vduse_driver_ok(struct vhd_vdev *vdev)
+{
+    bool has_event_idx, in_order;
+    uint64_t features;
+    uint16_t i;
+    int ret = 0;
+
+    if (vdev->num_vrings_in_flight) {
+        VHD_OBJ_ERROR(vdev, "vrings still running since before reset");
+        return -EISCONN;
+    }
+
+    if (ioctl(vdev->vduse_fd, VDUSE_DEV_GET_FEATURES, &features) < 0) {
+        ret = -errno;
+        VHD_OBJ_ERROR(vdev, "VDUSE_DEV_GET_FEATURES: %s", strerror(-ret));
+        return ret;
+    }
+
+    vdev->negotiated_features = features;
+    has_event_idx = has_feature(features, VIRTIO_F_RING_EVENT_IDX);
+    in_order = has_feature(features, VIRTIO_F_IN_ORDER);
+    for (i = 0; i < vdev->num_queues; i++) {
+        vdev->vrings[i].vq.has_event_idx = has_event_idx;
+        vdev->vrings[i].vq.in_order = in_order;
+        vdev->vrings[i].shadow_vq.enabled = true;
+    }
+
+    if (vdev->memmap) {
+        vhd_memmap_unref(vdev->memmap);
+        vdev->memmap = NULL;
+    }
+    ret = vduse_get_memmap(vdev, &vdev->memmap);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        ret = vduse_start_vring(&vdev->vrings[i]);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    if (!vdev->num_vrings_in_flight) {
+        if (ret < 0) {
+            vhd_memmap_unref(vdev->memmap);
+            vdev->memmap = NULL;
+            return ret;
+        }
+        return vduse_start_complete(vdev);
+    }
+
+    vdev->handle_complete = ret < 0 ? vduse_start_fail_complete :
+                                      vduse_start_complete;
+    for (i = 0; i < vdev->num_queues; i++) {
+        vring_handle_msg(&vdev->vrings[i], vring_start_bh);
+    }
+    return 0;
+}
+
+static int vduse_set_status(struct vhd_vdev *vdev, uint8_t status)
+{
+    vdev->vduse_req_status = status;
+
+    /*
+     * Reset: stop the vrings, and only respond once they are drained and the
+     * memory is unmapped, in vduse_drained
+     */
+    if (!status) {
+        VHD_OBJ_INFO(vdev, "device reset");
+        vdev_disconnect_vrings(vdev);
+        return 0;
+    }
+
+    if ((status & VIRTIO_CONFIG_S_DRIVER_OK) &&
+        !(vdev->vduse_status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        VHD_OBJ_INFO(vdev, "driver ready");
+        return vduse_driver_ok(vdev);
+    }
+
+    return vduse_ack(vdev, 0);
+}
+
+static void vduse_drained(struct vhd_vdev *vdev)
+{
+    if (vdev->vduse_req_pending &&
+        vdev->vduse_req_type == VDUSE_SET_STATUS && !vdev->vduse_req_status) {
+        vduse_ack(vdev, 0);
+    }
+}
+
+/*
+ * The avail index to resume from.  Only meaningful for a stopped vring, which
+ * is when the driver asks; it's 0 for one reset.
+ */
+static int vduse_get_vq_state(struct vhd_vdev *vdev,
+                              const struct vduse_vq_state *vq_state)
+{
+    struct vduse_dev_response resp = {
+        .result = VDUSE_REQ_RESULT_OK,
+    };
+
+    if (vq_state->index >= vdev->num_queues) {
+        VHD_OBJ_ERROR(vdev, "vring %u out of range (%u)", vq_state->index,
+                      vdev->num_queues);
+        return -EINVAL;
+    }
+
+    resp.vq_state.index = vq_state->index;
+    resp.vq_state.split.avail_index =
+        vdev->vrings[vq_state->index].vq.last_avail;
+    return vduse_reply(vdev, &resp);
+}
+
+static int vduse_update_iotlb_complete(struct vhd_vdev *vdev)
+{
+    if (vdev->old_memmap) {
+        vhd_memmap_unref(vdev->old_memmap);
+        vdev->old_memmap = NULL;
+    }
+
+    return vduse_ack(vdev, 0);
+}
+
+/*
+ * IOVA ranges changed; while running, switch over to the memory map as it is
+ * now, or else it's only picked up on DRIVER_OK
+ */
+static int vduse_update_iotlb(struct vhd_vdev *vdev,
+                              const struct vduse_iova_range *iova)
+{
+    struct vhd_memory_map *mm;
+    int ret;
+
+    VHD_OBJ_DEBUG(vdev, "IOVA range 0x%llx-0x%llx updated", iova->start,
+                  iova->last);
+
+    if (!vdev->memmap) {
+        return vduse_ack(vdev, 0);
+    }
+
+    ret = vduse_get_memmap(vdev, &mm);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return set_mem_table_install(vdev, mm, vduse_update_iotlb_complete);
+}
+
+/*
+ * Read a request from the kernel and begin handling it.  Like with the
+ * vhost-user messages, suspend reading further requests until the response
+ * is sent back.
+ */
+static int vduse_read(void *opaque)
+{
+    struct vhd_vdev *vdev = opaque;
+    struct vduse_dev_request req;
+    ssize_t len;
+    int ret;
+
+    len = read(vdev->vduse_fd, &req, sizeof(req));
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            VHD_OBJ_ERROR(vdev, "failed to read VDUSE request: %s",
+                          strerror(errno));
+        }
+        return 0;
+    }
+    if (len != sizeof(req)) {
+        VHD_OBJ_ERROR(vdev, "short VDUSE request: %zd bytes", len);
+        return 0;
+    }
+
+    vhd_detach_io_handler(vdev->vduse_handler);
+    vdev->vduse_req_pending = true;
+    vdev->vduse_req_id = req.request_id;
+    vdev->vduse_req_type = req.type;
+
+    switch (req.type) {
+    case VDUSE_GET_VQ_STATE:
+        ret = vduse_get_vq_state(vdev, &req.vq_state);
+        break;
+    case VDUSE_SET_STATUS:
+        ret = vduse_set_status(vdev, req.s.status);
+        break;
+    case VDUSE_UPDATE_IOTLB:
+        ret = vduse_update_iotlb(vdev, &req.iova);
+        break;
+    default:
+        VHD_OBJ_WARN(vdev, "VDUSE request %u not supported", req.type);
+        ret = -ENOTSUP;
+        break;
+    }
+
+    if (ret < 0 && vdev->vduse_req_pending) {
+        vduse_ack(vdev, ret);
+    }
+    return 0;
+}
+
+static int vduse_start_handling(struct vhd_vdev *vdev)
+{
+    vdev->vduse_handler = vhd_add_vhost_io_handler(vdev->vduse_fd,
+                                                   vduse_read, vdev);
+    if (!vdev->vduse_handler) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int vduse_destroy_dev(const char *name)
+{
+    char buf[VDUSE_NAME_MAX] = {};
+    int ctlfd, ret = 0;
+
+    ctlfd = open(VDUSE_CONTROL_PATH, O_RDWR | O_CLOEXEC);
+    if (ctlfd < 0) {
+        return -errno;
+    }
+
+    strncpy(buf, name, sizeof(buf) - 1);
+    if (ioctl(ctlfd, VDUSE_DESTROY_DEV, buf) < 0) {
+        ret = -errno;
+    }
+
+    close(ctlfd);
+    return ret;
+}
+
+static void vduse_destroy(struct vhd_vdev *vdev)
+{
+    int ret;
+
+    replace_fd(&vdev->vduse_fd, -1);
+
+    /* fails if the device is still attached to the vDPA bus */
+    ret = vduse_destroy_dev(vdev->vduse_name);
+    if (ret < 0) {
+        VHD_OBJ_WARN(vdev, "failed to destroy VDUSE device: %s",
+                     strerror(-ret));
+    }
+
+    vhd_free(vdev->vduse_name);
+    vdev->vduse_name = NULL;
+}
+
+/*
+ * Create the VDUSE device @name with the features and config of the device
+ * type and @num_queues vrings, and open it.  @vdev is only passed to the type
+ * callbacks.
+ */
+static int vduse_create_dev(struct vhd_vdev *vdev,
+                            const struct vhd_vdev_type *type,
+                            const char *name, uint32_t num_queues)
+{
+    struct vduse_dev_config *cfg;
+    uint64_t features;
+    char *path;
+    int ctlfd, fd, ret;
+    uint32_t i;
+
+    if (strlen(name) >= VDUSE_NAME_MAX) {
+        VHD_LOG_ERROR("%s exceeds max size %d", name, VDUSE_NAME_MAX);
+        return -EINVAL;
+    }
+
+    if (!type->device_id || !type->queue_size) {
+        VHD_LOG_ERROR("%s: %s devices can't be served over VDUSE", name,
+                      type->desc);
+        return -ENOTSUP;
+    }
+
+    /* the kernel only takes devices that go through its IOTLB */
+    features = (type->get_features(vdev) & VDUSE_FEATURES_MASK) |
+               (1ull << VIRTIO_F_ACCESS_PLATFORM);
+    /* and with no transitional interface to offer */
+    if (!has_feature(features, VIRTIO_F_VERSION_1)) {
+        VHD_LOG_ERROR("%s: VDUSE needs VIRTIO_F_VERSION_1", name);
+        return -ENOTSUP;
+    }
+
+    ctlfd = open(VDUSE_CONTROL_PATH, O_RDWR | O_CLOEXEC);
+    if (ctlfd < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("open(%s): %s", VDUSE_CONTROL_PATH, strerror(-ret));
+        return ret;
+    }
+
+    cfg = vhd_zalloc(sizeof(*cfg) + VHOST_USER_CONFIG_SPACE_MAX);
+    strcpy(cfg->name, name);
+    cfg->device_id = type->device_id;
+    cfg->features = features;
+    cfg->vq_num = num_queues;
+    cfg->vq_align = sysconf(_SC_PAGESIZE);
+    cfg->config_size = type->get_config(vdev, cfg->config,
+                                        VHOST_USER_CONFIG_SPACE_MAX, 0);
+
+    ret = ioctl(ctlfd, VDUSE_CREATE_DEV, cfg);
+    vhd_free(cfg);
+    close(ctlfd);
+    if (ret < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("%s: VDUSE_CREATE_DEV: %s", name, strerror(-ret));
+        return ret;
+    }
+
+    path = vhd_strdup_printf("%s/%s", VDUSE_DEV_DIR, name);
+    fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("open(%s): %s", path, strerror(-ret));
+        vhd_free(path);
+        goto destroy;
+    }
+    vhd_free(path);
+
+    for (i = 0; i < num_queues; i++) {
+        struct vduse_vq_config vq_cfg = {
+            .index = i,
+            .max_size = type->queue_size,
+        };
+
+        if (ioctl(fd, VDUSE_VQ_SETUP, &vq_cfg) < 0) {
+            ret = -errno;
+            VHD_LOG_ERROR("%s: VDUSE_VQ_SETUP: %s", name, strerror(-ret));
+            close(fd);
+            goto destroy;
+        }
+    }
+
+    return fd;
+
+destroy:
+    vduse_destroy_dev(name);
+    return ret;
+}
+
+void vhd_vdev_config_changed(struct vhd_vdev *vdev)
+{
+    union {
+        struct vduse_config_data data;
+        uint8_t buf[sizeof(struct vduse_config_data) +
+                    VHOST_USER_CONFIG_SPACE_MAX];
+    } cfg = {};
+
+    /* vhost-user masters only find out on their own */
+    if (vdev->vduse_fd < 0) {
+        return;
+    }
+
+    cfg.data.length = vdev->type->get_config(vdev, cfg.data.buffer,
+                                             VHOST_USER_CONFIG_SPACE_MAX, 0);
+    if (ioctl(vdev->vduse_fd, VDUSE_DEV_SET_CONFIG, &cfg.data) < 0 ||
+        ioctl(vdev->vduse_fd, VDUSE_DEV_INJECT_CONFIG_IRQ) < 0) {
+        VHD_OBJ_WARN(vdev, "failed to update VDUSE device config: %s",
+                     strerror(errno));
+    }
+}
+
+static void vdev_start(struct vhd_vdev *vdev, void *opaque)
+{
+    int ret;
+
+    if (vdev->vduse_fd >= 0) {
+        ret = vduse_start_handling(vdev);
+    } else {
+        ret = vdev_start_listening(vdev);
+    }
+
+    vdev_complete_work(vdev, ret);
+}
+
+static bool vdev_validate_queues(const char *name, int max_queues,
+                                 struct vhd_request_queue **rqs, int num_rqs)
+{
+    /*
+     * The spec is unclear about the maximum number of queues allowed, using
+     * different types for the vring index in different messages.  The most
+     * limiting appear to VHOST_USER_SET_VRING_{CALL,ERR,KICK}, which allow
+     * only 8 bits for the vring index.
+     */
+    if (max_queues > VHOST_VRING_IDX_MASK + 1) {
+        VHD_LOG_ERROR("%s: %d queues is too many", name, max_queues);
+        return false;
+    }
+
+    if (num_rqs < 1 || num_rqs > VHD_MAX_REQUEST_QUEUES ||
+        num_rqs > max_queues) {
+        VHD_LOG_ERROR("%s: invalid number of requests queues: %d",
+                      name, num_rqs);
+        return false;
     }
     if ((max_queues % num_rqs) != 0) {
         VHD_LOG_WARN("%s: max_queues %d is not aligned to num_rqs %d, "
-                     "expect uneven request distribution", socket_path,
+                     "expect uneven request distribution", name,
                      max_queues, num_rqs);
     }
     VHD_ASSERT(rqs);
 
-    listenfd = sock_create_server(socket_path);
-    if (listenfd < 0) {
-        return -1;
-    }
+    return true;
+}
+
+/* Init the parts common to all transports and start the device */
+static int vdev_init(
+    struct vhd_vdev *vdev,
+    const char *name,
+    int listenfd,
+    int vduse_fd,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len),
+    int (*unmap_cb)(void *addr, size_t len))
+{
+    int ret;
+    uint16_t i;
+    struct vhd_request_queue **vhd_rqs;
 
     vhd_rqs = vhd_alloc(num_rqs * sizeof(*rqs));
     memcpy(vhd_rqs, rqs, num_rqs * sizeof(*rqs));
@@ -2176,20 +3513,27 @@ int vhd_vdev_init_server(
         .supported_protocol_features = g_default_protocol_features,
         .num_queues = max_queues,
         .keep_fd = -1,
+        .state_fd = -1,
+        .postcopy_ufd = -1,
+        .vduse_fd = vduse_fd,
     };
 
-    vdev->log_tag = vhd_strdup(socket_path);
+    vdev->log_tag = vhd_strdup(name);
+    if (vduse_fd >= 0) {
+        vdev->vduse_name = vhd_strdup(name);
+    }
 
     vdev->vrings = vhd_calloc(vdev->num_queues, sizeof(vdev->vrings[0]));
     for (i = 0; i < vdev->num_queues; i++) {
         vdev->vrings[i] = (struct vhd_vring) {
             .vdev = vdev,
-            .log_tag = vhd_strdup_printf("%s[%u]", socket_path, i),
+            .log_tag = vhd_strdup_printf("%s[%u]", name, i),
             .callfd = -1,
             .kickfd = -1,
             .errfd = -1,
         };
     }
+    vdev_place_rqs(vdev);
 
     LIST_INSERT_HEAD(&g_vdevs, vdev, vdev_list);
 
@@ -2201,6 +3545,58 @@ int vhd_vdev_init_server(
     return ret;
 }
 
+int vhd_vdev_init_server(
+    struct vhd_vdev *vdev,
+    const char *socket_path,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len),
+    int (*unmap_cb)(void *addr, size_t len))
+{
+    int listenfd;
+
+    if (!vdev_validate_queues(socket_path, max_queues, rqs, num_rqs)) {
+        return -1;
+    }
+
+    listenfd = sock_create_server(socket_path);
+    if (listenfd < 0) {
+        return -1;
+    }
+
+    return vdev_init(vdev, socket_path, listenfd, -1, type, max_queues,
+                     rqs, num_rqs, priv, map_cb, unmap_cb);
+}
+
+int vhd_vdev_init_vduse(
+    struct vhd_vdev *vdev,
+    const char *name,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len),
+    int (*unmap_cb)(void *addr, size_t len))
+{
+    int vduse_fd;
+
+    if (!vdev_validate_queues(name, max_queues, rqs, num_rqs)) {
+        return -1;
+    }
+
+    vduse_fd = vduse_create_dev(vdev, type, name, max_queues);
+    if (vduse_fd < 0) {
+        return -1;
+    }
+
+    return vdev_init(vdev, name, -1, vduse_fd, type, max_queues,
+                     rqs, num_rqs, priv, map_cb, unmap_cb);
+}
+
 struct vdev_stop_work {
     void (*release_cb)(void *);
     void *release_arg;
@@ -2212,6 +3608,18 @@ static void vdev_stop(struct vhd_vdev *vdev, void *opaque)
 
    vdev->release_cb = work->release_cb;
    vdev->release_arg = work->release_arg;
+   vdev->stopping = true;
+
+    /*
+     * A VDUSE device has no connection to drop: stop taking requests from
+     * the kernel and stop the vrings, if running.
+     */
+    if (vdev->vduse_fd >= 0) {
+        vhd_del_io_handler(vdev->vduse_handler);
+        vdev->vduse_handler = NULL;
+        vdev_disconnect_vrings(vdev);
+        return;
+    }
 
    vdev_stop_listening(vdev);
 
@@ -21,9 +21,15 @@ struct vhd_request_queue;
 struct vhd_vdev_type {
     /* Human-readable description */
     const char *desc;
+    /* Virtio device ID, for the transports announcing it */
+    uint32_t device_id;
+    /* Max vring size, for the transports where the device sets it */
+    uint16_t queue_size;
 
     /* Polymorphic type ops */
     uint64_t (*get_features)(struct vhd_vdev *vdev);
+    /* vhost-user protocol features on top of the generic ones; optional */
+    uint64_t (*get_protocol_features)(struct vhd_vdev *vdev);
     int (*set_features)(struct vhd_vdev *vdev, uint64_t features);
     size_t (*get_config)(struct vhd_vdev *vdev, void *cfgbuf,
                          size_t bufsize, size_t offset);
@@ -123,7 +129,48 @@ struct vhd_vdev {
     /* fd to keep open until handle_complete and to close there */
     int keep_fd;
 
+    /*
+     * #vrings stopped with their requests in flight left for the device
+     * state, and not yet drained; only the device state transfer messages
+     * are handled meanwhile, reading the rest is held off
+     */
+    uint16_t num_vrings_handing_over;
+    bool conn_held;
+
+    /* device state being transferred and its direction */
+    int state_fd;
+    uint32_t state_direction;
+
+    /*
+     * Postcopy migration: userfaultfd handed over to the master for the
+     * faults on the guest memory pages yet to arrive, whether the guest
+     * memory mapped from now on is to be registered with it, the memory map
+     * waiting for the master to get ready for the faults on it, and the
+     * region added to report where it's mapped
+     */
+    int postcopy_ufd;
+    bool postcopy_listening;
+    struct vhd_memory_map *postcopy_memmap;
+    struct vhost_user_mem_region postcopy_region;
+
     struct vhd_work *work;
+
+    /* being stopped, to be released once drained */
+    bool stopping;
+
+    /*
+     * VDUSE device served in place of the vhost-user server: its fd and
+     * name, the request from the kernel being handled, if any, and the
+     * device status last accepted
+     */
+    int vduse_fd;
+    char *vduse_name;
+    struct vhd_io_handler *vduse_handler;
+    bool vduse_req_pending;
+    uint32_t vduse_req_id;
+    uint32_t vduse_req_type;
+    uint8_t vduse_req_status;
+    uint8_t vduse_status;
 };
 
 /**
@@ -148,6 +195,28 @@ int vhd_vdev_init_server(
     int (*map_cb)(void *addr, size_t len),
     int (*unmap_cb)(void *addr, size_t len));
 
+/**
+ * Init new generic vhost device as a VDUSE device, to be attached to the vDPA
+ * bus by the administrator, e.g. with "vdpa dev add name @name mgmtdev vduse"
+ * @name            VDUSE device name
+ * Other parameters are the same as for vhd_vdev_init_server().
+ */
+int vhd_vdev_init_vduse(
+    struct vhd_vdev *vdev,
+    const char *name,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs, int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len),
+    int (*unmap_cb)(void *addr, size_t len));
+
+/**
+ * Let the driver know the device config has changed.  Only to be called in
+ * the control event loop.
+ */
+void vhd_vdev_config_changed(struct vhd_vdev *vdev);
+
 /**
  * Stop vhost device.  Once this returns no more new requests will reach the
  * backend.  @release_cb(@release_arg) will be called once all requests are
@@ -156,6 +225,19 @@ int vhd_vdev_init_server(
 int vhd_vdev_stop_server(struct vhd_vdev *vdev,
                          void (*release_cb)(void *), void *release_arg);
 
+/**
+ * Vring state passed in the device state on migration: the requests in
+ * flight when the vring was stopped, to be resubmitted on the destination.
+ */
+struct vhd_vring_state {
+    uint16_t last_avail;
+    uint16_t num_heads;
+    /* in the order they were made available */
+    uint16_t *heads;
+    /* loaded from the source, as opposed to saved at stop */
+    bool loaded;
+};
+
 /**
  * Device vring instance
  */
@@ -163,6 +245,12 @@ struct vhd_vring {
     struct vhd_vdev *vdev;
     char *log_tag;
 
+    /*
+     * Request queue serving the vring: the one attached by the caller, or
+     * its replacement local to the guest memory, see vdev_place_rqs()
+     */
+    struct vhd_request_queue *rq;
+
     int kickfd;
     int callfd;
     int errfd;
@@ -177,6 +265,13 @@ struct vhd_vring {
 
     /* called in control plane once vring is drained */
     int (*on_drain_cb)(struct vhd_vring *);
+    /* called in control plane once vring is stopped */
+    int (*on_stop_cb)(struct vhd_vring *);
+
+    /* stopping without waiting for the requests in flight */
+    bool handing_over;
+    /* state for the device state transfer, if any */
+    struct vhd_vring_state *state;
 
     /*
      * vq attributes that may change while vring is started; these are updated
@@ -203,6 +298,8 @@ struct vhd_vring {
     struct virtio_virtq vq;
     /* started as seen from dataplane */
     bool started_in_rq;
+    /* no longer processed after a dispatch failure, until restarted */
+    bool suspended;
     /* #requests pending completion */
     uint16_t num_in_flight;
     /* #requests pending completion when the queue is requested to stop */
@@ -215,6 +312,7 @@ struct vhd_request_queue *vhd_get_rq_for_vring(struct vhd_vring *vring);
 
 void vhd_vring_inc_in_flight(struct vhd_vring *vring);
 void vhd_vring_dec_in_flight(struct vhd_vring *vring);
+void vhd_vring_poll_avail(struct vhd_vring *vring);
 
 #ifdef __cplusplus
 }
@@ -39,13 +39,17 @@ extern "C" {
 #define VHOST_USER_PROTOCOL_F_CONFIG         9
 #define VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD 12
 #define VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS 15
+#define VHOST_USER_PROTOCOL_F_DEVICE_STATE   19
 
 /* Vhost user features (GET_FEATURES and SET_FEATURES commands). */
 #define VHOST_F_LOG_ALL                     26
 #define VHOST_USER_F_PROTOCOL_FEATURES      30
+#define VIRTIO_F_ANY_LAYOUT                 27
 #define VIRTIO_F_RING_INDIRECT_DESC         28
 #define VIRTIO_F_RING_EVENT_IDX             29
 #define VIRTIO_F_VERSION_1                  32
+#define VIRTIO_F_ACCESS_PLATFORM            33
+#define VIRTIO_F_IN_ORDER                   35
 
 /*
  * Invalid FD bit for the VHOST_USER_SET_VRING_KICK and
@@ -105,6 +109,8 @@ enum {
     VHOST_USER_GET_MAX_MEM_SLOTS = 36,
     VHOST_USER_ADD_MEM_REG = 37,
     VHOST_USER_REM_MEM_REG = 38,
+    VHOST_USER_SET_DEVICE_STATE_FD = 42,
+    VHOST_USER_CHECK_DEVICE_STATE = 43,
 };
 
 struct vhost_user_mem_region {
@@ -176,6 +182,21 @@ struct vhost_user_log {
     uint64_t offset;
 };
 
+struct vhost_user_device_state {
+#define VHOST_TRANSFER_STATE_DIRECTION_SAVE 0
+#define VHOST_TRANSFER_STATE_DIRECTION_LOAD 1
+    uint32_t direction;
+#define VHOST_TRANSFER_STATE_PHASE_STOPPED  0
+    uint32_t phase;
+};
+
+/*
+ * VHOST_USER_SET_DEVICE_STATE_FD reply: error code in the low byte, and
+ * whether the back-end has returned no fd of its own to use instead
+ */
+#define VHOST_USER_DEVICE_STATE_ERROR_MASK  0xff
+#define VHOST_USER_DEVICE_STATE_INVALID_FD  (1 << 8)
+
 struct vhost_user_msg_hdr {
     uint32_t req;
     uint32_t flags;
@@ -204,6 +225,8 @@ union vhost_user_msg_payload {
     struct vhost_user_inflight_desc inflight_desc;
     /* VHOST_USER_SET_LOG_BASE */
     struct vhost_user_log log;
+    /* VHOST_USER_SET_DEVICE_STATE_FD */
+    struct vhost_user_device_state device_state;
 };
 
 #ifdef __cplusplus
@@ -7,6 +7,7 @@
 #include <inttypes.h>
 
 #include "catomic.h"
+#include "event.h"
 #include "virt_queue.h"
 #include "logging.h"
 #include "memmap.h"
@@ -18,6 +19,8 @@
 struct virtq_iov_private {
     /* Private virtq fields */
     uint16_t used_head;
+    /* position in the avail ring, to keep the order with VIRTIO_F_IN_ORDER */
+    uint16_t avail_idx;
     struct vhd_memory_map *mm;
 
     /* Iov we show to caller */
@@ -71,6 +74,67 @@ uint16_t virtio_iov_get_head(struct virtio_iov *iov)
     return priv->used_head;
 }
 
+size_t virtio_buffers_size(const struct vhd_buffer *bufs, unsigned nbufs)
+{
+    size_t len = 0;
+    unsigned i;
+
+    for (i = 0; i < nbufs; i++) {
+        len += bufs[i].len;
+    }
+    return len;
+}
+
+size_t virtio_buffers_read(const struct vhd_buffer *bufs, unsigned nbufs,
+                           size_t offset, void *dst, size_t len)
+{
+    char *p = dst;
+    size_t skip = offset, left = len;
+    unsigned i;
+
+    for (i = 0; i < nbufs && left; i++) {
+        size_t n;
+
+        if (skip >= bufs[i].len) {
+            skip -= bufs[i].len;
+            continue;
+        }
+
+        n = MIN(left, bufs[i].len - skip);
+        memcpy(p, (const char *)bufs[i].base + skip, n);
+        p += n;
+        left -= n;
+        skip = 0;
+    }
+
+    return offset + len;
+}
+
+size_t virtio_buffers_write(const struct vhd_buffer *bufs, unsigned nbufs,
+                            size_t offset, const void *src, size_t len)
+{
+    const char *p = src;
+    size_t skip = offset, left = len;
+    unsigned i;
+
+    for (i = 0; i < nbufs && left; i++) {
+        size_t n;
+
+        if (skip >= bufs[i].len) {
+            skip -= bufs[i].len;
+            continue;
+        }
+
+        n = MIN(left, bufs[i].len - skip);
+        memcpy((char *)bufs[i].base + skip, p, n);
+        p += n;
+        left -= n;
+        skip = 0;
+    }
+
+    return offset + len;
+}
+
 static int add_buffer(struct virtio_virtq *vq, void *addr, size_t len, bool in)
 {
     uint16_t niov = vq->niov_out + vq->niov_in;
@@ -160,7 +224,7 @@ static void virtq_inflight_used_update(struct virtio_virtq *vq, uint16_t head)
 }
 
 /* Post commit inflight descriptor handling. */
-static void virtq_inflight_used_commit(struct virtio_virtq *vq, uint16_t head)
+static void virtq_inflight_used_clear(struct virtio_virtq *vq, uint16_t head)
 {
     if (!vq->inflight_region) {
         return;
@@ -172,6 +236,18 @@ static void virtq_inflight_used_commit(struct virtio_virtq *vq, uint16_t head)
     }
 
     vq->inflight_region->desc[head].inflight = 0;
+}
+
+/*
+ * Complete the commit of the last batch once all its descriptors are
+ * cleared; until then the batch is recovered via last_batch_head.
+ */
+static void virtq_inflight_used_commit(struct virtio_virtq *vq)
+{
+    if (!vq->inflight_region) {
+        return;
+    }
+
     /*
      * Make sure used_idx is stored after the desc content, so that the next
      * incarnation of the vhost backend sees consistent values regardless of
@@ -215,8 +291,12 @@ static void virtq_inflight_reconnect_update(struct virtio_virtq *vq)
         goto out;
     }
 
-    /* we don't do batching for now */
-    VHD_ASSERT(batch_size == 1);
+    /* more than one only with VIRTIO_F_IN_ORDER */
+    if (batch_size > vq->inflight_region->desc_num) {
+        VHD_OBJ_WARN(vq, "last batch of %u exceeds %u descriptors",
+                     batch_size, vq->inflight_region->desc_num);
+        batch_size = vq->inflight_region->desc_num;
+    }
 
     idx = vq->inflight_region->last_batch_head;
     while (batch_size) {
@@ -249,6 +329,12 @@ void virtio_virtq_init(struct virtio_virtq *vq)
 
     vq->buffers = vhd_calloc(vq->max_chain_len, sizeof(vq->buffers[0]));
 
+    if (vq->in_order) {
+        vq->in_order_slots = vhd_calloc(vq->qsz, sizeof(vq->in_order_slots[0]));
+        /* inflight requests are resubmitted at the avail index they had */
+        vq->in_order_next = vq->last_avail;
+    }
+
     /* Make check on the first virtq dequeue. */
     vq->inflight_check = true;
     virtq_inflight_reconnect_update(vq);
@@ -260,6 +346,7 @@ void virtio_virtq_release(struct virtio_virtq *vq)
 {
     VHD_ASSERT(vq->buffers);
     vhd_free(vq->buffers);
+    vhd_free(vq->in_order_slots);
     *vq = (struct virtio_virtq) {};
 }
 
@@ -281,12 +368,36 @@ static int inflight_resubmit_compare(const void *first, const void *second)
     return 1;
 }
 
+/*
+ * Fill @resubmit_array, with room for the whole inflight region, with the
+ * requests in flight in the order they were made available.  Returns their
+ * number.
+ */
+static uint16_t inflight_collect(struct virtio_virtq *vq,
+                                 struct inflight_resubmit *resubmit_array)
+{
+    uint16_t desc_num = vq->inflight_region->desc_num;
+    uint16_t cnt = 0;
+    uint16_t i;
+
+    for (i = 0; i < desc_num; i++) {
+        if (vq->inflight_region->desc[i].inflight) {
+            resubmit_array[cnt].counter = vq->inflight_region->desc[i].counter;
+            resubmit_array[cnt].head = i;
+            cnt++;
+        }
+    }
+    qsort(resubmit_array, cnt, sizeof(*resubmit_array),
+            inflight_resubmit_compare);
+
+    return cnt;
+}
+
 /* Resubmit inflight requests on the virtqueue start. */
 static int virtq_inflight_resubmit(struct virtio_virtq *vq,
                                    virtq_handle_buffers_cb handle_buffers_cb,
                                    void *arg)
 {
-    uint16_t desc_num;
     uint16_t cnt;
     struct inflight_resubmit *resubmit_array;
     uint16_t i;
@@ -296,18 +407,9 @@ static int virtq_inflight_resubmit(struct virtio_virtq *vq,
         return 0;
     }
 
-    desc_num = vq->inflight_region->desc_num;
-    cnt = 0;
-    resubmit_array = alloca(sizeof(*resubmit_array) * desc_num);
-    for (i = 0; i < desc_num; i++) {
-        if (vq->inflight_region->desc[i].inflight) {
-            resubmit_array[cnt].counter = vq->inflight_region->desc[i].counter;
-            resubmit_array[cnt].head = i;
-            cnt++;
-        }
-    }
-    qsort(resubmit_array, cnt, sizeof(*resubmit_array),
-            inflight_resubmit_compare);
+    resubmit_array = alloca(sizeof(*resubmit_array) *
+                            vq->inflight_region->desc_num);
+    cnt = inflight_collect(vq, resubmit_array);
 
     res = 0;
     VHD_OBJ_DEBUG(vq, "cnt = %d inflight requests should be resubmitted", cnt);
@@ -328,11 +430,84 @@ static int virtq_inflight_resubmit(struct virtio_virtq *vq,
     return res;
 }
 
+uint16_t *virtq_get_inflight_heads(struct virtio_virtq *vq, uint16_t *num)
+{
+    struct inflight_resubmit *resubmit_array;
+    uint16_t *heads;
+    uint16_t i;
+
+    *num = 0;
+    if (!vq->inflight_region) {
+        return NULL;
+    }
+
+    resubmit_array = alloca(sizeof(*resubmit_array) *
+                            vq->inflight_region->desc_num);
+    *num = inflight_collect(vq, resubmit_array);
+
+    heads = vhd_calloc(*num + 1, sizeof(heads[0]));
+    for (i = 0; i < *num; i++) {
+        heads[i] = resubmit_array[i].head;
+    }
+    return heads;
+}
+
+int virtq_set_inflight_heads(struct virtio_virtq *vq, const uint16_t *heads,
+                             uint16_t num)
+{
+    struct inflight_split_region *region = vq->inflight_region;
+    uint16_t i;
+
+    if (!region) {
+        VHD_OBJ_ERROR(vq, "no inflight region to resubmit %u requests", num);
+        return -ENOTSUP;
+    }
+
+    if (num > vq->qsz || (uint16_t)(vq->last_avail - vq->used->idx) < num) {
+        VHD_OBJ_ERROR(vq, "%u requests in flight past avail index %u",
+                      num, vq->last_avail);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (heads[i] >= vq->qsz || heads[i] >= region->desc_num) {
+            VHD_OBJ_ERROR(vq, "invalid request in flight: head %u", heads[i]);
+            return -EINVAL;
+        }
+    }
+
+    for (i = 0; i < num; i++) {
+        uint16_t head = heads[i];
+
+        /* left over in the region since the requests were handed over */
+        if (region->desc[head].inflight) {
+            continue;
+        }
+
+        region->desc[head].counter = vq->req_cnt++;
+        /* same ordering as in virtq_inflight_avail_update() */
+        barrier();
+        region->desc[head].inflight = 1;
+    }
+
+    /* the requests are made available anew on resubmission */
+    vq->last_avail -= num;
+    if (vq->in_order) {
+        vq->in_order_next = vq->last_avail;
+    }
+    return 0;
+}
+
 bool virtq_is_broken(struct virtio_virtq *vq)
 {
     return vq->broken;
 }
 
+bool virtq_has_avail(struct virtio_virtq *vq)
+{
+    return vq->avail->idx != vq->last_avail;
+}
+
 void mark_broken(struct virtio_virtq *vq)
 {
     vq->broken = true;
@@ -562,6 +737,7 @@ static int virtq_dequeue_one(struct virtio_virtq *vq, uint16_t head,
     /* Create iov copy from stored buffer for client handling */
     struct virtq_iov_private *priv = clone_iov(vq);
     priv->used_head = head;
+    priv->avail_idx = vq->last_avail;
     priv->mm = vq->mm;
     /* matched with unref in virtio_free_iov */
     vhd_memmap_ref(priv->mm);
@@ -589,17 +765,8 @@ static void vhd_log_buffers(struct vhd_memory_log *log,
     }
 }
 
-/*
- * NOTE: this @mm is the one the request was started with, not the current one
- * on @vq
- */
-static void vhd_log_modified(struct virtio_virtq *vq,
-                             struct vhd_memory_map *mm,
-                             struct virtio_iov *iov,
-                             uint16_t used_idx)
+static void vhd_log_used(struct virtio_virtq *vq, uint16_t used_idx)
 {
-    /* log modifications of buffers in descr */
-    vhd_log_buffers(vq->log, mm, iov);
     if (vq->flags & VHOST_VRING_F_LOG) {
         /* log modification of used->idx */
         vhd_mark_gpa_range_dirty(vq->log,
@@ -614,15 +781,33 @@ static void vhd_log_modified(struct virtio_virtq *vq,
     }
 }
 
+/*
+ * NOTE: this @mm is the one the request was started with, not the current one
+ * on @vq
+ */
+static void vhd_log_modified(struct virtio_virtq *vq,
+                             struct vhd_memory_map *mm,
+                             struct virtio_iov *iov,
+                             uint16_t used_idx)
+{
+    /* log modifications of buffers in descr */
+    vhd_log_buffers(vq->log, mm, iov);
+    vhd_log_used(vq, used_idx);
+}
+
 static void virtq_do_notify(struct virtio_virtq *vq)
 {
-    if (vq->notify_fd != -1) {
+    if (vq->notify_cb) {
+        vq->notify_cb(vq);
+    } else if (vq->notify_fd != -1) {
         eventfd_write(vq->notify_fd, 1);
     }
 }
 
-static bool virtq_need_notify(struct virtio_virtq *vq)
+static bool virtq_need_notify(struct virtio_virtq *vq, uint16_t old_idx)
 {
+    uint16_t new_idx = vq->used->idx;
+
     if (!vq->has_event_idx) {
         /*
          * Virtio specification v1.0, 5.1.6.2.3:
@@ -641,28 +826,141 @@ static bool virtq_need_notify(struct virtio_virtq *vq)
      * If the idx field in the used ring was
      * equal to used_event, the device MUST send an interrupt.
      * --------------------------------------------------------
-     * Note: code below assumes that virtq_notify is always called
-     * per one completion, and never per batch.
+     * A batch moves the idx by more than one at a time, so check whether it
+     * has gone past used_event anywhere in (old_idx, new_idx].
      */
-    return virtq_get_used_event(vq) == (uint16_t)(vq->used->idx - 1);
+    return (uint16_t)(new_idx - virtq_get_used_event(vq) - 1) <
+           (uint16_t)(new_idx - old_idx);
 }
 
-static void virtq_notify(struct virtio_virtq *vq)
+static void virtq_notify(struct virtio_virtq *vq, uint16_t old_idx)
 {
     /* expose used ring entries before checking used event */
     smp_mb();
 
-    if (virtq_need_notify(vq)) {
+    if (virtq_need_notify(vq, old_idx)) {
         virtq_do_notify(vq);
     }
 }
 
+/*
+ * With VIRTIO_F_IN_ORDER the completion is parked in its avail ring slot and
+ * published by virtq_flush() together with the other completed buffers that
+ * directly follow the oldest one outstanding.
+ */
+static void virtq_push_in_order(struct virtio_virtq *vq,
+                                struct virtq_iov_private *priv, uint32_t len)
+{
+    uint16_t ahead = priv->avail_idx - vq->in_order_next;
+    struct virtq_in_order_slot *slot =
+        &vq->in_order_slots[priv->avail_idx % vq->qsz];
+
+    if (ahead >= vq->qsz || slot->done) {
+        VHD_OBJ_ERROR(vq, "head %u at avail %u completed twice or out of "
+                      "window at %u", priv->used_head, priv->avail_idx,
+                      vq->in_order_next);
+        mark_broken(vq);
+        return;
+    }
+
+    *slot = (struct virtq_in_order_slot) {
+        .len = len,
+        .head = priv->used_head,
+        .done = true,
+    };
+    VHD_OBJ_DEBUG(vq, "head = %d held at avail %u", priv->used_head,
+                  priv->avail_idx);
+
+    /* the buffers are logged now while the request memmap is still around */
+    if (vq->log) {
+        vhd_log_buffers(vq->log, priv->mm, &priv->iov);
+    }
+
+    if (vq->flush_bh) {
+        vhd_bh_schedule(vq->flush_bh);
+    } else {
+        virtq_flush(vq);
+    }
+}
+
+void virtq_flush(struct virtio_virtq *vq)
+{
+    uint16_t old_idx;
+    uint16_t used_idx;
+    uint16_t i, n;
+    struct virtq_in_order_slot *slot = NULL;
+
+    if (!vq->in_order) {
+        return;
+    }
+
+    old_idx = vq->used->idx;
+    used_idx = old_idx % vq->qsz;
+
+    /*
+     * Chain the whole batch via last_batch_head in the inflight region, so
+     * that it's recovered if we die once used->idx covers it.
+     */
+    for (n = 0; n < vq->qsz; n++) {
+        struct virtq_in_order_slot *next =
+            &vq->in_order_slots[(uint16_t)(vq->in_order_next + n) % vq->qsz];
+        if (!next->done) {
+            break;
+        }
+        slot = next;
+        virtq_inflight_used_update(vq, slot->head);
+    }
+
+    if (!n) {
+        return;
+    }
+
+    /*
+     * 2.7.9 In-order use of descriptors: a single used element with the id
+     * of the last buffer in the batch stands for the whole batch.
+     */
+    vq->used->ring[used_idx] = (struct virtq_used_elem) {
+        .id = slot->head,
+        .len = slot->len,
+    };
+
+    smp_wmb();                  /* barrier pair [A] */
+    vq->used->idx = old_idx + n;
+
+    for (i = 0; i < n; i++) {
+        slot = &vq->in_order_slots[vq->in_order_next % vq->qsz];
+        virtq_inflight_used_clear(vq, slot->head);
+        slot->done = false;
+        vq->in_order_next++;
+    }
+    virtq_inflight_used_commit(vq);
+    VHD_OBJ_DEBUG(vq, "batch of %u up to avail %u", n,
+                  (uint16_t)(vq->in_order_next - 1));
+
+    if (vq->log) {
+        vhd_log_used(vq, used_idx);
+    }
+
+    virtq_notify(vq, old_idx);
+    vq->stat.metrics.request_completed += n;
+}
+
 void virtq_push(struct virtio_virtq *vq, struct virtio_iov *iov, uint32_t len)
 {
     /* Put buffer head index and len into used ring */
     struct virtq_iov_private *priv = containerof(iov, struct virtq_iov_private,
                                                  iov);
-    uint16_t used_idx = vq->used->idx % vq->qsz;
+    if (vq->handed_over) {
+        return;
+    }
+
+    if (vq->in_order) {
+        virtq_push_in_order(vq, priv, len);
+        return;
+    }
+
+    uint16_t old_idx = vq->used->idx;
+    uint16_t used_idx = old_idx % vq->qsz;
     struct virtq_used_elem *used = &vq->used->ring[used_idx];
     used->id = priv->used_head;
     used->len = len;
@@ -672,7 +970,8 @@ void virtq_push(struct virtio_virtq *vq, struct virtio_iov *iov, uint32_t len)
     smp_wmb();                  /* barrier pair [A] */
     vq->used->idx++;
 
-    virtq_inflight_used_commit(vq, used->id);
+    virtq_inflight_used_clear(vq, used->id);
+    virtq_inflight_used_commit(vq);
     VHD_OBJ_DEBUG(vq, "head = %d", priv->used_head);
 
     /* use memmap the request was started with rather than the current one */
@@ -680,7 +979,7 @@ void virtq_push(struct virtio_virtq *vq, struct virtio_iov *iov, uint32_t len)
         vhd_log_modified(vq, priv->mm, &priv->iov, used_idx);
     }
 
-    virtq_notify(vq);
+    virtq_notify(vq, old_idx);
     vq->stat.metrics.request_completed++;
 }
 
@@ -24,6 +24,14 @@ struct virtio_iov {
 
 struct vhd_memory_map;
 struct vhd_memory_log;
+struct vhd_bh;
+
+/* Completion held back until the ones before it in the avail ring are done */
+struct virtq_in_order_slot {
+    uint32_t len;
+    uint16_t head;
+    bool done;
+};
 
 struct virtio_virtq {
     const char *log_tag;
@@ -67,11 +75,37 @@ struct virtio_virtq {
      */
     bool has_event_idx;
 
+    /*
+     * If set, VIRTIO_F_IN_ORDER is negotiated for this queue: buffers are
+     * returned in the order they were made available, and each run of
+     * consecutive completions is published with a single used element.
+     */
+    bool in_order;
+    /* avail index of the oldest buffer not yet returned to the guest */
+    uint16_t in_order_next;
+    /* completions waiting to be published, indexed by avail index % qsz */
+    struct virtq_in_order_slot *in_order_slots;
+    /*
+     * If set, scheduled to call virtq_flush() instead of publishing the
+     * completions right in virtq_push(), so that the ones arriving together
+     * make a single batch.
+     */
+    struct vhd_bh *flush_bh;
+
+    /*
+     * If set, the vring is stopped with the requests in flight handed over in
+     * the device state: their completions are dropped rather than returned to
+     * the guest, as they are to be resubmitted from the inflight region.
+     */
+    bool handed_over;
+
     /*
      * eventfd for used buffers notification.
      * can be reset after virtq is started.
      */
     int notify_fd;
+    /* notifies in place of @notify_fd if set, for transports without one */
+    void (*notify_cb)(struct virtio_virtq *vq);
 
     /*
      * Whether the processing of this virtq is enabled.
@@ -110,6 +144,12 @@ bool virtq_is_broken(struct virtio_virtq *vq);
 
 void mark_broken(struct virtio_virtq *vq);
 
+/*
+ * Whether the guest has made buffers available since the virtq was last
+ * processed.  Doesn't touch avail_event, so it's cheap enough to poll.
+ */
+bool virtq_has_avail(struct virtio_virtq *vq);
+
 typedef void(*virtq_handle_buffers_cb)(void *arg,
                                        struct virtio_virtq *vq,
                                        struct virtio_iov *iov);
@@ -119,11 +159,45 @@ int virtq_dequeue_many(struct virtio_virtq *vq,
 
 void virtq_push(struct virtio_virtq *vq, struct virtio_iov *iov, uint32_t len);
 
+/*
+ * Publish the completions held back with VIRTIO_F_IN_ORDER; no-op otherwise.
+ */
+void virtq_flush(struct virtio_virtq *vq);
+
+/*
+ * Return the heads of the requests in flight as per the inflight region, in
+ * the order they were made available, in a vhd_alloc'ed array, and set @num
+ * to their number.  Returns NULL if there's no inflight region.
+ */
+uint16_t *virtq_get_inflight_heads(struct virtio_virtq *vq, uint16_t *num);
+
+/*
+ * Mark @num requests with @heads, in the order they were made available, in
+ * flight, unless they still are, so that they are resubmitted when @vq
+ * starts; they are to be the last @num ones before the current avail index.
+ * Only to be called right after virtio_virtq_init().
+ */
+int virtq_set_inflight_heads(struct virtio_virtq *vq, const uint16_t *heads,
+                             uint16_t num);
+
 void virtq_set_notify_fd(struct virtio_virtq *vq, int fd);
 
 void virtio_free_iov(struct virtio_iov *iov);
 uint16_t virtio_iov_get_head(struct virtio_iov *iov);
 
+/* Total length of @bufs */
+size_t virtio_buffers_size(const struct vhd_buffer *bufs, unsigned nbufs);
+
+/*
+ * Copy @len bytes between @bufs at byte @offset, as if they were contiguous,
+ * and a flat buffer; the copy is cut short at the end of @bufs.  Returns the
+ * offset past the copied range.
+ */
+size_t virtio_buffers_read(const struct vhd_buffer *bufs, unsigned nbufs,
+                           size_t offset, void *dst, size_t len);
+size_t virtio_buffers_write(const struct vhd_buffer *bufs, unsigned nbufs,
+                            size_t offset, const void *src, size_t len);
+
 void virtio_virtq_get_stat(struct virtio_virtq *vq,
                            struct vhd_vq_metrics *metrics);
 
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <string.h>
 #include <inttypes.h>
 
@@ -5,8 +6,20 @@
 
 #include "virtio_blk.h"
 #include "virtio_blk_spec.h"
-
+#include "virtio_blk_coalesce.h"
+#include "virtio_blk_fault.h"
+#include "virtio_blk_rmw.h"
+#include "virtio_blk_stream.h"
+#include "virtio_blk_trace.h"
+#include "virtio_blk_zeroes.h"
+
+#include "bdev_builtin.h"
+#include "bdev_shm.h"
 #include "bio.h"
+#include "catomic.h"
+#include "event.h"
+#include "interval_tree.h"
+#include "queue.h"
 #include "virt_queue.h"
 #include "logging.h"
 #include "server_internal.h"
@@ -14,23 +27,107 @@
 
 /* virtio blk data for bdev io */
 struct virtio_blk_io {
+    struct virtio_blk_dev *dev;
     struct virtio_virtq *vq;
     struct virtio_iov *iov;
+    /* copy of the data buffers trimmed to the data, see buffers_slice() */
+    struct vhd_buffer *data_slice;
+
+    /* submission time if the device is being traced */
+    uint64_t trace_ts;
+    /* fault injector the request goes through, if any */
+    struct virtio_blk_faults *faults;
+
+    /*
+     * Sectors of the request and its place in the device order of
+     * overlapping writes, if the device keeps one.  Only writes are put in
+     * the index; the requests held behind them are also on the held list.
+     */
+    struct vhd_interval order_range;
+    uint64_t order_seq;
+    bool order_indexed;
+    TAILQ_ENTRY(virtio_blk_io) order_held;
+
+    /*
+     * Place in the read domain of the device, if any: either other reads may
+     * attach to this one, or it's attached to another and is to be served
+     * from its buffers
+     */
+    struct virtio_blk_inflight_read read;
+    bool coalesce_primary;
+    bool coalesced;
+
+    /*
+     * Place among the writes in flight in the known-zero map of the device,
+     * if it keeps one, and the sectors trimmed off a read at either end as
+     * known to be zero
+     */
+    struct virtio_blk_zero_write zero_write;
+    bool zero_tracked;
+    uint64_t zero_head;
+    uint64_t zero_tail;
+
+    /*
+     * Place among the writes in flight of a device aligning to blocks, the
+     * read-modify-write in progress if the request covers some blocks partly,
+     * and the request this one is a part of, if any
+     */
+    struct virtio_blk_rmw_write rmw_write;
+    bool rmw_tracked;
+    struct rmw_req *rmw;
+    struct virtio_blk_io *rmw_parent;
 
     struct vhd_io io;
     struct vhd_bdev_io bdev_io;
 };
 
-static size_t iov_size(const struct vhd_buffer *iov, unsigned niov)
+/*
+ * Point @sglist at @len bytes of @bufs starting at @offset; the range must
+ * be within @bufs.  If it starts or ends in the middle of a buffer, the
+ * buffers are copied and trimmed; the copy is returned for the caller to
+ * free.  Otherwise @sglist refers to @bufs directly and NULL is returned.
+ */
+static struct vhd_buffer *buffers_slice(struct vhd_sglist *sglist,
+                                        struct vhd_buffer *bufs,
+                                        unsigned nbufs,
+                                        size_t offset, size_t len)
 {
-    size_t len;
-    unsigned int i;
+    struct vhd_buffer *copy;
+    size_t skip = offset, end;
+    unsigned first, last, n;
+
+    for (first = 0; first < nbufs && skip >= bufs[first].len; first++) {
+        skip -= bufs[first].len;
+    }
+
+    if (!len) {
+        sglist->buffers = bufs + first;
+        sglist->nbuffers = 0;
+        return NULL;
+    }
+
+    /* end of the range relative to the start of bufs[last] */
+    end = skip + len;
+    for (last = first; end > bufs[last].len; last++) {
+        end -= bufs[last].len;
+    }
+    n = last - first + 1;
 
-    len = 0;
-    for (i = 0; i < niov; i++) {
-        len += iov[i].len;
+    if (!skip && end == bufs[last].len) {
+        sglist->buffers = bufs + first;
+        sglist->nbuffers = n;
+        return NULL;
     }
-    return len;
+
+    copy = vhd_alloc(n * sizeof(copy[0]));
+    memcpy(copy, bufs + first, n * sizeof(copy[0]));
+    copy[n - 1].len = end;
+    copy[0].base = (char *)copy[0].base + skip;
+    copy[0].len -= skip;
+
+    sglist->buffers = copy;
+    sglist->nbuffers = n;
+    return copy;
 }
 
 static uint8_t translate_status(enum vhd_bdev_io_result status)
@@ -38,32 +135,125 @@ static uint8_t translate_status(enum vhd_bdev_io_result status)
     switch (status) {
     case VHD_BDEV_SUCCESS:
         return VIRTIO_BLK_S_OK;
+    case VHD_BDEV_ZONE_INVALID_CMD:
+        return VIRTIO_BLK_S_ZONE_INVALID_CMD;
+    case VHD_BDEV_ZONE_UNALIGNED_WP:
+        return VIRTIO_BLK_S_ZONE_UNALIGNED_WP;
+    case VHD_BDEV_ZONE_OPEN_RESOURCE:
+        return VIRTIO_BLK_S_ZONE_OPEN_RESOURCE;
+    case VHD_BDEV_ZONE_ACTIVE_RESOURCE:
+        return VIRTIO_BLK_S_ZONE_ACTIVE_RESOURCE;
     default:
         return VIRTIO_BLK_S_IOERR;
     }
 }
 
-static void set_status(struct virtio_iov *iov, uint8_t status)
-{
-    struct vhd_buffer *last_iov = &iov->iov_in[iov->niov_in - 1];
-    *((uint8_t *)last_iov->base) = status;
-}
-
 static void complete_req(struct virtio_virtq *vq, struct virtio_iov *iov,
                          uint8_t status)
 {
-    set_status(iov, status);
+    size_t in_len = virtio_buffers_size(iov->iov_in, iov->niov_in);
+
+    /* the status is the last byte of the IN area, see handle_buffers() */
+    virtio_buffers_write(iov->iov_in, iov->niov_in, in_len - 1, &status,
+                         sizeof(status));
     /*
-     * the last byte in the IN buffer is always written (for status), so pass
-     * the total length of the IN buffer to virtq_push()
+     * the last byte in the IN area is always written (for status), so pass
+     * the total length of the IN area to virtq_push()
      */
-    virtq_push(vq, iov, iov_size(iov->iov_in, iov->niov_in));
+    virtq_push(vq, iov, in_len);
     virtio_free_iov(iov);
 }
 
-static void complete_io(struct vhd_io *io)
+static void trace_io(struct virtio_blk_io *bio)
 {
-    struct virtio_blk_io *bio = containerof(io, struct virtio_blk_io, io);
+    struct virtio_blk_dev *dev = bio->dev;
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(bio->vq);
+    /* the range the guest asked for rather than the one trimmed */
+    struct vhd_bdev_io bdev_io = bio->bdev_io;
+
+    bdev_io.first_sector -= bio->zero_head;
+    bdev_io.total_sectors += bio->zero_head + bio->zero_tail;
+
+    virtio_blk_trace_record(dev->trace, bio->trace_ts,
+                            vring - vring->vdev->vrings, &bdev_io,
+                            bio->io.status);
+}
+
+static void order_untrack(struct virtio_blk_io *bio);
+static void coalesce_finish(struct virtio_blk_io *bio);
+static void zeroes_finish(struct virtio_blk_io *bio);
+static void rmw_untrack(struct virtio_blk_io *bio);
+static bool rmw_part_done(struct virtio_blk_io *bio,
+                          enum vhd_bdev_io_result status);
+static bool rmw_start(struct virtio_blk_io *bio);
+
+static void bio_free(struct virtio_blk_io *bio)
+{
+    if (unlikely(bio->coalesce_primary)) {
+        /* never made it to the backend */
+        bio->io.status = VHD_BDEV_IOERR;
+        coalesce_finish(bio);
+    }
+    if (unlikely(bio->zero_tracked)) {
+        bio->io.status = VHD_BDEV_IOERR;
+        zeroes_finish(bio);
+    }
+    if (unlikely(bio->rmw_tracked)) {
+        rmw_untrack(bio);
+    }
+    if (unlikely(bio->order_indexed)) {
+        order_untrack(bio);
+    }
+    if (unlikely(bio->faults)) {
+        virtio_blk_faults_unref(bio->faults);
+    }
+    vhd_free(bio->bdev_io.zones);
+    vhd_free(bio->data_slice);
+    vhd_free(bio);
+}
+
+/* request held back by the fault injector */
+struct fault_held_io {
+    struct vhd_timer timer;
+    struct virtio_blk_io *bio;
+};
+
+static uint16_t bio_vring_idx(struct virtio_blk_io *bio)
+{
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(bio->vq);
+    return vring - vring->vdev->vrings;
+}
+
+/*
+ * Resume @bio with @cb once @delay_ns passes.  The vring counts it as in
+ * flight meanwhile, so that it isn't considered drained and its memory isn't
+ * remapped under the held request.
+ */
+static void hold_bio(struct virtio_blk_io *bio, uint64_t delay_ns,
+                     void (*cb)(void *))
+{
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(bio->vq);
+    struct fault_held_io *held = vhd_alloc(sizeof(*held));
+
+    held->bio = bio;
+    vhd_vring_inc_in_flight(vring);
+    vhd_rq_timer_init(vhd_get_rq_for_vring(vring), &held->timer, cb, held);
+    vhd_timer_mod(&held->timer, vhd_timer_now_ns() + delay_ns);
+}
+
+static void zone_finish_io(struct virtio_blk_io *bio);
+
+static void finish_io(struct virtio_blk_io *bio)
+{
+    if (unlikely(bio->trace_ts)) {
+        trace_io(bio);
+    }
+
+    if (unlikely(bio->bdev_io.type == VHD_BDEV_ZONE_APPEND ||
+                 bio->bdev_io.type == VHD_BDEV_ZONE_REPORT) &&
+        bio->io.status == VHD_BDEV_SUCCESS) {
+        zone_finish_io(bio);
+    }
 
     if (likely(bio->io.status != VHD_BDEV_CANCELED)) {
         complete_req(bio->vq, bio->iov, translate_status(bio->io.status));
@@ -71,7 +261,54 @@ static void complete_io(struct vhd_io *io)
         virtio_free_iov(bio->iov);
     }
 
-    vhd_free(bio);
+    bio_free(bio);
+}
+
+static void held_completion_done(void *opaque)
+{
+    struct fault_held_io *held = opaque;
+    struct virtio_blk_io *bio = held->bio;
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(bio->vq);
+
+    vhd_free(held);
+    finish_io(bio);
+    vhd_vring_dec_in_flight(vring);
+}
+
+/* @bio is done with the backend */
+static void bio_done(struct virtio_blk_io *bio)
+{
+    if (unlikely(bio->coalesce_primary)) {
+        coalesce_finish(bio);
+    }
+    if (unlikely(bio->zero_tracked)) {
+        zeroes_finish(bio);
+    }
+    if (unlikely(bio->rmw_tracked)) {
+        rmw_untrack(bio);
+    }
+
+    if (unlikely(bio->faults) && bio->io.status != VHD_BDEV_CANCELED) {
+        uint64_t delay_ns = virtio_blk_faults_complete(
+            bio->faults, bio_vring_idx(bio), vhd_timer_now_ns());
+        if (delay_ns) {
+            hold_bio(bio, delay_ns, held_completion_done);
+            return;
+        }
+    }
+
+    finish_io(bio);
+}
+
+static void complete_io(struct vhd_io *io)
+{
+    struct virtio_blk_io *bio = containerof(io, struct virtio_blk_io, io);
+
+    if (unlikely(bio->rmw) && !rmw_part_done(bio, io->status)) {
+        return;
+    }
+
+    bio_done(bio);
 }
 
 static bool is_valid_block_range_req(uint64_t sector, size_t nsectors,
@@ -105,60 +342,1119 @@ static bool is_valid_req(uint64_t sector, size_t len, uint64_t capacity)
     return is_valid_block_range_req(sector, nsectors, capacity);
 }
 
-static bool bio_submit(struct virtio_blk_io *bio)
+static bool bio_send(struct virtio_blk_io *bio)
 {
-    int res = virtio_blk_handle_request(bio->vq, &bio->io);
+    int res;
+
+    if (bio->dev->builtin) {
+        bio->io.vring = VHD_VRING_FROM_VQ(bio->vq);
+        vhd_bdev_builtin_submit(bio->dev->builtin, &bio->io);
+        return true;
+    }
+
+    res = virtio_blk_handle_request(bio->vq, &bio->io);
     if (res != 0) {
         VHD_LOG_ERROR("bdev request submission failed with %d", res);
-        vhd_free(bio);
+        bio_free(bio);
         return false;
     }
 
     return true;
 }
 
+static bool bio_to_backend(struct virtio_blk_io *bio)
+{
+    if (unlikely(bio->dev->rmw) && rmw_start(bio)) {
+        return true;
+    }
+
+    return bio_send(bio);
+}
+
+/* whether @bio may change the data in its range */
+static bool bio_is_write(struct virtio_blk_io *bio)
+{
+    switch (bio->bdev_io.type) {
+    case VHD_BDEV_READ:
+    case VHD_BDEV_ZONE_REPORT:
+    case VHD_BDEV_ZONE_OPEN:
+    case VHD_BDEV_ZONE_CLOSE:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/*
+ * The sectors @bio covers for the overlap checks.  A zone append only has
+ * the zone start and the data length, and the data goes at the write
+ * pointer, which only the backend knows, so take it as covering the whole
+ * zone.
+ */
+static void bio_range(struct virtio_blk_io *bio, uint64_t *start,
+                      uint64_t *end)
+{
+    struct virtio_blk_dev *dev = bio->dev;
+
+    *start = bio->bdev_io.first_sector;
+    if (unlikely(bio->bdev_io.type == VHD_BDEV_ZONE_APPEND)) {
+        *end = MIN(*start + dev->config.zoned.zone_sectors,
+                   dev->config.capacity);
+    } else {
+        *end = *start + bio->bdev_io.total_sectors;
+    }
+}
+
+/*
+ * Coalescing of concurrent reads
+ *
+ * The copies from the buffers of the completed read to those of the reads
+ * attached to it are made in its request queue thread, and the attached ones
+ * are then completed in their own, as if served by the backend.  If the read
+ * fails, the attached reads go to the backend on their own instead.
+ */
+
+/* fill all of @dst from @src starting at @src_off */
+static void sglist_copy(const struct vhd_sglist *dst,
+                        const struct vhd_sglist *src, size_t src_off)
+{
+    uint32_t di = 0, si = 0;
+    size_t dst_off = 0;
+
+    while (src_off >= src->buffers[si].len) {
+        src_off -= src->buffers[si].len;
+        si++;
+    }
+
+    while (di < dst->nbuffers) {
+        const struct vhd_buffer *d = &dst->buffers[di];
+        const struct vhd_buffer *sb;
+        size_t len;
+
+        if (dst_off == d->len) {
+            di++;
+            dst_off = 0;
+            continue;
+        }
+
+        sb = &src->buffers[si];
+        len = MIN(d->len - dst_off, sb->len - src_off);
+        memcpy((char *)d->base + dst_off, (char *)sb->base + src_off, len);
+        dst_off += len;
+        src_off += len;
+        if (src_off == sb->len) {
+            si++;
+            src_off = 0;
+        }
+    }
+}
+
+static void coalesce_resume(void *opaque)
+{
+    struct virtio_blk_io *bio = opaque;
+    struct virtio_virtq *vq = bio->vq;
+    struct virtio_iov *iov = bio->iov;
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(vq);
+
+    if (bio->coalesced) {
+        bio->io.vring = vring;
+        vhd_start_request(vhd_get_rq_for_vring(vring), &bio->io);
+        vhd_complete_bio(&bio->io, VHD_BDEV_SUCCESS);
+    } else if (!bio_to_backend(bio)) {
+        complete_req(vq, iov, VIRTIO_BLK_S_IOERR);
+    }
+    vhd_vring_dec_in_flight(vring);
+}
+
+static void coalesce_finish(struct virtio_blk_io *bio)
+{
+    virtio_blk_read_waiters waiters;
+    struct virtio_blk_inflight_read *read;
+
+    bio->coalesce_primary = false;
+    virtio_blk_read_domain_finish(bio->dev->read_domain, &bio->read,
+                                  &waiters);
+
+    while ((read = SLIST_FIRST(&waiters))) {
+        struct virtio_blk_io *waiter =
+            containerof(read, struct virtio_blk_io, read);
+
+        SLIST_REMOVE_HEAD(&waiters, waiter_link);
+        if (bio->io.status == VHD_BDEV_SUCCESS) {
+            sglist_copy(&waiter->bdev_io.sglist, &bio->bdev_io.sglist,
+                        (waiter->bdev_io.first_sector -
+                         bio->bdev_io.first_sector) * VHD_SECTOR_SIZE);
+            waiter->coalesced = true;
+        }
+        vhd_run_in_rq(vhd_get_rq_for_vring(VHD_VRING_FROM_VQ(waiter->vq)),
+                      coalesce_resume, waiter);
+    }
+}
+
+/*
+ * Known-zero ranges
+ *
+ * Writes enter the map of the device as they are sent to the backend and
+ * leave it as they complete.  Reads are looked up in it before anything
+ * else: the ones within the known-zero ranges are completed right in the
+ * request queue, and the rest are trimmed to the sectors not known to be
+ * zero, so that the coalescing and the backend only see those.
+ */
+
+/* zero @len bytes of @sglist starting at @offset */
+static void sglist_zero(const struct vhd_sglist *sglist, size_t offset,
+                        size_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < sglist->nbuffers && len; i++) {
+        const struct vhd_buffer *buf = &sglist->buffers[i];
+        size_t n;
+
+        if (offset >= buf->len) {
+            offset -= buf->len;
+            continue;
+        }
+
+        n = MIN(buf->len - offset, len);
+        memset((char *)buf->base + offset, 0, n);
+        len -= n;
+        offset = 0;
+    }
+}
+
+static void zeroes_finish(struct virtio_blk_io *bio)
+{
+    bio->zero_tracked = false;
+    virtio_blk_zeroes_write_finish(bio->dev->zeroes, &bio->zero_write,
+                                   bio->io.status == VHD_BDEV_SUCCESS);
+}
+
+/* returns true if @bio is served without the backend */
+static bool zeroes_start(struct virtio_blk_io *bio)
+{
+    struct virtio_blk_dev *dev = bio->dev;
+    struct vhd_bdev_io *bdev_io = &bio->bdev_io;
+    struct vhd_vq_metrics *metrics = &bio->vq->stat.metrics;
+    uint64_t start, end;
+    uint64_t head, tail, len;
+
+    bio_range(bio, &start, &end);
+    if (bio_is_write(bio)) {
+        bool zeroing = bdev_io->type == VHD_BDEV_WRITE_ZEROES ||
+            (bdev_io->type == VHD_BDEV_DISCARD && dev->discard_zeroes);
+
+        virtio_blk_zeroes_write_start(dev->zeroes, &bio->zero_write, start,
+                                      end, zeroing);
+        bio->zero_tracked = true;
+        return false;
+    }
+
+    if (bdev_io->type != VHD_BDEV_READ) {
+        return false;
+    }
+
+    virtio_blk_zeroes_lookup(dev->zeroes, start, end, &head, &tail);
+    if (likely(!head && !tail)) {
+        return false;
+    }
+
+    if (head == bdev_io->total_sectors) {
+        sglist_zero(&bdev_io->sglist, 0, head * VHD_SECTOR_SIZE);
+        metrics->read_zero_hits++;
+        bio->io.vring = VHD_VRING_FROM_VQ(bio->vq);
+        vhd_start_request(vhd_get_rq_for_vring(bio->io.vring), &bio->io);
+        vhd_complete_bio(&bio->io, VHD_BDEV_SUCCESS);
+        return true;
+    }
+
+    len = bdev_io->total_sectors - head - tail;
+    sglist_zero(&bdev_io->sglist, 0, head * VHD_SECTOR_SIZE);
+    sglist_zero(&bdev_io->sglist, (head + len) * VHD_SECTOR_SIZE,
+                tail * VHD_SECTOR_SIZE);
+    metrics->read_zero_trims++;
+
+    /* the read data is at the start of the IN area, see handle_inout() */
+    vhd_free(bio->data_slice);
+    bio->data_slice = buffers_slice(&bdev_io->sglist, bio->iov->iov_in,
+                                    bio->iov->niov_in,
+                                    head * VHD_SECTOR_SIZE,
+                                    len * VHD_SECTOR_SIZE);
+    bdev_io->first_sector += head;
+    bdev_io->total_sectors = len;
+    bio->zero_head = head;
+    bio->zero_tail = tail;
+    return false;
+}
+
+static bool bio_start(struct virtio_blk_io *bio)
+{
+    struct virtio_blk_read_domain *rd = bio->dev->read_domain;
+    struct vhd_vq_metrics *metrics = &bio->vq->stat.metrics;
+    uint64_t start, end;
+
+    if (unlikely(bio->dev->zeroes) && zeroes_start(bio)) {
+        return true;
+    }
+
+    if (likely(!rd)) {
+        return bio_to_backend(bio);
+    }
+
+    bio_range(bio, &start, &end);
+    if (bio_is_write(bio)) {
+        virtio_blk_read_domain_invalidate(rd, start, end);
+        return bio_to_backend(bio);
+    }
+
+    if (bio->bdev_io.type != VHD_BDEV_READ) {
+        return bio_to_backend(bio);
+    }
+
+    metrics->read_coalesce_lookups++;
+    if (virtio_blk_read_domain_attach(rd, &bio->read, start, end)) {
+        /* resumed by coalesce_resume() */
+        metrics->read_coalesce_hits++;
+        vhd_vring_inc_in_flight(VHD_VRING_FROM_VQ(bio->vq));
+        return true;
+    }
+
+    bio->coalesce_primary = true;
+    return bio_to_backend(bio);
+}
+
+/*
+ * Ordering of overlapping writes
+ *
+ * A request overlapping a write handed to the backend earlier is held until
+ * that write completes to the guest; everything else goes to the backend
+ * right away.  Writes, discards and write-zeroes are all writes here, and the
+ * held writes hold back the later requests as well, so the overlapping
+ * requests reach the backend in the order the guest submitted them.
+ * The vrings of a device may be served by different request queues, hence
+ * the lock; the held requests are resumed in the request queue of their own
+ * vring.
+ */
+static bool order_earlier_write(struct vhd_interval *range, void *opaque)
+{
+    struct virtio_blk_io *bio = opaque;
+    struct virtio_blk_io *write =
+        containerof(range, struct virtio_blk_io, order_range);
+
+    /* stop at the first one */
+    return write->order_seq >= bio->order_seq;
+}
+
+static bool order_blocked(struct virtio_blk_dev *dev,
+                          struct virtio_blk_io *bio)
+{
+    return !vhd_interval_tree_foreach_overlap(&dev->order_writes,
+                                              bio->order_range.start,
+                                              bio->order_range.end,
+                                              order_earlier_write, bio);
+}
+
+/*
+ * Put @bio in the device order.  Returns true if it's held behind an
+ * overlapping write, in which case the vring counts it as in flight until
+ * it's resumed.
+ */
+static bool order_track(struct virtio_blk_io *bio)
+{
+    struct virtio_blk_dev *dev = bio->dev;
+    bool blocked;
+
+    bio_range(bio, &bio->order_range.start, &bio->order_range.end);
+
+    pthread_mutex_lock(&dev->order_lock);
+    bio->order_seq = ++dev->order_seq;
+    if (bio_is_write(bio)) {
+        vhd_interval_tree_insert(&dev->order_writes, &bio->order_range);
+        bio->order_indexed = true;
+    }
+
+    blocked = order_blocked(dev, bio);
+    if (blocked) {
+        TAILQ_INSERT_TAIL(&dev->order_held, bio, order_held);
+        vhd_vring_inc_in_flight(VHD_VRING_FROM_VQ(bio->vq));
+        bio->vq->stat.metrics.order_held++;
+    }
+    pthread_mutex_unlock(&dev->order_lock);
+
+    return blocked;
+}
+
+static bool bio_inject(struct virtio_blk_io *bio);
+
+static void order_resume(void *opaque)
+{
+    struct virtio_blk_io *bio = opaque;
+    struct virtio_virtq *vq = bio->vq;
+    struct virtio_iov *iov = bio->iov;
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(vq);
+
+    if (!bio_inject(bio)) {
+        complete_req(vq, iov, VIRTIO_BLK_S_IOERR);
+    }
+    vhd_vring_dec_in_flight(vring);
+}
+
+static bool ranges_overlap(const struct vhd_interval *a,
+                           const struct vhd_interval *b)
+{
+    return a->start < b->end && b->start < a->end;
+}
+
+/*
+ * Drop the finished write @bio from the order and resume the requests held
+ * behind it that aren't held by any other write.
+ */
+static void order_untrack(struct virtio_blk_io *bio)
+{
+    struct virtio_blk_dev *dev = bio->dev;
+    struct virtio_blk_io *held, *next;
+    TAILQ_HEAD(, virtio_blk_io) resumed = TAILQ_HEAD_INITIALIZER(resumed);
+
+    pthread_mutex_lock(&dev->order_lock);
+    vhd_interval_tree_remove(&dev->order_writes, &bio->order_range);
+    bio->order_indexed = false;
+
+    for (held = TAILQ_FIRST(&dev->order_held); held; held = next) {
+        next = TAILQ_NEXT(held, order_held);
+        if (ranges_overlap(&held->order_range, &bio->order_range) &&
+            !order_blocked(dev, held)) {
+            TAILQ_REMOVE(&dev->order_held, held, order_held);
+            TAILQ_INSERT_TAIL(&resumed, held, order_held);
+        }
+    }
+    pthread_mutex_unlock(&dev->order_lock);
+
+    for (held = TAILQ_FIRST(&resumed); held; held = next) {
+        next = TAILQ_NEXT(held, order_held);
+        vhd_run_in_rq(vhd_get_rq_for_vring(VHD_VRING_FROM_VQ(held->vq)),
+                      order_resume, held);
+    }
+}
+
+static void held_submission_done(void *opaque)
+{
+    struct fault_held_io *held = opaque;
+    struct virtio_blk_io *bio = held->bio;
+    struct virtio_virtq *vq = bio->vq;
+    struct virtio_iov *iov = bio->iov;
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(vq);
+
+    vhd_free(held);
+    if (!bio_start(bio)) {
+        complete_req(vq, iov, VIRTIO_BLK_S_IOERR);
+    }
+    vhd_vring_dec_in_flight(vring);
+}
+
+static struct virtio_blk_faults *get_faults(struct virtio_blk_dev *dev)
+{
+    struct virtio_blk_faults *faults;
+
+    pthread_mutex_lock(&dev->faults_lock);
+    faults = dev->faults;
+    if (faults) {
+        virtio_blk_faults_ref(faults);
+    }
+    pthread_mutex_unlock(&dev->faults_lock);
+    return faults;
+}
+
+/*
+ * Apply the injected faults to @bio on its way to the backend.  This comes
+ * after the ordering, for the delays not to reorder the overlapping requests
+ * the guest submitted.
+ */
+static bool bio_inject(struct virtio_blk_io *bio)
+{
+    uint64_t delay_ns;
+
+    if (likely(!catomic_read(&bio->dev->faults))) {
+        return bio_start(bio);
+    }
+
+    bio->faults = get_faults(bio->dev);
+    if (!bio->faults) {
+        return bio_start(bio);
+    }
+
+    if (virtio_blk_faults_submit(bio->faults, bio_vring_idx(bio),
+                                 bio->bdev_io.type, vhd_timer_now_ns(),
+                                 &delay_ns)) {
+        /* fail it as if the backend did */
+        bio->io.vring = VHD_VRING_FROM_VQ(bio->vq);
+        vhd_start_request(vhd_get_rq_for_vring(bio->io.vring), &bio->io);
+        vhd_complete_bio(&bio->io, VHD_BDEV_IOERR);
+        return true;
+    }
+
+    if (delay_ns) {
+        hold_bio(bio, delay_ns, held_submission_done);
+        return true;
+    }
+
+    return bio_start(bio);
+}
+
+static bool bio_submit(struct virtio_blk_io *bio)
+{
+    if (unlikely(virtio_blk_trace_running(bio->dev->trace))) {
+        bio->trace_ts = virtio_blk_trace_now();
+    }
+
+    /* zone reports have no range to order */
+    if (unlikely(bio->dev->order_overlapping_writes) &&
+        bio->bdev_io.total_sectors && order_track(bio)) {
+        return true;
+    }
+
+    return bio_inject(bio);
+}
+
+static struct virtio_blk_io *alloc_bio(struct virtio_blk_dev *dev,
+                                       struct virtio_virtq *vq,
+                                       struct virtio_iov *iov,
+                                       enum vhd_bdev_io_type io_type,
+                                       uint64_t sector, uint64_t nsectors)
+{
+    struct virtio_blk_io *bio = vhd_zalloc(sizeof(*bio));
+
+    bio->dev = dev;
+    bio->vq = vq;
+    bio->iov = iov;
+    bio->io.completion_handler = complete_io;
+    bio->bdev_io.type = io_type;
+    bio->bdev_io.first_sector = sector;
+    bio->bdev_io.total_sectors = nsectors;
+    return bio;
+}
+
+/*
+ * Read-modify-write of the partial blocks
+ *
+ * On a device aligning to blocks, a request covering some blocks partly is
+ * split into the blocks at its ends, read whole into bounce buffers, and the
+ * whole blocks in between, which the request itself goes to the backend for.
+ * For the reads, the parts the guest asked for are copied out of the bounce
+ * buffers once all of them are done.  For the writes, the guest data, or
+ * zeroes, are merged into the bounce buffers once read, and those are written
+ * back whole.  Every write takes its blocks in the device state first, see
+ * virtio_blk_rmw.c, and the request completes once all its parts do.
+ */
+
+/* block at either end of a request covering it partly */
+struct rmw_edge {
+    uint64_t block;
+    /* the sectors of the block the request covers */
+    uint64_t start;
+    uint64_t end;
+    struct vhd_buffer buf;
+};
+
+struct rmw_req {
+    /* the request as it was before the split */
+    uint64_t first_sector;
+    uint64_t total_sectors;
+    struct vhd_sglist sglist;
+    /* copy of the data buffers trimmed to the middle, see buffers_slice() */
+    struct vhd_buffer *slice;
+
+    struct rmw_edge edges[2];
+    unsigned num_edges;
+    /* parts in flight, and the edge reads among them */
+    unsigned pending;
+    unsigned reads_pending;
+    enum vhd_bdev_io_result status;
+};
+
+/* copy @len bytes between @buf and @sglist at @offset */
+static void sglist_transfer(const struct vhd_sglist *sglist, size_t offset,
+                            void *buf, size_t len, bool to_sglist)
+{
+    uint32_t i;
+
+    for (i = 0; i < sglist->nbuffers && len; i++) {
+        const struct vhd_buffer *sb = &sglist->buffers[i];
+        size_t n;
+
+        if (offset >= sb->len) {
+            offset -= sb->len;
+            continue;
+        }
+
+        n = MIN(sb->len - offset, len);
+        if (to_sglist) {
+            memcpy((char *)sb->base + offset, buf, n);
+        } else {
+            memcpy(buf, (char *)sb->base + offset, n);
+        }
+        buf = (char *)buf + n;
+        len -= n;
+        offset = 0;
+    }
+}
+
+/* send @bio, or a part of a request, to the backend, or fail it as such */
+static void rmw_send(struct virtio_blk_io *bio)
+{
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(bio->vq);
+
+    if (bio->dev->builtin) {
+        bio->io.vring = vring;
+        vhd_bdev_builtin_submit(bio->dev->builtin, &bio->io);
+        return;
+    }
+
+    if (virtio_blk_handle_request(bio->vq, &bio->io) != 0) {
+        bio->io.vring = vring;
+        vhd_start_request(vhd_get_rq_for_vring(vring), &bio->io);
+        vhd_complete_bio(&bio->io, VHD_BDEV_IOERR);
+    }
+}
+
+static void rmw_merge_status(struct rmw_req *rmw,
+                             enum vhd_bdev_io_result status)
+{
+    /* a cancelled part cancels the request, to be resubmitted as a whole */
+    if (status == VHD_BDEV_CANCELED ||
+        (status != VHD_BDEV_SUCCESS && rmw->status == VHD_BDEV_SUCCESS)) {
+        rmw->status = status;
+    }
+}
+
+static void rmw_part_complete(struct vhd_io *io);
+
+static void rmw_send_edge(struct virtio_blk_io *bio, struct rmw_edge *edge,
+                          enum vhd_bdev_io_type type)
+{
+    struct virtio_blk_io *part;
+
+    part = alloc_bio(bio->dev, bio->vq, NULL, type, edge->block,
+                     virtio_blk_rmw_block_sectors(bio->dev->rmw));
+    part->io.completion_handler = rmw_part_complete;
+    part->rmw_parent = bio;
+    part->bdev_io.sglist.buffers = &edge->buf;
+    part->bdev_io.sglist.nbuffers = 1;
+    rmw_send(part);
+}
+
+/* merge the data into the edges read and write them back */
+static void rmw_write_back(struct virtio_blk_io *bio)
+{
+    struct rmw_req *rmw = bio->rmw;
+    unsigned i;
+
+    rmw->pending += rmw->num_edges;
+
+    for (i = 0; i < rmw->num_edges; i++) {
+        struct rmw_edge *edge = &rmw->edges[i];
+        char *dst = (char *)edge->buf.base +
+                    (edge->start - edge->block) * VHD_SECTOR_SIZE;
+        size_t len = (edge->end - edge->start) * VHD_SECTOR_SIZE;
+
+        if (bio->bdev_io.type == VHD_BDEV_WRITE) {
+            sglist_transfer(&rmw->sglist,
+                            (edge->start - rmw->first_sector) *
+                            VHD_SECTOR_SIZE, dst, len, false);
+        } else {
+            memset(dst, 0, len);
+        }
+        rmw_send_edge(bio, edge, VHD_BDEV_WRITE);
+    }
+}
+
+/*
+ * A part of the read-modify-write of @bio is done with @status.  Returns
+ * true if the whole request is, with @bio restored to what it was before the
+ * split and the status of the request.
+ */
+static bool rmw_part_done(struct virtio_blk_io *bio,
+                          enum vhd_bdev_io_result status)
+{
+    struct rmw_req *rmw = bio->rmw;
+    unsigned i;
+
+    rmw_merge_status(rmw, status);
+    if (--rmw->pending) {
+        return false;
+    }
+
+    for (i = 0; i < rmw->num_edges; i++) {
+        struct rmw_edge *edge = &rmw->edges[i];
+
+        if (bio->bdev_io.type == VHD_BDEV_READ &&
+            rmw->status == VHD_BDEV_SUCCESS) {
+            sglist_transfer(&rmw->sglist,
+                            (edge->start - rmw->first_sector) *
+                            VHD_SECTOR_SIZE,
+                            (char *)edge->buf.base +
+                            (edge->start - edge->block) * VHD_SECTOR_SIZE,
+                            (edge->end - edge->start) * VHD_SECTOR_SIZE,
+                            true);
+        }
+        virtio_blk_rmw_put_block(bio->dev->rmw, edge->buf.base);
+    }
+
+    bio->bdev_io.first_sector = rmw->first_sector;
+    bio->bdev_io.total_sectors = rmw->total_sectors;
+    bio->bdev_io.sglist = rmw->sglist;
+    bio->io.status = rmw->status;
+
+    vhd_free(rmw->slice);
+    vhd_free(rmw);
+    bio->rmw = NULL;
+    return true;
+}
+
+static void rmw_part_complete(struct vhd_io *io)
+{
+    struct virtio_blk_io *part = containerof(io, struct virtio_blk_io, io);
+    struct virtio_blk_io *bio = part->rmw_parent;
+    struct rmw_req *rmw = bio->rmw;
+    enum vhd_bdev_io_result status = io->status;
+    bool read = part->bdev_io.type == VHD_BDEV_READ;
+
+    bio_free(part);
+
+    if (read) {
+        rmw_merge_status(rmw, status);
+        if (!--rmw->reads_pending && bio_is_write(bio) &&
+            rmw->status == VHD_BDEV_SUCCESS) {
+            rmw_write_back(bio);
+        }
+    }
+
+    if (rmw_part_done(bio, status)) {
+        bio_done(bio);
+    }
+}
+
+static void rmw_add_edge(struct rmw_req *rmw, uint64_t block,
+                         uint64_t start, uint64_t end)
+{
+    struct rmw_edge *edge = &rmw->edges[rmw->num_edges++];
+
+    edge->block = block;
+    edge->start = start;
+    edge->end = end;
+}
+
+/*
+ * Split @bio covering some blocks partly into the reads of those, and the
+ * whole blocks between them, if any, which @bio itself is trimmed to
+ */
+static void rmw_split(struct virtio_blk_io *bio)
+{
+    struct virtio_blk_dev *dev = bio->dev;
+    struct vhd_bdev_io *bdev_io = &bio->bdev_io;
+    struct vhd_vq_metrics *metrics = &bio->vq->stat.metrics;
+    struct rmw_req *rmw = vhd_zalloc(sizeof(*rmw));
+    uint64_t block_sectors = virtio_blk_rmw_block_sectors(dev->rmw);
+    uint64_t mask = block_sectors - 1;
+    uint64_t start = bdev_io->first_sector;
+    uint64_t end = start + bdev_io->total_sectors;
+    uint64_t mid_start = start, mid_end = end;
+    unsigned i;
+
+    if (start & mask) {
+        mid_start = (start & ~mask) + block_sectors;
+        rmw_add_edge(rmw, start & ~mask, start, MIN(end, mid_start));
+    }
+    if ((end & mask) && (end & ~mask) >= mid_start) {
+        mid_end = end & ~mask;
+        rmw_add_edge(rmw, mid_end, MAX(start, mid_end), end);
+    }
+    mid_end = MAX(mid_start, mid_end);
+
+    if (bdev_io->type == VHD_BDEV_READ) {
+        metrics->rmw_reads++;
+    } else {
+        metrics->rmw_writes++;
+    }
+
+    rmw->first_sector = start;
+    rmw->total_sectors = bdev_io->total_sectors;
+    rmw->sglist = bdev_io->sglist;
+    rmw->status = VHD_BDEV_SUCCESS;
+    rmw->pending = rmw->reads_pending = rmw->num_edges;
+    for (i = 0; i < rmw->num_edges; i++) {
+        rmw->edges[i].buf = (struct vhd_buffer) {
+            .base = virtio_blk_rmw_get_block(dev->rmw),
+            .len = block_sectors * VHD_SECTOR_SIZE,
+            .write_only = true,
+        };
+    }
+    bio->rmw = rmw;
+
+    if (mid_start < mid_end) {
+        rmw->pending++;
+        if (bdev_io->sglist.nbuffers) {
+            rmw->slice = buffers_slice(&bdev_io->sglist,
+                                       rmw->sglist.buffers,
+                                       rmw->sglist.nbuffers,
+                                       (mid_start - start) * VHD_SECTOR_SIZE,
+                                       (mid_end - mid_start) *
+                                       VHD_SECTOR_SIZE);
+        }
+        bdev_io->first_sector = mid_start;
+        bdev_io->total_sectors = mid_end - mid_start;
+    }
+
+    for (i = 0; i < rmw->num_edges; i++) {
+        rmw_send_edge(bio, &rmw->edges[i], VHD_BDEV_READ);
+    }
+    if (mid_start < mid_end) {
+        rmw_send(bio);
+    }
+}
+
+static void rmw_resume(void *opaque)
+{
+    struct virtio_blk_io *bio = opaque;
+    struct virtio_virtq *vq = bio->vq;
+    struct virtio_iov *iov = bio->iov;
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(vq);
+
+    if (bio->rmw_write.rmw) {
+        rmw_split(bio);
+    } else if (!bio_send(bio)) {
+        complete_req(vq, iov, VIRTIO_BLK_S_IOERR);
+    }
+    vhd_vring_dec_in_flight(vring);
+}
+
+/* drop the finished write @bio from the device and resume the ones it held */
+static void rmw_untrack(struct virtio_blk_io *bio)
+{
+    virtio_blk_rmw_held resumed = TAILQ_HEAD_INITIALIZER(resumed);
+    struct virtio_blk_rmw_write *held, *next;
+
+    bio->rmw_tracked = false;
+    virtio_blk_rmw_write_finish(bio->dev->rmw, &bio->rmw_write, &resumed);
+
+    for (held = TAILQ_FIRST(&resumed); held; held = next) {
+        struct virtio_blk_io *waiter =
+            containerof(held, struct virtio_blk_io, rmw_write);
+
+        next = TAILQ_NEXT(held, held_link);
+        vhd_run_in_rq(vhd_get_rq_for_vring(VHD_VRING_FROM_VQ(waiter->vq)),
+                      rmw_resume, waiter);
+    }
+}
+
+/*
+ * Take over @bio on its way to the backend if it covers some blocks partly,
+ * or is a write to wait for another one to the same blocks.  Returns false
+ * if it's to go to the backend as is.
+ */
+static bool rmw_start(struct virtio_blk_io *bio)
+{
+    struct virtio_blk_dev *dev = bio->dev;
+    struct vhd_bdev_io *bdev_io = &bio->bdev_io;
+    uint64_t mask = virtio_blk_rmw_block_sectors(dev->rmw) - 1;
+    uint64_t start = bdev_io->first_sector;
+    uint64_t end = start + bdev_io->total_sectors;
+    bool aligned = !(start & mask) && !(end & mask);
+
+    switch (bdev_io->type) {
+    case VHD_BDEV_READ:
+        if (aligned) {
+            return false;
+        }
+        rmw_split(bio);
+        return true;
+    case VHD_BDEV_WRITE:
+    case VHD_BDEV_WRITE_ZEROES:
+        break;
+    case VHD_BDEV_DISCARD:
+        if (aligned || dev->discard_zeroes) {
+            break;
+        }
+        /* nobody cares about the rest of the blocks discarded partly */
+        start = (start + mask) & ~mask;
+        end &= ~mask;
+        if (start >= end) {
+            bio->io.vring = VHD_VRING_FROM_VQ(bio->vq);
+            vhd_start_request(vhd_get_rq_for_vring(bio->io.vring), &bio->io);
+            vhd_complete_bio(&bio->io, VHD_BDEV_SUCCESS);
+            return true;
+        }
+        bdev_io->first_sector = start;
+        bdev_io->total_sectors = end - start;
+        aligned = true;
+        break;
+    default:
+        return false;
+    }
+
+    bio->rmw_tracked = true;
+    if (virtio_blk_rmw_write_start(dev->rmw, &bio->rmw_write, start & ~mask,
+                                   (end + mask) & ~mask, !aligned)) {
+        /* resumed by rmw_resume() */
+        bio->vq->stat.metrics.rmw_waits++;
+        vhd_vring_inc_in_flight(VHD_VRING_FROM_VQ(bio->vq));
+        return true;
+    }
+
+    if (aligned) {
+        return false;
+    }
+    rmw_split(bio);
+    return true;
+}
+
+/*
+ * Zoned devices
+ *
+ * The library only checks the requests against the zone geometry; the zone
+ * states and write pointers are up to the backend.  Zone appends carry the
+ * sector the data went to back to the guest in front of the status, and the
+ * zone reports are converted from the backend descriptors into the guest
+ * buffers on completion.
+ */
+static uint64_t zone_sectors(struct virtio_blk_dev *dev)
+{
+    return dev->config.zoned.zone_sectors;
+}
+
+static uint8_t check_zone_append(struct virtio_blk_dev *dev, uint64_t sector,
+                                 size_t len)
+{
+    size_t nsectors = len / VIRTIO_BLK_SECTOR_SIZE;
+
+    if (sector % zone_sectors(dev)) {
+        VHD_LOG_ERROR("Zone append to %" PRIu64 " not at a zone start",
+                      sector);
+        return VIRTIO_BLK_S_ZONE_INVALID_CMD;
+    }
+
+    if (nsectors > dev->config.zoned.max_append_sectors) {
+        VHD_LOG_ERROR("Zone append too large: %zu (max is %" PRIu32 ")",
+                      nsectors, dev->config.zoned.max_append_sectors);
+        return VIRTIO_BLK_S_IOERR;
+    }
+
+    return VIRTIO_BLK_S_OK;
+}
+
+static uint32_t zone_report_room(size_t len)
+{
+    return (len - sizeof(struct virtio_blk_zone_report)) /
+           sizeof(struct virtio_blk_zone_descriptor);
+}
+
+static void zone_write_report(struct virtio_blk_io *bio)
+{
+    struct virtio_iov *iov = bio->iov;
+    const struct vhd_buffer *bufs = iov->iov_in;
+    unsigned nbufs = iov->niov_in;
+    /* the report goes in front of the status byte */
+    size_t len = virtio_buffers_size(bufs, nbufs) - VIRTIO_BLK_STATUS_LENGTH;
+    uint32_t nr_zones = MIN(bio->bdev_io.nr_zones, zone_report_room(len));
+    struct virtio_blk_zone_report hdr = { .nr_zones = nr_zones };
+    size_t offset;
+    uint32_t i;
+
+    offset = virtio_buffers_write(bufs, nbufs, 0, &hdr, sizeof(hdr));
+    for (i = 0; i < nr_zones; i++) {
+        const struct vhd_zone_descriptor *zone = &bio->bdev_io.zones[i];
+        struct virtio_blk_zone_descriptor desc = {
+            .z_cap = zone->capacity,
+            .z_start = zone->start,
+            .z_wp = zone->write_pointer,
+            .z_type = zone->type,
+            .z_state = zone->state,
+        };
+
+        offset = virtio_buffers_write(bufs, nbufs, offset, &desc,
+                                      sizeof(desc));
+    }
+}
+
+static void zone_finish_io(struct virtio_blk_io *bio)
+{
+    struct virtio_iov *iov = bio->iov;
+
+    if (bio->bdev_io.type == VHD_BDEV_ZONE_REPORT) {
+        zone_write_report(bio);
+        return;
+    }
+
+    /* at the start of the IN area, checked to fit in handle_buffers() */
+    virtio_buffers_write(iov->iov_in, iov->niov_in, 0,
+                         &bio->bdev_io.append_sector,
+                         sizeof(bio->bdev_io.append_sector));
+}
+
+static void handle_zone_report(struct virtio_blk_dev *dev,
+                               const struct virtio_blk_req_hdr *req,
+                               struct virtio_virtq *vq,
+                               struct virtio_iov *iov)
+{
+    uint64_t capacity = dev->config.capacity;
+    size_t len = virtio_buffers_size(iov->iov_in, iov->niov_in) -
+                 VIRTIO_BLK_STATUS_LENGTH;
+    uint64_t zones_left;
+    uint32_t nr_zones;
+    struct virtio_blk_io *bio;
+
+    if (len < sizeof(struct virtio_blk_zone_report)) {
+        VHD_LOG_ERROR("Zone report buffer too small: %zu", len);
+        goto fail_request;
+    }
+
+    if (req->sector >= capacity) {
+        VHD_LOG_ERROR("Zone report from %" PRIu64 " beyond device capacity %"
+                      PRIu64, req->sector, capacity);
+        goto fail_request;
+    }
+
+    zones_left = VHD_ALIGN_UP(capacity, zone_sectors(dev)) /
+                 zone_sectors(dev) - req->sector / zone_sectors(dev);
+    nr_zones = MIN(zone_report_room(len), zones_left);
+
+    bio = alloc_bio(dev, vq, iov, VHD_BDEV_ZONE_REPORT, req->sector, 0);
+    bio->bdev_io.nr_zones = nr_zones;
+    bio->bdev_io.zones = vhd_calloc(nr_zones ?: 1,
+                                    sizeof(bio->bdev_io.zones[0]));
+
+    if (!bio_submit(bio)) {
+        goto fail_request;
+    }
+
+    /* request will be completed asynchronously */
+    return;
+
+fail_request:
+    complete_req(vq, iov, VIRTIO_BLK_S_IOERR);
+}
+
+static void handle_zone_mgmt(struct virtio_blk_dev *dev,
+                             const struct virtio_blk_req_hdr *req,
+                             struct virtio_virtq *vq,
+                             struct virtio_iov *iov)
+{
+    uint64_t capacity = dev->config.capacity;
+    uint64_t sector = 0, nsectors = capacity;
+    enum vhd_bdev_io_type io_type;
+    uint8_t status = VIRTIO_BLK_S_IOERR;
+    struct virtio_blk_io *bio;
+
+    switch (req->type) {
+    case VIRTIO_BLK_T_ZONE_OPEN:
+        io_type = VHD_BDEV_ZONE_OPEN;
+        break;
+    case VIRTIO_BLK_T_ZONE_CLOSE:
+        io_type = VHD_BDEV_ZONE_CLOSE;
+        break;
+    case VIRTIO_BLK_T_ZONE_FINISH:
+        io_type = VHD_BDEV_ZONE_FINISH;
+        break;
+    case VIRTIO_BLK_T_ZONE_RESET:
+        io_type = VHD_BDEV_ZONE_RESET;
+        break;
+    case VIRTIO_BLK_T_ZONE_RESET_ALL:
+        io_type = VHD_BDEV_ZONE_RESET_ALL;
+        break;
+    default:
+        VHD_UNREACHABLE();
+    }
+
+    if (virtio_blk_is_readonly(dev)) {
+        VHD_LOG_ERROR("Zone management request to readonly device");
+        goto fail_request;
+    }
+
+    if (io_type != VHD_BDEV_ZONE_RESET_ALL) {
+        if (req->sector >= capacity) {
+            VHD_LOG_ERROR("Zone %" PRIu64 " beyond device capacity %" PRIu64,
+                          req->sector, capacity);
+            goto fail_request;
+        }
+        if (req->sector % zone_sectors(dev)) {
+            VHD_LOG_ERROR("Zone management request to %" PRIu64
+                          " not at a zone start", req->sector);
+            status = VIRTIO_BLK_S_ZONE_INVALID_CMD;
+            goto fail_request;
+        }
+        sector = req->sector;
+        nsectors = MIN(zone_sectors(dev), capacity - sector);
+    }
+
+    bio = alloc_bio(dev, vq, iov, io_type, sector, nsectors);
+
+    if (!bio_submit(bio)) {
+        status = VIRTIO_BLK_S_IOERR;
+        goto fail_request;
+    }
+
+    /* request will be completed asynchronously */
+    return;
+
+fail_request:
+    complete_req(vq, iov, status);
+}
+
 static void handle_inout(struct virtio_blk_dev *dev,
-                         struct virtio_blk_req_hdr *req,
+                         const struct virtio_blk_req_hdr *req,
                          struct virtio_virtq *vq,
                          struct virtio_iov *iov)
 {
     size_t len;
-    uint16_t ndatabufs;
-    struct vhd_buffer *pdata;
+    struct vhd_buffer *data_bufs;
+    uint16_t ndata_bufs;
+    size_t data_off;
     enum vhd_bdev_io_type io_type;
+    uint8_t status = VIRTIO_BLK_S_IOERR;
 
+    /* the data is between the header and the status, see handle_buffers() */
     if (req->type == VIRTIO_BLK_T_IN) {
         io_type = VHD_BDEV_READ;
-        pdata = &iov->iov_in[0];
-        ndatabufs = iov->niov_in - 1;
+        data_bufs = iov->iov_in;
+        ndata_bufs = iov->niov_in;
+        data_off = 0;
+        len = virtio_buffers_size(data_bufs, ndata_bufs) -
+              VIRTIO_BLK_STATUS_LENGTH;
     } else {
         if (virtio_blk_is_readonly(dev)) {
             VHD_LOG_ERROR("Write request to readonly device");
             goto fail_request;
         }
-        io_type = VHD_BDEV_WRITE;
-        pdata = &iov->iov_out[1];
-        ndatabufs = iov->niov_out - 1;
+        io_type = req->type == VIRTIO_BLK_T_ZONE_APPEND ?
+            VHD_BDEV_ZONE_APPEND : VHD_BDEV_WRITE;
+        data_bufs = iov->iov_out;
+        ndata_bufs = iov->niov_out;
+        data_off = sizeof(*req);
+        len = virtio_buffers_size(data_bufs, ndata_bufs) - sizeof(*req);
     }
 
-    len = iov_size(pdata, ndatabufs);
-
     if (!is_valid_req(req->sector, len, dev->config.capacity)) {
         goto fail_request;
     }
 
-    struct virtio_blk_io *bio = vhd_zalloc(sizeof(*bio));
-    bio->vq = vq;
-    bio->iov = iov;
-    bio->io.completion_handler = complete_io;
+    if (io_type == VHD_BDEV_ZONE_APPEND) {
+        status = check_zone_append(dev, req->sector, len);
+        if (status != VIRTIO_BLK_S_OK) {
+            goto fail_request;
+        }
+    }
 
-    bio->bdev_io.type = io_type;
-    bio->bdev_io.first_sector = req->sector;
-    bio->bdev_io.total_sectors = len / VIRTIO_BLK_SECTOR_SIZE;
-    bio->bdev_io.sglist.nbuffers = ndatabufs;
-    bio->bdev_io.sglist.buffers = pdata;
+    struct virtio_blk_io *bio = alloc_bio(dev, vq, iov, io_type, req->sector,
+                                          len / VIRTIO_BLK_SECTOR_SIZE);
+    bio->data_slice = buffers_slice(&bio->bdev_io.sglist, data_bufs,
+                                    ndata_bufs, data_off, len);
+
+    if (unlikely(dev->streams) && io_type == VHD_BDEV_READ) {
+        virtio_blk_streams_read(dev->streams, bio_vring_idx(bio),
+                                &bio->bdev_io, dev->config.capacity);
+    }
 
     if (!bio_submit(bio)) {
+        status = VIRTIO_BLK_S_IOERR;
         goto fail_request;
     }
 
@@ -166,7 +1462,7 @@ static void handle_inout(struct virtio_blk_dev *dev,
     return;
 
 fail_request:
-    complete_req(vq, iov, VIRTIO_BLK_S_IOERR);
+    complete_req(vq, iov, status);
 }
 
 static void handle_discard_or_write_zeroes(struct virtio_blk_dev *dev,
@@ -174,6 +1470,8 @@ static void handle_discard_or_write_zeroes(struct virtio_blk_dev *dev,
                                            struct virtio_virtq *vq,
                                            struct virtio_iov *iov)
 {
+    size_t len = virtio_buffers_size(iov->iov_out, iov->niov_out) -
+                 sizeof(struct virtio_blk_req_hdr);
     struct virtio_blk_discard_write_zeroes seg;
     struct virtio_blk_io *bio;
     enum vhd_bdev_io_type io_type;
@@ -191,21 +1489,15 @@ static void handle_discard_or_write_zeroes(struct virtio_blk_dev *dev,
      * The data used for discard, secure erase or write zeroes commands
      * consists of one or more segments. We support only one at the moment.
      */
-    if (iov->niov_out != 2) {
-        VHD_LOG_ERROR("Invalid number of segments for a "
-                      "%s request %"PRIu16,
-                      type_str, iov->niov_out);
-        goto fail_request;
-    }
-
-    if (iov->iov_out[1].len != sizeof(seg)) {
+    if (len != sizeof(seg)) {
         VHD_LOG_ERROR("Invalid %s segment size: "
                       "expected %zu, got %zu!", type_str,
-                      sizeof(seg), iov->iov_out[1].len);
+                      sizeof(seg), len);
         goto fail_request;
     }
 
-    memcpy(&seg, iov->iov_out[1].base, sizeof(seg));
+    virtio_buffers_read(iov->iov_out, iov->niov_out,
+                        sizeof(struct virtio_blk_req_hdr), &seg, sizeof(seg));
     if (!is_valid_block_range_req(seg.sector, seg.num_sectors,
                                   dev->config.capacity)) {
         goto fail_request;
@@ -242,13 +1534,7 @@ static void handle_discard_or_write_zeroes(struct virtio_blk_dev *dev,
         goto fail_request;
     }
 
-    bio = vhd_zalloc(sizeof(*bio));
-    bio->vq = vq;
-    bio->iov = iov;
-    bio->io.completion_handler = complete_io;
-    bio->bdev_io.type = io_type;
-    bio->bdev_io.first_sector = seg.sector;
-    bio->bdev_io.total_sectors = seg.num_sectors;
+    bio = alloc_bio(dev, vq, iov, io_type, seg.sector, seg.num_sectors);
 
     if (!bio_submit(bio)) {
         goto fail_request;
@@ -264,23 +1550,18 @@ fail_request:
 static uint8_t handle_getid(struct virtio_blk_dev *dev,
                             struct virtio_iov *iov)
 {
-    if (iov->niov_in != 2) {
-        VHD_LOG_ERROR("Bad number of IN segments %u in request", iov->niov_in);
-        return VIRTIO_BLK_S_IOERR;
-    }
+    size_t len = virtio_buffers_size(iov->iov_in, iov->niov_in) -
+                 VIRTIO_BLK_STATUS_LENGTH;
+    char id[VIRTIO_BLK_DISKID_LENGTH] = {};
 
-    struct vhd_buffer *id_buf = &iov->iov_in[0];
-
-    if (id_buf->len != VIRTIO_BLK_DISKID_LENGTH) {
-        VHD_LOG_ERROR("Bad id buffer (len %zu)", id_buf->len);
+    if (len != VIRTIO_BLK_DISKID_LENGTH) {
+        VHD_LOG_ERROR("Bad id buffer (len %zu)", len);
         return VIRTIO_BLK_S_IOERR;
     }
 
-    /*
-     * strncpy will not add a null-term if src length is >= desc->len, which is
-     * what we need
-     */
-    strncpy((char *) id_buf->base, dev->serial, id_buf->len);
+    /* no null-term if the serial takes up the whole id, which is what we need */
+    memcpy(id, dev->serial, strnlen(dev->serial, sizeof(id)));
+    virtio_buffers_write(iov->iov_in, iov->niov_in, 0, id, sizeof(id));
 
     return VIRTIO_BLK_S_OK;
 }
@@ -300,6 +1581,15 @@ static bool dev_supports_req(struct virtio_blk_dev *dev, le32 type)
     case VIRTIO_BLK_T_WRITE_ZEROES:
         feature = VIRTIO_BLK_F_WRITE_ZEROES;
         break;
+    case VIRTIO_BLK_T_ZONE_APPEND:
+    case VIRTIO_BLK_T_ZONE_REPORT:
+    case VIRTIO_BLK_T_ZONE_OPEN:
+    case VIRTIO_BLK_T_ZONE_CLOSE:
+    case VIRTIO_BLK_T_ZONE_FINISH:
+    case VIRTIO_BLK_T_ZONE_RESET:
+    case VIRTIO_BLK_T_ZONE_RESET_ALL:
+        feature = VIRTIO_BLK_F_ZONED;
+        break;
     default:
         return false;
     }
@@ -312,32 +1602,40 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq,
 {
     uint8_t status;
     struct virtio_blk_dev *dev = arg;
-    struct virtio_blk_req_hdr *req;
+    struct virtio_blk_req_hdr req;
     le32 type;
+    size_t in_len;
 
     /*
-     * Assume legacy message framing without VIRTIO_F_ANY_LAYOUT:
-     * - one 16-byte device-readable segment for header
-     * - data segments
-     * - one 1-byte device-writable segment for status
-     * FIXME: get rid of this assumption and support VIRTIO_F_ANY_LAYOUT
+     * Message framing is up to the driver (VIRTIO_F_ANY_LAYOUT, implied by
+     * VIRTIO_F_VERSION_1), so descriptor boundaries carry no meaning:
+     * - the device-readable area starts with the 16-byte header, followed by
+     *   the data for writes
+     * - the device-writable area ends with the status byte, preceded by the
+     *   data for reads; for zone appends it's only the appended sector at
+     *   its start and the status at its end
+     * Whatever shares a descriptor with the header or the status is trimmed
+     * off when handed over to the backend.
      */
 
-    if (!iov->niov_in || iov->iov_in[iov->niov_in - 1].len != 1) {
-        VHD_LOG_ERROR("No room for status response in the request");
+    if (virtio_buffers_size(iov->iov_out, iov->niov_out) < sizeof(req)) {
+        VHD_LOG_ERROR("Malformed request header");
         abort_request(vq, iov);
         return;
     }
 
-    if (!iov->niov_out || iov->iov_out[0].len != sizeof(*req)) {
-        VHD_LOG_ERROR("Malformed request header");
+    virtio_buffers_read(iov->iov_out, iov->niov_out, 0, &req, sizeof(req));
+    type = req.type;
+
+    in_len = virtio_buffers_size(iov->iov_in, iov->niov_in);
+    if (type == VIRTIO_BLK_T_ZONE_APPEND ?
+        in_len < sizeof(struct virtio_blk_zone_append_inhdr) :
+        in_len < VIRTIO_BLK_STATUS_LENGTH) {
+        VHD_LOG_ERROR("No room for status response in the request");
         abort_request(vq, iov);
         return;
     }
 
-    req = iov->iov_out[0].base;
-    type = req->type;
-
     if (!dev_supports_req(dev, type)) {
         VHD_LOG_WARN("Unknown or unsupported request type %"PRIu32, type);
         status = VIRTIO_BLK_S_UNSUPP;
@@ -347,7 +1645,8 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq,
     switch (type) {
     case VIRTIO_BLK_T_IN:
     case VIRTIO_BLK_T_OUT:
-        handle_inout(dev, req, vq, iov);
+    case VIRTIO_BLK_T_ZONE_APPEND:
+        handle_inout(dev, &req, vq, iov);
         return;         /* async completion */
     case VIRTIO_BLK_T_GET_ID:
         status = handle_getid(dev, iov);
@@ -356,6 +1655,16 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq,
     case VIRTIO_BLK_T_WRITE_ZEROES:
         handle_discard_or_write_zeroes(dev, type, vq, iov);
         return;         /* async completion */
+    case VIRTIO_BLK_T_ZONE_REPORT:
+        handle_zone_report(dev, &req, vq, iov);
+        return;         /* async completion */
+    case VIRTIO_BLK_T_ZONE_OPEN:
+    case VIRTIO_BLK_T_ZONE_CLOSE:
+    case VIRTIO_BLK_T_ZONE_FINISH:
+    case VIRTIO_BLK_T_ZONE_RESET:
+    case VIRTIO_BLK_T_ZONE_RESET_ALL:
+        handle_zone_mgmt(dev, &req, vq, iov);
+        return;         /* async completion */
     default:  /* unreachable because of dev_supports_req() */
         VHD_UNREACHABLE();
     };
@@ -375,8 +1684,19 @@ int virtio_blk_dispatch_requests(struct virtio_blk_dev *dev,
 __attribute__((weak))
 int virtio_blk_handle_request(struct virtio_virtq *vq, struct vhd_io *io)
 {
+    struct vhd_request_queue *rq;
+    struct vhd_shm_channel *ch;
+
     io->vring = VHD_VRING_FROM_VQ(vq);
-    return vhd_enqueue_request(vhd_get_rq_for_vring(io->vring), io);
+    rq = vhd_get_rq_for_vring(io->vring);
+
+    ch = vhd_rq_get_shm_channel(rq);
+    if (ch) {
+        vhd_shm_channel_submit(ch, io, vq->mm);
+        return 0;
+    }
+
+    return vhd_enqueue_request(rq, io);
 }
 
 size_t virtio_blk_get_config(struct virtio_blk_dev *dev, void *cfgbuf,
@@ -462,6 +1782,39 @@ void virtio_blk_init_dev(
     uint8_t phys_block_exp = vhd_find_first_bit32(phys_block_sectors);
 
     dev->serial = vhd_strdup(bdev->serial);
+    dev->trace = virtio_blk_trace_new(bdev->num_queues);
+    dev->builtin = NULL;
+    dev->faults = NULL;
+    pthread_mutex_init(&dev->faults_lock, NULL);
+
+    dev->order_overlapping_writes = bdev->order_overlapping_writes;
+    pthread_mutex_init(&dev->order_lock, NULL);
+    vhd_interval_tree_init(&dev->order_writes);
+    TAILQ_INIT(&dev->order_held);
+    dev->order_seq = 0;
+
+    dev->read_domain = NULL;
+    if (bdev->backing_id) {
+        dev->read_domain = virtio_blk_read_domain_get(bdev->backing_id);
+    }
+
+    dev->streams = NULL;
+    if (bdev->readahead_max_sectors) {
+        dev->streams = virtio_blk_streams_new(bdev->num_queues,
+                                              bdev->readahead_max_sectors);
+    }
+
+    dev->zeroes = NULL;
+    dev->discard_zeroes = bdev->zeroes.discard_zeroes;
+    if (bdev->zeroes.enabled) {
+        dev->zeroes = virtio_blk_zeroes_new(bdev->zeroes.ranges,
+                                            bdev->zeroes.num_ranges);
+    }
+
+    dev->rmw = NULL;
+    if (bdev->align_to_blocks && phys_block_sectors > 1) {
+        dev->rmw = virtio_blk_rmw_new(phys_block_sectors);
+    }
 
     dev->features = VIRTIO_BLK_DEFAULT_FEATURES;
     if (vhd_blockdev_is_readonly(bdev)) {
@@ -473,6 +1826,12 @@ void virtio_blk_init_dev(
     if (vhd_blockdev_has_write_zeroes(bdev)) {
         dev->features |= (1ull << VIRTIO_BLK_F_WRITE_ZEROES);
     }
+    if (vhd_blockdev_is_zoned(bdev)) {
+        dev->features |= (1ull << VIRTIO_BLK_F_ZONED);
+    }
+    if (vhd_blockdev_is_in_order(bdev)) {
+        dev->features |= (1ull << VIRTIO_F_IN_ORDER);
+    }
 
     /*
      * Both virtio and block backend use the same sector size of 512.  Don't
@@ -515,13 +1874,104 @@ void virtio_blk_init_dev(
      * we have to use it to provide migration compatibility between virtio-blk
      * and vhost-user-blk in both directions.
      */
-    dev->config.seg_max = 128 - 2;
+    dev->config.seg_max = VIRTIO_BLK_QUEUE_SIZE - 2;
+
+    if (vhd_blockdev_is_zoned(bdev)) {
+        const struct vhd_bdev_zoned_info *zoned = &bdev->zoned;
+
+        dev->config.zoned.zone_sectors = zoned->zone_sectors;
+        dev->config.zoned.max_open_zones = zoned->max_open_zones;
+        dev->config.zoned.max_active_zones = zoned->max_active_zones;
+        dev->config.zoned.max_append_sectors =
+            zoned->max_append_sectors ?: zoned->zone_sectors;
+        dev->config.zoned.write_granularity =
+            zoned->write_granularity ?: bdev->block_size;
+        dev->config.zoned.model =
+            zoned->model == VHD_BDEV_ZONED_HOST_MANAGED ? VIRTIO_BLK_Z_HM :
+                                                          VIRTIO_BLK_Z_HA;
+    }
 
     refresh_config_geometry(&dev->config);
 }
 
+int virtio_blk_start_trace(struct virtio_blk_dev *dev, const char *path)
+{
+    return virtio_blk_trace_start(dev->trace, path, dev->config.capacity);
+}
+
+void virtio_blk_stop_trace(struct virtio_blk_dev *dev)
+{
+    virtio_blk_trace_stop(dev->trace);
+}
+
+int virtio_blk_set_faults(struct virtio_blk_dev *dev,
+                          const struct vhd_fault_config *conf)
+{
+    struct virtio_blk_faults *faults = NULL, *old;
+
+    if (conf) {
+        faults = virtio_blk_faults_new(conf, dev->config.numqueues);
+        if (!faults) {
+            return -EINVAL;
+        }
+    }
+
+    pthread_mutex_lock(&dev->faults_lock);
+    old = dev->faults;
+    if (faults && old) {
+        virtio_blk_faults_inherit_stalls(faults, old);
+    }
+    catomic_set(&dev->faults, faults);
+    pthread_mutex_unlock(&dev->faults_lock);
+
+    /* the requests in flight may still hold it */
+    if (old) {
+        virtio_blk_faults_unref(old);
+    }
+    return 0;
+}
+
+int virtio_blk_stall_vring(struct virtio_blk_dev *dev, uint32_t vring,
+                           uint64_t until_ns)
+{
+    static const struct vhd_fault_config no_faults;
+
+    if (vring >= dev->config.numqueues) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&dev->faults_lock);
+    if (!dev->faults) {
+        catomic_set(&dev->faults,
+                    virtio_blk_faults_new(&no_faults, dev->config.numqueues));
+    }
+    virtio_blk_faults_stall(dev->faults, vring, until_ns);
+    pthread_mutex_unlock(&dev->faults_lock);
+    return 0;
+}
+
 void virtio_blk_destroy_dev(struct virtio_blk_dev *dev)
 {
+    virtio_blk_trace_free(dev->trace);
+    if (dev->faults) {
+        virtio_blk_faults_unref(dev->faults);
+    }
+    pthread_mutex_destroy(&dev->faults_lock);
+    VHD_ASSERT(vhd_interval_tree_empty(&dev->order_writes));
+    VHD_ASSERT(TAILQ_EMPTY(&dev->order_held));
+    pthread_mutex_destroy(&dev->order_lock);
+    if (dev->read_domain) {
+        virtio_blk_read_domain_put(dev->read_domain);
+    }
+    if (dev->streams) {
+        virtio_blk_streams_free(dev->streams);
+    }
+    if (dev->zeroes) {
+        virtio_blk_zeroes_free(dev->zeroes);
+    }
+    if (dev->rmw) {
+        virtio_blk_rmw_free(dev->rmw);
+    }
     vhd_free(dev->serial);
     dev->serial = NULL;
 }
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <pthread.h>
+
 #include "virtio_blk_spec.h"
+#include "interval_tree.h"
+#include "queue.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define VIRTIO_BLK_DEFAULT_FEATURES ((uint64_t)( \
+    (1UL << VIRTIO_F_ANY_LAYOUT) | \
     (1UL << VIRTIO_F_RING_INDIRECT_DESC) | \
     (1UL << VIRTIO_F_RING_EVENT_IDX) | \
     (1UL << VIRTIO_F_VERSION_1) | \
@@ -21,6 +26,12 @@ extern "C" {
      * (1UL << VIRTIO_BLK_F_SIZE_MAX) | \
      */
 
+/*
+ * The queue size seg_max is chosen for, and the one offered where the device
+ * sets it, i.e. over VDUSE; over vhost-user the driver picks it.
+ */
+#define VIRTIO_BLK_QUEUE_SIZE 128
+
 /*
  * Same as QEMU:
  * We support only one segment per request since multiple segments
@@ -39,10 +50,15 @@ extern "C" {
 #define VIRTIO_BLK_MAX_WRITE_ZEROES_SECTORS UINT32_MAX
 
 struct vhd_bdev_info;
+struct vhd_fault_config;
 struct vhd_io;
 
 struct virtio_virtq;
 struct virtio_blk_dev;
+struct virtio_blk_read_domain;
+struct virtio_blk_rmw;
+struct virtio_blk_streams;
+struct virtio_blk_zeroes;
 
 /**
  * Virtio block I/O dispatch function,
@@ -61,6 +77,38 @@ struct virtio_blk_dev {
 
     /* blk config data generated on init from bdev */
     struct virtio_blk_config config;
+
+    /* I/O trace recorder, idle unless started */
+    struct virtio_blk_trace *trace;
+
+    /* built-in backend serving the requests instead of the client, if any */
+    struct vhd_bdev_builtin *builtin;
+    /* fault injector the requests go through, if any */
+    struct virtio_blk_faults *faults;
+    pthread_mutex_t faults_lock;
+
+    /*
+     * Writes in flight and the requests held behind them, if the device
+     * orders overlapping writes
+     */
+    bool order_overlapping_writes;
+    pthread_mutex_t order_lock;
+    struct vhd_interval_tree order_writes;
+    TAILQ_HEAD(, virtio_blk_io) order_held;
+    uint64_t order_seq;
+
+    /* reads in flight shared with the devices of the same backing, if any */
+    struct virtio_blk_read_domain *read_domain;
+
+    /* sequential read detection for readahead hints, if enabled */
+    struct virtio_blk_streams *streams;
+
+    /* ranges known to read as zeroes, if tracked */
+    struct virtio_blk_zeroes *zeroes;
+    bool discard_zeroes;
+
+    /* read-modify-write of the partial blocks, if aligning to blocks */
+    struct virtio_blk_rmw *rmw;
 };
 
 /**
@@ -81,6 +129,28 @@ void virtio_blk_destroy_dev(struct virtio_blk_dev *dev);
 int virtio_blk_dispatch_requests(struct virtio_blk_dev *dev,
                                  struct virtio_virtq *vq);
 
+/**
+ * Start recording the device I/O trace to @path
+ */
+int virtio_blk_start_trace(struct virtio_blk_dev *dev, const char *path);
+
+/**
+ * Stop recording the device I/O trace
+ */
+void virtio_blk_stop_trace(struct virtio_blk_dev *dev);
+
+/**
+ * Inject faults per @conf into the device requests, or stop if @conf is NULL
+ */
+int virtio_blk_set_faults(struct virtio_blk_dev *dev,
+                          const struct vhd_fault_config *conf);
+
+/**
+ * Stall the requests of vring @vring until @until_ns
+ */
+int virtio_blk_stall_vring(struct virtio_blk_dev *dev, uint32_t vring,
+                           uint64_t until_ns);
+
 /**
  * Get the virtio config
  */
@@ -0,0 +1,158 @@
+/*
+ * Coalescing of concurrent reads of the same data
+ *
+ * Devices sharing the data behind them, e.g. a base image, are given the
+ * same backing identity by the client and share a read domain: an index of
+ * the reads in flight on any of their vrings.  A read fully covered by an
+ * indexed one is attached to it and served from its buffers once it
+ * completes, rather than sent to the backend again.  A write to the range
+ * of an indexed read takes the read out of the index, as the data it
+ * returns may predate the write.
+ */
+
+#include <pthread.h>
+
+#include "virtio_blk_coalesce.h"
+#include "logging.h"
+#include "platform.h"
+
+struct virtio_blk_read_domain {
+    uint64_t backing_id;
+    /* under g_domains_lock */
+    unsigned int refcount;
+    LIST_ENTRY(virtio_blk_read_domain) link;
+
+    pthread_mutex_t lock;
+    struct vhd_interval_tree reads;
+};
+
+static LIST_HEAD(, virtio_blk_read_domain) g_domains =
+    LIST_HEAD_INITIALIZER(g_domains);
+static pthread_mutex_t g_domains_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct virtio_blk_read_domain *virtio_blk_read_domain_get(uint64_t backing_id)
+{
+    struct virtio_blk_read_domain *rd;
+
+    pthread_mutex_lock(&g_domains_lock);
+    LIST_FOREACH(rd, &g_domains, link) {
+        if (rd->backing_id == backing_id) {
+            rd->refcount++;
+            goto out;
+        }
+    }
+
+    rd = vhd_zalloc(sizeof(*rd));
+    rd->backing_id = backing_id;
+    rd->refcount = 1;
+    pthread_mutex_init(&rd->lock, NULL);
+    vhd_interval_tree_init(&rd->reads);
+    LIST_INSERT_HEAD(&g_domains, rd, link);
+
+out:
+    pthread_mutex_unlock(&g_domains_lock);
+    return rd;
+}
+
+void virtio_blk_read_domain_put(struct virtio_blk_read_domain *rd)
+{
+    pthread_mutex_lock(&g_domains_lock);
+    if (--rd->refcount) {
+        pthread_mutex_unlock(&g_domains_lock);
+        return;
+    }
+    LIST_REMOVE(rd, link);
+    pthread_mutex_unlock(&g_domains_lock);
+
+    VHD_ASSERT(vhd_interval_tree_empty(&rd->reads));
+    pthread_mutex_destroy(&rd->lock);
+    vhd_free(rd);
+}
+
+struct covering_lookup {
+    uint64_t start;
+    uint64_t end;
+    struct virtio_blk_inflight_read *found;
+};
+
+static bool find_covering(struct vhd_interval *range, void *opaque)
+{
+    struct covering_lookup *lookup = opaque;
+
+    if (range->start <= lookup->start && range->end >= lookup->end) {
+        lookup->found =
+            containerof(range, struct virtio_blk_inflight_read, range);
+        return false;
+    }
+    return true;
+}
+
+bool virtio_blk_read_domain_attach(struct virtio_blk_read_domain *rd,
+                                   struct virtio_blk_inflight_read *read,
+                                   uint64_t start, uint64_t end)
+{
+    struct covering_lookup lookup = {
+        .start = start,
+        .end = end,
+    };
+
+    SLIST_INIT(&read->waiters);
+    read->range.start = start;
+    read->range.end = end;
+
+    pthread_mutex_lock(&rd->lock);
+    vhd_interval_tree_foreach_overlap(&rd->reads, start, end, find_covering,
+                                      &lookup);
+    if (lookup.found) {
+        SLIST_INSERT_HEAD(&lookup.found->waiters, read, waiter_link);
+        read->indexed = false;
+    } else {
+        vhd_interval_tree_insert(&rd->reads, &read->range);
+        read->indexed = true;
+    }
+    pthread_mutex_unlock(&rd->lock);
+
+    return lookup.found;
+}
+
+static bool collect_overlapping(struct vhd_interval *range, void *opaque)
+{
+    virtio_blk_read_waiters *reads = opaque;
+    struct virtio_blk_inflight_read *read =
+        containerof(range, struct virtio_blk_inflight_read, range);
+
+    /* the waiter link is free while the read is indexed */
+    SLIST_INSERT_HEAD(reads, read, waiter_link);
+    return true;
+}
+
+void virtio_blk_read_domain_invalidate(struct virtio_blk_read_domain *rd,
+                                       uint64_t start, uint64_t end)
+{
+    virtio_blk_read_waiters reads = SLIST_HEAD_INITIALIZER(reads);
+    struct virtio_blk_inflight_read *read;
+
+    pthread_mutex_lock(&rd->lock);
+    vhd_interval_tree_foreach_overlap(&rd->reads, start, end,
+                                      collect_overlapping, &reads);
+    while ((read = SLIST_FIRST(&reads))) {
+        SLIST_REMOVE_HEAD(&reads, waiter_link);
+        vhd_interval_tree_remove(&rd->reads, &read->range);
+        read->indexed = false;
+    }
+    pthread_mutex_unlock(&rd->lock);
+}
+
+void virtio_blk_read_domain_finish(struct virtio_blk_read_domain *rd,
+                                   struct virtio_blk_inflight_read *read,
+                                   virtio_blk_read_waiters *waiters)
+{
+    pthread_mutex_lock(&rd->lock);
+    if (read->indexed) {
+        vhd_interval_tree_remove(&rd->reads, &read->range);
+        read->indexed = false;
+    }
+    *waiters = read->waiters;
+    SLIST_INIT(&read->waiters);
+    pthread_mutex_unlock(&rd->lock);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interval_tree.h"
+#include "queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct virtio_blk_read_domain;
+
+typedef SLIST_HEAD(, virtio_blk_inflight_read) virtio_blk_read_waiters;
+
+/**
+ * Read in flight on a device with a backing identity, either sent to the
+ * backend or waiting for another read to serve it
+ */
+struct virtio_blk_inflight_read {
+    struct vhd_interval range;
+    /* other reads may still attach to this one */
+    bool indexed;
+
+    virtio_blk_read_waiters waiters;
+    SLIST_ENTRY(virtio_blk_inflight_read) waiter_link;
+};
+
+/**
+ * Get the domain of the devices with the backing identity @backing_id,
+ * creating it for the first device
+ */
+struct virtio_blk_read_domain *virtio_blk_read_domain_get(uint64_t backing_id);
+
+void virtio_blk_read_domain_put(struct virtio_blk_read_domain *rd);
+
+/**
+ * Attach the read @read of [@start, @end) to a read in flight in the domain
+ * covering the whole range and return true, or make it available to the
+ * later reads and return false if there is none.
+ */
+bool virtio_blk_read_domain_attach(struct virtio_blk_read_domain *rd,
+                                   struct virtio_blk_inflight_read *read,
+                                   uint64_t start, uint64_t end);
+
+/**
+ * A write of [@start, @end) is about to be sent to the backend: the reads in
+ * flight overlapping it may return stale data and are not to take any more
+ * waiters.
+ */
+void virtio_blk_read_domain_invalidate(struct virtio_blk_read_domain *rd,
+                                       uint64_t start, uint64_t end);
+
+/**
+ * The read @read is done; stop attaching reads to it and move the ones
+ * attached to @waiters.
+ */
+void virtio_blk_read_domain_finish(struct virtio_blk_read_domain *rd,
+                                   struct virtio_blk_inflight_read *read,
+                                   virtio_blk_read_waiters *waiters);
+
+#ifdef __cplusplus
+}
+#endif
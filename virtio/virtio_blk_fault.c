@@ -0,0 +1,205 @@
+/*
+ * Fault and latency injection for virtio-blk requests
+ *
+ * The injector only makes the decisions; virtio_blk.c holds the requests on
+ * the request queue timers and fails them.  Each vring is served by a single
+ * request queue, so the per-vring random generators need no locking, and the
+ * sequence of faults only depends on the seed and the order of the requests
+ * on the vring.
+ */
+
+#include <inttypes.h>
+
+#include "vhost/blockdev.h"
+
+#include "virtio_blk_fault.h"
+#include "catomic.h"
+#include "logging.h"
+#include "objref.h"
+#include "platform.h"
+
+#define NSEC_PER_USEC   1000ull
+#define LN2             0.69314718055994530942
+
+struct fault_vring {
+    uint64_t rng;
+    /* set by vhd_blockdev_stall_vring() in any thread */
+    uint64_t stall_until_ns;
+};
+
+struct virtio_blk_faults {
+    struct objref ref;
+    struct vhd_fault_config conf;
+    uint16_t num_vrings;
+    struct fault_vring vrings[];
+};
+
+/* splitmix64: tiny state, good enough statistics, cheap to seed per vring */
+static uint64_t rng_next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static bool rng_chance_ppm(uint64_t *state, uint32_t ppm)
+{
+    return ppm && rng_next(state) % VHD_FAULT_PPM_MAX < ppm;
+}
+
+/*
+ * -ln(u) for a uniform u in (0, 1], drawn from 53 random bits.  Written out
+ * with the atanh series rather than pulling in libm; the error is within
+ * 1e-6, way below the timer resolution.
+ */
+static double rng_neg_log_unit(uint64_t *state)
+{
+    uint64_t x = (rng_next(state) >> 11) + 1;
+    int k = 63 - __builtin_clzll(x);
+    double m = (double)x / (double)(1ull << k);
+    double z = (m - 1) / (m + 1);
+    double z2 = z * z;
+    double ln_m = 2 * z * (1 + z2 * (1. / 3 + z2 * (1. / 5 + z2 *
+                                     (1. / 7 + z2 * (1. / 9)))));
+
+    /* u = x / 2^53 = m * 2^(k - 53) */
+    return (53 - k) * LN2 - ln_m;
+}
+
+static uint64_t draw_delay_ns(uint64_t *state,
+                              const struct vhd_fault_delay *delay)
+{
+    switch (delay->type) {
+    case VHD_FAULT_DELAY_FIXED:
+        return delay->us * NSEC_PER_USEC;
+    case VHD_FAULT_DELAY_EXPONENTIAL:
+        return delay->us * NSEC_PER_USEC * rng_neg_log_unit(state);
+    case VHD_FAULT_DELAY_BIMODAL:
+        return (rng_chance_ppm(state, delay->slow_ppm) ? delay->slow_us :
+                                                         delay->us) *
+               NSEC_PER_USEC;
+    default:
+        return 0;
+    }
+}
+
+static bool delay_valid(const struct vhd_fault_delay *delay)
+{
+    return delay->type <= VHD_FAULT_DELAY_BIMODAL &&
+           delay->slow_ppm <= VHD_FAULT_PPM_MAX;
+}
+
+static void faults_release(struct objref *objref)
+{
+    struct virtio_blk_faults *faults =
+        containerof(objref, struct virtio_blk_faults, ref);
+
+    vhd_free(faults);
+}
+
+struct virtio_blk_faults *virtio_blk_faults_new(
+    const struct vhd_fault_config *conf, uint16_t num_vrings)
+{
+    struct virtio_blk_faults *faults;
+    uint16_t i;
+
+    if (!delay_valid(&conf->submit_delay) ||
+        !delay_valid(&conf->complete_delay)) {
+        VHD_LOG_ERROR("Invalid fault injection delay");
+        return NULL;
+    }
+
+    for (i = 0; i < countof(conf->error_ppm); i++) {
+        if (conf->error_ppm[i] > VHD_FAULT_PPM_MAX) {
+            VHD_LOG_ERROR("Invalid fault injection error rate %" PRIu32,
+                          conf->error_ppm[i]);
+            return NULL;
+        }
+    }
+
+    faults = vhd_zalloc(sizeof(*faults) +
+                        num_vrings * sizeof(faults->vrings[0]));
+    objref_init(&faults->ref, faults_release);
+    faults->conf = *conf;
+    faults->num_vrings = num_vrings;
+
+    for (i = 0; i < num_vrings; i++) {
+        /* decorrelate the vrings while keeping them reproducible */
+        uint64_t seed = conf->seed ^ ((uint64_t)i << 32);
+        faults->vrings[i].rng = rng_next(&seed);
+    }
+
+    return faults;
+}
+
+void virtio_blk_faults_ref(struct virtio_blk_faults *faults)
+{
+    objref_get(&faults->ref);
+}
+
+void virtio_blk_faults_unref(struct virtio_blk_faults *faults)
+{
+    objref_put(&faults->ref);
+}
+
+void virtio_blk_faults_inherit_stalls(struct virtio_blk_faults *faults,
+                                      struct virtio_blk_faults *old)
+{
+    uint16_t i;
+
+    for (i = 0; i < MIN(faults->num_vrings, old->num_vrings); i++) {
+        catomic_set(&faults->vrings[i].stall_until_ns,
+                    catomic_read(&old->vrings[i].stall_until_ns));
+    }
+}
+
+void virtio_blk_faults_stall(struct virtio_blk_faults *faults, uint16_t vring,
+                             uint64_t until_ns)
+{
+    VHD_ASSERT(vring < faults->num_vrings);
+    catomic_set(&faults->vrings[vring].stall_until_ns, until_ns);
+}
+
+static uint64_t stall_delay_ns(struct fault_vring *fv, uint64_t now_ns)
+{
+    uint64_t until_ns = catomic_read(&fv->stall_until_ns);
+
+    return until_ns > now_ns ? until_ns - now_ns : 0;
+}
+
+bool virtio_blk_faults_submit(struct virtio_blk_faults *faults, uint16_t vring,
+                              int type, uint64_t now_ns, uint64_t *delay_ns)
+{
+    struct fault_vring *fv;
+
+    if (vring >= faults->num_vrings) {
+        *delay_ns = 0;
+        return false;
+    }
+    fv = &faults->vrings[vring];
+
+    if (type >= 0 && type < (int)countof(faults->conf.error_ppm) &&
+        rng_chance_ppm(&fv->rng, faults->conf.error_ppm[type])) {
+        return true;
+    }
+
+    *delay_ns = MAX(draw_delay_ns(&fv->rng, &faults->conf.submit_delay),
+                    stall_delay_ns(fv, now_ns));
+    return false;
+}
+
+uint64_t virtio_blk_faults_complete(struct virtio_blk_faults *faults,
+                                    uint16_t vring, uint64_t now_ns)
+{
+    struct fault_vring *fv;
+
+    if (vring >= faults->num_vrings) {
+        return 0;
+    }
+    fv = &faults->vrings[vring];
+
+    return MAX(draw_delay_ns(&fv->rng, &faults->conf.complete_delay),
+               stall_delay_ns(fv, now_ns));
+}
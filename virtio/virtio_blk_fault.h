@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct virtio_blk_faults;
+struct vhd_fault_config;
+
+/**
+ * Create a fault injector per @conf for a device with @num_vrings vrings.
+ * Returns NULL if the config is invalid.
+ */
+struct virtio_blk_faults *virtio_blk_faults_new(
+    const struct vhd_fault_config *conf, uint16_t num_vrings);
+
+void virtio_blk_faults_ref(struct virtio_blk_faults *faults);
+void virtio_blk_faults_unref(struct virtio_blk_faults *faults);
+
+/**
+ * Carry the vring stalls in progress over from @old to @faults
+ */
+void virtio_blk_faults_inherit_stalls(struct virtio_blk_faults *faults,
+                                      struct virtio_blk_faults *old);
+
+/**
+ * Hold the requests of vring @vring until @until_ns; thread-safe
+ */
+void virtio_blk_faults_stall(struct virtio_blk_faults *faults, uint16_t vring,
+                             uint64_t until_ns);
+
+/**
+ * Decide the fate of a request of type @type submitted on vring @vring at
+ * @now_ns: returns true if it's to fail without reaching the backend,
+ * otherwise sets @delay_ns to hold it for.  Only to be called in the request
+ * queue thread of the vring.
+ */
+bool virtio_blk_faults_submit(struct virtio_blk_faults *faults, uint16_t vring,
+                              int type, uint64_t now_ns, uint64_t *delay_ns);
+
+/**
+ * Delay to hold a request completed on vring @vring at @now_ns for before
+ * returning it to the guest.  Same threading rules as above.
+ */
+uint64_t virtio_blk_faults_complete(struct virtio_blk_faults *faults,
+                                    uint16_t vring, uint64_t now_ns);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Read-modify-write of the partial blocks for block-aligned backends
+ *
+ * A write covering a block only partly is turned into a read of the whole
+ * block, the merge of the guest data into it, and a write of the whole block
+ * back.  The data read is only good until another write to the block lands,
+ * so such a write waits for any earlier write to its blocks, and any later
+ * write to them waits for it.  Plain writes of whole blocks don't wait for
+ * each other, as the backend sees them just as the guest sent them.
+ *
+ * The blocks read and written back live in bounce buffers from a per-device
+ * pool, which keeps the ones freed up to a limit for the next requests.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "vhost/blockdev.h"
+
+#include "virtio_blk_rmw.h"
+#include "logging.h"
+#include "platform.h"
+
+#define RMW_POOL_MAX_BLOCKS 256
+
+struct pool_block {
+    SLIST_ENTRY(pool_block) link;
+};
+
+struct virtio_blk_rmw {
+    uint32_t block_sectors;
+
+    pthread_mutex_t lock;
+    struct vhd_interval_tree writes;
+    virtio_blk_rmw_held held;
+    uint64_t seq;
+
+    SLIST_HEAD(, pool_block) free_blocks;
+    uint32_t num_free_blocks;
+};
+
+struct virtio_blk_rmw *virtio_blk_rmw_new(uint32_t block_sectors)
+{
+    struct virtio_blk_rmw *rmw = vhd_zalloc(sizeof(*rmw));
+
+    rmw->block_sectors = block_sectors;
+    pthread_mutex_init(&rmw->lock, NULL);
+    vhd_interval_tree_init(&rmw->writes);
+    TAILQ_INIT(&rmw->held);
+    SLIST_INIT(&rmw->free_blocks);
+    return rmw;
+}
+
+void virtio_blk_rmw_free(struct virtio_blk_rmw *rmw)
+{
+    struct pool_block *block;
+
+    VHD_ASSERT(vhd_interval_tree_empty(&rmw->writes));
+
+    while ((block = SLIST_FIRST(&rmw->free_blocks))) {
+        SLIST_REMOVE_HEAD(&rmw->free_blocks, link);
+        free(block);
+    }
+
+    pthread_mutex_destroy(&rmw->lock);
+    vhd_free(rmw);
+}
+
+uint32_t virtio_blk_rmw_block_sectors(struct virtio_blk_rmw *rmw)
+{
+    return rmw->block_sectors;
+}
+
+static bool rmw_earlier_conflict(struct vhd_interval *range, void *opaque)
+{
+    struct virtio_blk_rmw_write *write = opaque;
+    struct virtio_blk_rmw_write *other =
+        containerof(range, struct virtio_blk_rmw_write, range);
+
+    /* stop at the first one */
+    return other->seq >= write->seq || (!other->rmw && !write->rmw);
+}
+
+static bool rmw_blocked(struct virtio_blk_rmw *rmw,
+                        struct virtio_blk_rmw_write *write)
+{
+    return !vhd_interval_tree_foreach_overlap(&rmw->writes,
+                                              write->range.start,
+                                              write->range.end,
+                                              rmw_earlier_conflict, write);
+}
+
+bool virtio_blk_rmw_write_start(struct virtio_blk_rmw *rmw,
+                                struct virtio_blk_rmw_write *write,
+                                uint64_t start, uint64_t end, bool is_rmw)
+{
+    write->range.start = start;
+    write->range.end = end;
+    write->rmw = is_rmw;
+
+    pthread_mutex_lock(&rmw->lock);
+    write->seq = ++rmw->seq;
+    vhd_interval_tree_insert(&rmw->writes, &write->range);
+    write->held = rmw_blocked(rmw, write);
+    if (write->held) {
+        TAILQ_INSERT_TAIL(&rmw->held, write, held_link);
+    }
+    pthread_mutex_unlock(&rmw->lock);
+
+    return write->held;
+}
+
+static bool ranges_overlap(const struct vhd_interval *a,
+                           const struct vhd_interval *b)
+{
+    return a->start < b->end && b->start < a->end;
+}
+
+void virtio_blk_rmw_write_finish(struct virtio_blk_rmw *rmw,
+                                 struct virtio_blk_rmw_write *write,
+                                 virtio_blk_rmw_held *resumed)
+{
+    struct virtio_blk_rmw_write *held, *next;
+
+    pthread_mutex_lock(&rmw->lock);
+    vhd_interval_tree_remove(&rmw->writes, &write->range);
+
+    for (held = TAILQ_FIRST(&rmw->held); held; held = next) {
+        next = TAILQ_NEXT(held, held_link);
+        if (ranges_overlap(&held->range, &write->range) &&
+            !rmw_blocked(rmw, held)) {
+            TAILQ_REMOVE(&rmw->held, held, held_link);
+            held->held = false;
+            TAILQ_INSERT_TAIL(resumed, held, held_link);
+        }
+    }
+    pthread_mutex_unlock(&rmw->lock);
+}
+
+void *virtio_blk_rmw_get_block(struct virtio_blk_rmw *rmw)
+{
+    size_t size = (size_t)rmw->block_sectors * VHD_SECTOR_SIZE;
+    struct pool_block *block;
+    void *p;
+
+    pthread_mutex_lock(&rmw->lock);
+    block = SLIST_FIRST(&rmw->free_blocks);
+    if (block) {
+        SLIST_REMOVE_HEAD(&rmw->free_blocks, link);
+        rmw->num_free_blocks--;
+    }
+    pthread_mutex_unlock(&rmw->lock);
+
+    if (block) {
+        return block;
+    }
+
+    VHD_VERIFY(posix_memalign(&p, size, size) == 0);
+    return p;
+}
+
+void virtio_blk_rmw_put_block(struct virtio_blk_rmw *rmw, void *p)
+{
+    struct pool_block *block = p;
+
+    pthread_mutex_lock(&rmw->lock);
+    if (rmw->num_free_blocks < RMW_POOL_MAX_BLOCKS) {
+        SLIST_INSERT_HEAD(&rmw->free_blocks, block, link);
+        rmw->num_free_blocks++;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&rmw->lock);
+
+    free(block);
+}
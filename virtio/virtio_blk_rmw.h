@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interval_tree.h"
+#include "queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct virtio_blk_rmw;
+
+typedef TAILQ_HEAD(, virtio_blk_rmw_write) virtio_blk_rmw_held;
+
+/**
+ * Write, discard or write-zeroes in flight on a device passing only whole
+ * blocks to the backend
+ */
+struct virtio_blk_rmw_write {
+    /* whole blocks written, in sectors */
+    struct vhd_interval range;
+    uint64_t seq;
+    /* reads the partial blocks at its ends and writes them back */
+    bool rmw;
+    /* waits for an earlier write to the same blocks */
+    bool held;
+    TAILQ_ENTRY(virtio_blk_rmw_write) held_link;
+};
+
+/**
+ * Create the read-modify-write state of a device with blocks of
+ * @block_sectors sectors
+ */
+struct virtio_blk_rmw *virtio_blk_rmw_new(uint32_t block_sectors);
+
+void virtio_blk_rmw_free(struct virtio_blk_rmw *rmw);
+
+uint32_t virtio_blk_rmw_block_sectors(struct virtio_blk_rmw *rmw);
+
+/**
+ * A write of the whole blocks [@start, @end), read-modify-write of some of
+ * them if @is_rmw, is about to be sent to the backend.  Returns true if it's
+ * to wait for an earlier write to the same blocks first, which is the case
+ * when either of the two is a read-modify-write.
+ */
+bool virtio_blk_rmw_write_start(struct virtio_blk_rmw *rmw,
+                                struct virtio_blk_rmw_write *write,
+                                uint64_t start, uint64_t end, bool is_rmw);
+
+/**
+ * The write @write is done; move the writes held behind it that no longer
+ * wait for any other to @resumed, in the order they started.
+ */
+void virtio_blk_rmw_write_finish(struct virtio_blk_rmw *rmw,
+                                 struct virtio_blk_rmw_write *write,
+                                 virtio_blk_rmw_held *resumed);
+
+/**
+ * Get a block-sized and -aligned bounce buffer from the pool of the device
+ */
+void *virtio_blk_rmw_get_block(struct virtio_blk_rmw *rmw);
+
+void virtio_blk_rmw_put_block(struct virtio_blk_rmw *rmw, void *block);
+
+#ifdef __cplusplus
+}
+#endif
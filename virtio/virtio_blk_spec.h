@@ -11,6 +11,8 @@
 extern "C" {
 #endif
 
+#define VIRTIO_ID_BLOCK             2
+
 #define VIRTIO_BLK_SECTOR_SIZE      512
 #define VIRTIO_BLK_SECTOR_SHIFT     9
 #define VIRTIO_BLK_DISKID_LENGTH    20
@@ -27,6 +29,7 @@ extern "C" {
 #define VIRTIO_BLK_F_CONFIG_WCE 11  /* Device can toggle its cache between writeback and writethrough modes. */
 #define VIRTIO_BLK_F_DISCARD    13  /* Device can support discard command */
 #define VIRTIO_BLK_F_WRITE_ZEROES 14  /* Device supports write-zeroes requests */
+#define VIRTIO_BLK_F_ZONED      17  /* Device is a zoned block device */
 
 /* Custom extentions */
 #define VIRTIO_BLK_F_MQ         12  /* Device reports maximum supported queues in numqueues config field */
@@ -75,6 +78,26 @@ struct VHD_PACKED virtio_blk_config {
     le32 max_write_zeroes_seg;
     u8 write_zeroes_may_unmap;
     u8 _reserved1[3];
+
+    /* VIRTIO_BLK_F_SECURE_ERASE-specific fields, unused */
+    le32 max_secure_erase_sectors;
+    le32 max_secure_erase_seg;
+    le32 secure_erase_sector_alignment;
+
+    /* VIRTIO_BLK_F_ZONED-specific fields */
+    struct VHD_PACKED virtio_blk_zoned_characteristics {
+        le32 zone_sectors;
+        le32 max_open_zones;
+        le32 max_active_zones;
+        le32 max_append_sectors;
+        /* in bytes */
+        le32 write_granularity;
+#define VIRTIO_BLK_Z_NONE       0
+#define VIRTIO_BLK_Z_HM         1   /* host-managed */
+#define VIRTIO_BLK_Z_HA         2   /* host-aware */
+        u8 model;
+        u8 _reserved2[3];
+    } zoned;
 };
 
 /*
@@ -98,6 +121,13 @@ struct virtio_blk_req_hdr {
 #define VIRTIO_BLK_T_GET_ID     8   /* Get device id */
 #define VIRTIO_BLK_T_DISCARD    11  /* Discard */
 #define VIRTIO_BLK_T_WRITE_ZEROES 13  /* Write zeroes */
+#define VIRTIO_BLK_T_ZONE_APPEND    15  /* Write at the zone write pointer */
+#define VIRTIO_BLK_T_ZONE_REPORT    16  /* Report zones */
+#define VIRTIO_BLK_T_ZONE_OPEN      18  /* Explicitly open a zone */
+#define VIRTIO_BLK_T_ZONE_CLOSE     20  /* Close a zone */
+#define VIRTIO_BLK_T_ZONE_FINISH    22  /* Transition a zone to full */
+#define VIRTIO_BLK_T_ZONE_RESET     24  /* Reset a zone write pointer */
+#define VIRTIO_BLK_T_ZONE_RESET_ALL 26  /* Reset all zone write pointers */
     le32 type;
     le32 reserved;
     le64 sector;
@@ -112,12 +142,68 @@ struct virtio_blk_discard_write_zeroes {
     } flags;
 };
 
+/*
+ * The device-writable part of a zone append is the sector the data was
+ * written at followed by the status:
+ * struct virtio_blk_req_za {
+ *     le32 type;
+ *     le32 reserved;
+ *     le64 sector;
+ *     u8 data[][512];
+ *     le64 append_sector;
+ *     u8 status;
+ * };
+ * Linux pads it to 16 bytes; the status is always the last byte.
+ */
+struct VHD_PACKED virtio_blk_zone_append_inhdr {
+    le64 append_sector;
+    u8 status;
+};
+
+/*
+ * Zone report: the header followed by as many descriptors as fit into the
+ * device-writable data buffers, starting from the zone containing the sector
+ * in the request header.
+ */
+struct virtio_blk_zone_descriptor {
+    le64 z_cap;
+    le64 z_start;
+    le64 z_wp;
+#define VIRTIO_BLK_ZT_CONV      1   /* conventional */
+#define VIRTIO_BLK_ZT_SWR       2   /* sequential write required */
+#define VIRTIO_BLK_ZT_SWP       3   /* sequential write preferred */
+    u8 z_type;
+#define VIRTIO_BLK_ZS_NOT_WP    0
+#define VIRTIO_BLK_ZS_EMPTY     1
+#define VIRTIO_BLK_ZS_IOPEN     2
+#define VIRTIO_BLK_ZS_EOPEN     3
+#define VIRTIO_BLK_ZS_CLOSED    4
+#define VIRTIO_BLK_ZS_RDONLY    13
+#define VIRTIO_BLK_ZS_FULL      14
+#define VIRTIO_BLK_ZS_OFFLINE   15
+    u8 z_state;
+    u8 _reserved[38];
+};
+
+struct virtio_blk_zone_report {
+    le64 nr_zones;
+    u8 _reserved[56];
+    struct virtio_blk_zone_descriptor zones[];
+};
+
 VHD_STATIC_ASSERT(sizeof(struct virtio_blk_req_hdr) == 16);
 VHD_STATIC_ASSERT(sizeof(struct virtio_blk_discard_write_zeroes) == 16);
+VHD_STATIC_ASSERT(sizeof(struct virtio_blk_zone_append_inhdr) == 9);
+VHD_STATIC_ASSERT(sizeof(struct virtio_blk_zone_descriptor) == 64);
+VHD_STATIC_ASSERT(sizeof(struct virtio_blk_zone_report) == 64);
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
+#define VIRTIO_BLK_S_ZONE_INVALID_CMD       3
+#define VIRTIO_BLK_S_ZONE_UNALIGNED_WP      4
+#define VIRTIO_BLK_S_ZONE_OPEN_RESOURCE     5
+#define VIRTIO_BLK_S_ZONE_ACTIVE_RESOURCE   6
 
 #ifdef __cplusplus
 }
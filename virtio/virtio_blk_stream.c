@@ -0,0 +1,125 @@
+/*
+ * Sequential read stream detection
+ *
+ * Every vring tracks a few streams of reads, each expecting the next read to
+ * start where the previous one ended; a read matching none of them replaces
+ * the least recently used stream, so the state is bounded and random reads
+ * just keep recycling the slots without producing any hints.
+ *
+ * Once a stream has continued a couple of times, its reads carry a readahead
+ * window past the data read so far.  As with the kernel page cache
+ * readahead, the next window is hinted when the stream has consumed half of
+ * the previous one, and the windows double in size from four requests' worth
+ * up to the configured limit, so the backend gets a hint every few requests
+ * rather than on each of them.
+ */
+
+#include "vhost/blockdev.h"
+
+#include "virtio_blk_stream.h"
+#include "platform.h"
+
+#define STREAMS_PER_VRING   4
+/* reads in a stream before the following ones carry readahead hints */
+#define STREAM_MIN_HITS     2
+
+struct stream {
+    /* where the next read of the stream is expected to start */
+    uint64_t next_sector;
+    /* end of the data hinted for readahead so far */
+    uint64_t ra_end;
+    uint32_t window;
+    uint32_t hits;
+    uint64_t last_used;
+};
+
+struct vring_streams {
+    uint64_t clock;
+    struct stream streams[STREAMS_PER_VRING];
+};
+
+struct virtio_blk_streams {
+    uint32_t max_window;
+    uint16_t num_vrings;
+    struct vring_streams vrings[];
+};
+
+struct virtio_blk_streams *virtio_blk_streams_new(uint16_t num_vrings,
+                                                  uint32_t max_window)
+{
+    struct virtio_blk_streams *streams;
+
+    streams = vhd_zalloc(sizeof(*streams) +
+                         num_vrings * sizeof(streams->vrings[0]));
+    streams->max_window = max_window;
+    streams->num_vrings = num_vrings;
+    return streams;
+}
+
+void virtio_blk_streams_free(struct virtio_blk_streams *streams)
+{
+    vhd_free(streams);
+}
+
+static struct stream *lookup_stream(struct vring_streams *vs, uint64_t sector)
+{
+    struct stream *lru = &vs->streams[0];
+    int i;
+
+    for (i = 0; i < STREAMS_PER_VRING; i++) {
+        struct stream *st = &vs->streams[i];
+
+        if (st->hits && st->next_sector == sector) {
+            return st;
+        }
+        if (st->last_used < lru->last_used) {
+            lru = st;
+        }
+    }
+
+    /* a new stream, maybe */
+    *lru = (struct stream) {};
+    return lru;
+}
+
+void virtio_blk_streams_read(struct virtio_blk_streams *streams,
+                             uint16_t vring, struct vhd_bdev_io *bio,
+                             uint64_t capacity)
+{
+    struct vring_streams *vs;
+    struct stream *st;
+    uint64_t start;
+
+    if (vring >= streams->num_vrings) {
+        return;
+    }
+    vs = &streams->vrings[vring];
+
+    st = lookup_stream(vs, bio->first_sector);
+    st->last_used = ++vs->clock;
+    st->next_sector = bio->first_sector + bio->total_sectors;
+    if (++st->hits <= STREAM_MIN_HITS) {
+        return;
+    }
+
+    if (!st->window) {
+        st->window = MIN(bio->total_sectors * 4, streams->max_window);
+        st->ra_end = st->next_sector;
+    }
+
+    /* still more than half of the last window ahead of the stream */
+    if (st->ra_end > st->next_sector &&
+        st->ra_end - st->next_sector > st->window / 2) {
+        return;
+    }
+
+    start = MAX(st->ra_end, st->next_sector);
+    if (start >= capacity) {
+        return;
+    }
+
+    bio->readahead_sector = start;
+    bio->readahead_sectors = MIN(st->window, capacity - start);
+    st->ra_end = start + bio->readahead_sectors;
+    st->window = MIN((uint64_t)st->window * 2, streams->max_window);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct virtio_blk_streams;
+struct vhd_bdev_io;
+
+/**
+ * Create sequential read stream detectors for @num_vrings vrings, hinting
+ * readahead windows of up to @max_window sectors
+ */
+struct virtio_blk_streams *virtio_blk_streams_new(uint16_t num_vrings,
+                                                  uint32_t max_window);
+
+void virtio_blk_streams_free(struct virtio_blk_streams *streams);
+
+/**
+ * Account read @bio arriving on vring @vring and set its readahead hint if it
+ * continues a sequential stream.  The window is clipped at @capacity
+ * sectors.  Only to be called in the request queue thread of the vring.
+ */
+void virtio_blk_streams_read(struct virtio_blk_streams *streams,
+                             uint16_t vring, struct vhd_bdev_io *bio,
+                             uint64_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vhost/blktrace.h"
+#include "vhost/blockdev.h"
+
+#include "virtio_blk_trace.h"
+#include "catomic.h"
+#include "logging.h"
+#include "queue.h"
+
+/*
+ * Each vring accumulates its records in a buffer of its own, so that the
+ * request queues don't contend with each other.  Full buffers are handed over
+ * to a writer thread, so that neither a syscall per request nor a blocking
+ * write is on the request queue path.  If the writer falls behind and runs
+ * the pool dry, the records are dropped and counted instead.
+ */
+#define TRACE_BUF_SIZE (64 * 1024)
+#define TRACE_BUFS_PER_VRING 4
+
+struct trace_buf {
+    STAILQ_ENTRY(trace_buf) link;
+    size_t len;
+    char data[TRACE_BUF_SIZE];
+};
+
+STAILQ_HEAD(trace_buf_list, trace_buf);
+
+struct trace_vring {
+    /*
+     * The vring is served by a single request queue, so this is only
+     * contended when the trace is started or stopped.
+     */
+    pthread_mutex_t lock;
+    bool on;
+    struct trace_buf *buf;
+    uint64_t lost;
+} __attribute__((aligned(64)));
+
+struct virtio_blk_trace {
+    uint16_t num_vrings;
+    struct trace_vring *vrings;
+
+    /* serializes start and stop */
+    pthread_mutex_t ctl_lock;
+    bool running;
+    int fd;
+    uint64_t start_ns;
+    pthread_t writer;
+    struct trace_buf *bufs;
+
+    /* protects the buffer lists shared with the writer */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct trace_buf_list full;
+    struct trace_buf_list free;
+    bool stopping;
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t virtio_blk_trace_now(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf = (const char *)buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void *trace_writer(void *opaque)
+{
+    struct virtio_blk_trace *trace = opaque;
+    struct trace_buf *buf;
+    int ret;
+
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        buf = STAILQ_FIRST(&trace->full);
+        if (!buf) {
+            if (trace->stopping) {
+                break;
+            }
+            pthread_cond_wait(&trace->cond, &trace->lock);
+            continue;
+        }
+        STAILQ_REMOVE_HEAD(&trace->full, link);
+        pthread_mutex_unlock(&trace->lock);
+
+        ret = write_all(trace->fd, buf->data, buf->len);
+        if (ret < 0) {
+            VHD_LOG_ERROR("failed to write trace: %s, %zu bytes lost",
+                          strerror(-ret), buf->len);
+        }
+
+        pthread_mutex_lock(&trace->lock);
+        STAILQ_INSERT_TAIL(&trace->free, buf, link);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+/*
+ * Hand @full, if any, over to the writer and return an empty buffer, or NULL
+ * if there's none left
+ */
+static struct trace_buf *trace_buf_swap(struct virtio_blk_trace *trace,
+                                        struct trace_buf *full)
+{
+    struct trace_buf *buf;
+
+    pthread_mutex_lock(&trace->lock);
+    if (full) {
+        STAILQ_INSERT_TAIL(&trace->full, full, link);
+        pthread_cond_signal(&trace->cond);
+    }
+    buf = STAILQ_FIRST(&trace->free);
+    if (buf) {
+        STAILQ_REMOVE_HEAD(&trace->free, link);
+        buf->len = 0;
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return buf;
+}
+
+struct virtio_blk_trace *virtio_blk_trace_new(uint16_t num_vrings)
+{
+    struct virtio_blk_trace *trace = vhd_zalloc(sizeof(*trace));
+    uint16_t i;
+
+    trace->num_vrings = num_vrings;
+    trace->vrings = vhd_calloc(num_vrings, sizeof(trace->vrings[0]));
+    for (i = 0; i < num_vrings; i++) {
+        pthread_mutex_init(&trace->vrings[i].lock, NULL);
+    }
+    pthread_mutex_init(&trace->ctl_lock, NULL);
+    trace->fd = -1;
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->cond, NULL);
+    STAILQ_INIT(&trace->full);
+    STAILQ_INIT(&trace->free);
+    return trace;
+}
+
+void virtio_blk_trace_free(struct virtio_blk_trace *trace)
+{
+    uint16_t i;
+
+    virtio_blk_trace_stop(trace);
+    pthread_cond_destroy(&trace->cond);
+    pthread_mutex_destroy(&trace->lock);
+    pthread_mutex_destroy(&trace->ctl_lock);
+    for (i = 0; i < trace->num_vrings; i++) {
+        pthread_mutex_destroy(&trace->vrings[i].lock);
+    }
+    vhd_free(trace->vrings);
+    vhd_free(trace);
+}
+
+int virtio_blk_trace_start(struct virtio_blk_trace *trace, const char *path,
+                           uint64_t capacity)
+{
+    struct vhd_blktrace_header hdr = {
+        .magic = VHD_BLKTRACE_MAGIC,
+        .version = VHD_BLKTRACE_VERSION,
+        .capacity = capacity,
+        .start_time_ns = clock_ns(CLOCK_REALTIME),
+    };
+    size_t i, num_bufs = (size_t)trace->num_vrings * TRACE_BUFS_PER_VRING;
+    int fd, ret;
+
+    pthread_mutex_lock(&trace->ctl_lock);
+
+    if (trace->fd >= 0) {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("open(%s): %s", path, strerror(-ret));
+        goto out;
+    }
+
+    ret = write_all(fd, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        VHD_LOG_ERROR("failed to write trace header: %s", strerror(-ret));
+        close(fd);
+        goto out;
+    }
+
+    trace->fd = fd;
+    trace->start_ns = virtio_blk_trace_now();
+    trace->bufs = vhd_calloc(num_bufs, sizeof(trace->bufs[0]));
+    for (i = 0; i < num_bufs; i++) {
+        STAILQ_INSERT_TAIL(&trace->free, &trace->bufs[i], link);
+    }
+    trace->stopping = false;
+
+    ret = pthread_create(&trace->writer, NULL, trace_writer, trace);
+    if (ret) {
+        VHD_LOG_ERROR("failed to start trace writer: %s", strerror(ret));
+        ret = -ret;
+        STAILQ_INIT(&trace->free);
+        vhd_free(trace->bufs);
+        trace->bufs = NULL;
+        close(fd);
+        trace->fd = -1;
+        goto out;
+    }
+
+    for (i = 0; i < trace->num_vrings; i++) {
+        struct trace_vring *tv = &trace->vrings[i];
+
+        pthread_mutex_lock(&tv->lock);
+        tv->on = true;
+        tv->lost = 0;
+        pthread_mutex_unlock(&tv->lock);
+    }
+    catomic_set(&trace->running, true);
+
+out:
+    pthread_mutex_unlock(&trace->ctl_lock);
+    return ret;
+}
+
+void virtio_blk_trace_stop(struct virtio_blk_trace *trace)
+{
+    uint64_t lost = 0;
+    uint16_t i;
+
+    pthread_mutex_lock(&trace->ctl_lock);
+
+    if (trace->fd < 0) {
+        goto out;
+    }
+
+    catomic_set(&trace->running, false);
+    for (i = 0; i < trace->num_vrings; i++) {
+        struct trace_vring *tv = &trace->vrings[i];
+
+        pthread_mutex_lock(&tv->lock);
+        tv->on = false;
+        if (tv->buf) {
+            pthread_mutex_lock(&trace->lock);
+            STAILQ_INSERT_TAIL(&trace->full, tv->buf, link);
+            pthread_mutex_unlock(&trace->lock);
+            tv->buf = NULL;
+        }
+        lost += tv->lost;
+        pthread_mutex_unlock(&tv->lock);
+    }
+
+    /* the writer drains the full buffers before it quits */
+    pthread_mutex_lock(&trace->lock);
+    trace->stopping = true;
+    pthread_cond_signal(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+
+    if (lost) {
+        VHD_LOG_WARN("%" PRIu64 " trace records lost", lost);
+    }
+
+    close(trace->fd);
+    trace->fd = -1;
+    STAILQ_INIT(&trace->free);
+    vhd_free(trace->bufs);
+    trace->bufs = NULL;
+
+out:
+    pthread_mutex_unlock(&trace->ctl_lock);
+}
+
+bool virtio_blk_trace_running(struct virtio_blk_trace *trace)
+{
+    return catomic_read(&trace->running);
+}
+
+void virtio_blk_trace_record(struct virtio_blk_trace *trace,
+                             uint64_t submit_ns, uint16_t vring,
+                             const struct vhd_bdev_io *bdev_io,
+                             uint8_t status)
+{
+    uint16_t nsegs = MIN(bdev_io->sglist.nbuffers, UINT16_MAX);
+    size_t size = vhd_blktrace_record_size(nsegs);
+    uint64_t now = virtio_blk_trace_now();
+    struct vhd_blktrace_record *rec;
+    struct trace_vring *tv;
+    uint16_t i;
+
+    if (vring >= trace->num_vrings) {
+        return;
+    }
+
+    tv = &trace->vrings[vring];
+    pthread_mutex_lock(&tv->lock);
+
+    /* requests submitted before the trace started don't belong to it */
+    if (!tv->on || submit_ns < trace->start_ns) {
+        goto out;
+    }
+
+    if (size > TRACE_BUF_SIZE) {
+        tv->lost++;
+        goto out;
+    }
+
+    if (!tv->buf || tv->buf->len + size > TRACE_BUF_SIZE) {
+        tv->buf = trace_buf_swap(trace, tv->buf);
+        if (!tv->buf) {
+            tv->lost++;
+            goto out;
+        }
+    }
+
+    rec = (struct vhd_blktrace_record *)(tv->buf->data + tv->buf->len);
+    memset(rec, 0, size);
+    *rec = (struct vhd_blktrace_record) {
+        .ts_ns = submit_ns - trace->start_ns,
+        .latency_ns = now - submit_ns,
+        .sector = bdev_io->first_sector,
+        .nsectors = bdev_io->total_sectors,
+        .vring = vring,
+        .type = bdev_io->type,
+        .status = status,
+        .nsegs = nsegs,
+    };
+    for (i = 0; i < nsegs; i++) {
+        rec->seg_len[i] = bdev_io->sglist.buffers[i].len;
+    }
+    tv->buf->len += size;
+
+out:
+    pthread_mutex_unlock(&tv->lock);
+}
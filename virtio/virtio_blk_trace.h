@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct virtio_blk_trace;
+struct vhd_bdev_io;
+
+/**
+ * Create a stopped trace for a device with @num_vrings vrings
+ */
+struct virtio_blk_trace *virtio_blk_trace_new(uint16_t num_vrings);
+
+/**
+ * Stop the trace if it's running and free it
+ */
+void virtio_blk_trace_free(struct virtio_blk_trace *trace);
+
+/**
+ * Open trace file @path, write the trace header and start recording
+ */
+int virtio_blk_trace_start(struct virtio_blk_trace *trace, const char *path,
+                           uint64_t capacity);
+
+/**
+ * Stop recording, write out the buffered records and close the file
+ */
+void virtio_blk_trace_stop(struct virtio_blk_trace *trace);
+
+/**
+ * Timestamp to pass as @submit_ns to virtio_blk_trace_record
+ */
+uint64_t virtio_blk_trace_now(void);
+
+/**
+ * Whether the trace is recording; cheap enough to check on every request
+ */
+bool virtio_blk_trace_running(struct virtio_blk_trace *trace);
+
+/**
+ * Record a completed request; thread-safe
+ */
+void virtio_blk_trace_record(struct virtio_blk_trace *trace,
+                             uint64_t submit_ns, uint16_t vring,
+                             const struct vhd_bdev_io *bdev_io,
+                             uint8_t status);
+
+#ifdef __cplusplus
+}
+#endif
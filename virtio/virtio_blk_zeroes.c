@@ -0,0 +1,253 @@
+/*
+ * Tracking of the ranges known to read as zeroes
+ *
+ * The map holds the non-overlapping extents known to be zero, merged with
+ * their neighbours, and the writes in flight.  Completed zeroings add their
+ * ranges to it, while writes take theirs out as they are sent to the
+ * backend.  A zeroing overlapped by a write in flight at any time while it is
+ * in flight may complete before the write lands and adds nothing.
+ *
+ * Forgetting a zero extent is always safe: the reads of it merely go to the
+ * backend.  So the number of extents is capped, and the map drops them
+ * rather than grow past that, e.g. with the small random writes to a fresh
+ * disk splitting its only extent again and again.
+ */
+
+#include <pthread.h>
+
+#include "vhost/blockdev.h"
+
+#include "virtio_blk_zeroes.h"
+#include "logging.h"
+#include "platform.h"
+#include "queue.h"
+
+#define ZEROES_MAX_EXTENTS  65536
+
+struct zero_extent {
+    struct vhd_interval range;
+    SLIST_ENTRY(zero_extent) link;
+};
+
+typedef SLIST_HEAD(, zero_extent) zero_extent_list;
+
+struct virtio_blk_zeroes {
+    pthread_mutex_t lock;
+    struct vhd_interval_tree extents;
+    uint32_t num_extents;
+    struct vhd_interval_tree writes;
+};
+
+static bool collect_extent(struct vhd_interval *range, void *opaque)
+{
+    zero_extent_list *list = opaque;
+
+    SLIST_INSERT_HEAD(list, containerof(range, struct zero_extent, range),
+                      link);
+    return true;
+}
+
+static void extent_insert(struct virtio_blk_zeroes *zm,
+                          struct zero_extent *ext, uint64_t start,
+                          uint64_t end)
+{
+    ext->range.start = start;
+    ext->range.end = end;
+    vhd_interval_tree_insert(&zm->extents, &ext->range);
+    zm->num_extents++;
+}
+
+static void extent_remove(struct virtio_blk_zeroes *zm,
+                          struct zero_extent *ext)
+{
+    vhd_interval_tree_remove(&zm->extents, &ext->range);
+    zm->num_extents--;
+}
+
+/* merge [@start, @end) with the extents overlapping or adjoining it */
+static void extents_mark(struct virtio_blk_zeroes *zm, uint64_t start,
+                         uint64_t end)
+{
+    zero_extent_list list = SLIST_HEAD_INITIALIZER(list);
+    struct zero_extent *ext, *reuse = NULL;
+
+    vhd_interval_tree_foreach_overlap(&zm->extents, start ? start - 1 : 0,
+                                      end + 1, collect_extent, &list);
+    while ((ext = SLIST_FIRST(&list))) {
+        SLIST_REMOVE_HEAD(&list, link);
+        start = MIN(start, ext->range.start);
+        end = MAX(end, ext->range.end);
+        extent_remove(zm, ext);
+        if (reuse) {
+            vhd_free(ext);
+        } else {
+            reuse = ext;
+        }
+    }
+
+    if (!reuse) {
+        if (zm->num_extents >= ZEROES_MAX_EXTENTS) {
+            return;
+        }
+        reuse = vhd_alloc(sizeof(*reuse));
+    }
+    extent_insert(zm, reuse, start, end);
+}
+
+/* take [@start, @end) out of the extents, splitting those around it */
+static void extents_clear(struct virtio_blk_zeroes *zm, uint64_t start,
+                          uint64_t end)
+{
+    zero_extent_list list = SLIST_HEAD_INITIALIZER(list);
+    struct zero_extent *ext;
+
+    vhd_interval_tree_foreach_overlap(&zm->extents, start, end,
+                                      collect_extent, &list);
+    while ((ext = SLIST_FIRST(&list))) {
+        uint64_t ext_start = ext->range.start, ext_end = ext->range.end;
+        bool head = ext_start < start, tail = ext_end > end;
+
+        SLIST_REMOVE_HEAD(&list, link);
+        extent_remove(zm, ext);
+
+        if (head && tail && zm->num_extents + 2 > ZEROES_MAX_EXTENTS) {
+            /* keep the larger piece only */
+            if (start - ext_start >= ext_end - end) {
+                tail = false;
+            } else {
+                head = false;
+            }
+        }
+
+        if (head && tail) {
+            extent_insert(zm, ext, ext_start, start);
+            extent_insert(zm, vhd_alloc(sizeof(*ext)), end, ext_end);
+        } else if (head) {
+            extent_insert(zm, ext, ext_start, start);
+        } else if (tail) {
+            extent_insert(zm, ext, end, ext_end);
+        } else {
+            vhd_free(ext);
+        }
+    }
+}
+
+struct virtio_blk_zeroes *virtio_blk_zeroes_new(
+    const struct vhd_bdev_range *ranges, uint32_t num_ranges)
+{
+    struct virtio_blk_zeroes *zm = vhd_zalloc(sizeof(*zm));
+    uint32_t i;
+
+    pthread_mutex_init(&zm->lock, NULL);
+    vhd_interval_tree_init(&zm->extents);
+    vhd_interval_tree_init(&zm->writes);
+
+    for (i = 0; i < num_ranges; i++) {
+        if (ranges[i].num_sectors) {
+            extents_mark(zm, ranges[i].sector,
+                         ranges[i].sector + ranges[i].num_sectors);
+        }
+    }
+
+    return zm;
+}
+
+void virtio_blk_zeroes_free(struct virtio_blk_zeroes *zm)
+{
+    zero_extent_list list = SLIST_HEAD_INITIALIZER(list);
+    struct zero_extent *ext;
+
+    VHD_ASSERT(vhd_interval_tree_empty(&zm->writes));
+
+    vhd_interval_tree_foreach_overlap(&zm->extents, 0, UINT64_MAX,
+                                      collect_extent, &list);
+    while ((ext = SLIST_FIRST(&list))) {
+        SLIST_REMOVE_HEAD(&list, link);
+        vhd_free(ext);
+    }
+
+    pthread_mutex_destroy(&zm->lock);
+    vhd_free(zm);
+}
+
+static bool spoil_overlapping(struct vhd_interval *range, void *opaque)
+{
+    struct virtio_blk_zero_write *write = opaque;
+    struct virtio_blk_zero_write *other =
+        containerof(range, struct virtio_blk_zero_write, range);
+
+    if (write->zeroing && !other->zeroing) {
+        write->spoiled = true;
+    } else if (!write->zeroing && other->zeroing) {
+        other->spoiled = true;
+    }
+    return true;
+}
+
+void virtio_blk_zeroes_write_start(struct virtio_blk_zeroes *zm,
+                                   struct virtio_blk_zero_write *write,
+                                   uint64_t start, uint64_t end,
+                                   bool zeroing)
+{
+    write->range.start = start;
+    write->range.end = end;
+    write->zeroing = zeroing;
+    write->spoiled = false;
+
+    pthread_mutex_lock(&zm->lock);
+    vhd_interval_tree_foreach_overlap(&zm->writes, start, end,
+                                      spoil_overlapping, write);
+    if (!zeroing) {
+        extents_clear(zm, start, end);
+    }
+    vhd_interval_tree_insert(&zm->writes, &write->range);
+    pthread_mutex_unlock(&zm->lock);
+}
+
+void virtio_blk_zeroes_write_finish(struct virtio_blk_zeroes *zm,
+                                    struct virtio_blk_zero_write *write,
+                                    bool success)
+{
+    pthread_mutex_lock(&zm->lock);
+    vhd_interval_tree_remove(&zm->writes, &write->range);
+    if (write->zeroing && !write->spoiled && success) {
+        extents_mark(zm, write->range.start, write->range.end);
+    }
+    pthread_mutex_unlock(&zm->lock);
+}
+
+struct zero_lookup {
+    struct vhd_interval *first;
+    struct vhd_interval *last;
+};
+
+static bool find_ends(struct vhd_interval *range, void *opaque)
+{
+    struct zero_lookup *lookup = opaque;
+
+    if (!lookup->first) {
+        lookup->first = range;
+    }
+    lookup->last = range;
+    return true;
+}
+
+void virtio_blk_zeroes_lookup(struct virtio_blk_zeroes *zm,
+                              uint64_t start, uint64_t end,
+                              uint64_t *head, uint64_t *tail)
+{
+    struct zero_lookup lookup = {};
+
+    *head = *tail = 0;
+
+    pthread_mutex_lock(&zm->lock);
+    vhd_interval_tree_foreach_overlap(&zm->extents, start, end, find_ends,
+                                      &lookup);
+    if (lookup.first && lookup.first->start <= start) {
+        *head = MIN(lookup.first->end, end) - start;
+    }
+    if (lookup.last && lookup.last->end >= end && *head < end - start) {
+        *tail = end - MAX(lookup.last->start, start);
+    }
+    pthread_mutex_unlock(&zm->lock);
+}
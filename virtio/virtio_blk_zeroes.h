@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interval_tree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vhd_bdev_range;
+struct virtio_blk_zeroes;
+
+/**
+ * Write, discard or write-zeroes in flight on a device tracking the ranges
+ * known to read as zeroes
+ */
+struct virtio_blk_zero_write {
+    struct vhd_interval range;
+    /* leaves the range reading as zeroes once done */
+    bool zeroing;
+    /* overlapped by a write in flight, which may land after the zeroing */
+    bool spoiled;
+};
+
+/**
+ * Create the known-zero map of a device with the @num_ranges @ranges known
+ * to read as zeroes
+ */
+struct virtio_blk_zeroes *virtio_blk_zeroes_new(
+    const struct vhd_bdev_range *ranges, uint32_t num_ranges);
+
+void virtio_blk_zeroes_free(struct virtio_blk_zeroes *zm);
+
+/**
+ * A write of [@start, @end), or a zeroing if @zeroing, is about to be sent
+ * to the backend: the range is no longer known to be zero but for a zeroing,
+ * which makes it zero once done unless overlapped by a write meanwhile.
+ */
+void virtio_blk_zeroes_write_start(struct virtio_blk_zeroes *zm,
+                                   struct virtio_blk_zero_write *write,
+                                   uint64_t start, uint64_t end,
+                                   bool zeroing);
+
+/**
+ * The write @write is done, successfully if @success
+ */
+void virtio_blk_zeroes_write_finish(struct virtio_blk_zeroes *zm,
+                                    struct virtio_blk_zero_write *write,
+                                    bool success);
+
+/**
+ * Find how many sectors at the start and at the end of [@start, @end) are
+ * known to be zero into @head and @tail.  If the whole range is, @head spans
+ * it and @tail is 0.
+ */
+void virtio_blk_zeroes_lookup(struct virtio_blk_zeroes *zm,
+                              uint64_t start, uint64_t end,
+                              uint64_t *head, uint64_t *tail);
+
+#ifdef __cplusplus
+}
+#endif
@@ -27,13 +27,15 @@ static void complete_request(struct vhd_io *io)
 {
     struct virtio_fs_io *vbio = containerof(io, struct virtio_fs_io, io);
     struct virtio_iov *viov = vbio->iov;
-    /* if IN iov has at least one buffer it accomodates fuse_out_header */
-    struct virtio_fs_out_header *out =
-                        viov->niov_in ? viov->iov_in[0].base : NULL;
-    uint32_t len = out ? out->len : 0;
+    struct virtio_fs_out_header out = {};
+
+    /* if there's an IN area it accommodates fuse_out_header */
+    if (viov->niov_in) {
+        virtio_buffers_read(viov->iov_in, viov->niov_in, 0, &out, sizeof(out));
+    }
 
     if (likely(io->status != VHD_BDEV_CANCELED)) {
-        virtq_push(vbio->vq, vbio->iov, len);
+        virtq_push(vbio->vq, vbio->iov, out.len);
     }
 
     virtio_free_iov(viov);
@@ -53,32 +55,29 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq, struct virtio_iov
     (void)arg;
 
     /*
-     * Assume legacy message framing without VIRTIO_F_ANY_LAYOUT:
-     * - virtio IN / FUSE OUT segments, with the first one fully containing
-     *   fuse_in_header
-     * - virtio OUT / FUSE IN segments, with the first one fully containing
-     *   fuse_out_header (except FUSE_FORGET and FUSE_BATCH_FORGET which have
-     *   no response part at all)
+     * Message framing is up to the driver (VIRTIO_F_ANY_LAYOUT, implied by
+     * VIRTIO_F_VERSION_1), the headers may span descriptors:
+     * - virtio IN / FUSE OUT area, starting with fuse_in_header
+     * - virtio OUT / FUSE IN area, starting with fuse_out_header (except
+     *   FUSE_FORGET and FUSE_BATCH_FORGET which have no response part at all)
      */
 
-    struct virtio_fs_in_header *in;
-    struct virtio_fs_out_header *out;
+    struct virtio_fs_in_header in;
+    struct virtio_fs_out_header out;
 
-    if (iov->niov_in && iov->iov_in[0].len < sizeof(*out)) {
+    if (iov->niov_in &&
+        virtio_buffers_size(iov->iov_in, iov->niov_in) < sizeof(out)) {
         VHD_LOG_ERROR("No room for response in the request");
         abort_request(vq, iov);
         return;
     }
 
-    if (!iov->niov_out || iov->iov_out[0].len < sizeof(*in)) {
+    if (virtio_buffers_size(iov->iov_out, iov->niov_out) < sizeof(in)) {
         VHD_LOG_ERROR("Malformed request header");
         abort_request(vq, iov);
         return;
     }
 
-    in = iov->iov_out[0].base;
-    out = iov->niov_in ? iov->iov_in[0].base : NULL;
-
     struct virtio_fs_io *bio = vhd_zalloc(sizeof(*bio));
     bio->vq = vq;
     bio->iov = iov;
@@ -91,10 +90,16 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq, struct virtio_iov
     if (res != 0) {
         VHD_LOG_ERROR("request submission failed with %d", res);
 
-        if (out) {
-            out->len = sizeof(*out);
-            out->error = res;
-            out->unique = in->unique;
+        if (iov->niov_in) {
+            virtio_buffers_read(iov->iov_out, iov->niov_out, 0, &in,
+                                sizeof(in));
+            out = (struct virtio_fs_out_header) {
+                .len = sizeof(out),
+                .error = res,
+                .unique = in.unique,
+            };
+            virtio_buffers_write(iov->iov_in, iov->niov_in, 0, &out,
+                                 sizeof(out));
         }
 
         complete_request(&bio->io);
@@ -14,6 +14,7 @@ struct vhd_bio;
 struct vhd_guest_memory_map;
 
 #define VIRTIO_FS_DEFAULT_FEATURES ((uint64_t)( \
+    (1UL << VIRTIO_F_ANY_LAYOUT) | \
     (1UL << VIRTIO_F_RING_INDIRECT_DESC) | \
     (1UL << VIRTIO_F_VERSION_1)))
 